@@ -0,0 +1,507 @@
+/**
+ * @file bench.c
+ * @brief Microbenchmarks of the hot functions of the server.
+ *
+ * Every benchmark runs its operation in batches, doubling the batch until it
+ * takes at least BENCH_MIN_NS, and reports the time and the heap allocations
+ * per operation. Allocations are counted by wrapping malloc, calloc, realloc,
+ * aligned_alloc and strdup at link time (-Wl,--wrap), so only the calls made
+ * by the server code are seen, not the ones libc makes internally.
+ *
+ * The benchmarks run against a fixture tree created in a temporary
+ * directory, with one file of each File_type, and the request corpus of
+ * bench/corpus or the requests of a capture taken with CAPTURE_FILE.
+ *
+ * ## Usage:
+ * ```
+ * ./bin/bench [-c corpus] [-t capture] [-f filter]
+ * ```
+ * - `-c`: File with the request corpus (default: bench/corpus/requests.txt).
+ * - `-t`: Capture file whose first CORPUS_MAX requests are used as corpus.
+ * - `-f`: Only run the benchmarks whose name contains this text.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../src/utils/server_config.h"
+#include "../src/utils/http_parser.h"
+#include "../src/utils/response.h"
+#include "../src/utils/arena.h"
+#include "../src/utils/capture.h"
+#include "../src/utils/ratelimit.h"
+
+#define BENCH_MIN_NS 200000000L
+#define BENCH_MAX_ITERS (1L << 26)
+#define CORPUS_MAX 4096
+#define CORPUS_REQUEST 8192
+#define BENCH_ADDRESSES 4096
+
+/* ---------------------- Allocation counting ---------------------- */
+_Atomic long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_realloc(ptr, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_aligned_alloc(alignment, size);
+}
+
+char *__wrap_strdup(const char *s) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __real_strdup(s);
+}
+
+
+/* ---------------------- Global objects ---------------------- */
+char fixture[] = "/tmp/re_server_bench.XXXXXX";
+char conf_path[MAX_PATH];
+ServerConfig *config;
+Arena *arena;
+
+char *corpus[CORPUS_MAX];
+int corpus_count = 0;
+long corpus_next = 0;
+
+Dict *conf_dict;
+char *conf_keys[] = {"PORT", "BASE_DIR", "INDEX_FILE", "MAX_CLIENTS", "TIMEOUT", "SCRIPT_TIMEOUT",
+    "LOG_LEVEL", "STATS_PATH", "NOT_A_KEY"};
+
+char *bench_type_names[] = {"jpg", "html", "text", "binary", "gif", "mpeg", "php", "python", "unknown",
+    "mp4", "metrics"};
+char *type_requests[] = {"GET /media/foto.jpg HTTP/1.1\r\n\r\n", "GET /index.html HTTP/1.1\r\n\r\n",
+    "GET /IMPORTANTE.txt HTTP/1.1\r\n\r\n", NULL, "GET /media/anim.gif HTTP/1.1\r\n\r\n",
+    "GET /media/clip.mpeg HTTP/1.1\r\n\r\n", "GET /scripts/hola.php HTTP/1.1\r\n\r\n",
+    "GET /scripts/hola.py?a=1 HTTP/1.1\r\n\r\n", NULL, "GET /media/video.mp4 HTTP/1.1\r\n\r\n",
+    "GET /__stats HTTP/1.1\r\n\r\n"};
+Parser *type_parser;
+
+char *file_names[] = {"index.html", "foto.jpg", "anim.gif", "video.mp4", "README", "script.py",
+    "archive.tar.gz", "a.b.c.d.mpeg", "/var/www/html/IMPORTANTE.txt", "favicon.ico"};
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Current monotonic time in nanoseconds.
+ *
+ * @return The time.
+ */
+long _now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * @brief Runs a benchmark and prints its result.
+ *
+ * @param name Name of the benchmark.
+ * @param filter Only runs it if the name contains this text, NULL for all.
+ * @param op Operation to measure, called with the number of iterations.
+ */
+void _run(const char *name, const char *filter, void (*op)(long)) {
+    long iters = 1, start, elapsed = 0, allocs = 0;
+
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+
+    op(1);
+    while (iters < BENCH_MAX_ITERS) {
+        allocs = atomic_load(&allocations);
+        start = _now_ns();
+        op(iters);
+        elapsed = _now_ns() - start;
+        allocs = atomic_load(&allocations) - allocs;
+        if (elapsed >= BENCH_MIN_NS) {
+            break;
+        }
+        iters *= 2;
+    }
+
+    printf("%-32s %10ld %12.1f ns/op %8.2f allocs/op\n", name, iters, (double)elapsed / iters,
+        (double)allocs / iters);
+    fflush(stdout);
+}
+
+/**
+ * @brief Writes a fixture file of the given size.
+ *
+ * @param name Path relative to the fixture directory.
+ * @param size Size in bytes.
+ * @param content Content to repeat, NULL for pseudo-random bytes.
+ * @return 0 on success, -1 on error.
+ */
+int _write_fixture(const char *name, size_t size, const char *content) {
+    char path[MAX_PATH];
+    FILE *file;
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s/%s", fixture, name);
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        fputc(content ? content[i % strlen(content)] : (int)((i * 2654435761u) >> 13), file);
+    }
+    fclose(file);
+    return 0;
+}
+
+/**
+ * @brief Creates the fixture tree and the configuration pointing at it.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int _create_fixture() {
+    char path[MAX_PATH];
+    FILE *file;
+
+    if (mkdtemp(fixture) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/media", fixture);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/scripts", fixture);
+    mkdir(path, 0755);
+
+    if (_write_fixture("index.html", 4294, "<p>Servidor HTTP en C</p>\n") ||
+        _write_fixture("IMPORTANTE.txt", 612, "texto de prueba ") ||
+        _write_fixture("favicon.ico", 1150, NULL) ||
+        _write_fixture("media/foto.jpg", 32768, NULL) ||
+        _write_fixture("media/anim.gif", 65536, NULL) ||
+        _write_fixture("media/clip.mpeg", 262144, NULL) ||
+        _write_fixture("media/video.mp4", 1048576, NULL) ||
+        _write_fixture("scripts/hola.py", 1, "\n") ||
+        _write_fixture("scripts/hola.php", 1, "\n")) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/scripts/hola.py", fixture);
+    file = fopen(path, "w");
+    if (file != NULL) {
+        fprintf(file, "import sys\nprint('hola', sys.argv[1:])\n");
+        fclose(file);
+    }
+
+    snprintf(conf_path, sizeof(conf_path), "%s/bench.conf", fixture);
+    file = fopen(conf_path, "w");
+    if (file == NULL) {
+        perror(conf_path);
+        return -1;
+    }
+    fprintf(file, "BASE_DIR = %s\nINDEX_FILE = %s/index.html\nPORT = 8080\nMAX_CLIENTS = 10\n"
+        "TIMEOUT = 30\nSCRIPT_TIMEOUT = 10\nLOG_LEVEL = error\nSTATS_PATH = /__stats\n", fixture, fixture);
+    fclose(file);
+    return 0;
+}
+
+/**
+ * @brief Removes the fixture tree.
+ */
+void _remove_fixture() {
+    char command[MAX_PATH + 16];
+
+    snprintf(command, sizeof(command), "rm -rf '%s'", fixture);
+    if (system(command) != 0) {
+        fprintf(stderr, "No se pudo borrar %s\n", fixture);
+    }
+}
+
+/**
+ * @brief Loads the request corpus.
+ *
+ * @param path File of the corpus.
+ * @return Number of requests loaded, -1 on error.
+ */
+int _load_corpus(const char *path) {
+    char line[CORPUS_REQUEST], request[CORPUS_REQUEST];
+    size_t length = 0, n;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        n = strcspn(line, "\r\n");
+        line[n] = '\0';
+        if (length == 0 && line[0] == '#') {
+            continue;
+        }
+        if (strcmp(line, "%%") == 0) {
+            if (length > 0 && corpus_count < CORPUS_MAX) {
+                request[length] = '\0';
+                corpus[corpus_count++] = strdup(request);
+            }
+            length = 0;
+            continue;
+        }
+        if (length + n + 3 < sizeof(request)) {
+            memcpy(request + length, line, n);
+            memcpy(request + length + n, "\r\n", 2);
+            length += n + 2;
+        }
+    }
+    if (length > 0 && corpus_count < CORPUS_MAX) {
+        request[length] = '\0';
+        corpus[corpus_count++] = strdup(request);
+    }
+    fclose(file);
+    return corpus_count;
+}
+
+/**
+ * @brief Loads the request corpus from a capture.
+ *
+ * Bodies that were not stored are left out, the parser only looks at them
+ * for POST arguments.
+ *
+ * @param path File of the capture.
+ * @return Number of requests loaded, -1 on error.
+ */
+int _load_capture(const char *path) {
+    Capture_record record;
+    char *head, *body, *request;
+    FILE *file;
+
+    file = capture_open(path, NULL);
+    if (file == NULL) {
+        fprintf(stderr, "%s: no es una captura\n", path);
+        return -1;
+    }
+    while (corpus_count < CORPUS_MAX && capture_read(file, &record, &head, &body) == 1) {
+        request = (char*)malloc(record.head_length + record.body_stored + 1);
+        if (request != NULL) {
+            memcpy(request, head, record.head_length);
+            if (body != NULL) {
+                memcpy(request + record.head_length, body, record.body_stored);
+            }
+            request[record.head_length + record.body_stored] = '\0';
+            corpus[corpus_count++] = request;
+        }
+        free(head);
+        free(body);
+    }
+    fclose(file);
+    return corpus_count;
+}
+
+
+/* ---------------------- Benchmarks ---------------------- */
+void _bench_pars_http(long iters) {
+    Parser *parser;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        parser = pars_http(corpus[corpus_next++ % corpus_count], config, arena);
+        if (parser == NULL) {
+            abort();
+        }
+        free_parser(parser);
+        arena_reset(arena);
+    }
+}
+
+void _bench_pars_http_malloc(long iters) {
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        free_parser(pars_http(corpus[corpus_next++ % corpus_count], config, NULL));
+    }
+}
+
+void _bench_create_response(long iters) {
+    Response *response;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        response = create_response(type_parser);
+        if (response == NULL) {
+            abort();
+        }
+        free_response(response);
+        arena_reset(arena);
+    }
+}
+
+void _bench_get_file_type(long iters) {
+    volatile File_type type;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        type = get_file_type(file_names[i % (sizeof(file_names) / sizeof(file_names[0]))]);
+    }
+    (void)type;
+}
+
+void _bench_conf_parse(long iters) {
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        free_dict(conf_parse(conf_path));
+    }
+}
+
+void _bench_get_value(long iters) {
+    volatile char *value;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        value = get_value(conf_dict, conf_keys[i % (sizeof(conf_keys) / sizeof(conf_keys[0]))]);
+    }
+    (void)value;
+}
+
+void _bench_compile_config(long iters) {
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        free_config(compile_config(conf_dict));
+    }
+}
+
+void _bench_ratelimit_request(long iters) {
+    long i;
+
+    // Spread over many addresses so every shard and probe length is exercised
+    for (i = 0; i < iters; i++) {
+        ratelimit_request(0x0a000000u + (uint32_t)(i % BENCH_ADDRESSES));
+    }
+}
+
+void _bench_ratelimit_connect(long iters) {
+    uint32_t address;
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        address = 0x0a000000u + (uint32_t)(i % BENCH_ADDRESSES);
+        if (ratelimit_connect(address) == 0) {
+            ratelimit_disconnect(address);
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    char *corpus_path = "bench/corpus/requests.txt", *capture_path = NULL, *filter = NULL, name[64];
+    Dict *dict;
+    int opt, type;
+    // Limits high enough that every check takes the allowed path
+    Rate_limits limits = {1 << 30, 1 << 30, 1 << 20, 60};
+
+    while ((opt = getopt(argc, argv, "c:t:f:")) != -1) {
+        switch (opt) {
+            case 'c': corpus_path = optarg; break;
+            case 't': capture_path = optarg; break;
+            case 'f': filter = optarg; break;
+            default:
+                fprintf(stderr, "Uso: %s [-c corpus] [-t captura] [-f filtro]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (_create_fixture() != 0) {
+        return 1;
+    }
+    if ((capture_path != NULL ? _load_capture(capture_path) : _load_corpus(corpus_path)) <= 0) {
+        fprintf(stderr, "Corpus vacío: %s\n", capture_path != NULL ? capture_path : corpus_path);
+        _remove_fixture();
+        return 1;
+    }
+
+    dict = conf_parse(conf_path);
+    config = compile_config(dict);
+    free_dict(dict);
+    conf_dict = conf_parse(conf_path);
+    arena = arena_create();
+    if (config != NULL) {
+        set_script_limits(&config->script_limits);
+    }
+    if (config == NULL || conf_dict == NULL || arena == NULL) {
+        fprintf(stderr, "No se pudo preparar el benchmark\n");
+        _remove_fixture();
+        return 1;
+    }
+
+    printf("%d peticiones en el corpus, ficheros en %s\n", corpus_count, fixture);
+
+    _run("pars_http", filter, _bench_pars_http);
+    _run("pars_http/malloc", filter, _bench_pars_http_malloc);
+
+    for (type = 0; type < (int)(sizeof(type_requests) / sizeof(type_requests[0])); type++) {
+        if (type_requests[type] == NULL) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "create_response/%s", bench_type_names[type]);
+        if (filter != NULL && strstr(name, filter) == NULL) {
+            continue;
+        }
+        // The parser lives outside the arena so it survives the resets
+        type_parser = pars_http(type_requests[type], config, NULL);
+        if (type_parser == NULL || type_parser->status != HTTP_OK) {
+            printf("%-32s omitido\n", name);
+            free_parser(type_parser);
+            continue;
+        }
+        type_parser->arena = arena;
+        if ((type == PHP && system("command -v php > /dev/null") != 0)) {
+            printf("%-32s omitido (sin php)\n", name);
+        } else {
+            _run(name, filter, _bench_create_response);
+        }
+        type_parser->arena = NULL;
+        free_parser(type_parser);
+    }
+
+    _run("get_file_type", filter, _bench_get_file_type);
+    _run("conf_parse", filter, _bench_conf_parse);
+    _run("get_value", filter, _bench_get_value);
+    _run("compile_config", filter, _bench_compile_config);
+
+    if (ratelimit_init(&limits) == 0) {
+        _run("ratelimit_request", filter, _bench_ratelimit_request);
+        _run("ratelimit_connect", filter, _bench_ratelimit_connect);
+        ratelimit_close();
+    }
+
+    arena_destroy(arena);
+    free_dict(conf_dict);
+    free_config(config);
+    while (corpus_count > 0) {
+        free(corpus[--corpus_count]);
+    }
+    _remove_fixture();
+    return 0;
+}
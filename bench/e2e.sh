@@ -0,0 +1,174 @@
+#!/bin/bash
+#
+# End-to-end performance run of the server.
+#
+# Starts bin/main on loopback over a generated www tree (small, medium and
+# large files plus a script), drives it with bin/loadgen and records
+# throughput, latency percentiles, peak RSS and syscalls per request. The
+# results are compared with the committed baseline and the run fails if any
+# metric is worse than its tolerance allows.
+#
+# Usage: bench/e2e.sh [--update]
+#   --update       Writes the results as the new baseline instead of comparing.
+#
+# Environment:
+#   E2E_PORT       Port of the server (default: 18080).
+#   E2E_DURATION   Seconds of each workload (default: 5).
+#   E2E_BASELINE   Baseline file (default: bench/e2e_baseline.txt).
+#   E2E_SLACK      Multiplies every tolerance, for noisy machines (default: 1).
+#
+# Syscalls are counted with the read and write syscall counters of
+# /proc/<pid>/io (syscr + syscw) over the static workload. They cost nothing
+# and exist on every machine, so the timed workloads never run traced and the
+# count means the same on every run.
+
+set -u
+cd "$(dirname "$0")/.." || exit 1
+
+PORT=${E2E_PORT:-18080}
+DURATION=${E2E_DURATION:-5}
+BASELINE=${E2E_BASELINE:-bench/e2e_baseline.txt}
+SLACK=${E2E_SLACK:-1}
+UPDATE=0
+[ "${1:-}" = "--update" ] && UPDATE=1
+
+WORK=$(mktemp -d /tmp/re_server_e2e.XXXXXX)
+RESULTS=$WORK/results.txt
+SERVER=
+cleanup() {
+    [ -n "$SERVER" ] && kill -INT "$SERVER" 2>/dev/null && sleep 1 && kill -9 "$SERVER" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+make main loadgen > /dev/null || exit 1
+
+# ---------------------- www tree ----------------------
+mkdir -p "$WORK/www/media" "$WORK/www/scripts"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$WORK/www/index.html"
+for i in $(seq 1 20); do
+    head -c $((512 + i * 64)) /dev/zero | tr '\0' 'b' > "$WORK/www/small$i.txt"
+done
+head -c 65536 /dev/urandom > "$WORK/www/media/medium.jpg"
+head -c 262144 /dev/urandom > "$WORK/www/media/medium.gif"
+head -c 4194304 /dev/urandom > "$WORK/www/media/large.mp4"
+cp www/scripts/suma.py "$WORK/www/scripts/suma.py"
+
+cat > "$WORK/e2e.conf" <<EOF
+BASE_DIR = $WORK/www
+INDEX_FILE = $WORK/www/index.html
+PORT = $PORT
+MAX_CLIENTS = 256
+TIMEOUT = 30
+SCRIPT_MAX_RUNNING = 8
+SCRIPT_TIMEOUT = 10
+LOG_LEVEL = error
+STATS_PATH = /__stats
+EOF
+
+# The mix is weighted towards small files, as a web page would be
+{
+    for i in $(seq 1 20); do echo "/small$i.txt"; done
+    for i in $(seq 1 8); do echo "/"; done
+    for i in $(seq 1 4); do echo "/media/medium.jpg"; done
+    echo "/media/medium.gif"
+    echo "/media/large.mp4"
+} > "$WORK/static.urls"
+printf "/scripts/suma.py?num1=4&num2=5\nPOST /scripts/suma.py num1=1&num2=2\n" > "$WORK/scripts.urls"
+
+# ---------------------- server ----------------------
+./bin/main "$WORK/e2e.conf" > "$WORK/server.log" 2>&1 &
+SERVER=$!
+for i in $(seq 1 50); do
+    (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null && break
+    sleep 0.1
+done
+PID=$SERVER
+
+json_value() {
+    grep -o "\"$2\":[0-9.]*" <<< "$1" | head -1 | cut -d: -f2
+}
+
+io_syscalls() {
+    awk '/^syscr|^syscw/ { total += $2 } END { print total + 0 }' "/proc/$PID/io" 2>/dev/null || echo 0
+}
+
+# ---------------------- workloads ----------------------
+./bin/loadgen -p "$PORT" -c 8 -d 1 -u "$WORK/static.urls" -j > /dev/null
+
+SYSCALLS_BEFORE=$(io_syscalls)
+STATIC=$(./bin/loadgen -p "$PORT" -c 32 -t 2 -d "$DURATION" -u "$WORK/static.urls" -j)
+SYSCALLS_AFTER=$(io_syscalls)
+STATIC_REQUESTS=$(json_value "$STATIC" requests)
+
+STATIC_RATE=$(awk -v rps="$(json_value "$STATIC" rps)" 'BEGIN { printf "%d", rps * 0.5 }')
+RATED=$(./bin/loadgen -p "$PORT" -c 32 -t 2 -d "$DURATION" -R "$STATIC_RATE" -u "$WORK/static.urls" -j)
+SCRIPTS=$(./bin/loadgen -p "$PORT" -c 4 -d "$DURATION" -u "$WORK/scripts.urls" -j)
+
+RSS=$(awk '/^VmHWM/ { print $2 }' "/proc/$PID/status" 2>/dev/null)
+
+kill -INT "$SERVER"
+wait "$SERVER" 2>/dev/null
+SERVER=
+
+SYSCALLS=$(( SYSCALLS_AFTER - SYSCALLS_BEFORE ))
+
+# metric value better tolerance(%)
+{
+    echo "static.rps $(json_value "$STATIC" rps) higher 15"
+    echo "static.p50_us $(json_value "$STATIC" p50) lower 30"
+    echo "static.p99_us $(json_value "$STATIC" p99) lower 50"
+    echo "static.errors $(json_value "$STATIC" errors) lower 0"
+    echo "rated.p50_us $(json_value "$RATED" p50) lower 30"
+    echo "rated.p99_us $(json_value "$RATED" p99) lower 50"
+    echo "rated.p999_us $(json_value "$RATED" p999) lower 75"
+    echo "scripts.rps $(json_value "$SCRIPTS" rps) higher 20"
+    echo "scripts.p99_us $(json_value "$SCRIPTS" p99) lower 50"
+    echo "server.rss_kb ${RSS:-0} lower 20"
+    awk -v s="$SYSCALLS" -v r="$STATIC_REQUESTS" \
+        'BEGIN { printf "server.io_syscalls_per_request %.2f lower 10\n", (r > 0 ? s / r : 0) }'
+} > "$RESULTS"
+
+echo "Resultados:"
+column -t "$RESULTS" 2>/dev/null || cat "$RESULTS"
+
+if [ "$UPDATE" = 1 ]; then
+    {
+        echo "# Baseline of bench/e2e.sh, regenerate with make e2e_baseline on the reference machine."
+        echo "# $(uname -m), $(nproc) CPUs, $(date -u +%Y-%m-%d)"
+        echo "# io_syscalls_per_request: syscr + syscw of /proc/<pid>/io over the static workload"
+        cat "$RESULTS"
+    } > "$BASELINE"
+    echo "Baseline actualizado en $BASELINE"
+    exit 0
+fi
+
+if [ ! -f "$BASELINE" ]; then
+    echo "No hay baseline en $BASELINE, ejecuta make e2e_baseline"
+    exit 1
+fi
+
+# ---------------------- comparison ----------------------
+awk -v slack="$SLACK" '
+    NR == FNR {
+        if ($1 !~ /^#/) { base[$1] = $2; better[$1] = $3; tol[$1] = $4 }
+        next
+    }
+    ($1 in base) {
+        limit = tol[$1] * slack / 100
+        if (better[$1] == "higher") {
+            bad = $2 < base[$1] * (1 - limit)
+        } else {
+            bad = $2 > base[$1] * (1 + limit) && $2 > 0
+        }
+        printf "%-30s %12s %12s %s\n", $1, base[$1], $2, bad ? "REGRESION" : "ok"
+        failed += bad
+    }
+    END {
+        if (failed) {
+            printf "%d metricas empeoran mas de lo tolerado\n", failed
+            exit 1
+        }
+        print "Sin regresiones"
+    }
+' "$BASELINE" "$RESULTS"
@@ -0,0 +1,159 @@
+/**
+ * @file load_utils.c
+ * @brief Histogram and response reader shared by the load tools.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "load_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Bucket of a latency.
+ *
+ * @param value Latency in microseconds.
+ * @return Index of the bucket.
+ */
+int _bucket(unsigned long value) {
+    int octave;
+
+    if (value < 2 * HIST_SUB) {
+        return value;
+    }
+    octave = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+    if (octave >= HIST_BUCKETS / HIST_SUB - 1) {
+        return HIST_BUCKETS - 1;
+    }
+    return octave * HIST_SUB + (value >> octave);
+}
+
+/**
+ * @brief Highest latency that falls into a bucket.
+ *
+ * @param bucket Index of the bucket.
+ * @return The latency in microseconds.
+ */
+unsigned long _bucket_value(int bucket) {
+    int octave;
+
+    if (bucket < 2 * HIST_SUB) {
+        return bucket;
+    }
+    octave = bucket / HIST_SUB - 1;
+    return ((unsigned long)(bucket - octave * HIST_SUB + 1) << octave) - 1;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+unsigned long now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void histogram_record(Histogram *histogram, unsigned long value) {
+    histogram->counts[_bucket(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+void histogram_merge(Histogram *to, Histogram *from) {
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        to->counts[i] += from->counts[i];
+    }
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->max > to->max) {
+        to->max = from->max;
+    }
+}
+
+unsigned long histogram_percentile(Histogram *histogram, double quantile) {
+    unsigned long target = (unsigned long)(quantile * histogram->total + 0.5), seen = 0;
+    int i;
+
+    if (target == 0) {
+        target = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= target) {
+            return _bucket_value(i) < histogram->max ? _bucket_value(i) : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void reader_reset(Response_reader *reader) {
+    reader->head_length = 0;
+    reader->body_left = 0;
+    reader->in_body = 0;
+}
+
+int reader_feed(Response_reader *reader, char **data, size_t *length) {
+    char *end, *line;
+    size_t take, head;
+
+    while (*length > 0 || (reader->in_body && reader->body_left == 0)) {
+        if (reader->in_body) {
+            take = *length < reader->body_left ? *length : reader->body_left;
+            reader->body_left -= take;
+            *data += take;
+            *length -= take;
+            if (reader->body_left == 0) {
+                reader->in_body = 0;
+                return 1;
+            }
+            continue;
+        }
+
+        take = HEAD_MAX - 1 - reader->head_length;
+        take = *length < take ? *length : take;
+        memcpy(reader->head + reader->head_length, *data, take);
+        reader->head_length += take;
+        reader->head[reader->head_length] = '\0';
+
+        end = strstr(reader->head, "\r\n\r\n");
+        if (end == NULL) {
+            if (reader->head_length == HEAD_MAX - 1) {
+                return -1;
+            }
+            *data += take;
+            *length -= take;
+            continue;
+        }
+        head = end - reader->head + 4;
+        // Bytes copied past the head belong to the body or to the next response
+        *data += take - (reader->head_length - head);
+        *length -= take - (reader->head_length - head);
+
+        reader->status = 0;
+        sscanf(reader->head, "HTTP/%*s %d", &reader->status);
+        reader->body_left = 0;
+        line = reader->head;
+        while (line != NULL && line < end) {
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                reader->body_left = strtoul(line + 15, NULL, 10);
+            }
+            line = strstr(line, "\r\n");
+            if (line != NULL) {
+                line += 2;
+            }
+        }
+        reader->in_body = 1;
+        reader->head_length = 0;
+    }
+    return 0;
+}
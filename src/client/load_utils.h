@@ -0,0 +1,96 @@
+/**
+ * @file load_utils.h
+ * @brief Pieces shared by the load generator and the replay tool.
+ *
+ * A log-linear latency histogram and an incremental reader that splits the
+ * bytes received on a keep-alive connection into responses.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef LOAD_UTILS_H
+#define LOAD_UTILS_H
+
+#include <stddef.h>
+
+#define HEAD_MAX 8192
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * 42)
+
+/**
+ * @struct Histogram
+ * @brief Log-linear latency histogram in microseconds, about 1.5% precision.
+ */
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long max;
+    double sum;
+} Histogram;
+
+/**
+ * @struct Response_reader
+ * @brief State of the response being read on a connection.
+ */
+typedef struct {
+    char head[HEAD_MAX];     /**< Head of the response being read. */
+    size_t head_length;      /**< Length of head. */
+    size_t body_left;        /**< Body bytes still to read. */
+    int status;              /**< Status of the last response. */
+    int in_body;             /**< Whether the head is complete. */
+} Response_reader;
+
+/**
+ * @brief Current monotonic time in microseconds.
+ *
+ * @return The time.
+ */
+unsigned long now_us();
+
+/**
+ * @brief Adds a latency to a histogram.
+ *
+ * @param histogram The histogram.
+ * @param value Latency in microseconds.
+ */
+void histogram_record(Histogram *histogram, unsigned long value);
+
+/**
+ * @brief Adds the samples of a histogram to another.
+ *
+ * @param to The histogram that receives the samples.
+ * @param from The histogram to add.
+ */
+void histogram_merge(Histogram *to, Histogram *from);
+
+/**
+ * @brief Latency below which a fraction of the samples fall.
+ *
+ * @param histogram The histogram.
+ * @param quantile The fraction, between 0 and 1.
+ * @return The latency in microseconds.
+ */
+unsigned long histogram_percentile(Histogram *histogram, double quantile);
+
+/**
+ * @brief Prepares a reader for a new connection.
+ *
+ * @param reader The reader.
+ */
+void reader_reset(Response_reader *reader);
+
+/**
+ * @brief Consumes received bytes until a response is complete.
+ *
+ * @param reader The reader.
+ * @param data Received bytes, moved past the consumed ones.
+ * @param length Number of bytes, reduced by the consumed ones.
+ * @return 1 if a response was completed (its status is in reader->status),
+ *         0 if every byte was consumed without completing one, -1 if the
+ *         response cannot be parsed.
+ */
+int reader_feed(Response_reader *reader, char **data, size_t *length);
+
+#endif
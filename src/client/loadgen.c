@@ -0,0 +1,636 @@
+/**
+ * @file loadgen.c
+ * @brief Non-interactive load generator for the server.
+ *
+ * This program opens a number of concurrent keep-alive connections to the
+ * server and sends requests taken from a URL mix, either as fast as the
+ * server answers (closed loop) or at a constant rate. It reports throughput
+ * and the latency distribution.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ *
+ * @details
+ * ## Features:
+ * - N keep-alive connections spread over several threads, each one running
+ *   an epoll loop.
+ * - Optional pipelining of up to PIPELINE_MAX requests per connection.
+ * - URL mix read from a file, one request per line: `[METHOD] path [body]`.
+ * - Fixed duration or fixed number of requests.
+ * - Constant rate mode with coordinated-omission correction: the latency of
+ *   every request is measured from the moment it should have been sent
+ *   according to the schedule, not from the moment it was actually sent, so
+ *   a stall of the server is charged to every request it delayed (like wrk2).
+ * - Text or JSON report with p50/p90/p99/p99.9 latency.
+ *
+ * ## Usage:
+ * ```
+ * ./loadgen [-h host] [-p port] [-c connections] [-t threads] [-d seconds]
+ *           [-n requests] [-P pipeline] [-R rate] [-u urls] [-j] [path]
+ * ```
+ * - `-c`: Concurrent connections (default: 10).
+ * - `-t`: Threads (default: 1).
+ * - `-d`: Duration in seconds (default: 10).
+ * - `-n`: Stop after this many responses instead of after the duration.
+ * - `-P`: Requests in flight per connection (default: 1).
+ * - `-R`: Total requests per second, 0 for closed loop (default: 0).
+ * - `-u`: File with the URL mix, `path` is used if not given (default: /).
+ * - `-j`: Print the report as JSON.
+ *
+ * ## Example:
+ * ```
+ * ./loadgen -c 50 -t 4 -d 30 -R 20000 -u urls.txt
+ * ```
+ */
+
+#define _GNU_SOURCE
+#include "load_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define PIPELINE_MAX 64
+#define MAX_URLS 4096
+#define MAX_LINE 8192
+#define OUT_MAX 65536
+#define RECV_SIZE 65536
+
+/**
+ * @struct Url
+ * @brief A request of the mix, already rendered.
+ */
+typedef struct {
+    char *request;     /**< Bytes of the request. */
+    size_t length;     /**< Length of the request. */
+} Url;
+
+/**
+ * @struct Connection
+ * @brief State of one connection.
+ */
+typedef struct {
+    int fd;                              /**< Socket, -1 if closed. */
+    int id;                              /**< Index of the connection. */
+    unsigned long sent[PIPELINE_MAX];    /**< Start times of the requests in flight. */
+    int sent_head;                       /**< Oldest request in flight. */
+    int in_flight;                       /**< Requests in flight. */
+    char out[OUT_MAX];                   /**< Bytes waiting to be written. */
+    size_t out_length;                   /**< Length of out. */
+    size_t out_offset;                   /**< Bytes of out already written. */
+    int want_write;                      /**< Whether EPOLLOUT is registered. */
+    Response_reader reader;              /**< Response being read. */
+    unsigned long next_due;              /**< Scheduled time of the next request (rate mode). */
+    unsigned long url;                   /**< Next request of the mix. */
+} Connection;
+
+/**
+ * @struct Worker
+ * @brief A thread and its connections.
+ */
+typedef struct {
+    pthread_t thread;
+    int id;
+    int epoll;
+    Connection *connections;
+    int count;
+    Histogram histogram;
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long errors;
+    unsigned long reconnects;
+    unsigned long statuses[6];
+} Worker;
+
+/* ---------------------- Global objects ---------------------- */
+struct addrinfo *server_addr;
+Url urls[MAX_URLS];
+int url_count = 0;
+int connections = 10;
+int threads = 1;
+int pipeline = 1;
+double duration = 10;
+long max_requests = 0;
+double rate = 0;
+unsigned long interval_us = 0;
+unsigned long start_us, end_us;
+_Atomic long completed = 0;
+_Atomic int stop = 0;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Renders a request of the mix.
+ *
+ * @param line Line of the mix: `[METHOD] path [body]`.
+ * @param host Value of the Host header.
+ * @return 0 on success, -1 if the line is empty or memory allocation fails.
+ */
+int _add_url(char *line, const char *host) {
+    char method[16] = "GET", path[MAX_LINE], *body = NULL, *request;
+    size_t length;
+    int n;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#' || url_count == MAX_URLS) {
+        return -1;
+    }
+
+    if (line[0] == '/') {
+        sscanf(line, "%8191s%n", path, &n);
+    } else if (sscanf(line, "%15s %8191s%n", method, path, &n) < 2) {
+        return -1;
+    }
+    if (line[n] == ' ') {
+        body = line + n + 1;
+    }
+
+    length = strlen(method) + strlen(path) + strlen(host) + (body ? strlen(body) : 0) + 64;
+    request = (char*)malloc(length);
+    if (request == NULL) {
+        return -1;
+    }
+    if (body != NULL) {
+        length = snprintf(request, length, "%s %s HTTP/1.1\r\nHost: %s\r\nContent-Length: %zu\r\n\r\n%s",
+            method, path, host, strlen(body), body);
+    } else {
+        length = snprintf(request, length, "%s %s HTTP/1.1\r\nHost: %s\r\n\r\n", method, path, host);
+    }
+    if (length > OUT_MAX / PIPELINE_MAX) {
+        fprintf(stderr, "Petición demasiado larga: %.60s\n", line);
+        free(request);
+        return -1;
+    }
+
+    urls[url_count].request = request;
+    urls[url_count].length = length;
+    url_count++;
+    return 0;
+}
+
+/**
+ * @brief Opens a connection and registers it in the epoll of its worker.
+ *
+ * @param worker The worker.
+ * @param connection The connection.
+ * @return 0 on success, -1 on error.
+ */
+int _connect(Worker *worker, Connection *connection) {
+    struct epoll_event event;
+    int fd, one = 1;
+
+    fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    connection->fd = fd;
+    connection->sent_head = 0;
+    connection->in_flight = 0;
+    connection->out_length = 0;
+    connection->out_offset = 0;
+    connection->want_write = 0;
+    reader_reset(&connection->reader);
+
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        connection->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes a connection after an error and opens it again.
+ *
+ * The requests in flight are counted as errors. In rate mode their slots
+ * in the schedule are not given back, so the delay is still measured.
+ *
+ * @param worker The worker.
+ * @param connection The connection.
+ */
+void _reconnect(Worker *worker, Connection *connection) {
+    if (connection->fd != -1) {
+        close(connection->fd);
+        connection->fd = -1;
+    }
+    worker->errors += connection->in_flight;
+    worker->reconnects++;
+    if (!atomic_load(&stop) && _connect(worker, connection) == -1) {
+        worker->errors++;
+    }
+}
+
+/**
+ * @brief Writes pending bytes and updates the EPOLLOUT registration.
+ *
+ * @param worker The worker.
+ * @param connection The connection.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int _flush(Worker *worker, Connection *connection) {
+    struct epoll_event event;
+    ssize_t status;
+    int want;
+
+    while (connection->out_offset < connection->out_length) {
+        status = send(connection->fd, connection->out + connection->out_offset,
+            connection->out_length - connection->out_offset, MSG_NOSIGNAL);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            return -1;
+        }
+        connection->out_offset += status;
+    }
+    if (connection->out_offset == connection->out_length) {
+        connection->out_offset = connection->out_length = 0;
+    }
+
+    want = connection->out_length > 0;
+    if (want != connection->want_write) {
+        event.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        event.data.ptr = connection;
+        epoll_ctl(worker->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->want_write = want;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues as many requests as the pipeline and the schedule allow.
+ *
+ * @param worker The worker.
+ * @param connection The connection.
+ * @param now Current time in microseconds.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int _fill(Worker *worker, Connection *connection, unsigned long now) {
+    Url *url;
+    int slot;
+
+    if (connection->fd == -1) {
+        return 0;
+    }
+    while (connection->in_flight < pipeline && !atomic_load(&stop)) {
+        if (interval_us > 0 && connection->next_due > now) {
+            break;
+        }
+        url = &urls[connection->url % url_count];
+        if (connection->out_length + url->length > OUT_MAX) {
+            break;
+        }
+        memcpy(connection->out + connection->out_length, url->request, url->length);
+        connection->out_length += url->length;
+        connection->url++;
+
+        slot = (connection->sent_head + connection->in_flight) % PIPELINE_MAX;
+        // With a schedule the latency starts when the request was due, not when it was sent
+        connection->sent[slot] = interval_us > 0 ? connection->next_due : now;
+        connection->next_due += interval_us;
+        connection->in_flight++;
+    }
+    return _flush(worker, connection);
+}
+
+/**
+ * @brief Accounts a complete response.
+ *
+ * @param worker The worker.
+ * @param connection The connection.
+ * @param now Current time in microseconds.
+ */
+void _complete(Worker *worker, Connection *connection, unsigned long now) {
+    unsigned long start;
+
+    if (connection->in_flight == 0) {
+        worker->errors++;
+        return;
+    }
+    start = connection->sent[connection->sent_head];
+    connection->sent_head = (connection->sent_head + 1) % PIPELINE_MAX;
+    connection->in_flight--;
+
+    histogram_record(&worker->histogram, now > start ? now - start : 0);
+    worker->requests++;
+    worker->statuses[connection->reader.status / 100 <= 5 ? connection->reader.status / 100 : 0]++;
+    if (connection->reader.status < 200 || connection->reader.status >= 400) {
+        worker->errors++;
+    }
+    if (max_requests > 0 && atomic_fetch_add(&completed, 1) + 1 >= max_requests) {
+        atomic_store(&stop, 1);
+    }
+}
+
+/**
+ * @brief Consumes received bytes, splitting them into responses.
+ *
+ * @param worker The worker.
+ * @param connection The connection.
+ * @param data Received bytes.
+ * @param length Number of bytes.
+ * @param now Current time in microseconds.
+ * @return 0 on success, -1 if the response cannot be parsed.
+ */
+int _consume(Worker *worker, Connection *connection, char *data, size_t length, unsigned long now) {
+    int status;
+
+    worker->bytes += length;
+    while (length > 0) {
+        status = reader_feed(&connection->reader, &data, &length);
+        if (status == -1) {
+            return -1;
+        }
+        if (status == 1) {
+            _complete(worker, connection, now);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Event loop of a worker thread.
+ *
+ * @param arg The worker.
+ * @return NULL
+ */
+void *_run_worker(void *arg) {
+    Worker *worker = (Worker *)arg;
+    struct epoll_event events[256];
+    Connection *connection;
+    char *data;
+    struct timespec wait;
+    unsigned long now, wake;
+    ssize_t received;
+    int i, n;
+
+    data = (char*)malloc(RECV_SIZE);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    while (!atomic_load(&stop)) {
+        now = now_us();
+        if (now >= end_us) {
+            atomic_store(&stop, 1);
+            break;
+        }
+
+        wake = end_us;
+        for (i = 0; i < worker->count; i++) {
+            connection = &worker->connections[i];
+            if (connection->fd == -1) {
+                _reconnect(worker, connection);
+            }
+            if (_fill(worker, connection, now) == -1) {
+                _reconnect(worker, connection);
+            }
+            if (interval_us > 0 && connection->in_flight < pipeline && connection->next_due < wake) {
+                wake = connection->next_due;
+            }
+        }
+
+        // Millisecond timeouts would delay every scheduled request, epoll_pwait2 takes a timespec
+        wake = interval_us > 0 && wake < now + 100000 ? (wake > now ? wake - now : 0) : 100000;
+        wait.tv_sec = 0;
+        wait.tv_nsec = wake * 1000;
+        n = epoll_pwait2(worker->epoll, events, 256, &wait, NULL);
+
+        now = now_us();
+        for (i = 0; i < n; i++) {
+            connection = (Connection *)events[i].data.ptr;
+            if (connection->fd == -1) {
+                continue;
+            }
+            if (events[i].events & EPOLLOUT && _flush(worker, connection) == -1) {
+                _reconnect(worker, connection);
+                continue;
+            }
+            if (!(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                continue;
+            }
+            while ((received = recv(connection->fd, data, RECV_SIZE, 0)) > 0) {
+                if (_consume(worker, connection, data, received, now) == -1) {
+                    received = 0;
+                    break;
+                }
+            }
+            if (received == 0 || (received == -1 && errno != EAGAIN && errno != EINTR)) {
+                _reconnect(worker, connection);
+            }
+        }
+    }
+
+    free(data);
+    return NULL;
+}
+
+/**
+ * @brief Prints the report.
+ *
+ * @param total Histogram of all the workers.
+ * @param workers The workers.
+ * @param elapsed Elapsed time in seconds.
+ * @param json Whether to print JSON.
+ */
+void _report(Histogram *total, Worker *workers, double elapsed, int json) {
+    unsigned long requests = 0, bytes = 0, errors = 0, reconnects = 0, statuses[6] = {0};
+    double mean = total->total > 0 ? total->sum / total->total : 0;
+    int i, j;
+
+    for (i = 0; i < threads; i++) {
+        requests += workers[i].requests;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+        reconnects += workers[i].reconnects;
+        for (j = 0; j < 6; j++) {
+            statuses[j] += workers[i].statuses[j];
+        }
+    }
+
+    if (json) {
+        printf("{\"connections\":%d,\"threads\":%d,\"pipeline\":%d,\"rate\":%.0f,"
+            "\"duration_s\":%.3f,\"requests\":%lu,\"rps\":%.1f,\"bytes\":%lu,\"errors\":%lu,"
+            "\"reconnects\":%lu,\"status\":{\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu},"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+            connections, threads, pipeline, rate, elapsed, requests, requests / elapsed, bytes, errors,
+            reconnects, statuses[2], statuses[3], statuses[4], statuses[5], mean,
+            histogram_percentile(total, 0.5), histogram_percentile(total, 0.9), histogram_percentile(total, 0.99),
+            histogram_percentile(total, 0.999), total->max);
+        return;
+    }
+
+    printf("%d conexiones, %d hilos, pipeline %d, %s\n", connections, threads, pipeline,
+        rate > 0 ? "ritmo constante" : "bucle cerrado");
+    printf("  %lu peticiones en %.2fs, %lu bytes leidos\n", requests, elapsed, bytes);
+    printf("  Peticiones/s: %.1f\n", requests / elapsed);
+    printf("  Transferencia/s: %.2f MB\n", bytes / elapsed / (1024 * 1024));
+    printf("  Respuestas: 2xx=%lu 3xx=%lu 4xx=%lu 5xx=%lu\n", statuses[2], statuses[3], statuses[4], statuses[5]);
+    printf("  Errores: %lu, reconexiones: %lu\n", errors, reconnects);
+    printf("  Latencia (us)%s:\n", rate > 0 ? " corregida" : "");
+    printf("    media  %10.1f\n", mean);
+    printf("    p50    %10lu\n", histogram_percentile(total, 0.5));
+    printf("    p90    %10lu\n", histogram_percentile(total, 0.9));
+    printf("    p99    %10lu\n", histogram_percentile(total, 0.99));
+    printf("    p99.9  %10lu\n", histogram_percentile(total, 0.999));
+    printf("    max    %10lu\n", total->max);
+}
+
+
+int main(int argc, char *argv[]) {
+    char *host = "127.0.0.1", *port = "8080", *url_file = NULL, *path = "/";
+    char line[MAX_LINE], host_header[300];
+    struct addrinfo hints;
+    Worker *workers;
+    Histogram *total;
+    FILE *file;
+    double elapsed;
+    int opt, json = 0, i, j, status;
+
+    while ((opt = getopt(argc, argv, "h:p:c:t:d:n:P:R:u:j")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': connections = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'n': max_requests = atol(optarg); break;
+            case 'P': pipeline = atoi(optarg); break;
+            case 'R': rate = atof(optarg); break;
+            case 'u': url_file = optarg; break;
+            case 'j': json = 1; break;
+            default:
+                fprintf(stderr, "Uso: %s [-h host] [-p port] [-c conexiones] [-t hilos] [-d segundos] "
+                    "[-n peticiones] [-P pipeline] [-R ritmo] [-u urls] [-j] [path]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        path = argv[optind];
+    }
+    if (connections <= 0 || threads <= 0 || pipeline <= 0 || pipeline > PIPELINE_MAX || duration <= 0) {
+        fprintf(stderr, "Parámetros invalidos\n");
+        return 1;
+    }
+    if (threads > connections) {
+        threads = connections;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    status = getaddrinfo(host, port, &hints, &server_addr);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return 1;
+    }
+
+    snprintf(host_header, sizeof(host_header), "%s:%s", host, port);
+    if (url_file != NULL) {
+        file = fopen(url_file, "r");
+        if (file == NULL) {
+            perror("Error al abrir la lista de URLs");
+            return 1;
+        }
+        while (fgets(line, sizeof(line), file) != NULL) {
+            _add_url(line, host_header);
+        }
+        fclose(file);
+    } else {
+        snprintf(line, sizeof(line), "GET %s", path);
+        _add_url(line, host_header);
+    }
+    if (url_count == 0) {
+        fprintf(stderr, "No hay URLs que pedir\n");
+        return 1;
+    }
+
+    workers = (Worker*)calloc(threads, sizeof(Worker));
+    total = (Histogram*)calloc(1, sizeof(Histogram));
+    if (workers == NULL || total == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    start_us = now_us();
+    end_us = start_us + (unsigned long)(duration * 1000000);
+    if (rate > 0) {
+        interval_us = (unsigned long)(connections * 1000000.0 / rate);
+        interval_us = interval_us > 0 ? interval_us : 1;
+    }
+
+    for (i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].count = connections / threads + (i < connections % threads);
+        workers[i].connections = (Connection*)calloc(workers[i].count, sizeof(Connection));
+        workers[i].epoll = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].connections == NULL || workers[i].epoll == -1) {
+            perror("worker");
+            return 1;
+        }
+        for (j = 0; j < workers[i].count; j++) {
+            Connection *connection = &workers[i].connections[j];
+            connection->id = j * threads + i;
+            connection->url = connection->id;
+            // Spread the schedules so the connections do not fire together
+            connection->next_due = start_us + interval_us * connection->id / connections;
+            if (_connect(&workers[i], connection) == -1) {
+                perror("connect");
+                return 1;
+            }
+        }
+    }
+
+    for (i = 0; i < threads; i++) {
+        pthread_create(&workers[i].thread, NULL, _run_worker, &workers[i]);
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    elapsed = (now_us() - start_us) / 1000000.0;
+
+    for (i = 0; i < threads; i++) {
+        histogram_merge(total, &workers[i].histogram);
+    }
+
+    _report(total, workers, elapsed, json);
+
+    for (i = 0; i < threads; i++) {
+        for (j = 0; j < workers[i].count; j++) {
+            if (workers[i].connections[j].fd != -1) {
+                close(workers[i].connections[j].fd);
+            }
+        }
+        close(workers[i].epoll);
+        free(workers[i].connections);
+    }
+    for (i = 0; i < url_count; i++) {
+        free(urls[i].request);
+    }
+    free(workers);
+    free(total);
+    freeaddrinfo(server_addr);
+    return 0;
+}
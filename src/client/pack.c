@@ -0,0 +1,395 @@
+/**
+ * @file pack.c
+ * @brief Packs a document root into an asset bundle.
+ *
+ * This program walks BASE_DIR and writes every file the server can send
+ * into a single bundle (see bundle.h) that the server maps at startup when
+ * BUNDLE is set in re_server.conf.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ *
+ * @details
+ * ## Features:
+ * - Paths, types and ETags are computed once here instead of on every
+ *   request.
+ * - Text and HTML files get a gzip variant when it is smaller, sent to the
+ *   clients that accept it.
+ * - Scripts and files of unknown type are left out, scripts keep running
+ *   from BASE_DIR.
+ * - Paths are sorted, so the same tree always gives the same bundle.
+ * - The bundle is written next to its destination and renamed over it, a
+ *   server starting meanwhile maps either the old one or the new one.
+ *
+ * ## Usage:
+ * ```
+ * ./pack [-n] base_dir bundle
+ * ```
+ * - `-n`: Do not add gzip variants.
+ *
+ * ## Example:
+ * ```
+ * ./pack ./www ./www.bundle
+ * ```
+ */
+
+#define _GNU_SOURCE
+#include "../utils/bundle.h"
+#include "../utils/file_type.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/**
+ * @struct Pack_file
+ * @brief A file found under the document root.
+ */
+typedef struct {
+    char *path;        /**< Path on disk. */
+    char *name;        /**< Path relative to the document root, starting with '/'. */
+    File_type type;    /**< Type of the file. */
+} Pack_file;
+
+/* ---------------------- Global objects ---------------------- */
+Pack_file *files = NULL;
+size_t file_count = 0;
+size_t file_capacity = 0;
+size_t root_length = 0;
+int skipped = 0;
+int with_gzip = 1;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Adds a file of the walk to the list.
+ */
+int _collect(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    Pack_file *grown;
+    File_type type;
+
+    if (flag != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    type = get_file_type(path);
+    if (type == PYTHON || type == PHP || type == UNKNOWN) {
+        printf("Omitido %s\n", path);
+        skipped++;
+        return 0;
+    }
+
+    if (file_count == file_capacity) {
+        file_capacity = file_capacity ? file_capacity * 2 : 256;
+        grown = (Pack_file*)realloc(files, file_capacity * sizeof(Pack_file));
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        files = grown;
+    }
+    files[file_count].path = strdup(path);
+    files[file_count].name = strdup(path + root_length);
+    files[file_count].type = type;
+    if (files[file_count].path == NULL || files[file_count].name == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    file_count++;
+    return 0;
+}
+
+/**
+ * @brief Orders files by path.
+ */
+int _compare_files(const void *a, const void *b) {
+    return strcmp(((const Pack_file *)a)->name, ((const Pack_file *)b)->name);
+}
+
+/**
+ * @brief Reads a whole file.
+ *
+ * @param path Path of the file.
+ * @param length Set to the length of the file.
+ * @return The content, allocated with malloc, or NULL on failure.
+ */
+char *_read_all(const char *path, size_t *length) {
+    struct stat st;
+    char *content;
+    ssize_t n;
+    size_t done = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+    // One more byte so an empty file still gets a buffer
+    content = (char*)malloc(st.st_size + 1);
+    if (content == NULL) {
+        perror("malloc");
+        close(fd);
+        return NULL;
+    }
+    while (done < (size_t)st.st_size) {
+        n = read(fd, content + done, st.st_size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    *length = done;
+    return content;
+}
+
+/**
+ * @brief Compresses a content with gzip.
+ *
+ * @param content The content.
+ * @param length Length of content.
+ * @param compressed_length Set to the length of the result.
+ * @return The gzip stream, allocated with malloc, or NULL if it is not
+ *         smaller than the content.
+ */
+char *_gzip(const char *content, size_t length, size_t *compressed_length) {
+    z_stream stream;
+    char *out;
+    size_t bound;
+
+    memset(&stream, 0, sizeof(stream));
+    // 15 + 16: largest window with a gzip wrapper
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    bound = deflateBound(&stream, length);
+    out = (char*)malloc(bound);
+    if (out == NULL) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef *)content;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = bound;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END || stream.total_out >= length) {
+        deflateEnd(&stream);
+        free(out);
+        return NULL;
+    }
+    *compressed_length = stream.total_out;
+    deflateEnd(&stream);
+    return out;
+}
+
+/**
+ * @brief Rounds an offset up to the alignment of the contents.
+ */
+uint64_t _align(uint64_t offset) {
+    return (offset + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+}
+
+/**
+ * @brief Writes a whole buffer at an offset.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int _write_at(int fd, const void *data, size_t length, uint64_t offset) {
+    ssize_t n;
+    size_t done = 0;
+
+    while (done < length) {
+        n = pwrite(fd, (const char *)data + done, length - done, offset + done);
+        if (n == -1) {
+            perror("pwrite");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes the bundle of the collected files.
+ *
+ * @param fd The file of the bundle, empty.
+ * @param size Set to the size of the bundle.
+ * @return 0 on success, -1 on error.
+ */
+int _write_bundle(int fd, uint64_t *size) {
+    Bundle_header header;
+    Bundle_entry *entries;
+    uint32_t *table, slots = 2, slot;
+    uint64_t names, data, hash;
+    size_t i, j, length, gzip_length, gzipped = 0;
+    char *content, *gzip;
+
+    while (slots < 2 * file_count) {
+        slots *= 2;
+    }
+    entries = (Bundle_entry*)calloc(file_count ? file_count : 1, sizeof(Bundle_entry));
+    table = (uint32_t*)calloc(slots, sizeof(uint32_t));
+    if (entries == NULL || table == NULL) {
+        perror("calloc");
+        free(entries);
+        free(table);
+        return -1;
+    }
+
+    // The names go right after the table, the contents after the names
+    names = sizeof(Bundle_header) + file_count * sizeof(Bundle_entry) + slots * sizeof(uint32_t);
+    data = names;
+    for (i = 0; i < file_count; i++) {
+        entries[i].name = data - names;
+        entries[i].name_length = strlen(files[i].name);
+        entries[i].type = files[i].type;
+        if (_write_at(fd, files[i].name, entries[i].name_length, data) == -1) {
+            goto fail;
+        }
+        data += entries[i].name_length;
+
+        slot = bundle_hash(files[i].name, entries[i].name_length) & (slots - 1);
+        while (table[slot] != 0) {
+            slot = (slot + 1) & (slots - 1);
+        }
+        table[slot] = i + 1;
+    }
+
+    for (i = 0; i < file_count; i++) {
+        content = _read_all(files[i].path, &length);
+        if (content == NULL) {
+            goto fail;
+        }
+
+        // FNV-1a of the content, it changes whenever the file does
+        hash = 14695981039346656037ULL;
+        for (j = 0; j < length; j++) {
+            hash ^= (unsigned char)content[j];
+            hash *= 1099511628211ULL;
+        }
+        snprintf(entries[i].etag, BUNDLE_ETAG_SIZE, "\"%016llx\"", (unsigned long long)hash);
+
+        data = _align(data);
+        entries[i].offset = data;
+        entries[i].length = length;
+        if (_write_at(fd, content, length, data) == -1) {
+            free(content);
+            goto fail;
+        }
+        data += length;
+
+        gzip = NULL;
+        if (with_gzip && (files[i].type == TEXT || files[i].type == HTML)) {
+            gzip = _gzip(content, length, &gzip_length);
+        }
+        if (gzip != NULL) {
+            data = _align(data);
+            entries[i].gzip_offset = data;
+            entries[i].gzip_length = gzip_length;
+            if (_write_at(fd, gzip, gzip_length, data) == -1) {
+                free(gzip);
+                free(content);
+                goto fail;
+            }
+            data += gzip_length;
+            gzipped++;
+            free(gzip);
+        }
+        free(content);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.count = file_count;
+    header.slots = slots;
+    header.size = data;
+    if (_write_at(fd, &header, sizeof(header), 0) == -1 ||
+        _write_at(fd, entries, file_count * sizeof(Bundle_entry), sizeof(header)) == -1 ||
+        _write_at(fd, table, slots * sizeof(uint32_t), sizeof(header) + file_count * sizeof(Bundle_entry)) == -1 ||
+        ftruncate(fd, data) == -1) {
+        goto fail;
+    }
+
+    printf("%zu archivos empaquetados (%zu con variante gzip), %d omitidos, %llu bytes\n",
+        file_count, gzipped, skipped, (unsigned long long)data);
+    *size = data;
+    free(entries);
+    free(table);
+    return 0;
+
+fail:
+    free(entries);
+    free(table);
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    char *root, *output, temp[4096];
+    uint64_t size;
+    size_t i;
+    int opt, fd, status;
+
+    while ((opt = getopt(argc, argv, "n")) != -1) {
+        switch (opt) {
+            case 'n': with_gzip = 0; break;
+            default:
+                fprintf(stderr, "Uso: %s [-n] directorio bundle\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind + 2 != argc) {
+        fprintf(stderr, "Uso: %s [-n] directorio bundle\n", argv[0]);
+        return 1;
+    }
+
+    // Names are relative to the root as written in BASE_DIR, without trailing slashes
+    root = argv[optind];
+    output = argv[optind + 1];
+    root_length = strlen(root);
+    while (root_length > 1 && root[root_length - 1] == '/') {
+        root[--root_length] = '\0';
+    }
+
+    if (nftw(root, _collect, 32, FTW_PHYS) != 0) {
+        fprintf(stderr, "No se pudo recorrer %s\n", root);
+        return 1;
+    }
+    if (files != NULL) {
+        qsort(files, file_count, sizeof(Pack_file), _compare_files);
+    }
+
+    snprintf(temp, sizeof(temp), "%s.tmp", output);
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror(temp);
+        return 1;
+    }
+    status = _write_bundle(fd, &size);
+    if (status == 0 && fsync(fd) == -1) {
+        perror("fsync");
+        status = -1;
+    }
+    close(fd);
+    if (status == 0 && rename(temp, output) == -1) {
+        perror("rename");
+        status = -1;
+    }
+    if (status != 0) {
+        unlink(temp);
+    }
+
+    for (i = 0; i < file_count; i++) {
+        free(files[i].path);
+        free(files[i].name);
+    }
+    free(files);
+    return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,610 @@
+/**
+ * @file replay.c
+ * @brief Replays a request capture against the server.
+ *
+ * This program reads a capture written by the server (CAPTURE_FILE) and sends
+ * its requests again, keeping the connections they arrived on and their
+ * arrival times scaled by a speed factor, or as fast as the server answers.
+ * It reports throughput and the latency distribution.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ *
+ * @details
+ * ## Features:
+ * - Every captured connection is replayed on its own keep-alive connection,
+ *   one request at a time and in the captured order.
+ * - At speed N the requests are due at their captured offset divided by N;
+ *   latency is measured from that moment, so when the server falls behind
+ *   the delay is charged to the requests it held up.
+ * - At speed 0 every connection sends its next request as soon as the
+ *   previous response arrives.
+ * - Bodies that were not stored in the capture are sent as filler of the
+ *   captured size.
+ * - Text or JSON report with p50/p90/p99/p99.9 latency.
+ *
+ * ## Usage:
+ * ```
+ * ./replay [-h host] [-p port] [-s speed] [-c connections] [-j] capture
+ * ```
+ * - `-s`: Speed factor, 1 for real time, 0 for maximum speed (default: 1).
+ * - `-c`: Maximum connections open at once (default: 256).
+ * - `-j`: Print the report as JSON.
+ *
+ * ## Example:
+ * ```
+ * ./replay -s 10 requests.capture
+ * ```
+ */
+
+#define _GNU_SOURCE
+#include "load_utils.h"
+#include "../utils/capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define RECV_SIZE 65536
+#define STALL_US 10000000UL
+
+/**
+ * @struct Replay_request
+ * @brief A captured request, ready to be sent.
+ */
+typedef struct {
+    char *request;            /**< Head and body of the request. */
+    size_t length;            /**< Length of the request. */
+    unsigned long offset_us;  /**< Arrival time in the capture. */
+    uint32_t connection;      /**< Captured connection. */
+} Replay_request;
+
+/**
+ * @struct Replay_connection
+ * @brief A captured connection and the state of its replay.
+ */
+typedef struct {
+    int fd;                    /**< Socket, -1 if closed. */
+    size_t next;               /**< Next request, index in order. */
+    size_t end;                /**< One past the last request, index in order. */
+    int in_flight;             /**< Whether requests[order[next]] is waiting for its response. */
+    unsigned long sent;        /**< Start time of the request in flight. */
+    size_t out_offset;         /**< Bytes of the request in flight already written. */
+    int want_write;            /**< Whether EPOLLOUT is registered. */
+    Response_reader reader;    /**< Response being read. */
+} Replay_connection;
+
+/* ---------------------- Global objects ---------------------- */
+struct addrinfo *server_addr;
+Replay_request *requests = NULL;
+size_t request_count = 0;
+size_t *order = NULL;
+Replay_connection *replays = NULL;
+size_t replay_count = 0;
+Replay_connection **heap = NULL;
+size_t heap_size = 0;
+int epoll_fd;
+int open_count = 0;
+int waiting = 0;
+int max_open = 256;
+double speed = 1;
+unsigned long start_us;
+
+Histogram histogram;
+unsigned long done = 0, errors = 0, bytes = 0, statuses[6];
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Orders requests by captured connection and arrival time.
+ */
+int _compare_requests(const void *a, const void *b) {
+    Replay_request *x = &requests[*(const size_t *)a], *y = &requests[*(const size_t *)b];
+
+    if (x->connection != y->connection) {
+        return x->connection < y->connection ? -1 : 1;
+    }
+    if (x->offset_us != y->offset_us) {
+        return x->offset_us < y->offset_us ? -1 : 1;
+    }
+    return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+/**
+ * @brief Loads a capture and groups its requests by connection.
+ *
+ * @param path File of the capture.
+ * @return 0 on success, -1 on error.
+ */
+int _load(const char *path) {
+    Capture_record record;
+    Replay_request *grown;
+    char *head, *body;
+    size_t capacity = 0, i;
+    FILE *file;
+    int status;
+
+    file = capture_open(path, NULL);
+    if (file == NULL) {
+        fprintf(stderr, "%s: no es una captura\n", path);
+        return -1;
+    }
+    while ((status = capture_read(file, &record, &head, &body)) == 1) {
+        if (request_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            grown = (Replay_request*)realloc(requests, capacity * sizeof(Replay_request));
+            if (grown == NULL) {
+                free(head);
+                free(body);
+                break;
+            }
+            requests = grown;
+        }
+        requests[request_count].request = (char*)malloc(record.head_length + record.body_length);
+        if (requests[request_count].request == NULL) {
+            free(head);
+            free(body);
+            break;
+        }
+        memcpy(requests[request_count].request, head, record.head_length);
+        if (body != NULL) {
+            memcpy(requests[request_count].request + record.head_length, body, record.body_length);
+        } else {
+            memset(requests[request_count].request + record.head_length, 'x', record.body_length);
+        }
+        requests[request_count].length = record.head_length + record.body_length;
+        requests[request_count].offset_us = record.offset_us;
+        requests[request_count].connection = record.connection;
+        request_count++;
+        free(head);
+        free(body);
+    }
+    fclose(file);
+    if (status == -1) {
+        fprintf(stderr, "%s: captura truncada, se usan %zu peticiones\n", path, request_count);
+    }
+    if (request_count == 0) {
+        return -1;
+    }
+
+    order = (size_t*)malloc(request_count * sizeof(size_t));
+    replays = (Replay_connection*)calloc(request_count, sizeof(Replay_connection));
+    heap = (Replay_connection**)malloc(request_count * sizeof(Replay_connection*));
+    if (order == NULL || replays == NULL || heap == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < request_count; i++) {
+        order[i] = i;
+    }
+    qsort(order, request_count, sizeof(size_t), _compare_requests);
+
+    for (i = 0; i < request_count; i++) {
+        if (i == 0 || requests[order[i]].connection != requests[order[i - 1]].connection) {
+            replays[replay_count].fd = -1;
+            replays[replay_count].next = i;
+            replay_count++;
+        }
+        replays[replay_count - 1].end = i + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Captured arrival time of the next request of a connection.
+ */
+unsigned long _key(Replay_connection *replay) {
+    return requests[order[replay->next]].offset_us;
+}
+
+/**
+ * @brief Adds an idle connection to the heap of pending connections.
+ *
+ * @param replay The connection.
+ */
+void _heap_push(Replay_connection *replay) {
+    size_t i = heap_size++, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (_key(heap[parent]) <= _key(replay)) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = replay;
+}
+
+/**
+ * @brief Removes the pending connection whose next request is due first.
+ *
+ * @return The connection.
+ */
+Replay_connection *_heap_pop() {
+    Replay_connection *top = heap[0], *last = heap[--heap_size];
+    size_t i = 0, child;
+
+    while ((child = 2 * i + 1) < heap_size) {
+        if (child + 1 < heap_size && _key(heap[child + 1]) < _key(heap[child])) {
+            child++;
+        }
+        if (_key(last) <= _key(heap[child])) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (heap_size > 0) {
+        heap[i] = last;
+    }
+    return top;
+}
+
+/**
+ * @brief Opens the socket of a connection.
+ *
+ * @param replay The connection.
+ * @return 0 on success, -1 on error.
+ */
+int _connect(Replay_connection *replay) {
+    struct epoll_event event;
+    int fd, one = 1;
+
+    fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    event.events = EPOLLIN;
+    event.data.ptr = replay;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        return -1;
+    }
+    replay->fd = fd;
+    replay->want_write = 0;
+    reader_reset(&replay->reader);
+    open_count++;
+    return 0;
+}
+
+/**
+ * @brief Closes the socket of a connection.
+ *
+ * @param replay The connection.
+ */
+void _disconnect(Replay_connection *replay) {
+    if (replay->fd != -1) {
+        close(replay->fd);
+        replay->fd = -1;
+        open_count--;
+    }
+}
+
+/**
+ * @brief Moves a connection past its current request.
+ *
+ * The connection goes back to the heap if it has more requests, otherwise
+ * it is closed.
+ *
+ * @param replay The connection.
+ */
+void _advance(Replay_connection *replay) {
+    waiting -= replay->in_flight;
+    replay->in_flight = 0;
+    replay->next++;
+    done++;
+    if (replay->next < replay->end) {
+        _heap_push(replay);
+    } else {
+        _disconnect(replay);
+    }
+}
+
+/**
+ * @brief Writes the rest of the request in flight.
+ *
+ * @param replay The connection.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int _flush(Replay_connection *replay) {
+    Replay_request *request = &requests[order[replay->next]];
+    struct epoll_event event;
+    ssize_t status;
+    int want;
+
+    while (replay->out_offset < request->length) {
+        status = send(replay->fd, request->request + replay->out_offset,
+            request->length - replay->out_offset, MSG_NOSIGNAL);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                break;
+            }
+            return -1;
+        }
+        replay->out_offset += status;
+    }
+
+    want = replay->out_offset < request->length;
+    if (want != replay->want_write) {
+        event.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        event.data.ptr = replay;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, replay->fd, &event);
+        replay->want_write = want;
+    }
+    return 0;
+}
+
+/**
+ * @brief Drops the request in flight after a connection error.
+ *
+ * @param replay The connection.
+ */
+void _fail(Replay_connection *replay) {
+    _disconnect(replay);
+    errors++;
+    _advance(replay);
+}
+
+/**
+ * @brief Closes an idle connection to make room for another one.
+ *
+ * The connection whose next request is due last is chosen.
+ *
+ * @return 0 if a connection was closed, -1 if every open connection is busy.
+ */
+int _close_idle() {
+    size_t i;
+
+    for (i = heap_size; i > 0; i--) {
+        if (heap[i - 1]->fd != -1) {
+            _disconnect(heap[i - 1]);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Sends the requests that are due.
+ *
+ * @param now Current time in microseconds.
+ * @return Microseconds until the next request is due, 0 if there is nothing to wait for.
+ */
+unsigned long _dispatch(unsigned long now) {
+    Replay_connection *replay;
+    unsigned long due;
+
+    while (heap_size > 0) {
+        due = speed > 0 ? start_us + (unsigned long)(_key(heap[0]) / speed) : now;
+        if (due > now) {
+            return due - now;
+        }
+        if (heap[0]->fd == -1 && open_count >= max_open && _close_idle() == -1) {
+            return 0;
+        }
+
+        replay = _heap_pop();
+        if (replay->fd == -1 && _connect(replay) == -1) {
+            errors++;
+            _advance(replay);
+            continue;
+        }
+        replay->in_flight = 1;
+        replay->out_offset = 0;
+        waiting++;
+        // Like in loadgen, a request delayed by the server is charged from when it was due
+        replay->sent = due;
+        if (_flush(replay) == -1) {
+            _fail(replay);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles the bytes received on a connection.
+ *
+ * @param replay The connection.
+ * @param data Received bytes.
+ * @param length Number of bytes.
+ * @param now Current time in microseconds.
+ * @return 0 on success, -1 if the response cannot be parsed.
+ */
+int _consume(Replay_connection *replay, char *data, size_t length, unsigned long now) {
+    int status;
+
+    bytes += length;
+    while (length > 0) {
+        status = reader_feed(&replay->reader, &data, &length);
+        if (status == -1 || (status == 1 && !replay->in_flight)) {
+            return -1;
+        }
+        if (status == 1) {
+            histogram_record(&histogram, now > replay->sent ? now - replay->sent : 0);
+            statuses[replay->reader.status / 100 <= 5 ? replay->reader.status / 100 : 0]++;
+            if (replay->reader.status < 200 || replay->reader.status >= 400) {
+                errors++;
+            }
+            _advance(replay);
+            // The connection may have been closed or be waiting for its next request
+            if (replay->fd == -1 || length > 0) {
+                return length > 0 ? -1 : 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Prints the report.
+ *
+ * @param elapsed Elapsed time in seconds.
+ * @param json Whether to print JSON.
+ */
+void _report(double elapsed, int json) {
+    double mean = histogram.total > 0 ? histogram.sum / histogram.total : 0;
+
+    if (json) {
+        printf("{\"speed\":%g,\"connections\":%zu,\"duration_s\":%.3f,\"requests\":%lu,\"rps\":%.1f,"
+            "\"bytes\":%lu,\"errors\":%lu,\"status\":{\"2xx\":%lu,\"3xx\":%lu,\"4xx\":%lu,\"5xx\":%lu},"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}}\n",
+            speed, replay_count, elapsed, done, done / elapsed, bytes, errors,
+            statuses[2], statuses[3], statuses[4], statuses[5], mean,
+            histogram_percentile(&histogram, 0.5), histogram_percentile(&histogram, 0.9),
+            histogram_percentile(&histogram, 0.99), histogram_percentile(&histogram, 0.999), histogram.max);
+        return;
+    }
+
+    if (speed > 0) {
+        printf("%zu peticiones de %zu conexiones a velocidad %gx\n", request_count, replay_count, speed);
+    } else {
+        printf("%zu peticiones de %zu conexiones a velocidad maxima\n", request_count, replay_count);
+    }
+    printf("  %lu peticiones en %.2fs, %lu bytes leidos\n", done, elapsed, bytes);
+    printf("  Peticiones/s: %.1f\n", done / elapsed);
+    printf("  Respuestas: 2xx=%lu 3xx=%lu 4xx=%lu 5xx=%lu\n", statuses[2], statuses[3], statuses[4], statuses[5]);
+    printf("  Errores: %lu\n", errors);
+    printf("  Latencia (us)%s:\n", speed > 0 ? " corregida" : "");
+    printf("    media  %10.1f\n", mean);
+    printf("    p50    %10lu\n", histogram_percentile(&histogram, 0.5));
+    printf("    p90    %10lu\n", histogram_percentile(&histogram, 0.9));
+    printf("    p99    %10lu\n", histogram_percentile(&histogram, 0.99));
+    printf("    p99.9  %10lu\n", histogram_percentile(&histogram, 0.999));
+    printf("    max    %10lu\n", histogram.max);
+}
+
+
+int main(int argc, char *argv[]) {
+    char *host = "127.0.0.1", *port = "8080", *data;
+    struct epoll_event events[256];
+    struct addrinfo hints;
+    struct timespec wait;
+    Replay_connection *replay;
+    unsigned long now, wake, progress;
+    ssize_t received;
+    size_t i;
+    int opt, json = 0, n, j, status;
+
+    while ((opt = getopt(argc, argv, "h:p:s:c:j")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 's': speed = atof(optarg); break;
+            case 'c': max_open = atoi(optarg); break;
+            case 'j': json = 1; break;
+            default:
+                fprintf(stderr, "Uso: %s [-h host] [-p port] [-s velocidad] [-c conexiones] [-j] captura\n",
+                    argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || speed < 0 || max_open <= 0) {
+        fprintf(stderr, "Uso: %s [-h host] [-p port] [-s velocidad] [-c conexiones] [-j] captura\n", argv[0]);
+        return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    status = getaddrinfo(host, port, &hints, &server_addr);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return 1;
+    }
+
+    data = (char*)malloc(RECV_SIZE);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (data == NULL || epoll_fd == -1 || _load(argv[optind]) != 0) {
+        return 1;
+    }
+    for (i = 0; i < replay_count; i++) {
+        _heap_push(&replays[i]);
+    }
+
+    start_us = progress = now_us();
+    while (done < request_count) {
+        now = now_us();
+        wake = _dispatch(now);
+        if (waiting > 0 && now - progress > STALL_US) {
+            fprintf(stderr, "El servidor no responde, se abandona la reproducción\n");
+            break;
+        }
+
+        // Millisecond timeouts would delay every scheduled request, epoll_pwait2 takes a timespec
+        wake = wake > 0 && wake < 100000 ? wake : 100000;
+        wait.tv_sec = 0;
+        wait.tv_nsec = wake * 1000;
+        n = epoll_pwait2(epoll_fd, events, 256, &wait, NULL);
+
+        now = now_us();
+        if (n > 0 || waiting == 0) {
+            progress = now;
+        }
+        for (j = 0; j < n; j++) {
+            replay = (Replay_connection *)events[j].data.ptr;
+            if (replay->fd == -1) {
+                continue;
+            }
+            if (events[j].events & EPOLLOUT && replay->in_flight && _flush(replay) == -1) {
+                _fail(replay);
+                continue;
+            }
+            if (!(events[j].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                continue;
+            }
+            while (replay->fd != -1 && (received = recv(replay->fd, data, RECV_SIZE, 0)) > 0) {
+                if (_consume(replay, data, received, now) == -1) {
+                    received = 0;
+                    break;
+                }
+            }
+            if (replay->fd == -1) {
+                continue;
+            }
+            if (received == 0 || (received == -1 && errno != EAGAIN && errno != EINTR)) {
+                // The server may close after a response, only a request in flight is lost
+                if (replay->in_flight) {
+                    _fail(replay);
+                } else {
+                    _disconnect(replay);
+                }
+            }
+        }
+    }
+
+    _report((now_us() - start_us) / 1000000.0, json);
+
+    for (i = 0; i < replay_count; i++) {
+        _disconnect(&replays[i]);
+    }
+    for (i = 0; i < request_count; i++) {
+        free(requests[i].request);
+    }
+    free(requests);
+    free(order);
+    free(replays);
+    free(heap);
+    free(data);
+    close(epoll_fd);
+    freeaddrinfo(server_addr);
+    return 0;
+}
@@ -8,15 +8,18 @@
  *
  * @details
  * The program expects a single command-line argument specifying the path
- * to the configuration file. The configuration file must contain a "PORT"
- * key specifying the port number on which the server will listen.
+ * to the configuration file. The configuration file must contain the "PORT",
+ * "MAX_CLIENTS", "TIMEOUT", "BASE_DIR" and "INDEX_FILE" keys.
  *
  * The program performs the following steps:
- * 1. Parses the configuration file to extract server settings.
- * 2. Initializes a server socket using the specified port.
- * 3. Sets up the request handler.
- * 4. Starts listening for incoming connections.
- * 5. Cleans up resources and threads upon termination.
+ * 1. Parses the configuration file and compiles it into a ServerConfig.
+ * 2. Initializes a server socket using the specified port, or takes over the
+ *    listening socket passed by the previous process during a hot upgrade.
+ * 3. With WORKERS, forks the worker processes and stays as their supervisor;
+ *    every following step runs in each worker.
+ * 4. Initializes the modules and sets up the request handler.
+ * 5. Starts listening for incoming connections (SIGHUP reloads the file).
+ * 6. Cleans up resources and threads upon termination.
  *
  * If any step fails, the program exits with an error code.
  *
@@ -28,14 +31,49 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "server/reactive.h"
+#include "utils/trace.h"
+#include "utils/capture.h"
+#include "utils/tls.h"
+#include "utils/ratelimit.h"
+#include "utils/proxy.h"
+#include "utils/io_pool.h"
+#include "utils/bundle.h"
+#include "utils/miss_cache.h"
+
+/**
+ * @brief Gives a worker its own copy of an output file.
+ *
+ * The trace and the capture are rewritten from the start when opened, so
+ * each worker process writes to the path followed by its pid. A restarted
+ * worker gets a new file instead of wiping the one of the worker it replaces.
+ *
+ * @param path The path in the configuration, replaced in place. Left alone if NULL.
+ * @return 0 on success, -1 if it could not be allocated.
+ */
+int _worker_path(char **path) {
+    char *own;
+
+    if (*path == NULL) {
+        return 0;
+    }
+    own = (char*)malloc(strlen(*path) + 16);
+    if (own == NULL) {
+        return -1;
+    }
+    sprintf(own, "%s.%d", *path, (int)getpid());
+    free(*path);
+    *path = own;
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     S_socket *socket;
     Dict *conf;
+    ServerConfig *config;
     int status;
-    char *port;
-    int int_port;
 
     if (argc != 2) {
         printf("Escribe la dirección del archivo de configuración\n");
@@ -47,25 +85,91 @@ int main(int argc, char *argv[]) {
         exit(-1);
     }
 
-    port = get_value(conf, "PORT");
-    int_port = atoi(port);
-    if (int_port == 0) {
-        free_dict(conf);
+    config = compile_config(conf);
+    free_dict(conf);
+    if (config == NULL) {
         exit(-1);
     }
 
-    socket = init_socket(int_port);
+    if (getenv(LISTEN_FD_ENV) != NULL) {
+        socket = init_socket_from_fd(atoi(getenv(LISTEN_FD_ENV)), &config->socket_options);
+    } else {
+        socket = init_socket(config->port, &config->socket_options);
+    }
     if (!socket) {
         printf("Error al inicializar el socket\n");
-        free_dict(conf);
+        free_config(config);
         exit(-1);
     }
 
     printf("Socket inicializado %d\n", socket->socket);
 
+    // The supervisor returns once its workers are done, each worker goes on below
+    if (config->workers > 0) {
+        status = server_supervise(socket, &config, argv);
+        if (status <= 0) {
+            if (socket->socket >= 0) {
+                close(socket->socket);
+            }
+            free(socket);
+            free_config(config);
+            exit(status == 0 ? 0 : -1);
+        }
+        if (_worker_path(&config->trace_file) != 0 || _worker_path(&config->capture_file) != 0) {
+            free_config(config);
+            exit(-1);
+        }
+    }
+
+    if (log_init(config->log_level, config->access_log) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
+    if (trace_init(config->trace_file) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+    trace_configure(config->slow_request_ms, config->trace_sample);
+
+    if (capture_init(config->capture_file, config->capture_body, config->capture_max_mb) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
+    if (tls_init(&config->tls, config->h2c) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
+    if (ratelimit_init(&config->rate_limits) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
+    if (proxy_init(&config->proxy) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
+    if (io_init(config->io_threads) != 0 || io_set_root(config->base_dir) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
+    if (config->bundle != NULL && bundle_open(config->bundle) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
+    if (miss_cache_init(config->base_dir, config->miss_cache_size, config->miss_cache_ttl) != 0) {
+        free_config(config);
+        exit(-1);
+    }
+
     init_handler();
 
-    status = server_listen(socket, conf);
+    status = server_listen(socket, config, argv);
 
     cleanup_threads();
 
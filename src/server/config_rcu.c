@@ -0,0 +1,163 @@
+/**
+ * @file config_rcu.c
+ * @brief Epoch-based publication and reclamation of the server configuration.
+ *
+ * Readers only perform an atomic load of the global epoch, a store in their
+ * own padded slot and an atomic load of the configuration pointer. The
+ * writer side (reload and reclamation) runs on the accepting thread and is
+ * the only one taking the mutex.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "config_rcu.h"
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* ---------------------- Global objects ---------------------- */
+/**
+ * @brief Epoch announced by one reader, 0 when it holds no snapshot.
+ *
+ * Padded to a cache line so readers never share one.
+ */
+typedef struct {
+    _Atomic unsigned long epoch; /**< Epoch of the snapshot being read. */
+    int used;                    /**< Whether a thread owns the slot. */
+    char pad[64 - sizeof(unsigned long) - sizeof(int)];
+} Reader;
+
+/**
+ * @brief Configuration waiting until no reader can hold it.
+ */
+typedef struct Retired {
+    ServerConfig *config;  /**< The retired configuration. */
+    unsigned long epoch;   /**< Last epoch in which it could be read. */
+    struct Retired *next;  /**< Next retired configuration. */
+} Retired;
+
+_Atomic(ServerConfig*) current_config = NULL;
+_Atomic unsigned long global_epoch = 1;
+Reader readers[CONFIG_READERS];
+Retired *retired = NULL;
+pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ---------------------- Public Functions ---------------------- */
+void config_init(ServerConfig *config) {
+    atomic_store(&current_config, config);
+}
+
+int config_reader_register() {
+    int i;
+
+    pthread_mutex_lock(&readers_mutex);
+    for (i = 0; i < CONFIG_READERS; i++) {
+        if (!readers[i].used) {
+            readers[i].used = 1;
+            atomic_store(&readers[i].epoch, 0);
+            pthread_mutex_unlock(&readers_mutex);
+            return i;
+        }
+    }
+    pthread_mutex_unlock(&readers_mutex);
+    return -1;
+}
+
+void config_reader_unregister(int reader) {
+    if (reader < 0 || reader >= CONFIG_READERS) {
+        return;
+    }
+    atomic_store(&readers[reader].epoch, 0);
+    pthread_mutex_lock(&readers_mutex);
+    readers[reader].used = 0;
+    pthread_mutex_unlock(&readers_mutex);
+}
+
+ServerConfig *config_acquire(int reader) {
+    // The epoch must be visible before the pointer is read
+    atomic_store(&readers[reader].epoch, atomic_load(&global_epoch));
+    return atomic_load(&current_config);
+}
+
+void config_release(int reader) {
+    atomic_store_explicit(&readers[reader].epoch, 0, memory_order_release);
+}
+
+ServerConfig *config_current() {
+    return atomic_load(&current_config);
+}
+
+void config_publish(ServerConfig *config) {
+    Retired *node;
+    ServerConfig *old;
+
+    node = (Retired*)malloc(sizeof(Retired));
+    old = atomic_exchange(&current_config, config);
+    if (old == NULL) {
+        free(node);
+        return;
+    }
+    if (node == NULL) {
+        // Without a node the old configuration can only be leaked safely
+        perror("malloc");
+        return;
+    }
+
+    node->config = old;
+    node->epoch = atomic_fetch_add(&global_epoch, 1);
+
+    pthread_mutex_lock(&readers_mutex);
+    node->next = retired;
+    retired = node;
+    pthread_mutex_unlock(&readers_mutex);
+
+    config_reclaim();
+}
+
+void config_reclaim() {
+    Retired **link, *node;
+    unsigned long oldest = (unsigned long)-1, epoch;
+    int i;
+
+    pthread_mutex_lock(&readers_mutex);
+    if (retired == NULL) {
+        pthread_mutex_unlock(&readers_mutex);
+        return;
+    }
+
+    for (i = 0; i < CONFIG_READERS; i++) {
+        epoch = atomic_load(&readers[i].epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    link = &retired;
+    while (*link != NULL) {
+        node = *link;
+        if (node->epoch < oldest) {
+            *link = node->next;
+            free_config(node->config);
+            free(node);
+        } else {
+            link = &node->next;
+        }
+    }
+    pthread_mutex_unlock(&readers_mutex);
+}
+
+void config_destroy() {
+    Retired *node;
+
+    pthread_mutex_lock(&readers_mutex);
+    while (retired != NULL) {
+        node = retired;
+        retired = node->next;
+        free_config(node->config);
+        free(node);
+    }
+    pthread_mutex_unlock(&readers_mutex);
+
+    free_config(atomic_exchange(&current_config, NULL));
+}
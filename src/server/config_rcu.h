@@ -0,0 +1,92 @@
+/**
+ * @file config_rcu.h
+ * @brief Header file for the live-reloadable server configuration.
+ *
+ * The current ServerConfig is published through an atomic pointer. Client
+ * threads take a snapshot per request without locking: they announce the
+ * epoch they are reading in and release it when the response is sent. A
+ * reload swaps the pointer and retires the old configuration, which is
+ * freed once no reader announced an epoch older than the swap.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef CONFIG_RCU_H
+#define CONFIG_RCU_H
+
+#include "../utils/server_config.h"
+
+#define CONFIG_READERS 1024
+
+/**
+ * @brief Publishes the first configuration.
+ *
+ * @param config Pointer to the configuration, owned by this module from now on.
+ */
+void config_init(ServerConfig *config);
+
+/**
+ * @brief Reserves a reader slot for the calling thread.
+ *
+ * Must be called once per thread before config_acquire. This is the only
+ * call that takes a lock.
+ *
+ * @return The reader slot, or -1 if every slot is in use.
+ */
+int config_reader_register();
+
+/**
+ * @brief Releases a reader slot reserved with config_reader_register.
+ *
+ * @param reader The reader slot.
+ */
+void config_reader_unregister(int reader);
+
+/**
+ * @brief Takes a snapshot of the current configuration.
+ *
+ * The snapshot stays valid until config_release is called with the same
+ * reader slot.
+ *
+ * @param reader The reader slot of the calling thread.
+ * @return Pointer to the current configuration.
+ */
+ServerConfig *config_acquire(int reader);
+
+/**
+ * @brief Ends the snapshot taken with config_acquire.
+ *
+ * @param reader The reader slot of the calling thread.
+ */
+void config_release(int reader);
+
+/**
+ * @brief Returns the current configuration without taking a snapshot.
+ *
+ * Only safe on the thread that publishes new configurations.
+ *
+ * @return Pointer to the current configuration.
+ */
+ServerConfig *config_current();
+
+/**
+ * @brief Publishes a new configuration and retires the previous one.
+ *
+ * @param config Pointer to the new configuration, owned by this module from now on.
+ */
+void config_publish(ServerConfig *config);
+
+/**
+ * @brief Frees the retired configurations that no reader can still hold.
+ */
+void config_reclaim();
+
+/**
+ * @brief Frees the current and every retired configuration.
+ *
+ * Must only be called once no client thread is left.
+ */
+void config_destroy();
+
+#endif
@@ -0,0 +1,1322 @@
+/**
+ * @file http2.c
+ * @brief Framing layer, streams and flow control of HTTP/2 connections.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include "http2.h"
+#include "reactive.h"
+#include "config_rcu.h"
+#include "../utils/hpack.h"
+#include "../utils/log.h"
+#include "../utils/trace.h"
+#include "../utils/tls.h"
+#include "../utils/ratelimit.h"
+#include "../utils/proxy.h"
+#include "../utils/io_pool.h"
+#include "../utils/metrics.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ctype.h>
+#include <strings.h>
+#include <unistd.h>
+
+#define H2_HEADER_LENGTH 9
+#define H2_HEADER_BLOCK_MAX 65536
+#define H2_WINDOW_MAX 0x7fffffffL
+#define H2_PUMP_BUDGET (256 * 1024)
+#define H2_CONDITIONS_SIZE 256
+
+// Frame types
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// Frame flags
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+// Settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+// Error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_INTERNAL_ERROR 0x2
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+/**
+ * @enum Stream_state
+ * @brief Life of a stream slot.
+ */
+typedef enum {
+    STREAM_IDLE,      /**< The slot is free. */
+    STREAM_OPEN,      /**< Receiving the request. */
+    STREAM_RUNNING,   /**< A helper or I/O thread is creating the response. */
+    STREAM_SENDING    /**< The header was sent, DATA frames are pending. */
+} Stream_state;
+
+/**
+ * @struct H2_stream
+ * @brief A request of the connection.
+ */
+typedef struct {
+    uint32_t id;                /**< Stream identifier. */
+    Stream_state state;         /**< State of the slot. */
+    char method[MAX_METHOD];    /**< Value of :method. */
+    char path[MAX_PATH];        /**< Value of :path. */
+    char conditions[H2_CONDITIONS_SIZE]; /**< Accept-Encoding and If-None-Match as HTTP/1.1 lines. */
+    char body[MAX_ARGS];        /**< Start of the body, used as POST arguments. */
+    size_t body_length;         /**< Length of body. */
+    int truncated;              /**< Whether the body did not fit in body. */
+    Parser *parser;             /**< Parsed request. */
+    Response *response;         /**< Response, once created. */
+    const char *data;           /**< Content sent in DATA frames. */
+    size_t data_length;         /**< Length of data. */
+    size_t data_offset;         /**< Bytes of data already sent. */
+    long window;                /**< Send window of the stream. */
+    size_t bytes;               /**< Bytes sent, header included. */
+    Request_trace trace;        /**< Phase timestamps of the request. */
+    pthread_t thread;           /**< Helper thread of a script or the proxy. */
+    _Atomic int finished;       /**< Set by the helper thread when the response is ready. */
+    int cancelled;              /**< Reset by the client while the script runs. */
+    int notify;                 /**< Pipe the helper thread writes to when it finishes. */
+    Io_job job;                 /**< Response created by an I/O thread, run is NULL if unused. */
+    int unverified;             /**< Whether pars_http left the existence check undone. */
+    Proxy_route route;          /**< Route of a proxied request, only its slots are used. */
+    uint32_t address;           /**< IPv4 address of the client, for the backend. */
+} H2_stream;
+
+/**
+ * @struct H2_connection
+ * @brief State of an HTTP/2 connection.
+ */
+typedef struct {
+    int fd;                                 /**< Socket of the client. */
+    int reader;                             /**< Configuration reader slot. */
+    uint32_t address;                       /**< IPv4 address of the client. */
+    int min_rate;                           /**< Bytes per second the client must read. */
+    Io_buffer **buffer;                     /**< Receive buffer. */
+    H2_stream streams[H2_MAX_STREAMS];      /**< Stream slots. */
+    int active;                             /**< Slots in use. */
+    int cursor;                             /**< Next slot of the DATA round robin. */
+    uint32_t last_stream;                   /**< Highest stream opened by the client. */
+    long window;                            /**< Send window of the connection. */
+    long initial_window;                    /**< Initial send window of new streams. */
+    size_t max_frame;                       /**< Largest frame the client accepts. */
+    Hpack_table table;                      /**< HPACK dynamic table of the client. */
+    uint8_t *block;                         /**< Header block being received. */
+    size_t block_length;                    /**< Length of block. */
+    uint32_t block_stream;                  /**< Stream of the header block, 0 if none. */
+    int block_end_stream;                   /**< Whether the HEADERS frame ended the stream. */
+    int notify[2];                          /**< Pipe of the helper threads. */
+    int goaway;                             /**< Whether a GOAWAY was sent or received. */
+    uint8_t out[H2_HEADER_LENGTH + H2_FRAME_SIZE]; /**< Frame being sent. */
+} H2_connection;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Reads a 32-bit big-endian integer.
+ */
+uint32_t _get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * @brief Writes a 32-bit big-endian integer.
+ */
+void _put32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/**
+ * @brief Sends a frame.
+ *
+ * The payload may already be in place after the frame header in out. Each
+ * frame has its own deadline, extended by the bytes the client reads.
+ *
+ * @param conn The connection.
+ * @param type Type of the frame.
+ * @param flags Flags of the frame.
+ * @param id Stream of the frame.
+ * @param payload Payload, at most H2_FRAME_SIZE bytes.
+ * @param length Length of the payload.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int _send_frame(H2_connection *conn, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t length) {
+    uint8_t *header = conn->out;
+    Deadline deadline;
+
+    header[0] = length >> 16;
+    header[1] = length >> 8;
+    header[2] = length;
+    header[3] = type;
+    header[4] = flags;
+    _put32(header + 5, id & 0x7fffffff);
+    if (length > 0 && payload != header + H2_HEADER_LENGTH) {
+        memcpy(header + H2_HEADER_LENGTH, payload, length);
+    }
+    deadline_start(&deadline, SEND_TIMEOUT_MS, 0, conn->min_rate);
+    if (tls_send_all(conn->fd, header, H2_HEADER_LENGTH + length, &deadline) == -1) {
+        if (errno == ETIMEDOUT) {
+            LOG_DEBUG("Cliente lento, trama incompleta (socket %d)", conn->fd);
+            metrics_slow_client();
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a GOAWAY frame, no new stream is accepted afterwards.
+ *
+ * @param conn The connection.
+ * @param code Error code.
+ */
+void _goaway(H2_connection *conn, uint32_t code) {
+    uint8_t payload[8];
+
+    if (conn->goaway) {
+        return;
+    }
+    _put32(payload, conn->last_stream);
+    _put32(payload + 4, code);
+    _send_frame(conn, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    conn->goaway = 1;
+    if (code != H2_NO_ERROR) {
+        LOG_DEBUG("HTTP/2 GOAWAY %u", code);
+    }
+}
+
+/**
+ * @brief Sends a RST_STREAM frame.
+ *
+ * @param conn The connection.
+ * @param id The stream.
+ * @param code Error code.
+ */
+void _rst_stream(H2_connection *conn, uint32_t id, uint32_t code) {
+    uint8_t payload[4];
+
+    _put32(payload, code);
+    _send_frame(conn, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * @brief Sends a WINDOW_UPDATE frame.
+ *
+ * @param conn The connection.
+ * @param id The stream, 0 for the connection.
+ * @param increment Bytes added to the window.
+ */
+void _window_update(H2_connection *conn, uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+
+    _put32(payload, increment);
+    _send_frame(conn, H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * @brief Looks up an active stream.
+ *
+ * @param conn The connection.
+ * @param id The stream.
+ * @return The stream, NULL if it is not active.
+ */
+H2_stream *_find_stream(H2_connection *conn, uint32_t id) {
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (conn->streams[i].state != STREAM_IDLE && conn->streams[i].id == id) {
+            return &conn->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Takes a free slot for a new stream.
+ *
+ * @param conn The connection.
+ * @param id The stream.
+ * @return The stream, NULL if the connection has H2_MAX_STREAMS already.
+ */
+H2_stream *_open_stream(H2_connection *conn, uint32_t id) {
+    H2_stream *stream;
+    int i;
+
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        stream = &conn->streams[i];
+        if (stream->state == STREAM_IDLE) {
+            stream->id = id;
+            stream->state = STREAM_OPEN;
+            stream->method[0] = '\0';
+            stream->path[0] = '\0';
+            stream->conditions[0] = '\0';
+            stream->body_length = 0;
+            stream->truncated = 0;
+            stream->parser = NULL;
+            stream->response = NULL;
+            stream->data = NULL;
+            stream->data_length = stream->data_offset = 0;
+            stream->window = conn->initial_window;
+            stream->bytes = 0;
+            stream->cancelled = 0;
+            stream->job.run = NULL;
+            stream->unverified = 0;
+            stream->notify = conn->notify[1];
+            atomic_store(&stream->finished, 0);
+            conn->active++;
+
+            // The request starts when its HEADERS arrive
+            trace_request_begin(&stream->trace);
+            trace_phase_begin(PHASE_READ);
+            trace_request_switch(NULL);
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Frees a stream slot.
+ *
+ * @param conn The connection.
+ * @param stream The stream.
+ */
+void _close_stream(H2_connection *conn, H2_stream *stream) {
+    free_response(stream->response);
+    free_parser(stream->parser);
+    stream->response = NULL;
+    stream->parser = NULL;
+    stream->state = STREAM_IDLE;
+    conn->active--;
+}
+
+/**
+ * @brief Records a served request and frees its stream.
+ *
+ * @param conn The connection.
+ * @param stream The stream.
+ */
+void _finish_stream(H2_connection *conn, H2_stream *stream) {
+    trace_request_switch(&stream->trace);
+    record_request(stream->parser, stream->bytes, &stream->trace);
+    _close_stream(conn, stream);
+}
+
+/**
+ * @brief Receives a decoded header of a request.
+ *
+ * Only the pseudo-headers and the ones that choose the variant of a file
+ * of the bundle matter, the server ignores the rest as it does for HTTP/1.1.
+ */
+void _emit_header(void *context, const char *name, size_t name_length, const char *value, size_t value_length) {
+    H2_stream *stream = (H2_stream *)context;
+    size_t used;
+
+    if (name_length == 7 && memcmp(name, ":method", 7) == 0) {
+        snprintf(stream->method, sizeof(stream->method), "%.*s", (int)value_length, value);
+    } else if (name_length == 5 && memcmp(name, ":path", 5) == 0) {
+        snprintf(stream->path, sizeof(stream->path), "%.*s", (int)value_length, value);
+    } else if ((name_length == 15 && memcmp(name, "accept-encoding", 15) == 0) ||
+               (name_length == 13 && memcmp(name, "if-none-match", 13) == 0)) {
+        // A line that does not fit is left out, the response is just not the best one
+        used = strlen(stream->conditions);
+        if (used + name_length + value_length + 4 < sizeof(stream->conditions)) {
+            snprintf(stream->conditions + used, sizeof(stream->conditions) - used, "%.*s: %.*s\r\n",
+                     (int)name_length, name, (int)value_length, value);
+        }
+    }
+}
+
+/**
+ * @brief Discards a decoded header of a refused stream.
+ */
+void _ignore_header(void *context, const char *name, size_t name_length, const char *value, size_t value_length) {
+}
+
+/**
+ * @brief Translates the HTTP/1.1 header of a response and sends it as HEADERS.
+ *
+ * The body of error responses travels in the header string after the blank
+ * line, it becomes the content of the DATA frames.
+ *
+ * @param conn The connection.
+ * @param stream The stream.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int _start_response(H2_connection *conn, H2_stream *stream) {
+    Parser *parser = stream->parser;
+    Response *response = stream->response;
+    uint8_t *block = conn->out + H2_HEADER_LENGTH;
+    char status[4] = "", name[64], *line, *end, *colon, *value, *eol;
+    size_t length = 0, room = H2_FRAME_SIZE < conn->max_frame ? H2_FRAME_SIZE : conn->max_frame, n, i;
+    int with_content;
+
+    if (response == NULL || response->header == NULL ||
+        sscanf(response->header, "HTTP/%*s %3s", status) != 1 ||
+        (end = strstr(response->header, "\r\n\r\n")) == NULL) {
+        _rst_stream(conn, stream->id, H2_INTERNAL_ERROR);
+        _close_stream(conn, stream);
+        return 0;
+    }
+
+    length = hpack_encode(block, room, ":status", status, strlen(status));
+    line = strstr(response->header, "\r\n") + 2;
+    while (line < end) {
+        eol = strstr(line, "\r\n");
+        colon = memchr(line, ':', eol - line);
+        if (colon != NULL && (size_t)(colon - line) < sizeof(name)) {
+            for (i = 0; line + i < colon; i++) {
+                name[i] = tolower((unsigned char)line[i]);
+            }
+            name[i] = '\0';
+            value = colon + 1;
+            while (value < eol && *value == ' ') {
+                value++;
+            }
+            // Connection-specific headers are not allowed in HTTP/2
+            if (strcmp(name, "connection") != 0 && strcmp(name, "keep-alive") != 0 &&
+                strcmp(name, "transfer-encoding") != 0 && strcmp(name, "upgrade") != 0) {
+                n = hpack_encode(block + length, room - length, name, value, eol - value);
+                length += n;
+            }
+        }
+        line = eol + 2;
+    }
+
+    with_content = parser->type == PROXY || (parser->status == HTTP_OK && parser->method != OPTIONS);
+    if (end[4] != '\0') {
+        stream->data = end + 4;
+        stream->data_length = strlen(end + 4);
+    } else if (with_content && response->content != NULL) {
+        stream->data = (const char *)response->content;
+        stream->data_length = response->content_length;
+    }
+
+    trace_request_switch(&stream->trace);
+    trace_phase_begin(PHASE_SEND);
+    if (_send_frame(conn, H2_HEADERS, H2_END_HEADERS | (stream->data_length == 0 ? H2_END_STREAM : 0),
+        stream->id, block, length) == -1) {
+        trace_request_switch(NULL);
+        return -1;
+    }
+    trace_phase_end(PHASE_SEND);
+    trace_request_switch(NULL);
+    stream->bytes = (end - response->header) + 4 + stream->data_length;
+
+    if (stream->data_length == 0) {
+        _finish_stream(conn, stream);
+    } else {
+        stream->state = STREAM_SENDING;
+    }
+    return 0;
+}
+
+/**
+ * @brief Does the existence check that pars_http left undone.
+ *
+ * Only called off the connection thread, the lookup may read the disk.
+ *
+ * @param stream The stream.
+ */
+void _verify_file(H2_stream *stream) {
+    int fd;
+
+    if (!stream->unverified || stream->parser->status != HTTP_OK) {
+        return;
+    }
+    // Through io_open, which keeps the lookup inside BASE_DIR
+    fd = io_open(stream->parser->filename, O_RDONLY);
+    if (fd == -1) {
+        stream->parser->status = HTTP_NOT_FOUND;
+        stream->parser->type = UNKNOWN;
+    } else {
+        stream->parser->fd = fd;
+    }
+}
+
+/**
+ * @brief Creates the response of a script on a helper thread.
+ *
+ * @param arg The stream.
+ * @return NULL
+ */
+void *_run_stream_script(void *arg) {
+    H2_stream *stream = (H2_stream *)arg;
+
+    trace_request_switch(&stream->trace);
+    _verify_file(stream);
+    stream->response = create_response(stream->parser);
+    trace_request_switch(NULL);
+    atomic_store(&stream->finished, 1);
+    if (write(stream->notify, "s", 1) == -1) {
+        // The pipe only wakes the connection up, it is checked anyway
+    }
+    return NULL;
+}
+
+/**
+ * @brief Creates the response of a file that is not cached on an I/O thread.
+ *
+ * @param arg The stream.
+ */
+void _run_stream_file(void *arg) {
+    H2_stream *stream = (H2_stream *)arg;
+
+    trace_request_switch(&stream->trace);
+    _verify_file(stream);
+    stream->response = create_response(stream->parser);
+    trace_request_switch(NULL);
+    atomic_store(&stream->finished, 1);
+    if (write(stream->notify, "f", 1) == -1) {
+        // The pipe only wakes the connection up, it is checked anyway
+    }
+}
+
+/**
+ * @brief Forwards a request to its backend and collects the response.
+ *
+ * @param stream The stream.
+ * @return The response, allocated with malloc, or NULL if memory ran out.
+ */
+Response *_fetch_upstream(H2_stream *stream) {
+    Proxy_fetch fetch;
+    Response *response;
+
+    response = (Response *)calloc(1, sizeof(Response));
+    if (response == NULL) {
+        return NULL;
+    }
+
+    memset(&fetch, 0, sizeof(fetch));
+    fetch.method = stream->method;
+    fetch.path = stream->path;
+    fetch.body = stream->body;
+    fetch.body_length = stream->body_length;
+    fetch.address = stream->address;
+    trace_phase_begin(PHASE_PROXY);
+    if (proxy_fetch(&stream->route, &fetch) == -1) {
+        trace_phase_end(PHASE_PROXY);
+        free(response);
+        return NULL;
+    }
+    trace_phase_end(PHASE_PROXY);
+
+    response->header = fetch.header;
+    response->content = fetch.content;
+    response->content_length = fetch.content_length;
+    stream->parser->status = (HttpStatusCode)fetch.status;
+    return response;
+}
+
+/**
+ * @brief Runs the exchange with a backend on a helper thread.
+ *
+ * @param arg The stream.
+ * @return NULL
+ */
+void *_run_stream_proxy(void *arg) {
+    H2_stream *stream = (H2_stream *)arg;
+
+    trace_request_switch(&stream->trace);
+    stream->response = _fetch_upstream(stream);
+    trace_request_switch(NULL);
+    atomic_store(&stream->finished, 1);
+    if (write(stream->notify, "p", 1) == -1) {
+        // The pipe only wakes the connection up, it is checked anyway
+    }
+    return NULL;
+}
+
+/**
+ * @brief Serves a request once all of it has been received.
+ *
+ * @param conn The connection.
+ * @param stream The stream.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int _dispatch(H2_connection *conn, H2_stream *stream) {
+    ServerConfig *snapshot;
+    char request[MAX_METHOD + MAX_PATH + H2_CONDITIONS_SIZE + 32];
+    const char *status;
+    uint32_t id = stream->id;
+    size_t length;
+    int deferred;
+
+    if (ratelimit_request(conn->address) != 0) {
+        metrics_rate_limited();
+        _close_stream(conn, stream);
+        length = hpack_encode(conn->out + H2_HEADER_LENGTH, H2_FRAME_SIZE, ":status", "429", 3);
+        length += hpack_encode(conn->out + H2_HEADER_LENGTH + length, H2_FRAME_SIZE - length, "retry-after", "1", 1);
+        return _send_frame(conn, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, id, conn->out + H2_HEADER_LENGTH, length);
+    }
+
+    trace_request_switch(&stream->trace);
+    trace_phase_end(PHASE_READ);
+
+    // The parser only looks at the request line and the conditions
+    snprintf(request, sizeof(request), "%s %s HTTP/2.0\r\n%s\r\n", stream->method, stream->path, stream->conditions);
+    snapshot = config_acquire(conn->reader);
+    trace_phase_begin(PHASE_PARSE);
+    // Nothing that reads the disk runs on the connection thread, the other streams would wait
+    io_nowait_begin();
+    stream->parser = pars_http(request, snapshot, NULL);
+    stream->unverified = deferred = io_nowait_end();
+    trace_phase_end(PHASE_PARSE);
+    if (stream->parser != NULL && stream->parser->type == PROXY) {
+        stream->route = snapshot->proxy.routes[stream->parser->route];
+        stream->address = conn->address;
+    }
+    config_release(conn->reader);
+    if (stream->parser == NULL) {
+        trace_request_switch(NULL);
+        _rst_stream(conn, stream->id, H2_INTERNAL_ERROR);
+        _close_stream(conn, stream);
+        return 0;
+    }
+
+    // The backend or the script would get a body cut at sizeof(stream->body)
+    if (stream->truncated && (stream->parser->type == PROXY || stream->parser->method == POST)) {
+        trace_request_switch(NULL);
+        _close_stream(conn, stream);
+        length = hpack_encode(conn->out + H2_HEADER_LENGTH, H2_FRAME_SIZE, ":status", "413", 3);
+        return _send_frame(conn, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, id, conn->out + H2_HEADER_LENGTH, length);
+    }
+
+    if (stream->parser->method == POST && stream->parser->type != PROXY &&
+        parser_set_body(stream->parser, stream->body, stream->body_length) != 0) {
+        status = errno == EINVAL ? "400" : "500";
+        trace_request_switch(NULL);
+        _close_stream(conn, stream);
+        length = hpack_encode(conn->out + H2_HEADER_LENGTH, H2_FRAME_SIZE, ":status", status, 3);
+        return _send_frame(conn, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, id, conn->out + H2_HEADER_LENGTH, length);
+    }
+
+    if (stream->parser->type == PROXY) {
+        stream->state = STREAM_RUNNING;
+        if (pthread_create(&stream->thread, NULL, _run_stream_proxy, stream) == 0) {
+            trace_request_switch(NULL);
+            return 0;
+        }
+        stream->state = STREAM_OPEN;
+        stream->response = _fetch_upstream(stream);
+        trace_request_switch(NULL);
+        return _start_response(conn, stream);
+    }
+
+    if ((stream->parser->type == PYTHON || stream->parser->type == PHP) &&
+        stream->parser->method != OPTIONS && stream->parser->status == HTTP_OK) {
+        stream->state = STREAM_RUNNING;
+        if (pthread_create(&stream->thread, NULL, _run_stream_script, stream) == 0) {
+            trace_request_switch(NULL);
+            return 0;
+        }
+        stream->state = STREAM_OPEN;
+    }
+
+    if (!deferred) {
+        io_nowait_begin();
+        stream->response = create_response(stream->parser);
+        deferred = io_nowait_end();
+    }
+    if (deferred) {
+        free_response(stream->response);
+        stream->response = NULL;
+        stream->job.run = _run_stream_file;
+        stream->job.arg = stream;
+        stream->state = STREAM_RUNNING;
+        if (io_submit(&stream->job) == 0) {
+            trace_request_switch(NULL);
+            return 0;
+        }
+        // The queue is full, this stream blocks the connection
+        stream->job.run = NULL;
+        stream->state = STREAM_OPEN;
+        _run_stream_file(stream);
+    }
+    trace_request_switch(NULL);
+    return _start_response(conn, stream);
+}
+
+/**
+ * @brief Starts the responses created by helper and I/O threads that finished.
+ *
+ * @param conn The connection.
+ * @param wait Whether to wait for the threads still running.
+ * @return 0 on success, -1 if the connection failed.
+ */
+int _reap(H2_connection *conn, int wait) {
+    H2_stream *stream;
+    char drain[64];
+    int i, status = 0;
+
+    while (read(conn->notify[0], drain, sizeof(drain)) > 0) {
+    }
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        stream = &conn->streams[i];
+        if (stream->state != STREAM_RUNNING || (!wait && !atomic_load(&stream->finished))) {
+            continue;
+        }
+        if (stream->job.run != NULL) {
+            io_wait(&stream->job);
+            stream->job.run = NULL;
+        } else {
+            pthread_join(stream->thread, NULL);
+        }
+        if (stream->cancelled || wait || status == -1) {
+            _close_stream(conn, stream);
+        } else {
+            status = _start_response(conn, stream);
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Sends DATA frames of the pending responses, round robin.
+ *
+ * Every stream gets one frame per turn as long as its window and the one
+ * of the connection allow it, so a big file does not delay the rest.
+ *
+ * @param conn The connection.
+ * @return 1 if there is more to send right away, 0 if not, -1 if the connection failed.
+ */
+int _pump(H2_connection *conn) {
+    size_t budget = H2_PUMP_BUDGET, chunk, frame;
+    H2_stream *stream;
+    int i, sent = 1, last;
+
+    frame = H2_FRAME_SIZE < conn->max_frame ? H2_FRAME_SIZE : conn->max_frame;
+    while (sent && budget > 0) {
+        sent = 0;
+        for (i = 0; i < H2_MAX_STREAMS && conn->window > 0; i++) {
+            stream = &conn->streams[(conn->cursor + i) % H2_MAX_STREAMS];
+            if (stream->state != STREAM_SENDING || stream->window <= 0) {
+                continue;
+            }
+            chunk = stream->data_length - stream->data_offset;
+            chunk = chunk < frame ? chunk : frame;
+            chunk = (long)chunk < stream->window ? chunk : (size_t)stream->window;
+            chunk = (long)chunk < conn->window ? chunk : (size_t)conn->window;
+            last = stream->data_offset + chunk == stream->data_length;
+
+            trace_request_switch(&stream->trace);
+            trace_phase_begin(PHASE_SEND);
+            if (_send_frame(conn, H2_DATA, last ? H2_END_STREAM : 0, stream->id,
+                stream->data + stream->data_offset, chunk) == -1) {
+                trace_request_switch(NULL);
+                return -1;
+            }
+            trace_phase_end(PHASE_SEND);
+            trace_request_switch(NULL);
+
+            stream->data_offset += chunk;
+            stream->window -= chunk;
+            conn->window -= chunk;
+            budget = budget > chunk ? budget - chunk : 0;
+            sent = 1;
+            if (last) {
+                _finish_stream(conn, stream);
+            }
+        }
+        conn->cursor = (conn->cursor + 1) % H2_MAX_STREAMS;
+    }
+
+    if (conn->window <= 0) {
+        return 0;
+    }
+    for (i = 0; i < H2_MAX_STREAMS; i++) {
+        if (conn->streams[i].state == STREAM_SENDING && conn->streams[i].window > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Applies the settings of the client.
+ *
+ * @param conn The connection.
+ * @param payload Payload of a SETTINGS frame.
+ * @param length Length of the payload.
+ * @return 0 on success, an error code otherwise.
+ */
+uint32_t _apply_settings(H2_connection *conn, const uint8_t *payload, size_t length) {
+    uint32_t value;
+    uint16_t id;
+    long delta;
+    size_t n;
+    int i;
+
+    if (length % 6 != 0) {
+        return H2_FRAME_SIZE_ERROR;
+    }
+    for (n = 0; n < length; n += 6) {
+        id = (payload[n] << 8) | payload[n + 1];
+        value = _get32(payload + n + 2);
+        switch (id) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_WINDOW_MAX) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                // The change applies to the windows of the open streams too
+                delta = (long)value - conn->initial_window;
+                conn->initial_window = value;
+                for (i = 0; i < H2_MAX_STREAMS; i++) {
+                    if (conn->streams[i].state != STREAM_IDLE) {
+                        conn->streams[i].window += delta;
+                    }
+                }
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_FRAME_SIZE || value > 0xffffff) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                conn->max_frame = value;
+                break;
+            default:
+                // The encoder does not use the dynamic table, its size does not matter
+                break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Handles a complete header block.
+ *
+ * @param conn The connection.
+ * @return 0 on success, -1 on a connection error.
+ */
+int _headers_complete(H2_connection *conn) {
+    uint32_t id = conn->block_stream;
+    H2_stream *stream;
+    int status;
+
+    conn->block_stream = 0;
+    stream = _find_stream(conn, id);
+    if (stream != NULL) {
+        // Trailers are decoded to keep the table in sync and then ignored
+        status = hpack_decode(&conn->table, conn->block, conn->block_length, _ignore_header, NULL);
+        if (status != 0) {
+            _goaway(conn, H2_COMPRESSION_ERROR);
+            return -1;
+        }
+        if (stream->state != STREAM_OPEN || !conn->block_end_stream) {
+            _rst_stream(conn, id, H2_PROTOCOL_ERROR);
+            if (stream->state == STREAM_RUNNING) {
+                stream->cancelled = 1;
+            } else {
+                _close_stream(conn, stream);
+            }
+            return 0;
+        }
+        return _dispatch(conn, stream);
+    }
+
+    if (id <= conn->last_stream || id % 2 == 0) {
+        _goaway(conn, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+    conn->last_stream = id;
+    stream = conn->goaway ? NULL : _open_stream(conn, id);
+    status = hpack_decode(&conn->table, conn->block, conn->block_length,
+        stream != NULL ? _emit_header : _ignore_header, stream);
+    if (status != 0) {
+        _goaway(conn, H2_COMPRESSION_ERROR);
+        return -1;
+    }
+    if (stream == NULL) {
+        _rst_stream(conn, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    if (stream->method[0] == '\0' || stream->path[0] == '\0') {
+        _rst_stream(conn, id, H2_PROTOCOL_ERROR);
+        _close_stream(conn, stream);
+        return 0;
+    }
+    if (conn->block_end_stream) {
+        return _dispatch(conn, stream);
+    }
+    return 0;
+}
+
+/**
+ * @brief Appends a fragment to the header block being received.
+ *
+ * @param conn The connection.
+ * @param fragment The fragment.
+ * @param length Length of the fragment.
+ * @param end_headers Whether it is the last fragment.
+ * @return 0 on success, -1 on a connection error.
+ */
+int _header_fragment(H2_connection *conn, const uint8_t *fragment, size_t length, int end_headers) {
+    if (conn->block == NULL) {
+        conn->block = (uint8_t*)malloc(H2_HEADER_BLOCK_MAX);
+    }
+    if (conn->block == NULL || conn->block_length + length > H2_HEADER_BLOCK_MAX) {
+        _goaway(conn, conn->block == NULL ? H2_INTERNAL_ERROR : H2_PROTOCOL_ERROR);
+        return -1;
+    }
+    memcpy(conn->block + conn->block_length, fragment, length);
+    conn->block_length += length;
+    return end_headers ? _headers_complete(conn) : 0;
+}
+
+/**
+ * @brief Handles a frame received from the client.
+ *
+ * @param conn The connection.
+ * @param frame The frame, header included.
+ * @return 0 on success, -1 if the connection must be closed.
+ */
+int _process_frame(H2_connection *conn, const uint8_t *frame) {
+    size_t length = ((size_t)frame[0] << 16) | (frame[1] << 8) | frame[2], total = length;
+    uint8_t type = frame[3], flags = frame[4];
+    uint32_t id = _get32(frame + 5) & 0x7fffffff, code, increment;
+    const uint8_t *payload = frame + H2_HEADER_LENGTH;
+    H2_stream *stream;
+    size_t take;
+
+    if (conn->block_stream != 0 && (type != H2_CONTINUATION || id != conn->block_stream)) {
+        _goaway(conn, H2_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    if ((type == H2_DATA || type == H2_HEADERS) && (flags & H2_PADDED)) {
+        if (length == 0 || payload[0] >= length) {
+            _goaway(conn, H2_PROTOCOL_ERROR);
+            return -1;
+        }
+        length -= payload[0] + 1;
+        payload++;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            if (id == 0) {
+                _goaway(conn, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            // Received bytes are given back right away, the body is copied or dropped
+            if (total > 0) {
+                _window_update(conn, 0, total);
+            }
+            stream = _find_stream(conn, id);
+            if (stream == NULL && id > conn->last_stream) {
+                _goaway(conn, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            if (stream == NULL || stream->state != STREAM_OPEN) {
+                _rst_stream(conn, id, H2_STREAM_CLOSED);
+                if (stream != NULL && stream->state == STREAM_RUNNING) {
+                    stream->cancelled = 1;
+                } else if (stream != NULL) {
+                    _close_stream(conn, stream);
+                }
+                return 0;
+            }
+            take = sizeof(stream->body) - stream->body_length;
+            take = length < take ? length : take;
+            stream->truncated |= take < length;
+            memcpy(stream->body + stream->body_length, payload, take);
+            stream->body_length += take;
+            if (flags & H2_END_STREAM) {
+                return _dispatch(conn, stream);
+            }
+            if (total > 0) {
+                _window_update(conn, id, total);
+            }
+            return 0;
+
+        case H2_HEADERS:
+            if (id == 0) {
+                _goaway(conn, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            if (flags & H2_PRIORITY_FLAG) {
+                if (length < 5) {
+                    _goaway(conn, H2_FRAME_SIZE_ERROR);
+                    return -1;
+                }
+                payload += 5;
+                length -= 5;
+            }
+            conn->block_stream = id;
+            conn->block_length = 0;
+            conn->block_end_stream = flags & H2_END_STREAM;
+            return _header_fragment(conn, payload, length, flags & H2_END_HEADERS);
+
+        case H2_CONTINUATION:
+            if (conn->block_stream == 0) {
+                _goaway(conn, H2_PROTOCOL_ERROR);
+                return -1;
+            }
+            return _header_fragment(conn, payload, length, flags & H2_END_HEADERS);
+
+        case H2_RST_STREAM:
+            if (id == 0 || length != 4) {
+                _goaway(conn, id == 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            stream = _find_stream(conn, id);
+            if (stream != NULL && stream->state == STREAM_RUNNING) {
+                stream->cancelled = 1;
+            } else if (stream != NULL) {
+                _close_stream(conn, stream);
+            }
+            return 0;
+
+        case H2_SETTINGS:
+            if (id != 0 || ((flags & H2_ACK) && length != 0)) {
+                _goaway(conn, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            if (flags & H2_ACK) {
+                return 0;
+            }
+            code = _apply_settings(conn, payload, length);
+            if (code != 0) {
+                _goaway(conn, code);
+                return -1;
+            }
+            return _send_frame(conn, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+
+        case H2_PING:
+            if (id != 0 || length != 8) {
+                _goaway(conn, id != 0 ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            if (flags & H2_ACK) {
+                return 0;
+            }
+            return _send_frame(conn, H2_PING, H2_ACK, 0, payload, 8);
+
+        case H2_GOAWAY:
+            conn->goaway = 1;
+            return 0;
+
+        case H2_WINDOW_UPDATE:
+            if (length != 4) {
+                _goaway(conn, H2_FRAME_SIZE_ERROR);
+                return -1;
+            }
+            increment = _get32(payload) & 0x7fffffff;
+            if (id == 0) {
+                if (increment == 0 || conn->window + increment > H2_WINDOW_MAX) {
+                    _goaway(conn, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                    return -1;
+                }
+                conn->window += increment;
+                return 0;
+            }
+            stream = _find_stream(conn, id);
+            if (stream == NULL) {
+                return 0;
+            }
+            if (increment == 0 || stream->window + increment > H2_WINDOW_MAX) {
+                _rst_stream(conn, id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                if (stream->state == STREAM_RUNNING) {
+                    stream->cancelled = 1;
+                } else {
+                    _close_stream(conn, stream);
+                }
+                return 0;
+            }
+            stream->window += increment;
+            return 0;
+
+        case H2_PUSH_PROMISE:
+            _goaway(conn, H2_PROTOCOL_ERROR);
+            return -1;
+
+        default:
+            // PRIORITY and unknown frame types are ignored
+            return 0;
+    }
+}
+
+/**
+ * @brief Decodes the base64url HTTP2-Settings header of an upgrade.
+ *
+ * @param request The upgrade request.
+ * @param out Where the SETTINGS payload is written.
+ * @param size Room in out.
+ * @return Length of the payload, 0 if there is none or it is malformed.
+ */
+size_t _upgrade_settings(const char *request, uint8_t *out, size_t size) {
+    const char *value = strcasestr(request, "\r\nHTTP2-Settings:");
+    unsigned int bits = 0, count = 0;
+    size_t length = 0;
+    int digit;
+
+    if (value == NULL) {
+        return 0;
+    }
+    value += 17;
+    while (*value == ' ') {
+        value++;
+    }
+    for (; *value != '\r' && *value != '\0' && *value != '='; value++) {
+        if (*value >= 'A' && *value <= 'Z') {
+            digit = *value - 'A';
+        } else if (*value >= 'a' && *value <= 'z') {
+            digit = *value - 'a' + 26;
+        } else if (*value >= '0' && *value <= '9') {
+            digit = *value - '0' + 52;
+        } else if (*value == '-') {
+            digit = 62;
+        } else if (*value == '_') {
+            digit = 63;
+        } else {
+            return 0;
+        }
+        bits = (bits << 6) | digit;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            if (length == size) {
+                return 0;
+            }
+            out[length++] = bits >> count;
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Receives more bytes into the buffer.
+ *
+ * @param conn The connection.
+ * @return Bytes received, 0 if the connection was closed or failed.
+ */
+size_t _receive(H2_connection *conn) {
+    Io_buffer *buffer = *conn->buffer;
+    ssize_t received;
+
+    // Over TLS a partial record leaves nothing to return yet
+    do {
+        received = tls_read(conn->fd, buffer->data + buffer->used, buffer->size - 1 - buffer->used);
+    } while (received == -1 && (errno == EINTR ||
+             (errno == EAGAIN && tls_wait(conn->fd, POLLIN, atomic_load(&timeout) * 1000) == 1)));
+    if (received <= 0) {
+        return 0;
+    }
+    buffer->used += received;
+    return received;
+}
+
+/**
+ * @brief Removes consumed bytes from the start of the buffer.
+ *
+ * @param buffer The buffer.
+ * @param length Bytes consumed.
+ */
+void _consume(Io_buffer *buffer, size_t length) {
+    buffer->used -= length;
+    if (buffer->used > 0) {
+        memmove(buffer->data, buffer->data + length, buffer->used);
+    }
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int http2_upgrade_requested(const char *request) {
+    const char *upgrade = strcasestr(request, "\r\nUpgrade:"), *end;
+
+    if (upgrade == NULL || strcasestr(request, "\r\nHTTP2-Settings:") == NULL) {
+        return 0;
+    }
+    end = strstr(upgrade + 2, "\r\n");
+    upgrade = strcasestr(upgrade, "h2c");
+    return upgrade != NULL && end != NULL && upgrade < end;
+}
+
+void http2_serve(int client_socket, Io_buffer **buffer, int reader, uint32_t address,
+                 const char *upgrade, size_t upgrade_length) {
+    const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    uint8_t settings[6], upgrade_settings[64];
+    char *request;
+    H2_connection *conn;
+    H2_stream *stream = NULL;
+    Io_buffer *bigger;
+    Deadline deadline;
+    struct pollfd fds[2];
+    size_t length, offset;
+    int status, more = 0, pending, timeout_ms;
+
+    conn = (H2_connection*)calloc(1, sizeof(H2_connection));
+    if (conn == NULL) {
+        perror("http2");
+        return;
+    }
+    conn->fd = client_socket;
+    conn->reader = reader;
+    conn->address = address;
+    conn->min_rate = config_acquire(reader)->transfer_limits.min_download_rate;
+    config_release(reader);
+    conn->buffer = buffer;
+    conn->window = H2_WINDOW;
+    conn->initial_window = H2_WINDOW;
+    conn->max_frame = H2_FRAME_SIZE;
+    hpack_table_init(&conn->table);
+    if (pipe2(conn->notify, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe");
+        free(conn);
+        return;
+    }
+
+    // A whole frame of the biggest size we accept must fit in the buffer
+    while ((*buffer)->size <= H2_HEADER_LENGTH + H2_FRAME_SIZE) {
+        bigger = buffer_grow(*buffer);
+        if (bigger == NULL) {
+            goto close;
+        }
+        *buffer = bigger;
+    }
+
+    if (upgrade != NULL) {
+        LOG_DEBUG("Actualizando a h2c (socket %d)", client_socket);
+        request = strndup(upgrade, upgrade_length);
+        if (request == NULL) {
+            goto close;
+        }
+        stream = _open_stream(conn, 1);
+        sscanf(request, "%7s %255s", stream->method, stream->path);
+        length = _upgrade_settings(request, upgrade_settings, sizeof(upgrade_settings));
+        free(request);
+        _consume(*buffer, upgrade_length);
+        conn->last_stream = 1;
+        deadline_start(&deadline, SEND_TIMEOUT_MS, 0, 0);
+        if (tls_send_all(client_socket, switching, sizeof(switching) - 1, &deadline) == -1 ||
+            _apply_settings(conn, upgrade_settings, length) != 0) {
+            goto close;
+        }
+    }
+
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    _put32(settings + 2, H2_MAX_STREAMS);
+    if (_send_frame(conn, H2_SETTINGS, 0, 0, settings, sizeof(settings)) == -1) {
+        goto close;
+    }
+    if (stream != NULL && _dispatch(conn, stream) == -1) {
+        goto close;
+    }
+
+    while ((*buffer)->used < H2_PREFACE_LENGTH) {
+        if (tls_wait(client_socket, POLLIN, atomic_load(&timeout) * 1000) != 1 || _receive(conn) == 0) {
+            goto close;
+        }
+    }
+    if (memcmp((*buffer)->data, H2_PREFACE, H2_PREFACE_LENGTH) != 0) {
+        _goaway(conn, H2_PROTOCOL_ERROR);
+        goto close;
+    }
+    _consume(*buffer, H2_PREFACE_LENGTH);
+
+    while (1) {
+        offset = 0;
+        status = 0;
+        while (status == 0 && (*buffer)->used - offset >= H2_HEADER_LENGTH) {
+            length = ((size_t)(uint8_t)(*buffer)->data[offset] << 16) |
+                ((uint8_t)(*buffer)->data[offset + 1] << 8) | (uint8_t)(*buffer)->data[offset + 2];
+            if (length > H2_FRAME_SIZE) {
+                _goaway(conn, H2_FRAME_SIZE_ERROR);
+                goto close;
+            }
+            if ((*buffer)->used - offset < H2_HEADER_LENGTH + length) {
+                break;
+            }
+            status = _process_frame(conn, (uint8_t *)(*buffer)->data + offset);
+            offset += H2_HEADER_LENGTH + length;
+        }
+        _consume(*buffer, offset);
+        if (status == -1) {
+            break;
+        }
+
+        more = _pump(conn);
+        if (more == -1) {
+            break;
+        }
+
+        if ((shutdown_flag || draining) && !conn->goaway) {
+            _goaway(conn, H2_NO_ERROR);
+        }
+        if (conn->goaway && conn->active == 0) {
+            break;
+        }
+
+        fds[0].fd = client_socket;
+        fds[0].events = POLLIN;
+        fds[1].fd = conn->notify[0];
+        fds[1].events = POLLIN;
+        // Records already decrypted by OpenSSL do not wake up poll()
+        pending = tls_pending();
+        timeout_ms = more || pending ? 0 : atomic_load(&timeout) * 1000;
+        status = poll(fds, 2, timeout_ms);
+        if (status == -1 && errno == EINTR) {
+            continue;
+        }
+        if (status == 0 && !more && !pending) {
+            // Idle, or the client stopped reading or granting window
+            _goaway(conn, H2_NO_ERROR);
+            break;
+        }
+        if (status > 0 && (fds[1].revents & POLLIN) && _reap(conn, 0) == -1) {
+            break;
+        }
+        if ((pending || (status > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR)))) && _receive(conn) == 0) {
+            break;
+        }
+    }
+
+close:
+    _reap(conn, 1);
+    for (status = 0; status < H2_MAX_STREAMS; status++) {
+        if (conn->streams[status].state != STREAM_IDLE) {
+            _close_stream(conn, &conn->streams[status]);
+        }
+    }
+    hpack_table_free(&conn->table);
+    close(conn->notify[0]);
+    close(conn->notify[1]);
+    free(conn->block);
+    free(conn);
+}
@@ -0,0 +1,59 @@
+/**
+ * @file http2.h
+ * @brief Header file for HTTP/2 over cleartext TCP (h2c).
+ *
+ * A connection switches to HTTP/2 either with prior knowledge, when the first
+ * bytes are the connection preface, or with `Upgrade: h2c` on an HTTP/1.1
+ * request without body, which becomes stream 1. From then on the thread of
+ * the connection runs the framing layer: requests of several streams are
+ * served at the same time, their DATA frames are interleaved and every
+ * stream and the connection respect the flow-control windows of the client.
+ *
+ * Each request goes through pars_http and create_response like an HTTP/1.1
+ * one, the HTTP/1.1 header it produces is translated to an HPACK header
+ * block. Scripts run on a helper thread per stream so a slow one does not
+ * hold back the rest of the connection.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../utils/buffer_pool.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+#define H2_MAX_STREAMS 32
+#define H2_FRAME_SIZE 16384
+#define H2_WINDOW 65535
+
+/**
+ * @brief Checks whether a request asks to upgrade to h2c.
+ *
+ * @param request The HTTP/1.1 request, NUL-terminated.
+ * @return 1 if it carries `Upgrade: h2c` and `HTTP2-Settings`, 0 otherwise.
+ */
+int http2_upgrade_requested(const char *request);
+
+/**
+ * @brief Serves an HTTP/2 connection until it is closed.
+ *
+ * @param client_socket Socket of the client.
+ * @param buffer Receive buffer of the connection, holding the bytes already
+ *               received. It may be replaced by a bigger one.
+ * @param reader Configuration reader slot of the connection.
+ * @param address IPv4 address of the client, every stream takes a token of
+ *                its rate limit.
+ * @param upgrade The HTTP/1.1 request that asked for the upgrade, at the
+ *                start of the buffer, or NULL if the buffer starts with the
+ *                connection preface.
+ * @param upgrade_length Length of the upgrade request.
+ */
+void http2_serve(int client_socket, Io_buffer **buffer, int reader, uint32_t address,
+                 const char *upgrade, size_t upgrade_length);
+
+#endif
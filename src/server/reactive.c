@@ -11,13 +11,38 @@
  * @date 03-2025
  */
 #include "reactive.h"
+#include "config_rcu.h"
+#include "http2.h"
+#include "../utils/log.h"
+#include "../utils/metrics.h"
+#include "../utils/trace.h"
+#include "../utils/capture.h"
+#include "../utils/buffer_pool.h"
+#include "../utils/tls.h"
+#include "../utils/ratelimit.h"
+#include "../utils/proxy.h"
+#include "../utils/io_pool.h"
+#include "../utils/bundle.h"
+#include "../utils/miss_cache.h"
 #include <signal.h>
 #include <sys/types.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <time.h>
+#include <linux/close_range.h>
+
+extern char **environ;
 
 /* ---------------------- Global objects ---------------------- */
 S_socket *s_socket;
-Dict *conf;
+char **exec_argv;
 
 int active_clients = 0;
 pthread_mutex_t active_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -27,8 +52,15 @@ pthread_mutex_t client_sockets_mutex = PTHREAD_MUTEX_INITIALIZER;
 int max_clients = 0;
 
 volatile sig_atomic_t shutdown_flag = 0;
+volatile sig_atomic_t reload_flag = 0;
+volatile sig_atomic_t upgrade_flag = 0;
+volatile sig_atomic_t draining = 0;
+
+int worker_index = 0;
+pid_t worker_pids[MAX_WORKERS + 1];
+time_t worker_started[MAX_WORKERS + 1];
 
-int timeout = 10;
+_Atomic int timeout = 10;
 
 /* ---------------------- Private Functions ---------------------- */
 
@@ -39,13 +71,19 @@ int timeout = 10;
  * associated with the client connection are properly released, including the parser, response,
  * and socket. It also updates the global state to reflect the disconnection of the client.
  *
- * @param arg Pointer to an array containing the client socket, parser, and response.
+ * @param arg Pointer to an array containing the client socket, parser, response,
+ *            configuration reader slot, arena, receive buffer and peer address of
+ *            the connection.
  */
 void _cleanup_handler(void *arg) {
     void **args = (void **)arg;
     int *client_socket = (int *)args[0];
     Parser **parser = (Parser **)args[1];
     Response **response = (Response **)args[2];
+    int *reader = (int *)args[3];
+    Arena **arena = (Arena **)args[4];
+    Io_buffer **buffer = (Io_buffer **)args[5];
+    uint32_t *address = (uint32_t *)args[6];
 
     if (*parser) {
         free_parser(*parser);
@@ -57,10 +95,21 @@ void _cleanup_handler(void *arg) {
         *response = NULL;
     }
 
-    printf("Cerrando conexión del cliente (socket %d)...\n", *client_socket);
+    if (*reader >= 0) {
+        config_release(*reader);
+        config_reader_unregister(*reader);
+    }
+
+    arena_destroy(*arena);
+    *arena = NULL;
+    buffer_release(*buffer);
+    *buffer = NULL;
+
+    LOG_DEBUG("Cerrando conexión del cliente (socket %d)...", *client_socket);
+    tls_end();
     close(*client_socket);
     pthread_mutex_lock(&client_sockets_mutex);
-    for (int i = 0; i < max_clients; i++) {
+    for (int i = 0; i < MAX_THREADS; i++) {
         if (client_sockets[i] == *client_socket) {
             client_sockets[i] = 0;
             break;
@@ -70,17 +119,8 @@ void _cleanup_handler(void *arg) {
     pthread_mutex_lock(&active_clients_mutex);
     active_clients--;
     pthread_mutex_unlock(&active_clients_mutex);
-}
-
-/**
- * @brief Signal handler for timeout events.
- *
- * This function is triggered when a timeout signal (SIGALRM) is received. It is used to handle
- * client connection timeouts.
- *
- * @param sig Signal number (unused).
- */
-void timeout_handler(int sig) {
+    ratelimit_disconnect(*address);
+    metrics_connection(-1);
 }
 
 /**
@@ -96,11 +136,17 @@ void timeout_handler(int sig) {
 void sigint_handler(int sig) {
     printf("\nSIGINT recibido, cerrando servidor...\n");
     shutdown_flag = 1;
-    shutdown(s_socket->socket, SHUT_RDWR);
-    close(s_socket->socket);
+    // After a hot upgrade the listening socket belongs to the new process
+    if (s_socket->socket >= 0) {
+        // Workers share it with their siblings, only their own copy is closed
+        if (worker_index == 0) {
+            shutdown(s_socket->socket, SHUT_RDWR);
+        }
+        close(s_socket->socket);
+    }
 
     pthread_mutex_lock(&client_sockets_mutex);
-    for (int i = 0; i < max_clients; i++) {
+    for (int i = 0; i < MAX_THREADS; i++) {
         if (client_sockets[i] != 0) {
             shutdown(client_sockets[i], SHUT_RD);
             close(client_sockets[i]);
@@ -110,86 +156,690 @@ void sigint_handler(int sig) {
     pthread_mutex_unlock(&client_sockets_mutex);
 }
 
+/**
+ * @brief Signal handler for SIGHUP.
+ *
+ * Only flags the reload, the configuration is parsed and published by the
+ * accepting thread once accept() is interrupted.
+ *
+ * @param sig The signal number (expected to be SIGHUP).
+ */
+void sighup_handler(int sig) {
+    reload_flag = 1;
+}
+
+/**
+ * @brief Re-reads the configuration file for a reload.
+ *
+ * Whatever cannot change without restarting keeps the value of the current
+ * configuration: the port and the number of workers.
+ *
+ * @param old_config The configuration in use.
+ * @return The new configuration, or NULL if the file is invalid.
+ */
+ServerConfig *_read_config(ServerConfig *old_config) {
+    ServerConfig *new_config;
+    Dict *dict;
+
+    dict = conf_parse(exec_argv[1]);
+    new_config = compile_config(dict);
+    free_dict(dict);
+    if (new_config == NULL) {
+        printf("Configuración invalida, se mantiene la anterior\n");
+        return NULL;
+    }
+    if (new_config->max_clients > MAX_THREADS) {
+        printf("MAX_CLIENTS invalido, se mantiene la configuración anterior\n");
+        free_config(new_config);
+        return NULL;
+    }
+    if (new_config->port != old_config->port) {
+        printf("El puerto no se puede cambiar en caliente, se mantiene %d\n", old_config->port);
+        new_config->port = old_config->port;
+    }
+    if (new_config->workers != old_config->workers) {
+        printf("WORKERS no se puede cambiar en caliente, se mantiene %d\n", old_config->workers);
+        new_config->workers = old_config->workers;
+    }
+    return new_config;
+}
+
+/**
+ * @brief Re-parses the configuration file and publishes it.
+ *
+ * The new configuration is compiled into a fresh ServerConfig and swapped in
+ * atomically. Requests in flight keep the snapshot they took; the previous
+ * configuration is freed once none of them holds it. The port cannot change
+ * without restarting the server.
+ */
+void _reload_config() {
+    ServerConfig *new_config, *old_config;
+
+    printf("SIGHUP recibido, recargando %s...\n", exec_argv[1]);
+
+    old_config = config_current();
+    new_config = _read_config(old_config);
+    if (new_config == NULL) {
+        return;
+    }
+    if (io_set_root(new_config->base_dir) == -1) {
+        printf("BASE_DIR invalido, se mantiene la configuración anterior\n");
+        free_config(new_config);
+        return;
+    }
+    if (proxy_configure(&new_config->proxy) == -1) {
+        printf("Backends invalidos, se mantiene la configuración anterior\n");
+        free_config(new_config);
+        return;
+    }
+
+    if (strcmp(new_config->base_dir, old_config->base_dir) != 0) {
+        miss_cache_watch(new_config->base_dir);
+    }
+
+    max_clients = new_config->max_clients;
+    atomic_store(&timeout, new_config->timeout);
+    ratelimit_configure(&new_config->rate_limits);
+    log_set_level(new_config->log_level);
+    trace_configure(new_config->slow_request_ms, new_config->trace_sample);
+    set_script_limits(&new_config->script_limits);
+    config_publish(new_config);
+
+    printf("Configuración recargada\n");
+}
+
+/**
+ * @brief Signal handler for SIGUSR2.
+ *
+ * Only flags the hot upgrade, it is carried out by the accepting thread.
+ *
+ * @param sig The signal number (expected to be SIGUSR2).
+ */
+void sigusr2_handler(int sig) {
+    upgrade_flag = 1;
+}
+
+/**
+ * @brief Launches the new binary and hands it the listening socket.
+ *
+ * The binary found at the original argv[0] is executed with the same
+ * arguments. The listening descriptor and the write end of a readiness pipe
+ * are the only descriptors it inherits, their numbers travel in the
+ * environment. Since the socket is never closed in between, the kernel keeps
+ * queueing connections and none is refused while the new process starts.
+ *
+ * @return 0 if the new process is accepting connections, -1 if the upgrade
+ *         was aborted and this process must keep serving.
+ */
+int _hot_upgrade() {
+    char listen_env[64], ready_env[64];
+    sigset_t unblocked;
+    char **envp;
+    int ready[2], n = 0, i, status;
+    struct pollfd pfd;
+    char byte;
+    pid_t pid;
+
+    printf("SIGUSR2 recibido, lanzando %s...\n", exec_argv[0]);
+
+    if (pipe(ready) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+    fcntl(ready[1], F_SETFD, FD_CLOEXEC);
+
+    // Everything the child needs is prepared before fork
+    while (environ[n] != NULL) {
+        n++;
+    }
+    envp = (char**)malloc((n + 3) * sizeof(char*));
+    if (envp == NULL) {
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+    snprintf(listen_env, sizeof(listen_env), "%s=%d", LISTEN_FD_ENV, s_socket->socket);
+    snprintf(ready_env, sizeof(ready_env), "%s=%d", READY_FD_ENV, ready[1]);
+    for (i = 0, n = 0; environ[i] != NULL; i++) {
+        if (strncmp(environ[i], LISTEN_FD_ENV "=", strlen(LISTEN_FD_ENV) + 1) != 0 &&
+            strncmp(environ[i], READY_FD_ENV "=", strlen(READY_FD_ENV) + 1) != 0) {
+            envp[n++] = environ[i];
+        }
+    }
+    envp[n++] = listen_env;
+    envp[n++] = ready_env;
+    envp[n] = NULL;
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        free(envp);
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Client sockets and script pipes must not leak into the new server
+        syscall(SYS_close_range, 3, ~0U, CLOSE_RANGE_CLOEXEC);
+        // A supervisor forks with its signals blocked, the new server starts with none
+        sigemptyset(&unblocked);
+        sigprocmask(SIG_SETMASK, &unblocked, NULL);
+        fcntl(s_socket->socket, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        execve(exec_argv[0], exec_argv, envp);
+        _exit(EXIT_FAILURE);
+    }
+
+    free(envp);
+    close(ready[1]);
+
+    pfd.fd = ready[0];
+    pfd.events = POLLIN;
+    do {
+        status = poll(&pfd, 1, UPGRADE_TIMEOUT * 1000);
+    } while (status == -1 && errno == EINTR);
+
+    if (status == 1 && read(ready[0], &byte, 1) == 1) {
+        close(ready[0]);
+        printf("Nuevo proceso %d aceptando conexiones, drenando...\n", pid);
+        return 0;
+    }
+
+    close(ready[0]);
+    printf("El nuevo proceso %d no arrancó, se cancela la actualización\n", pid);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/**
+ * @brief Tells the previous process that this one is accepting connections.
+ *
+ * Only does something when the server was started by a hot upgrade.
+ */
+void _notify_ready() {
+    char *ready = getenv(READY_FD_ENV);
+    int fd;
+
+    if (ready == NULL) {
+        return;
+    }
+
+    fd = atoi(ready);
+    if (write(fd, "1", 1) != 1) {
+        perror("ready");
+    }
+    close(fd);
+    unsetenv(READY_FD_ENV);
+    unsetenv(LISTEN_FD_ENV);
+}
+
+/**
+ * @brief Value of a Content-Length header.
+ *
+ * @param value The value, after the colon.
+ * @param body Set to the length.
+ * @return 0 on success, -1 if the value is not a number that fits.
+ */
+int _parse_length(const char *value, size_t *body) {
+    size_t digit;
+
+    // Digits only, strtoul would take signs, spaces inside and overflows
+    for (; *value == ' ' || *value == '\t'; value++);
+    if (*value < '0' || *value > '9') {
+        return -1;
+    }
+    *body = 0;
+    for (; *value >= '0' && *value <= '9'; value++) {
+        digit = *value - '0';
+        if (*body > (SIZE_MAX - digit) / 10) {
+            return -1;
+        }
+        *body = *body * 10 + digit;
+    }
+    for (; *value == ' ' || *value == '\t'; value++);
+    return *value == '\r' ? 0 : -1;
+}
+
+/**
+ * @brief Length of the body of a request and whether its framing is safe.
+ *
+ * Only Content-Length frames bodies here. A request that also carried
+ * Transfer-Encoding, or two different lengths, could be read one way by the
+ * server and another by a backend behind it, so it is refused.
+ *
+ * @param head Head of the request.
+ * @param length Length of the head.
+ * @param body Set to the length of the body, 0 if there is none.
+ * @return HTTP_OK, HTTP_BAD_REQUEST for an invalid or conflicting
+ *         Content-Length, HTTP_LENGTH_REQUIRED for a chunked body and
+ *         HTTP_NOT_IMPLEMENTED for any other transfer coding.
+ */
+HttpStatusCode _request_framing(const char *head, size_t length, size_t *body) {
+    const char *line = head, *end = head + length, *value;
+    size_t announced;
+    int seen = 0;
+
+    *body = 0;
+    while (line != NULL && line < end) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            if (_parse_length(line + 15, &announced) != 0 || (seen && announced != *body)) {
+                return HTTP_BAD_REQUEST;
+            }
+            *body = announced;
+            seen = 1;
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            for (value = line + 18; *value == ' ' || *value == '\t'; value++);
+            return strncasecmp(value, "chunked\r", 8) == 0 ? HTTP_LENGTH_REQUIRED : HTTP_NOT_IMPLEMENTED;
+        }
+        line = strstr(line, "\r\n");
+        if (line != NULL) {
+            line += 2;
+        }
+    }
+    return HTTP_OK;
+}
+
+/**
+ * @brief Receives a complete request into the buffer of the connection.
+ *
+ * Reads until the head and the body announced by Content-Length are in the
+ * buffer, moving to a bigger buffer when needed. Bytes received after the
+ * request are left in the buffer for the next one (pipelining).
+ *
+ * The head and then the body must arrive before their deadlines, which only
+ * grow as bytes come in: waiting on each read alone would let a client keep
+ * the thread forever by sending a byte every few seconds.
+ *
+ * @param client_socket Socket of the client.
+ * @param buffer Buffer of the connection, may be replaced by a bigger one.
+ * @param readable Whether the socket is known to have data.
+ * @param limits Deadlines of the request.
+ * @param status Set to HTTP_OK if the whole request was received. A body that
+ *               does not fit in the biggest buffer leaves HTTP_PAYLOAD_TOO_LARGE
+ *               and only its first part received. A head that does not fit
+ *               leaves HTTP_HEADER_TOO_LARGE and a body framed in a way that is
+ *               not accepted the status of _request_framing, both returning 0.
+ * @return Length of the request, 0 if the connection was closed, missed a
+ *         deadline or must be refused with status.
+ */
+size_t _receive_request(int client_socket, Io_buffer **buffer, int readable, Transfer_limits *limits, HttpStatusCode *status) {
+    Io_buffer *bigger;
+    Deadline deadline;
+    char *end;
+    size_t head = 0, length = 0, scanned = 0, body, needed;
+    ssize_t bffread;
+    int left;
+
+    deadline_start(&deadline, limits->header_timeout * 1000L, limits->header_timeout_max * 1000L,
+                   limits->min_upload_rate);
+    *status = HTTP_OK;
+    while (1) {
+        if (head == 0) {
+            // Only the new bytes are searched, with the last 3 already seen in case the separator was split
+            (*buffer)->data[(*buffer)->used] = '\0';
+            end = strstr((*buffer)->data + scanned, "\r\n\r\n");
+            scanned = (*buffer)->used > 3 ? (*buffer)->used - 3 : 0;
+            if (end != NULL) {
+                head = end - (*buffer)->data + 4;
+                *status = _request_framing((*buffer)->data, head, &body);
+                if (*status == HTTP_OK && body > SIZE_MAX - head) {
+                    *status = HTTP_BAD_REQUEST;
+                }
+                if (*status != HTTP_OK) {
+                    return 0;
+                }
+                length = head + body;
+                deadline_start(&deadline, limits->body_timeout * 1000L, 0, limits->min_upload_rate);
+            }
+        }
+        if (head != 0 && length <= (*buffer)->used) {
+            return length;
+        }
+
+        needed = head != 0 ? length : (*buffer)->used + 1;
+        while (needed >= (*buffer)->size) {
+            bigger = buffer_grow(*buffer);
+            if (bigger == NULL) {
+                // The head is needed whole, a body that does not fit may still be streamed to a backend
+                *status = head != 0 ? HTTP_PAYLOAD_TOO_LARGE : HTTP_HEADER_TOO_LARGE;
+                return head != 0 ? (*buffer)->used : 0;
+            }
+            *buffer = bigger;
+        }
+
+        if (!readable) {
+            left = deadline_remaining(&deadline);
+            if (left == 0 || tls_wait(client_socket, POLLIN, left) == 0) {
+                LOG_DEBUG("Cliente lento, %s incompleto (socket %d)", head != 0 ? "cuerpo" : "header", client_socket);
+                metrics_slow_client();
+                return 0;
+            }
+        }
+        bffread = tls_read(client_socket, (*buffer)->data + (*buffer)->used, (*buffer)->size - 1 - (*buffer)->used);
+        readable = 0;
+        if (bffread == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (bffread <= 0) {
+            return 0;
+        }
+        (*buffer)->used += bffread;
+        deadline.bytes += bffread;
+    }
+}
+
+/**
+ * @brief Refuses a request that cannot be served and closes the exchange.
+ *
+ * @param client_socket Socket of the client.
+ * @param status Status of the refusal, from _receive_request.
+ * @return Bytes sent.
+ */
+ssize_t _refuse_request(int client_socket, HttpStatusCode status) {
+    Deadline deadline;
+    const char *refusal;
+    size_t length;
+
+    if (status == HTTP_PAYLOAD_TOO_LARGE) {
+        refusal = PAYLOAD_TOO_LARGE_RESPONSE;
+        length = sizeof(PAYLOAD_TOO_LARGE_RESPONSE) - 1;
+    } else if (status == HTTP_HEADER_TOO_LARGE) {
+        refusal = HEADER_TOO_LARGE_RESPONSE;
+        length = sizeof(HEADER_TOO_LARGE_RESPONSE) - 1;
+    } else if (status == HTTP_LENGTH_REQUIRED) {
+        refusal = LENGTH_REQUIRED_RESPONSE;
+        length = sizeof(LENGTH_REQUIRED_RESPONSE) - 1;
+    } else if (status == HTTP_NOT_IMPLEMENTED) {
+        refusal = NOT_IMPLEMENTED_RESPONSE;
+        length = sizeof(NOT_IMPLEMENTED_RESPONSE) - 1;
+    } else {
+        refusal = BAD_REQUEST_RESPONSE;
+        length = sizeof(BAD_REQUEST_RESPONSE) - 1;
+    }
+    LOG_DEBUG("Petición rechazada con %d (socket %d)", status, client_socket);
+    deadline_start(&deadline, SEND_TIMEOUT_MS, 0, 0);
+    return tls_send_all(client_socket, refusal, length, &deadline) == -1 ? 0 : (ssize_t)length;
+}
+
+/**
+ * @brief Sends the header and, if requested, the content of a response.
+ *
+ * Small responses are copied into a single pool buffer and sent with one
+ * call. Over TLS each call becomes TLS records, sealed by the kernel when
+ * kTLS is active. The whole response shares one deadline, extended by the
+ * bytes the client reads, so a client that reads too slowly is cut.
+ *
+ * @param client_socket Socket of the client.
+ * @param response The response.
+ * @param with_content Whether the content must be sent.
+ * @param limits Deadlines of the request.
+ * @return Bytes of the response, -1 if it could not be sent in time.
+ */
+ssize_t _send_response(int client_socket, Response *response, int with_content, Transfer_limits *limits) {
+    size_t header_length = strlen(response->header);
+    size_t length = header_length + (with_content ? response->content_length : 0);
+    Deadline deadline;
+    Io_buffer *out;
+    ssize_t status;
+
+    deadline_start(&deadline, SEND_TIMEOUT_MS, 0, limits->min_download_rate);
+    if (with_content && length <= BUFFER_MIN_SIZE * 4 && (out = buffer_acquire(length)) != NULL) {
+        memcpy(out->data, response->header, header_length);
+        memcpy(out->data + header_length, response->content, response->content_length);
+        status = tls_send_all(client_socket, out->data, length, &deadline);
+        buffer_release(out);
+    } else {
+        status = tls_send_all(client_socket, response->header, header_length, &deadline);
+        LOG_DEBUG("Enviado header");
+        if (status != -1 && with_content) {
+            status = tls_send_all(client_socket, response->content, response->content_length, &deadline);
+            LOG_DEBUG("Enviado archivo");
+        }
+    }
+
+    if (status == -1) {
+        if (errno == ETIMEDOUT) {
+            LOG_DEBUG("Cliente lento, respuesta incompleta (socket %d)", client_socket);
+            metrics_slow_client();
+        } else {
+            perror("send");
+        }
+        return -1;
+    }
+    return length;
+}
+
+/**
+ * @brief Refuses a connection over the limits of its address.
+ *
+ * The pre-rendered 429 is only attempted once and without waiting, the
+ * accepting thread must never block on a client. Over TLS the connection
+ * is just closed, a response would need a handshake first.
+ *
+ * @param client_socket The accepted socket.
+ */
+void _reject_client(int client_socket) {
+    if (!tls_enabled()) {
+        send(client_socket, RATE_LIMIT_RESPONSE, sizeof(RATE_LIMIT_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(client_socket);
+    metrics_rate_limited();
+    LOG_DEBUG("Conexión rechazada por los límites del cliente");
+}
+
 /**
  * @brief Thread function to handle a single client connection.
  *
  * This function is executed by a thread to handle communication with a single client. It reads
  * HTTP requests, parses them, generates responses, and sends them back to the client. The thread
- * also handles connection timeouts and ensures proper cleanup of resources.
+ * also handles connection timeouts and ensures proper cleanup of resources. A receive buffer
+ * is only attached while a request is in flight.
  *
- * @param arg Pointer to the client socket descriptor.
+ * @param arg Pointer to the accepted Client.
  * @return NULL
  */
 void *_handle_client(void *arg) {
-    int client_socket = *(int *)arg;
+    int client_socket = ((Client *)arg)->socket;
+    uint32_t address = ((Client *)arg)->address;
     free(arg);
     Parser *parser = NULL;
     Response *response = NULL;
-    char buffer[BUFFER_SIZE], *postargs;
-    ssize_t bffread;
-    int keep_alive = 1;
+    ServerConfig *snapshot;
+    Io_buffer *buffer = NULL;
+    char *request, *postargs, next;
+    Request_trace trace;
+    Deadline deadline;
+    ssize_t bytes_sent = 0;
+    size_t length, proxy_bytes;
+    int keep_alive = 1, readable, proxy_status;
+    HttpStatusCode received;
+    int reader = config_reader_register();
+    uint32_t capture_id = capture_connection();
+    Arena *arena = arena_create();
 
-    void *cleanup_args[3] = {&client_socket, &parser, &response};
+    void *cleanup_args[7] = {&client_socket, &parser, &response, &reader, &arena, &buffer, &address};
     pthread_cleanup_push(_cleanup_handler, cleanup_args);
 
-    struct sigaction sa;
-    sa.sa_handler = timeout_handler;
-    sa.sa_flags = 0;
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGALRM, &sa, NULL);
+    if (reader < 0) {
+        LOG_WARN("Sin lectores de configuración libres");
+        keep_alive = 0;
+    }
+    if (arena == NULL) {
+        perror("arena");
+        keep_alive = 0;
+    }
 
+    // Reloads and upgrades must interrupt the accepting thread, not this one
     sigset_t mask;
     sigemptyset(&mask);
-    sigaddset(&mask, SIGALRM);
-    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    if (keep_alive && tls_enabled()) {
+        // Same allowance as the head of a request, a client that trickles the handshake is slow too
+        snapshot = config_acquire(reader);
+        deadline_start(&deadline, snapshot->transfer_limits.header_timeout * 1000L,
+                       snapshot->transfer_limits.header_timeout_max * 1000L, snapshot->transfer_limits.min_upload_rate);
+        config_release(reader);
+        if (tls_accept(client_socket, &deadline) != 0) {
+            if (errno == ETIMEDOUT) {
+                metrics_slow_client();
+            }
+            LOG_DEBUG("Handshake TLS fallido (socket %d)", client_socket);
+            keep_alive = 0;
+        }
+    }
 
     while(keep_alive && !shutdown_flag) {
-        memset(buffer, 0, BUFFER_SIZE);
+        readable = 0;
+        if (buffer == NULL) {
+            // The idle wait is not part of the request, it starts once data arrives
+            if (tls_wait(client_socket, POLLIN, atomic_load(&timeout) * 1000) != 1) {
+                keep_alive = 0;
+                continue;
+            }
+            buffer = buffer_acquire(BUFFER_MIN_SIZE);
+            if (buffer == NULL) {
+                perror("buffer");
+                keep_alive = 0;
+                continue;
+            }
+            readable = 1;
+        }
 
-        alarm(timeout);
-        bffread = read(client_socket, buffer, BUFFER_SIZE - 1);
-        alarm(0);
-        if (bffread <= 0) {
+        // Held from the first byte, the deadlines of the request come from it
+        snapshot = config_acquire(reader);
+        trace_request_begin(&trace);
+        trace_phase_begin(PHASE_READ);
+        length = _receive_request(client_socket, &buffer, readable, &snapshot->transfer_limits, &received);
+        trace_phase_end(PHASE_READ);
+        if (length == 0) {
+            if (received != HTTP_OK) {
+                _refuse_request(client_socket, received);
+            }
             keep_alive = 0;
             continue;
         }
 
-        printf("LEIDO:\n%s\n", buffer);
+        request = buffer->data;
+        capture_request(capture_id, request, length);
+        next = request[length];
+        request[length] = '\0';
+        LOG_DEBUG("LEIDO: %.200s", request);
+
+        if (ratelimit_request(address) != 0) {
+            deadline_start(&deadline, SEND_TIMEOUT_MS, 0, 0);
+            tls_send_all(client_socket, RATE_LIMIT_RESPONSE, sizeof(RATE_LIMIT_RESPONSE) - 1, &deadline);
+            metrics_rate_limited();
+            break;
+        }
+
+        // Prior-knowledge h2c: the preface looks like a request without headers
+        if (snapshot->h2c && length == H2_PREFACE_LENGTH - 6 && memcmp(request, H2_PREFACE, length) == 0) {
+            request[length] = next;
+            config_release(reader);
+            http2_serve(client_socket, &buffer, reader, address, NULL, 0);
+            break;
+        }
 
-        parser = pars_http(buffer, conf);
+        trace_phase_begin(PHASE_PARSE);
+        parser = pars_http(request, snapshot, arena);
+        trace_phase_end(PHASE_PARSE);
         if (parser ==  NULL) {
             perror("http_parser");
             break;
         }
 
-        if (parser->method == POST) {
-            postargs = strstr(buffer, "\r\n\r\n");
-            strcpy(parser->args, postargs);
-            parser->args += 4;
+        // Only a backend can take a body bigger than the buffers, it is streamed from the socket
+        if (received == HTTP_PAYLOAD_TOO_LARGE && parser->type != PROXY) {
+            parser->status = HTTP_PAYLOAD_TOO_LARGE;
+            record_request(parser, _refuse_request(client_socket, received), &trace);
+            break;
+        }
+
+        if (parser->method == POST && parser->type != PROXY) {
+            postargs = strstr(request, "\r\n\r\n");
+            postargs = postargs != NULL ? postargs + 4 : request + length;
+            if (parser_set_body(parser, postargs, length - (size_t)(postargs - request)) != 0) {
+                if (errno != EINVAL) {
+                    perror("body");
+                    break;
+                }
+                parser->status = HTTP_BAD_REQUEST;
+                record_request(parser, _refuse_request(client_socket, HTTP_BAD_REQUEST), &trace);
+                break;
+            }
         }
 
-        response = create_response(parser);
-        if (response == NULL) {
-            perror("Response");
+        // Only requests without body can be upgraded, the body would have to become DATA frames
+        if (snapshot->h2c && parser->method != POST && buffer->used == length &&
+            http2_upgrade_requested(request)) {
+            request[length] = next;
+            free_parser(parser);
+            arena_reset(arena);
+            parser = NULL;
+            config_release(reader);
+            http2_serve(client_socket, &buffer, reader, address, request, length);
             break;
         }
 
-        if(strstr(buffer, "Connection: close") != NULL || shutdown_flag || (parser->version == HTTP1_0)) {
+        if (parser->type == PROXY) {
+            // The backend answers in place of create_response, a long body is streamed from the socket
+            trace_phase_begin(PHASE_PROXY);
+            if (proxy_forward(&snapshot->proxy.routes[parser->route], client_socket, request, length, address,
+                              &snapshot->transfer_limits, &proxy_status, &proxy_bytes) == -1) {
+                keep_alive = 0;
+            }
+            trace_phase_end(PHASE_PROXY);
+            parser->status = (HttpStatusCode)proxy_status;
+            bytes_sent = proxy_bytes;
+        } else {
+            response = create_response(parser);
+            if (response == NULL) {
+                perror("Response");
+                break;
+            }
+        }
+
+        if(strstr(request, "Connection: close") != NULL || shutdown_flag || draining ||
+            (parser->version == HTTP1_0)) {
             keep_alive = 0;
         }
-        
-        send(client_socket, response->header, strlen(response->header), MSG_NOSIGNAL);
-        printf("Enviado header\n");
 
-        if (parser->status == HTTP_OK && parser->method != OPTIONS) {
-            send_file(client_socket, response);
-            printf("Enviado archivo\n");
+        // Pipelined bytes stay for the next request, otherwise the buffer goes back to the pool
+        request[length] = next;
+        buffer->used -= length;
+        if (buffer->used > 0) {
+            memmove(buffer->data, buffer->data + length, buffer->used);
+        } else {
+            buffer_release(buffer);
+            buffer = NULL;
         }
 
-        free_parser(parser);
+        if (parser->type != PROXY) {
+            trace_phase_begin(PHASE_SEND);
+            bytes_sent = _send_response(client_socket, response,
+                parser->status == HTTP_OK && parser->method != OPTIONS, &snapshot->transfer_limits);
+            trace_phase_end(PHASE_SEND);
+            if (bytes_sent == -1) {
+                keep_alive = 0;
+                bytes_sent = 0;
+            }
+        }
+
+        record_request(parser, bytes_sent, &trace);
+
+        // Everything the request allocated goes away at once
         free_response(response);
+        free_parser(parser);
+        arena_reset(arena);
         parser = NULL;
         response = NULL;
+        config_release(reader);
     }
     
     pthread_cleanup_pop(1);
@@ -197,7 +847,130 @@ void *_handle_client(void *arg) {
     return NULL;
 }
 
+/**
+ * @brief Signal handler of the supervisor.
+ *
+ * Only flags the signal, the supervisor loop acts on it. SIGCHLD just
+ * wakes the loop up.
+ *
+ * @param sig The signal number.
+ */
+void supervisor_handler(int sig) {
+    if (sig == SIGINT) {
+        shutdown_flag = 1;
+    } else if (sig == SIGHUP) {
+        reload_flag = 1;
+    } else if (sig == SIGUSR2) {
+        upgrade_flag = 1;
+    }
+}
+
+/**
+ * @brief Sends a signal to every running worker.
+ *
+ * @param sig The signal.
+ * @param workers Number of workers.
+ */
+void _signal_workers(int sig, int workers) {
+    int i;
+
+    for (i = 1; i <= workers; i++) {
+        if (worker_pids[i] > 0) {
+            kill(worker_pids[i], sig);
+        }
+    }
+}
+
+/**
+ * @brief Starts a worker.
+ *
+ * The child leaves with the signals of the supervisor unblocked and its
+ * counters in the shared area of its index; if the supervisor dies it
+ * receives SIGINT.
+ *
+ * @param index Index of the worker, from 1.
+ * @param unblocked Signal mask of the worker.
+ * @return 0 in the worker, its pid in the supervisor, -1 if fork failed.
+ */
+pid_t _spawn_worker(int index, sigset_t *unblocked) {
+    pid_t pid, supervisor = getpid();
+    struct sigaction sa;
+
+    // Whatever is still buffered would be printed again by the worker
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sa.sa_handler = SIG_DFL;
+        sigaction(SIGCHLD, &sa, NULL);
+        prctl(PR_SET_PDEATHSIG, SIGINT);
+        if (getppid() != supervisor) {
+            shutdown_flag = 1;
+        }
+        sigprocmask(SIG_SETMASK, unblocked, NULL);
+        metrics_attach(index);
+        worker_index = index;
+        return 0;
+    }
+
+    worker_pids[index] = pid;
+    worker_started[index] = time(NULL);
+    printf("Worker %d arrancado (pid %d)\n", index, pid);
+    return pid;
+}
+
+/**
+ * @brief Index of a worker.
+ *
+ * @param pid Pid of the worker.
+ * @param workers Number of workers.
+ * @return The index, 0 if pid is not a worker.
+ */
+int _worker_of(pid_t pid, int workers) {
+    int i;
+
+    for (i = 1; i <= workers; i++) {
+        if (worker_pids[i] == pid) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+
 /* ---------------------- Public Functions ---------------------- */
+void record_request(Parser *parser, size_t bytes, Request_trace *trace) {
+    Access_record record;
+    unsigned long end = trace_now();
+    long parse_ns = trace_ns(trace->ticks[PHASE_PARSE]);
+    long total_ns = trace_ns(end - trace->start);
+
+    trace_request_end(trace, end, parser->method, parser->filename, parser->status);
+
+    metrics_request(parser->method, parser->status, parser->type, bytes);
+    metrics_observe(HIST_PARSE, parse_ns);
+    metrics_observe(HIST_HANDLER, total_ns - parse_ns - trace_ns(trace->ticks[PHASE_READ]));
+    metrics_observe(HIST_TOTAL, total_ns);
+
+    if (!log_enabled(LOG_LEVEL_INFO)) {
+        return;
+    }
+
+    record.method = parser->method <= UNKNOWN_METHOD ? parser->method : UNKNOWN_METHOD;
+    record.status = parser->status;
+    record.type = parser->type;
+    record.bytes = bytes;
+    record.duration_us = total_ns / 1000;
+    snprintf(record.path, LOG_PATH, "%s", parser->filename);
+    log_access(&record);
+}
+
 int init_handler() {
     struct sigaction sa;
     sigemptyset(&sa.sa_mask);
@@ -209,10 +982,17 @@ int init_handler() {
         return -1;
     }
 
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGALRM);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    sa.sa_handler = sighup_handler;
+    if (sigaction(SIGHUP, &sa, NULL) == -1) {
+        perror("Error al registrar SIGHUP");
+        return -1;
+    }
+
+    sa.sa_handler = sigusr2_handler;
+    if (sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("Error al registrar SIGUSR2");
+        return -1;
+    }
 
     signal(SIGPIPE, SIG_IGN);
 
@@ -236,83 +1016,240 @@ void cleanup_threads() {
         free_socket(s_socket);
     }
 
-    if (conf) {
-        free_dict(conf);
-    }
+    config_destroy();
+    ratelimit_close();
+    proxy_close();
+    io_close();
+    bundle_close();
+    miss_cache_close();
+    tls_close();
+    trace_close();
+    capture_close();
+    log_close();
 
     printf("Servidor cerrado correctamente.\n");
 }
 
-int server_listen(S_socket *e_s_socket, Dict *e_conf){
-    socklen_t clilen;
-    int *client_socket;
+int server_listen(S_socket *e_s_socket, ServerConfig *e_config, char *e_argv[]){
+    Client *client;
     pthread_t thread_id;
-    max_clients = atoi(get_value(e_conf, "MAX_CLIENTS"));
+    max_clients = e_config->max_clients;
     if (max_clients <= 0 || max_clients > MAX_THREADS) {
         perror("MAX_CLIENTS");
         return -1;
     }
 
-    timeout = atoi(get_value(e_conf, "TIMEOUT"));
-    if (timeout <= 0){
-        printf("Timeout invalido");
-        return -1;
-    }
+    atomic_store(&timeout, e_config->timeout);
+    set_script_limits(&e_config->script_limits);
 
     s_socket = e_s_socket;
-    conf = e_conf;
-    clilen = sizeof(s_socket->address);
+    exec_argv = e_argv;
+    config_init(e_config);
 
-    printf("Servidor escuchando en el puerto %d...\n", atoi(get_value(conf, "PORT")));
+    printf("Servidor escuchando en el puerto %d...\n", e_config->port);
+    _notify_ready();
 
     while (!shutdown_flag) {
+        if (reload_flag) {
+            reload_flag = 0;
+            _reload_config();
+        }
+        if (upgrade_flag) {
+            upgrade_flag = 0;
+            // A worker leaves the upgrade to its supervisor and only drains
+            if (worker_index > 0 || _hot_upgrade() == 0) {
+                // Close our copy only, shutdown() would stop the new process too
+                draining = 1;
+                close(s_socket->socket);
+                s_socket->socket = -1;
+                break;
+            }
+        }
+        config_reclaim();
+
         pthread_mutex_lock(&active_clients_mutex);
         if (active_clients >= max_clients) {
             pthread_mutex_unlock(&active_clients_mutex);
-            printf("Se alcanzó el límite de clientes simultáneos (%d). Rechazando conexión.\n", max_clients);
+            LOG_WARN("Se alcanzó el límite de clientes simultáneos (%d). Rechazando conexión.", max_clients);
+            metrics_rejected();
             sleep(5);
             continue;
         }
         pthread_mutex_unlock(&active_clients_mutex);
 
-        client_socket = malloc(sizeof(int));
-        *client_socket = accept(s_socket->socket, (struct sockaddr*) &s_socket->address, &clilen);
+        client = malloc(sizeof(Client));
+        client->socket = accept_client(s_socket, &config_current()->socket_options);
         
         if (shutdown_flag) {
-            free(client_socket);
+            free(client);
             break;
         }
 
+        if (client->socket < 0) {
+            if (errno != EINTR) {
+                perror("Accept");
+            }
+            free(client);
+            continue;
+        }
+
+        // accept_client leaves the address of the peer in the listening socket
+        client->address = s_socket->address.sin_addr.s_addr;
+        if (ratelimit_connect(client->address) != 0) {
+            _reject_client(client->socket);
+            free(client);
+            continue;
+        }
+
         pthread_mutex_lock(&client_sockets_mutex);
-        for (int i = 0; i < max_clients; i++) {
+        for (int i = 0; i < MAX_THREADS; i++) {
             if (client_sockets[i] == 0) {
-                client_sockets[i] = *client_socket;
+                client_sockets[i] = client->socket;
                 break;
             }
         }
         pthread_mutex_unlock(&client_sockets_mutex);
 
-        if (*client_socket < 0) {
-            perror("Accept");
-            free(client_socket);
-            continue;
-        }
-
-        printf("Nueva conexion aceptada \n");
+        LOG_DEBUG("Nueva conexion aceptada");
 
-        if (pthread_create(&thread_id, NULL, _handle_client, client_socket) != 0) {
+        if (pthread_create(&thread_id, NULL, _handle_client, client) != 0) {
             perror("Error en pthread_create");
-            close(*client_socket);
-            free(client_socket);
+            ratelimit_disconnect(client->address);
+            close(client->socket);
+            free(client);
             continue;
         }
 
         pthread_mutex_lock(&active_clients_mutex);
         active_clients++;
         pthread_mutex_unlock(&active_clients_mutex);
+        metrics_connection(1);
 
         pthread_detach(thread_id);
     }
     
     return 0;
 }
+
+int server_supervise(S_socket *e_s_socket, ServerConfig **config, char *e_argv[]) {
+    ServerConfig *new_config;
+    struct sigaction sa;
+    sigset_t mask, unblocked;
+    int i, status, root, workers = (*config)->workers;
+    pid_t pid;
+
+    if (workers <= 0 || workers > MAX_WORKERS) {
+        printf("WORKERS invalido (1-%d)\n", MAX_WORKERS);
+        return -1;
+    }
+    if (metrics_share(workers + 1) != 0) {
+        return -1;
+    }
+
+    s_socket = e_s_socket;
+    exec_argv = e_argv;
+
+    // Signals only arrive inside sigsuspend, none is lost between two checks
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &unblocked);
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sa.sa_handler = supervisor_handler;
+    if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGHUP, &sa, NULL) == -1 ||
+        sigaction(SIGUSR2, &sa, NULL) == -1 || sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction");
+        sigprocmask(SIG_SETMASK, &unblocked, NULL);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // The listening socket already queues connections, the previous process can go
+    _notify_ready();
+
+    for (i = 1; i <= workers; i++) {
+        pid = _spawn_worker(i, &unblocked);
+        if (pid == 0) {
+            return i;
+        }
+        if (pid == -1) {
+            shutdown_flag = 1;
+            break;
+        }
+    }
+    printf("Supervisor %d con %d workers\n", getpid(), workers);
+
+    while (!shutdown_flag) {
+        if (reload_flag) {
+            reload_flag = 0;
+            printf("SIGHUP recibido, recargando %s...\n", exec_argv[1]);
+            // Running workers reload on their own, the ones started later are forked with this copy
+            new_config = _read_config(*config);
+            if (new_config != NULL) {
+                root = open(new_config->base_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (root == -1) {
+                    printf("BASE_DIR invalido, se mantiene la configuración anterior\n");
+                    free_config(new_config);
+                } else {
+                    close(root);
+                    free_config(*config);
+                    *config = new_config;
+                }
+            }
+            _signal_workers(SIGHUP, workers);
+        }
+        if (upgrade_flag) {
+            upgrade_flag = 0;
+            if (_hot_upgrade() == 0) {
+                // The new supervisor has its own workers, ours finish their clients and exit
+                close(s_socket->socket);
+                s_socket->socket = -1;
+                _signal_workers(SIGUSR2, workers);
+                break;
+            }
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            i = _worker_of(pid, workers);
+            if (i == 0) {
+                continue;
+            }
+            worker_pids[i] = 0;
+            if (WIFSIGNALED(status)) {
+                printf("El worker %d (pid %d) terminó por la señal %d, reiniciando...\n", i, pid, WTERMSIG(status));
+            } else {
+                printf("El worker %d (pid %d) terminó con estado %d, reiniciando...\n", i, pid, WEXITSTATUS(status));
+            }
+            // A worker that dies on start must not turn into a fork loop
+            if (time(NULL) - worker_started[i] < 1) {
+                sleep(1);
+            }
+            if (_spawn_worker(i, &unblocked) == 0) {
+                return i;
+            }
+        }
+
+        if (!shutdown_flag && !reload_flag && !upgrade_flag) {
+            sigsuspend(&unblocked);
+        }
+    }
+
+    if (shutdown_flag) {
+        printf("\nSIGINT recibido, cerrando los workers...\n");
+        _signal_workers(SIGINT, workers);
+    }
+
+    // Only the workers are waited for, after an upgrade the new supervisor is a child too
+    for (i = 1; i <= workers; i++) {
+        while (worker_pids[i] > 0 && waitpid(worker_pids[i], &status, 0) == -1 && errno == EINTR);
+        worker_pids[i] = 0;
+    }
+
+    sigprocmask(SIG_SETMASK, &unblocked, NULL);
+    printf("Supervisor cerrado correctamente.\n");
+    return 0;
+}
@@ -18,28 +18,57 @@
 #define REACTIVE_H
 
 #define MAX_THREADS 1024
+#define UPGRADE_TIMEOUT 10
+#define MAX_WORKERS 64
 
 #include "../utils/socket.h"
-#include "../utils/conf_parser.h"
+#include "../utils/server_config.h"
 #include "../utils/http_parser.h"
 #include "../utils/utils.h"
 #include "../utils/response.h"
+#include "../utils/trace.h"
+#include <signal.h>
+
+/**
+ * @struct Client
+ * @brief Accepted connection handed to its thread.
+ */
+typedef struct {
+    int socket;         /**< Socket of the connection. */
+    uint32_t address;   /**< IPv4 address of the peer, network byte order. */
+} Client;
+
+/** Set by SIGINT, connections finish their request and close. */
+extern volatile sig_atomic_t shutdown_flag;
+/** Set after a hot upgrade, connections close once idle. */
+extern volatile sig_atomic_t draining;
+/** Keep-alive timeout in seconds, updated on reload. */
+extern _Atomic int timeout;
 
 /**
  * @brief Initializes signal handlers for the server.
  *
- * This function sets up signal handlers for SIGINT (graceful shutdown) and SIGPIPE (ignored).
- * It also blocks the SIGALRM signal in the main thread to ensure proper handling in client threads.
+ * This function sets up signal handlers for SIGINT (graceful shutdown), SIGHUP (configuration
+ * reload), SIGUSR2 (hot upgrade) and SIGPIPE (ignored).
  *
  * @return 0 on success, -1 on failure.
  */
 int init_handler();
 
+/**
+ * @brief Records the metrics, the access record and the trace of a served request.
+ *
+ * @param parser The parsed request.
+ * @param bytes Bytes sent to the client.
+ * @param trace Phase timestamps of the request.
+ */
+void record_request(Parser *parser, size_t bytes, Request_trace *trace);
+
 /**
  * @brief Waits for all client threads to finish and cleans up resources.
  *
  * This function waits for all active client threads to terminate and releases global resources
- * such as the server socket and configuration dictionary.
+ * such as the server socket and configuration.
  */
 void cleanup_threads();
 
@@ -48,12 +77,38 @@ void cleanup_threads();
  *
  * This function initializes the server, listens for incoming client connections, and creates
  * a new thread for each client. It enforces a maximum number of simultaneous clients and handles
- * graceful shutdown when the shutdown flag is set.
+ * graceful shutdown when the shutdown flag is set. On SIGHUP the configuration file is parsed
+ * again and published without dropping any connection. On SIGUSR2 the binary at argv[0] is
+ * started with the listening socket; once it accepts connections this function returns and
+ * the caller drains the remaining clients with cleanup_threads().
  *
  * @param e_s_socket Pointer to the server socket structure.
- * @param e_conf Pointer to the configuration dictionary.
+ * @param e_config Pointer to the compiled server configuration, owned by the server from now on.
+ * @param e_argv Command line of the server: the binary and the configuration file.
  * @return 0 on success, -1 on failure.
  */
-int server_listen(S_socket *e_s_socket, Dict *e_conf);
+int server_listen(S_socket *e_s_socket, ServerConfig *e_config, char *e_argv[]);
+
+/**
+ * @brief Forks the workers that share the listening socket and supervises them.
+ *
+ * Each worker returns from this function and goes on like a single server
+ * process: it initializes the modules and calls server_listen. The
+ * supervisor stays here restarting the workers that die and forwarding
+ * SIGHUP and SIGINT to them. On SIGHUP it also compiles the configuration
+ * file again, so a worker restarted afterwards starts with the reloaded
+ * configuration; an invalid file keeps the previous one. On SIGUSR2 it starts the new binary at argv[0]
+ * with the listening socket, which forks its own workers, and the current
+ * workers drain their clients and exit. The counters of the metrics are
+ * shared, any worker renders the totals of all of them.
+ *
+ * @param e_s_socket Pointer to the server socket structure.
+ * @param config The compiled configuration, with from 1 to MAX_WORKERS
+ *        workers. Replaced by the last one reloaded when the function returns.
+ * @param e_argv Command line of the server: the binary and the configuration file.
+ * @return The index of the worker (from 1) in a worker, 0 in the supervisor
+ *         once every worker has exited, -1 on failure.
+ */
+int server_supervise(S_socket *e_s_socket, ServerConfig **config, char *e_argv[]);
 
 #endif
\ No newline at end of file
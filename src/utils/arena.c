@@ -0,0 +1,172 @@
+/**
+ * @file arena.c
+ * @brief Implementation of the per-connection bump allocator.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Takes a big allocation from malloc and links it to the arena.
+ *
+ * @param arena The arena.
+ * @param size Number of bytes.
+ * @return Pointer to the memory, or NULL on failure.
+ */
+void *_arena_large(Arena *arena, size_t size) {
+    void *ptr = malloc(size);
+
+    if (ptr == NULL) {
+        return NULL;
+    }
+    return arena_adopt(arena, ptr);
+}
+
+/**
+ * @brief Allocates an empty block.
+ *
+ * @return The block, or NULL if memory allocation fails.
+ */
+Arena_block *_arena_block() {
+    Arena_block *block = (Arena_block*)malloc(sizeof(Arena_block) + ARENA_BLOCK);
+
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = ARENA_BLOCK;
+    block->used = 0;
+    return block;
+}
+
+/**
+ * @brief Moves to the next block of the chain, allocating it if needed.
+ *
+ * @param arena The arena.
+ * @return The new current block, or NULL if memory allocation fails.
+ */
+Arena_block *_arena_next(Arena *arena) {
+    Arena_block *block = arena->current->next;
+
+    if (block == NULL) {
+        block = _arena_block();
+        if (block == NULL) {
+            return NULL;
+        }
+        arena->current->next = block;
+    }
+    block->used = 0;
+    arena->current = block;
+    return block;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+Arena *arena_create() {
+    Arena *arena = (Arena*)malloc(sizeof(Arena));
+
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->first = _arena_block();
+    if (arena->first == NULL) {
+        free(arena);
+        return NULL;
+    }
+    arena->current = arena->first;
+    arena->large = NULL;
+    return arena;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    Arena_block *block;
+    void *ptr;
+
+    if (arena == NULL) {
+        return malloc(size);
+    }
+    if (size > ARENA_LARGE) {
+        return _arena_large(arena, size);
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    block = arena->current;
+    if (block->size - block->used < size) {
+        block = _arena_next(arena);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void *arena_calloc(Arena *arena, size_t count, size_t size) {
+    void *ptr;
+
+    if (arena == NULL) {
+        return calloc(count, size);
+    }
+    if (size != 0 && count > (size_t)-1 / size) {
+        return NULL;
+    }
+    ptr = arena_alloc(arena, count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *arena_adopt(Arena *arena, void *ptr) {
+    Arena_large *large;
+
+    if (arena == NULL || ptr == NULL) {
+        return ptr;
+    }
+    large = (Arena_large*)arena_alloc(arena, sizeof(Arena_large));
+    if (large == NULL) {
+        free(ptr);
+        return NULL;
+    }
+    large->ptr = ptr;
+    large->next = arena->large;
+    arena->large = large;
+    return ptr;
+}
+
+void arena_free(Arena *arena, void *ptr) {
+    if (arena == NULL) {
+        free(ptr);
+    }
+}
+
+void arena_reset(Arena *arena) {
+    Arena_large *large;
+
+    for (large = arena->large; large != NULL; large = large->next) {
+        free(large->ptr);
+    }
+    arena->large = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
+
+void arena_destroy(Arena *arena) {
+    Arena_block *block, *next;
+
+    if (arena == NULL) {
+        return;
+    }
+    arena_reset(arena);
+    for (block = arena->first; block != NULL; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena);
+}
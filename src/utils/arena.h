@@ -0,0 +1,118 @@
+/**
+ * @file arena.h
+ * @brief Header file for the per-connection bump allocator.
+ *
+ * Every connection owns an arena where all the allocations of a request are
+ * made by moving a pointer forward. When the response has been sent the arena
+ * is reset in constant time and the memory is reused by the next request of
+ * the same connection, so the request path does not touch the malloc arenas
+ * shared by all the threads. Requests that need more than one block chain new
+ * blocks, which are kept for the following requests. Big allocations, such
+ * as file contents, are taken from malloc and released on reset.
+ *
+ * Passing a NULL arena to any function falls back to malloc and free.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK 16384
+#define ARENA_LARGE 4096
+#define ARENA_ALIGN 16
+
+/**
+ * @struct Arena_block
+ * @brief A block of memory of the arena.
+ */
+typedef struct Arena_block {
+    struct Arena_block *next;   /**< Next block of the chain. */
+    size_t size;                /**< Usable bytes of the block. */
+    size_t used;                /**< Bytes already handed out. */
+    _Alignas(ARENA_ALIGN) char data[]; /**< Memory of the block. */
+} Arena_block;
+
+/**
+ * @struct Arena_large
+ * @brief A big allocation owned by the arena until the next reset.
+ */
+typedef struct Arena_large {
+    struct Arena_large *next;   /**< Next big allocation. */
+    void *ptr;                  /**< Memory taken from malloc. */
+} Arena_large;
+
+/**
+ * @struct Arena
+ * @brief Bump allocator of a connection.
+ */
+typedef struct {
+    Arena_block *current;       /**< Block allocations are served from. */
+    Arena_large *large;         /**< Big allocations since the last reset. */
+    Arena_block *first;         /**< First block of the chain. */
+} Arena;
+
+/**
+ * @brief Creates an arena with its first block.
+ *
+ * @return Pointer to the arena, or NULL if memory allocation fails.
+ */
+Arena *arena_create();
+
+/**
+ * @brief Allocates memory from the arena.
+ *
+ * @param arena The arena, NULL to use malloc.
+ * @param size Number of bytes.
+ * @return Pointer to the memory, aligned to ARENA_ALIGN, or NULL on failure.
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * @brief Allocates zeroed memory from the arena.
+ *
+ * @param arena The arena, NULL to use calloc.
+ * @param count Number of elements.
+ * @param size Size of each element.
+ * @return Pointer to the memory, or NULL on failure.
+ */
+void *arena_calloc(Arena *arena, size_t count, size_t size);
+
+/**
+ * @brief Hands a malloc'd pointer to the arena, it is freed on the next reset.
+ *
+ * @param arena The arena, NULL to keep the pointer owned by the caller.
+ * @param ptr The pointer.
+ * @return The same pointer, or NULL if it could not be adopted (it is freed).
+ */
+void *arena_adopt(Arena *arena, void *ptr);
+
+/**
+ * @brief Frees memory obtained from arena_alloc when no arena is used.
+ *
+ * Memory of an arena is only released by arena_reset, so this does nothing
+ * when arena is not NULL.
+ *
+ * @param arena The arena the memory comes from.
+ * @param ptr The pointer.
+ */
+void arena_free(Arena *arena, void *ptr);
+
+/**
+ * @brief Releases every allocation of the arena at once.
+ *
+ * @param arena The arena.
+ */
+void arena_reset(Arena *arena);
+
+/**
+ * @brief Frees the arena and all its blocks.
+ *
+ * @param arena The arena.
+ */
+void arena_destroy(Arena *arena);
+
+#endif
@@ -0,0 +1,137 @@
+/**
+ * @file buffer_pool.c
+ * @brief Implementation of the slab pool of socket I/O buffers.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "buffer_pool.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* ---------------------- Global objects ---------------------- */
+/**
+ * @struct Buffer_class
+ * @brief Free list of one size class.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    Io_buffer *free;
+} Buffer_class;
+
+Buffer_class buffer_classes[BUFFER_CLASSES] = {
+    {PTHREAD_MUTEX_INITIALIZER, NULL},
+    {PTHREAD_MUTEX_INITIALIZER, NULL},
+    {PTHREAD_MUTEX_INITIALIZER, NULL}
+};
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Capacity of the buffers of a size class.
+ *
+ * @param size_class The size class.
+ * @return The capacity in bytes.
+ */
+size_t _class_size(int size_class) {
+    return (size_t)BUFFER_MIN_SIZE << (2 * size_class);
+}
+
+/**
+ * @brief Carves a new slab into buffers of a size class.
+ *
+ * Must be called with the mutex of the class held.
+ *
+ * @param size_class The size class.
+ * @return 0 on success, -1 if memory allocation fails.
+ */
+int _new_slab(int size_class) {
+    Buffer_class *cls = &buffer_classes[size_class];
+    size_t stride = (sizeof(Io_buffer) + _class_size(size_class) + 63) & ~(size_t)63;
+    size_t count = BUFFER_SLAB / stride > 0 ? BUFFER_SLAB / stride : 1;
+    char *slab;
+    Io_buffer *buffer;
+    size_t i;
+
+    slab = (char*)aligned_alloc(64, stride * count);
+    if (slab == NULL) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        buffer = (Io_buffer*)(slab + i * stride);
+        buffer->size = _class_size(size_class);
+        buffer->size_class = size_class;
+        buffer->next = cls->free;
+        cls->free = buffer;
+    }
+    return 0;
+}
+
+/**
+ * @brief Pops a buffer of a size class.
+ *
+ * @param size_class The size class.
+ * @return The buffer, or NULL on failure.
+ */
+Io_buffer *_pop(int size_class) {
+    Buffer_class *cls = &buffer_classes[size_class];
+    Io_buffer *buffer = NULL;
+
+    pthread_mutex_lock(&cls->mutex);
+    if (cls->free != NULL || _new_slab(size_class) == 0) {
+        buffer = cls->free;
+        cls->free = buffer->next;
+    }
+    pthread_mutex_unlock(&cls->mutex);
+
+    if (buffer != NULL) {
+        buffer->next = NULL;
+        buffer->used = 0;
+    }
+    return buffer;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+Io_buffer *buffer_acquire(size_t size) {
+    int size_class = 0;
+
+    while (size_class < BUFFER_CLASSES && _class_size(size_class) < size) {
+        size_class++;
+    }
+    if (size_class == BUFFER_CLASSES) {
+        return NULL;
+    }
+    return _pop(size_class);
+}
+
+Io_buffer *buffer_grow(Io_buffer *buffer) {
+    Io_buffer *bigger;
+
+    if (buffer->size_class + 1 >= BUFFER_CLASSES) {
+        return NULL;
+    }
+    bigger = _pop(buffer->size_class + 1);
+    if (bigger == NULL) {
+        return NULL;
+    }
+    memcpy(bigger->data, buffer->data, buffer->used);
+    bigger->used = buffer->used;
+    buffer_release(buffer);
+    return bigger;
+}
+
+void buffer_release(Io_buffer *buffer) {
+    Buffer_class *cls;
+
+    if (buffer == NULL) {
+        return;
+    }
+    cls = &buffer_classes[buffer->size_class];
+    pthread_mutex_lock(&cls->mutex);
+    buffer->next = cls->free;
+    cls->free = buffer;
+    pthread_mutex_unlock(&cls->mutex);
+}
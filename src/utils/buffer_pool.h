@@ -0,0 +1,64 @@
+/**
+ * @file buffer_pool.h
+ * @brief Header file for the pool of socket I/O buffers.
+ *
+ * Buffers come in a few size classes and are carved out of big slabs, so
+ * taking one is a pop from the free list of its class. A connection only
+ * holds a buffer while a request is being received or a response is being
+ * sent; idle keep-alive connections hold none, and their memory stays near
+ * zero no matter how many of them are open. Slabs are never returned to the
+ * system, the pool keeps the memory of the peak of requests in flight.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+#define BUFFER_CLASSES 3
+#define BUFFER_MIN_SIZE 4096
+#define BUFFER_MAX_SIZE (BUFFER_MIN_SIZE << (2 * (BUFFER_CLASSES - 1)))
+#define BUFFER_SLAB (256 * 1024)
+
+/**
+ * @struct Io_buffer
+ * @brief A buffer of the pool.
+ */
+typedef struct Io_buffer {
+    struct Io_buffer *next;     /**< Next free buffer of the class. */
+    size_t size;                /**< Capacity of data. */
+    size_t used;                /**< Bytes of data holding valid content. */
+    int size_class;             /**< Size class of the buffer. */
+    char data[];                /**< Content of the buffer. */
+} Io_buffer;
+
+/**
+ * @brief Takes a buffer of at least size bytes from the pool.
+ *
+ * @param size Minimum capacity, at most BUFFER_MAX_SIZE.
+ * @return The buffer with used set to 0, or NULL on failure.
+ */
+Io_buffer *buffer_acquire(size_t size);
+
+/**
+ * @brief Moves the content of a buffer into one of the next size class.
+ *
+ * The old buffer is returned to the pool.
+ *
+ * @param buffer The buffer.
+ * @return The bigger buffer, or NULL if there is no bigger class or memory
+ *         allocation fails, in which case the old buffer is still valid.
+ */
+Io_buffer *buffer_grow(Io_buffer *buffer);
+
+/**
+ * @brief Returns a buffer to the pool.
+ *
+ * @param buffer The buffer, may be NULL.
+ */
+void buffer_release(Io_buffer *buffer);
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * @file bundle.c
+ * @brief Lookups in the asset bundle mapped at startup.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "bundle.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* ---------------------- Global objects ---------------------- */
+const char *bundle_map = NULL;
+size_t bundle_size = 0;
+const Bundle_header *bundle_header = NULL;
+const Bundle_entry *bundle_entries = NULL;
+const uint32_t *bundle_table = NULL;
+const char *bundle_names = NULL;
+size_t bundle_names_size = 0;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Tells whether a range lies inside the mapping.
+ *
+ * @param offset Start of the range.
+ * @param length Length of the range.
+ * @return 1 if it does, 0 otherwise.
+ */
+int _bundle_fits(uint64_t offset, uint64_t length) {
+    return offset <= bundle_size && length <= bundle_size - offset;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+uint32_t bundle_hash(const char *path, size_t length) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int bundle_open(const char *path) {
+    const Bundle_header *header;
+    struct stat st;
+    size_t index;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("bundle");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Bundle_header)) {
+        fprintf(stderr, "El bundle %s no es válido\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    header = (const Bundle_header *)map;
+    index = sizeof(Bundle_header) + (size_t)header->count * sizeof(Bundle_entry) + (size_t)header->slots * sizeof(uint32_t);
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || header->size != (uint64_t)st.st_size ||
+        header->slots == 0 || (header->slots & (header->slots - 1)) != 0 || header->count >= header->slots ||
+        index > (size_t)st.st_size) {
+        fprintf(stderr, "El bundle %s no es válido\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    bundle_map = (const char *)map;
+    bundle_size = st.st_size;
+    bundle_header = header;
+    bundle_entries = (const Bundle_entry *)(bundle_map + sizeof(Bundle_header));
+    bundle_table = (const uint32_t *)(bundle_entries + header->count);
+    bundle_names = bundle_map + index;
+    bundle_names_size = bundle_size - index;
+
+    // The index is touched by every request, the data only by its own
+    madvise(map, index, MADV_WILLNEED);
+    return 0;
+}
+
+int bundle_loaded() {
+    return bundle_map != NULL;
+}
+
+const Bundle_entry *bundle_find(const char *path, size_t length) {
+    const Bundle_entry *entry;
+    uint32_t mask, slot, index, probes;
+
+    if (bundle_map == NULL) {
+        return NULL;
+    }
+
+    mask = bundle_header->slots - 1;
+    slot = bundle_hash(path, length) & mask;
+    for (probes = 0; probes <= mask && (index = bundle_table[slot]) != 0; probes++, slot = (slot + 1) & mask) {
+        if (index > bundle_header->count) {
+            return NULL;
+        }
+        entry = &bundle_entries[index - 1];
+        if (entry->name_length != length || entry->name > bundle_names_size ||
+            length > bundle_names_size - entry->name || memcmp(bundle_names + entry->name, path, length) != 0) {
+            continue;
+        }
+        // A damaged entry is as good as a missing one
+        if (!_bundle_fits(entry->offset, entry->length) || !_bundle_fits(entry->gzip_offset, entry->gzip_length)) {
+            return NULL;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+const void *bundle_content(const Bundle_entry *entry, int gzip, size_t *length) {
+    if (gzip && entry->gzip_offset != 0) {
+        *length = entry->gzip_length;
+        return bundle_map + entry->gzip_offset;
+    }
+    *length = entry->length;
+    return bundle_map + entry->offset;
+}
+
+void bundle_close() {
+    if (bundle_map != NULL) {
+        munmap((void *)bundle_map, bundle_size);
+        bundle_map = NULL;
+    }
+}
@@ -0,0 +1,112 @@
+/**
+ * @file bundle.h
+ * @brief Header file for serving the document root from a packed asset bundle.
+ *
+ * For immutable deployments BASE_DIR can be packed into a single file
+ * (bin/pack) that the server maps at startup. Lookups are then one probe of
+ * a hash table in the mapping, with no open or stat per request, and
+ * starting takes the same time whatever the number of files. The file is:
+ *
+ * ```
+ * header:  "RSBUNDL1" count(u32) slots(u32) size(u64)
+ * entries: Bundle_entry[count]
+ * table:   u32[slots], index of the entry + 1, 0 if the slot is empty
+ * names:   the paths, one after another, without terminator
+ * data:    the content of every entry and its gzip variant, each one
+ *          starting on a BUNDLE_ALIGN boundary
+ * ```
+ *
+ * Integers are in host byte order. Paths are relative to the document root
+ * and start with '/', the table is probed linearly from bundle_hash(path)
+ * and has at least twice as many slots as entries. Text files get a gzip
+ * variant when it is smaller than the original.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUNDLE_MAGIC "RSBUNDL1"
+#define BUNDLE_ALIGN 4096
+#define BUNDLE_ETAG_SIZE 24
+
+/**
+ * @struct Bundle_header
+ * @brief Start of a bundle file.
+ */
+typedef struct {
+    char magic[8];      /**< BUNDLE_MAGIC. */
+    uint32_t count;     /**< Number of entries. */
+    uint32_t slots;     /**< Slots of the hash table, a power of two. */
+    uint64_t size;      /**< Size of the whole file. */
+} Bundle_header;
+
+/**
+ * @struct Bundle_entry
+ * @brief A file of the bundle.
+ */
+typedef struct {
+    uint64_t name;                  /**< Offset of the path in the names area. */
+    uint32_t name_length;           /**< Length of the path. */
+    uint32_t type;                  /**< File_type of the path, gives the Content-Type. */
+    uint64_t offset;                /**< Offset of the content in the file. */
+    uint64_t length;                /**< Length of the content. */
+    uint64_t gzip_offset;           /**< Offset of the gzip variant, 0 if there is none. */
+    uint64_t gzip_length;           /**< Length of the gzip variant. */
+    char etag[BUNDLE_ETAG_SIZE];    /**< Quoted ETag of the content, NUL terminated. */
+} Bundle_entry;
+
+/**
+ * @brief Hash of a path, used to place it in the table.
+ *
+ * @param path The path.
+ * @param length Length of path.
+ * @return The hash.
+ */
+uint32_t bundle_hash(const char *path, size_t length);
+
+/**
+ * @brief Maps a bundle and checks its header.
+ *
+ * @param path File of the bundle.
+ * @return 0 on success, -1 if it cannot be mapped or is not a bundle.
+ */
+int bundle_open(const char *path);
+
+/**
+ * @brief Tells whether a bundle is mapped.
+ *
+ * @return 1 if bundle_open succeeded, 0 otherwise.
+ */
+int bundle_loaded();
+
+/**
+ * @brief Looks a path up in the bundle.
+ *
+ * @param path Path of the request, relative to the document root.
+ * @param length Length of path.
+ * @return The entry, or NULL if the path is not in the bundle.
+ */
+const Bundle_entry *bundle_find(const char *path, size_t length);
+
+/**
+ * @brief Content of an entry.
+ *
+ * @param entry The entry.
+ * @param gzip Whether the gzip variant is wanted, ignored if there is none.
+ * @param length Set to the length of the content.
+ * @return Pointer to the content inside the mapping.
+ */
+const void *bundle_content(const Bundle_entry *entry, int gzip, size_t *length);
+
+/**
+ * @brief Unmaps the bundle.
+ */
+void bundle_close();
+
+#endif
@@ -0,0 +1,161 @@
+/**
+ * @file capture.c
+ * @brief Writer and reader of request capture files.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include "capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define CAPTURE_BUFFER (1 << 20)
+
+/* ---------------------- Global objects ---------------------- */
+FILE *capture_file = NULL;
+char *capture_buffer = NULL;
+int capture_bodies = 0;
+unsigned long capture_limit = 0;
+unsigned long capture_size = 0;
+unsigned long capture_start_us = 0;
+_Atomic uint32_t capture_connections = 0;
+pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Reads a clock in microseconds.
+ *
+ * @param clock The clock.
+ * @return The time in microseconds.
+ */
+unsigned long _clock_us(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (unsigned long)ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int capture_init(const char *path, int bodies, long max_mb) {
+    uint64_t start_ns;
+
+    if (path == NULL) {
+        return 0;
+    }
+
+    capture_file = fopen(path, "wb");
+    if (capture_file == NULL) {
+        perror("capture");
+        return -1;
+    }
+    // Records are written under a mutex, a large buffer keeps write() out of it
+    capture_buffer = (char*)malloc(CAPTURE_BUFFER);
+    if (capture_buffer != NULL) {
+        setvbuf(capture_file, capture_buffer, _IOFBF, CAPTURE_BUFFER);
+    }
+
+    capture_bodies = bodies;
+    capture_limit = max_mb > 0 ? (unsigned long)max_mb << 20 : 0;
+    capture_start_us = _clock_us(CLOCK_MONOTONIC);
+    start_ns = (uint64_t)_clock_us(CLOCK_REALTIME) * 1000;
+
+    fwrite(CAPTURE_MAGIC, 1, 8, capture_file);
+    fwrite(&start_ns, sizeof(start_ns), 1, capture_file);
+    capture_size = 8 + sizeof(start_ns);
+    return 0;
+}
+
+uint32_t capture_connection() {
+    return atomic_fetch_add(&capture_connections, 1);
+}
+
+void capture_request(uint32_t connection, const char *request, size_t length) {
+    Capture_record record;
+    const char *end;
+    size_t size;
+
+    if (capture_file == NULL) {
+        return;
+    }
+
+    end = memmem(request, length, "\r\n\r\n", 4);
+    record.offset_us = _clock_us(CLOCK_MONOTONIC) - capture_start_us;
+    record.connection = connection;
+    record.head_length = end != NULL ? (size_t)(end - request) + 4 : length;
+    record.body_length = length - record.head_length;
+    record.body_stored = capture_bodies ? record.body_length : 0;
+    size = sizeof(record) + record.head_length + record.body_stored;
+
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL && (capture_limit == 0 || capture_size + size <= capture_limit)) {
+        fwrite(&record, sizeof(record), 1, capture_file);
+        fwrite(request, 1, record.head_length + record.body_stored, capture_file);
+        capture_size += size;
+    }
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+void capture_close() {
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_file != NULL) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    free(capture_buffer);
+    capture_buffer = NULL;
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+FILE *capture_open(const char *path, uint64_t *start_ns) {
+    char magic[8];
+    uint64_t start;
+    FILE *file;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0 ||
+        fread(&start, sizeof(start), 1, file) != 1) {
+        fclose(file);
+        return NULL;
+    }
+    if (start_ns != NULL) {
+        *start_ns = start;
+    }
+    return file;
+}
+
+int capture_read(FILE *file, Capture_record *record, char **head, char **body) {
+    *head = NULL;
+    *body = NULL;
+
+    if (fread(record, sizeof(*record), 1, file) != 1) {
+        return feof(file) ? 0 : -1;
+    }
+    *head = (char*)malloc(record->head_length + 1);
+    if (*head == NULL || fread(*head, 1, record->head_length, file) != record->head_length) {
+        free(*head);
+        *head = NULL;
+        return -1;
+    }
+    (*head)[record->head_length] = '\0';
+
+    if (record->body_stored > 0) {
+        *body = (char*)malloc(record->body_stored);
+        if (*body == NULL || fread(*body, 1, record->body_stored, file) != record->body_stored) {
+            free(*head);
+            free(*body);
+            *head = *body = NULL;
+            return -1;
+        }
+    }
+    return 1;
+}
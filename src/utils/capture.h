@@ -0,0 +1,100 @@
+/**
+ * @file capture.h
+ * @brief Header file for capturing the request stream to a binary trace.
+ *
+ * The server can append every request it receives to a capture file so a
+ * real workload can be replayed later (bin/replay) or used as the corpus of
+ * the parser microbenchmarks (bin/bench -t). The file starts with a header
+ * and holds one record per request:
+ *
+ * ```
+ * header: "RSCAPT01" start_ns(u64)
+ * record: offset_us(u64) connection(u32) head_length(u32) body_length(u32)
+ *         body_stored(u32) head[head_length] body[body_stored]
+ * ```
+ *
+ * Integers are in host byte order. The offset is the arrival time relative
+ * to the start of the capture, the connection tells which requests shared a
+ * keep-alive connection and the head keeps the request line and headers
+ * verbatim. Bodies are only stored when asked for, otherwise just their size.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPTURE_MAGIC "RSCAPT01"
+
+/**
+ * @struct Capture_record
+ * @brief Fixed part of a captured request.
+ */
+typedef struct {
+    uint64_t offset_us;     /**< Arrival time since the start of the capture. */
+    uint32_t connection;    /**< Connection the request arrived on. */
+    uint32_t head_length;   /**< Length of the request line and headers. */
+    uint32_t body_length;   /**< Length of the body as received. */
+    uint32_t body_stored;   /**< Body bytes stored after the head, 0 or body_length. */
+} Capture_record;
+
+/**
+ * @brief Opens the capture file.
+ *
+ * @param path File of the capture, NULL to disable capturing.
+ * @param bodies Whether to store the bodies of the requests.
+ * @param max_mb Capturing stops once the file reaches this size, 0 for no limit.
+ * @return 0 on success, -1 if the file cannot be opened.
+ */
+int capture_init(const char *path, int bodies, long max_mb);
+
+/**
+ * @brief Identifier of a new connection for the capture.
+ *
+ * @return The identifier.
+ */
+uint32_t capture_connection();
+
+/**
+ * @brief Appends a received request to the capture.
+ *
+ * Does nothing if capturing is disabled or the size limit was reached.
+ *
+ * @param connection Identifier returned by capture_connection.
+ * @param request The request as received, head and body.
+ * @param length Length of the request.
+ */
+void capture_request(uint32_t connection, const char *request, size_t length);
+
+/**
+ * @brief Flushes and closes the capture file.
+ */
+void capture_close();
+
+/**
+ * @brief Opens a capture file for reading.
+ *
+ * @param path File of the capture.
+ * @param start_ns Set to the CLOCK_REALTIME start of the capture, may be NULL.
+ * @return The file positioned at the first record, NULL if it cannot be
+ *         opened or is not a capture.
+ */
+FILE *capture_open(const char *path, uint64_t *start_ns);
+
+/**
+ * @brief Reads the next record of a capture.
+ *
+ * @param file File returned by capture_open.
+ * @param record Filled with the fixed part of the record.
+ * @param head Set to the NUL-terminated head, must be freed by the caller.
+ * @param body Set to the stored body or NULL, must be freed by the caller.
+ * @return 1 if a record was read, 0 at the end of the file, -1 if it is truncated.
+ */
+int capture_read(FILE *file, Capture_record *record, char **head, char **body);
+
+#endif
@@ -11,30 +11,56 @@
 
 #include "conf_parser.h"
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 
 /* ---------------------- Private Functions ---------------------- */
 /**
- * @brief Frees the memory allocated for an Elem structure.
+ * @brief Computes the FNV-1a hash of a string.
  *
- * @param elem Pointer to the Elem structure to be freed.
+ * @param str Pointer to the string to hash.
+ * @return The 32-bit hash of the string.
  */
-void _free_elem(Elem *elem) {
-    if (elem != NULL) {
-        if (elem->key != NULL) {
-            free(elem->key);
-        }
-        if (elem->value != NULL) {
-            free(elem->value);
+unsigned int _hash(const char *str) {
+    unsigned int hash = 2166136261u;
+
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Finds the bucket of a key in a Dict structure.
+ *
+ * Probes linearly from the home bucket of the hash until the key or an
+ * empty bucket is found.
+ *
+ * @param dict Pointer to the Dict structure.
+ * @param key Pointer to the key string.
+ * @param hash Hash of the key.
+ * @return Pointer to the bucket holding the key, or to the empty bucket
+ *         where it would be inserted.
+ */
+Elem *_find_bucket(Dict *dict, const char *key, unsigned int hash) {
+    unsigned int mask = dict->capacity - 1;
+    unsigned int i = hash & mask;
+
+    while (dict->dict[i].key != NULL) {
+        if (dict->dict[i].hash == hash && strcmp(dict->dict[i].key, key) == 0) {
+            return &dict->dict[i];
         }
-        free(elem);
+        i = (i + 1) & mask;
     }
-    return;
+    return &dict->dict[i];
 }
 
 /**
  * @brief Initializes a new Dict structure.
  *
- * Allocates memory for a Dict structure and initializes its fields.
+ * Allocates memory for a Dict structure and an empty table of
+ * DICT_MIN_CAPACITY buckets.
  *
  * @return Pointer to the initialized Dict structure, or NULL on failure.
  */
@@ -46,16 +72,52 @@ Dict *_init_dict() {
         return NULL;
     }
 
-    dict->dict = NULL;
+    dict->dict = (Elem*)calloc(DICT_MIN_CAPACITY, sizeof(Elem));
+    if (dict->dict == NULL) {
+        free(dict);
+        return NULL;
+    }
+    dict->capacity = DICT_MIN_CAPACITY;
     dict->size = 0;
 
     return dict;
 }
 
+/**
+ * @brief Doubles the capacity of a Dict structure.
+ *
+ * Rehashes every entry into a new table. The keys and values are moved,
+ * not copied.
+ *
+ * @param dict Pointer to the Dict structure.
+ * @return 0 on success, -1 on failure (the dictionary is left untouched).
+ */
+int _grow_dict(Dict *dict) {
+    Elem *old = dict->dict;
+    int old_capacity = dict->capacity;
+    int i;
+
+    dict->dict = (Elem*)calloc(old_capacity * 2, sizeof(Elem));
+    if (dict->dict == NULL) {
+        dict->dict = old;
+        return -1;
+    }
+    dict->capacity = old_capacity * 2;
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old[i].key != NULL) {
+            *_find_bucket(dict, old[i].key, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
 /**
  * @brief Adds a key-value pair to a Dict structure.
  *
- * Allocates memory for a new entry and appends it to the dictionary.
+ * Inserts a copy of the key and value, replacing the value if the key is
+ * already present.
  *
  * @param dict Pointer to the Dict structure.
  * @param key Pointer to the key string.
@@ -63,24 +125,42 @@ Dict *_init_dict() {
  * @return Pointer to the updated Dict structure, or NULL on failure.
  */
 Dict *_add_entry(Dict *dict, char *key, char *value) {
+    unsigned int hash;
+    Elem *elem;
+    char *copy;
+
     if (dict == NULL) {
         return NULL;
     }
 
-    dict->dict = (Elem**)realloc(dict->dict, (dict->size + 1) * sizeof(Elem*));
-    if (dict->dict == NULL) {
+    if ((dict->size + 1) * 4 > dict->capacity * 3 && _grow_dict(dict) != 0) {
         free_dict(dict);
         return NULL;
     }
 
-    dict->dict[dict->size] = (Elem*)malloc(sizeof(Elem));
-    if (dict->dict[dict->size] == NULL) {
+    hash = _hash(key);
+    elem = _find_bucket(dict, key, hash);
+
+    copy = strdup(value);
+    if (copy == NULL) {
         free_dict(dict);
         return NULL;
     }
 
-    dict->dict[dict->size]->key = strdup(key);
-    dict->dict[dict->size]->value = strdup(value);
+    if (elem->key != NULL) {
+        free(elem->value);
+        elem->value = copy;
+        return dict;
+    }
+
+    elem->key = strdup(key);
+    if (elem->key == NULL) {
+        free(copy);
+        free_dict(dict);
+        return NULL;
+    }
+    elem->value = copy;
+    elem->hash = hash;
 
     dict->size++;
 
@@ -129,8 +209,10 @@ void free_dict(Dict *dict) {
 
     if (dict != NULL) {
         if (dict->dict != NULL) { 
-            for (i = 0; i < dict->size; i++)
-                _free_elem(dict->dict[i]);
+            for (i = 0; i < dict->capacity; i++) {
+                free(dict->dict[i].key);
+                free(dict->dict[i].value);
+            }
             free(dict->dict);
         }
         free(dict);
@@ -141,12 +223,7 @@ void free_dict(Dict *dict) {
 }
 
 char *get_value(Dict *dict, char *key) {
-    int i;
-    for (i = 0; i < dict->size; i++) {
-        if (strcmp(dict->dict[i]->key, key) == 0)
-            return dict->dict[i]->value;
-    }
-    return NULL;
+    return _find_bucket(dict, key, _hash(key))->value;
 }
 
 Dict *conf_parse(char *filename) {
@@ -191,3 +268,48 @@ Dict *conf_parse(char *filename) {
     return dict;
 }
 
+int conf_get_long(Dict *dict, char *key, long def, long *value) {
+    char *text = get_value(dict, key), *end;
+    long number;
+
+    if (text == NULL) {
+        *value = def;
+        return 0;
+    }
+    errno = 0;
+    number = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE) {
+        printf("Valor invalido para %s: %s\n", key, text);
+        return -1;
+    }
+    *value = number;
+    return 0;
+}
+
+int conf_get_int(Dict *dict, char *key, int def, int *value) {
+    long number;
+
+    if (conf_get_long(dict, key, def, &number) != 0) {
+        return -1;
+    }
+    if (number < INT_MIN || number > INT_MAX) {
+        printf("Valor invalido para %s: %s\n", key, get_value(dict, key));
+        return -1;
+    }
+    *value = (int)number;
+    return 0;
+}
+
+int conf_get_string(Dict *dict, char *key, const char *def, char **value) {
+    const char *text = get_value(dict, key);
+
+    if (text == NULL) {
+        text = def;
+    }
+    *value = NULL;
+    if (text == NULL) {
+        return 0;
+    }
+    *value = strdup(text);
+    return *value != NULL ? 0 : -1;
+}
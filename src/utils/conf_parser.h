@@ -11,6 +11,10 @@
  * an '=' character. Lines starting with '#' or empty lines are ignored during
  * parsing.
  *
+ * The dictionary is only meant for startup: each module compiles its own
+ * keys into typed options with the getters below (see server_config.h), so
+ * the request path never does string-keyed lookups.
+ *
  * @author Miguel Paterson & Mijaíl Sazhín
  * @date 03-2025
  */
@@ -22,6 +26,7 @@
 
 #define MAX_LINE 2048
 #define MAX_ELEMS 20
+#define DICT_MIN_CAPACITY 32
 
 /**
  * @brief Represents a key-value pair element.
@@ -30,19 +35,22 @@
  * where both the key and value are strings.
  */
 typedef struct{
-    char *key;   /**< Pointer to the key string. */
-    char *value; /**< Pointer to the value string. */
+    char *key;         /**< Pointer to the key string, NULL if the bucket is empty. */
+    char *value;       /**< Pointer to the value string. */
+    unsigned int hash; /**< Cached hash of the key. */
 } Elem;
 
 /**
  * @brief Represents a dictionary of key-value pairs.
  * 
- * This structure is used to store a collection of key-value pairs
- * as an array of pointers to `Elem` structures.
+ * This structure is an open-addressing hash table with linear probing.
+ * The capacity is always a power of two and the table is grown before it
+ * is more than 3/4 full.
  */
 typedef struct{
-    Elem **dict; /**< Array of pointers to `Elem` structures. */
-    int size;    /**< Number of elements in the dictionary. */
+    Elem *dict;   /**< Array of `capacity` buckets. */
+    int capacity; /**< Number of buckets in the table. */
+    int size;     /**< Number of elements in the dictionary. */
 } Dict;
 
 /**
@@ -55,7 +63,7 @@ void free_dict(Dict *dict);
 /**
  * @brief Retrieves the value associated with a key in a Dict structure.
  *
- * Searches the dictionary for the specified key and returns the corresponding value.
+ * Hashes the key and probes the table for it.
  *
  * @param dict Pointer to the Dict structure.
  * @param key Pointer to the key string.
@@ -68,10 +76,42 @@ char *get_value(Dict *dict, char *key);
  *
  * Reads a configuration file line by line, extracting key-value pairs and storing
  * them in a dictionary. Lines starting with '#' or empty lines are ignored.
+ * When a key appears more than once the last value wins.
  *
  * @param filename Pointer to the name of the configuration file.
  * @return Pointer to the populated Dict structure, or NULL on failure.
  */
 Dict *conf_parse(char *filename);
 
+/**
+ * @brief Reads an integer setting.
+ *
+ * The whole value must be a decimal number, "80x" or "abc" are rejected.
+ *
+ * @param dict Pointer to the Dict structure.
+ * @param key Pointer to the key string.
+ * @param def Value used when the key is missing.
+ * @param value Set to the setting, or def.
+ * @return 0 on success, -1 if the value is not a number (it is printed).
+ */
+int conf_get_long(Dict *dict, char *key, long def, long *value);
+
+/**
+ * @brief Reads an integer setting that must fit in an int.
+ *
+ * @see conf_get_long
+ */
+int conf_get_int(Dict *dict, char *key, int def, int *value);
+
+/**
+ * @brief Copies a string setting.
+ *
+ * @param dict Pointer to the Dict structure.
+ * @param key Pointer to the key string.
+ * @param def Value used when the key is missing, may be NULL.
+ * @param value Set to a copy allocated with malloc, NULL if there is no value.
+ * @return 0 on success, -1 if memory ran out.
+ */
+int conf_get_string(Dict *dict, char *key, const char *def, char **value);
+
 #endif
\ No newline at end of file
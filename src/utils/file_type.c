@@ -0,0 +1,45 @@
+/**
+ * @file file_type.c
+ * @brief Type of a file by its extension.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "file_type.h"
+#include <string.h>
+
+/* ---------------------- Public Functions ---------------------- */
+File_type get_file_type(const char *filename){
+    const char *ext;
+
+    ext = strrchr(filename, '.');
+    if (ext == NULL){
+        return UNKNOWN;
+    }
+    if (strcmp(ext, ".html") == 0){
+        return HTML;
+    }
+    else if (strcmp(ext, ".txt") == 0){
+        return TEXT;
+    }
+    else if (strcmp(ext, ".gif") == 0){
+        return GIF;
+    }
+    else if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0 || strcmp(ext, ".ico") == 0){
+        return JPG;
+    }
+    else if (strcmp(ext, ".mpeg") == 0){
+        return MPEG;
+    }
+    else if (strcmp(ext, ".py") == 0){
+        return PYTHON;
+    }
+    else if (strcmp(ext, ".php") == 0){
+        return PHP;
+    }
+    else if (strcmp(ext, ".mp4") == 0){
+        return MP4;
+    }
+    return UNKNOWN;
+}
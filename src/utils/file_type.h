@@ -0,0 +1,47 @@
+/**
+ * @file file_type.h
+ * @brief Header file for the types of the files the server sends.
+ *
+ * The type of a file comes from its extension and gives its Content-Type.
+ * It is kept apart from utils.h so the packer, which stores the type of
+ * each file in the bundle, uses the same mapping as the server without
+ * linking the request handling code.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef FILE_TYPE_H
+#define FILE_TYPE_H
+
+/**
+ * @enum File_type
+ * @brief Enumeration of supported file types.
+ *
+ * This enum defines various file types that can be used to identify
+ * the type of a file based on its extension or content.
+ */
+typedef enum {
+    JPG,        /**< JPEG image file */
+    HTML,       /**< HTML file */
+    TEXT,       /**< Plain text file */
+    BINARY,     /**< Binary file */
+    GIF,        /**< GIF image file */
+    MPEG,       /**< MPEG video file */
+    PHP,        /**< PHP script file */
+    PYTHON,     /**< Python script file */
+    UNKNOWN,    /**< Unknown file type */
+    MP4,        /**< MP4 video file */
+    METRICS,    /**< Internal metrics endpoint */
+    PROXY       /**< Forwarded to an upstream backend */
+} File_type;
+
+/**
+ * @brief Determines the type of a file based on its name or content.
+ *
+ * @param filename The name of the file to analyze.
+ * @return The file type (from the File_type enum).
+ */
+File_type get_file_type(const char *filename);
+
+#endif
@@ -0,0 +1,168 @@
+/**
+ * @file flight.c
+ * @brief Table of the resources being produced, shared by the requests waiting for them.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "flight.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * @struct Flight
+ * @brief Work on a resource and the requests waiting for it.
+ */
+struct Flight {
+    char *key;              /**< Canonical name of the resource. */
+    uint64_t hash;          /**< Hash of key. */
+    int refs;               /**< Leader and followers holding the flight. */
+    int done;               /**< Set once the leader landed. */
+    void *result;           /**< Result of the leader, malloc, freed with the flight. */
+    size_t length;          /**< Length of result. */
+    int error;              /**< errno of the leader if it failed. */
+    pthread_cond_t cond;    /**< Signalled when the leader lands. */
+    struct Flight *next;    /**< Next flight of the bucket. */
+};
+
+/**
+ * @struct Flight_bucket
+ * @brief Flights whose keys share a hash, protected by their own lock.
+ */
+typedef struct {
+    pthread_mutex_t mutex;  /**< Protects the bucket and its flights. */
+    Flight *head;           /**< Flights in the air. */
+} Flight_bucket;
+
+/* ---------------------- Global objects ---------------------- */
+Flight_bucket flight_buckets[FLIGHT_BUCKETS];
+pthread_once_t flight_once = PTHREAD_ONCE_INIT;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Initializes the locks of the buckets.
+ */
+void _flight_init() {
+    int i;
+
+    for (i = 0; i < FLIGHT_BUCKETS; i++) {
+        pthread_mutex_init(&flight_buckets[i].mutex, NULL);
+        flight_buckets[i].head = NULL;
+    }
+}
+
+/**
+ * @brief FNV-1a hash of a key.
+ *
+ * @param key The key.
+ * @return The hash.
+ */
+uint64_t _flight_hash(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Bucket of a flight.
+ */
+Flight_bucket *_flight_bucket(uint64_t hash) {
+    return &flight_buckets[hash % FLIGHT_BUCKETS];
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+Flight *flight_join(const char *key, int *leader) {
+    Flight_bucket *bucket;
+    Flight *flight;
+    uint64_t hash;
+
+    pthread_once(&flight_once, _flight_init);
+    hash = _flight_hash(key);
+    bucket = _flight_bucket(hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+    for (flight = bucket->head; flight != NULL; flight = flight->next) {
+        if (flight->hash == hash && strcmp(flight->key, key) == 0) {
+            flight->refs++;
+            pthread_mutex_unlock(&bucket->mutex);
+            metrics_coalesced();
+            *leader = 0;
+            return flight;
+        }
+    }
+
+    flight = (Flight*)calloc(1, sizeof(Flight));
+    if (flight == NULL || (flight->key = strdup(key)) == NULL) {
+        pthread_mutex_unlock(&bucket->mutex);
+        free(flight);
+        return NULL;
+    }
+    flight->hash = hash;
+    flight->refs = 1;
+    pthread_cond_init(&flight->cond, NULL);
+    flight->next = bucket->head;
+    bucket->head = flight;
+    pthread_mutex_unlock(&bucket->mutex);
+
+    *leader = 1;
+    return flight;
+}
+
+const void *flight_wait(Flight *flight, size_t *length, int *error) {
+    Flight_bucket *bucket = _flight_bucket(flight->hash);
+
+    pthread_mutex_lock(&bucket->mutex);
+    while (!flight->done) {
+        pthread_cond_wait(&flight->cond, &bucket->mutex);
+    }
+    pthread_mutex_unlock(&bucket->mutex);
+
+    // Nothing changes once done is set, the result is read without the lock
+    *length = flight->length;
+    *error = flight->error;
+    return flight->result;
+}
+
+void flight_land(Flight *flight, void *result, size_t length, int error) {
+    Flight_bucket *bucket = _flight_bucket(flight->hash);
+    Flight **link;
+
+    // Out of the table, a request that arrives now starts a new flight
+    pthread_mutex_lock(&bucket->mutex);
+    for (link = &bucket->head; *link != flight; link = &(*link)->next);
+    *link = flight->next;
+    flight->result = result;
+    flight->length = result != NULL ? length : 0;
+    flight->error = error;
+    flight->done = 1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+void flight_leave(Flight *flight) {
+    Flight_bucket *bucket = _flight_bucket(flight->hash);
+    int refs;
+
+    pthread_mutex_lock(&bucket->mutex);
+    refs = --flight->refs;
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (refs == 0) {
+        pthread_cond_destroy(&flight->cond);
+        free(flight->result);
+        free(flight->key);
+        free(flight);
+    }
+}
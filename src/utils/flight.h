@@ -0,0 +1,68 @@
+/**
+ * @file flight.h
+ * @brief Header file for coalescing concurrent work on the same resource.
+ *
+ * When a file stops being cached or a popular script is asked for by many
+ * clients at once, each request used to read the file or fork the
+ * interpreter on its own. Requests now join the flight of their key: the
+ * first one (the leader) does the work and the others wait for it and use
+ * its result. The result is not copied, it belongs to the flight and is
+ * freed when the last request leaves it. The flight ends with the leader, a
+ * request that arrives later starts a new one, so nothing is cached.
+ *
+ * Only threads that may block join flights, see io_may_wait.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stddef.h>
+
+#define FLIGHT_BUCKETS 64
+
+typedef struct Flight Flight;
+
+/**
+ * @brief Joins the flight of a key, starting it if there is none.
+ *
+ * @param key Canonical name of the resource.
+ * @param leader Set to 1 if the caller must do the work, 0 if it must wait.
+ * @return The flight, or NULL if memory ran out (the caller works alone).
+ */
+Flight *flight_join(const char *key, int *leader);
+
+/**
+ * @brief Waits for the leader of a flight.
+ *
+ * @param flight The flight, joined as a follower.
+ * @param length Set to the length of the result.
+ * @param error Set to the errno of the leader if it failed.
+ * @return The result, valid until flight_leave, or NULL if the leader
+ *         failed.
+ */
+const void *flight_wait(Flight *flight, size_t *length, int *error);
+
+/**
+ * @brief Publishes the result of the leader and ends the flight.
+ *
+ * The flight takes the result, the leader may keep using it until its own
+ * flight_leave.
+ *
+ * @param flight The flight, joined as the leader.
+ * @param result The result, allocated with malloc, NULL if the work failed.
+ * @param length Length of result.
+ * @param error errno of the failure.
+ */
+void flight_land(Flight *flight, void *result, size_t length, int error);
+
+/**
+ * @brief Drops the reference of the caller, the last one frees the flight.
+ *
+ * @param flight The flight.
+ */
+void flight_leave(Flight *flight);
+
+#endif
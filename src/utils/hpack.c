@@ -0,0 +1,500 @@
+/**
+ * @file hpack.c
+ * @brief HPACK decoder with Huffman support and a minimal encoder.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "hpack.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define HPACK_STATIC_ENTRIES 61
+#define HUFFMAN_EOS 256
+
+/**
+ * @struct Hpack_static
+ * @brief An entry of the static table.
+ */
+typedef struct {
+    const char *name;
+    const char *value;
+} Hpack_static;
+
+/* ---------------------- Global objects ---------------------- */
+const Hpack_static hpack_static_table[HPACK_STATIC_ENTRIES] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+
+// Codes of RFC 7541 Appendix B, most significant bit first
+const uint32_t huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+const uint8_t huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+/*
+ * Decoding tree built from the codes: internal nodes are indexes, leaves are
+ * stored as -(symbol + 1).
+ */
+short huffman_tree[HUFFMAN_EOS][2];
+pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Inserts a code into the decoding tree.
+ *
+ * @param nodes Number of nodes already used, updated.
+ * @param symbol The symbol.
+ * @param code The code.
+ * @param length Length of the code in bits.
+ */
+void _huffman_insert(int *nodes, int symbol, uint32_t code, int length) {
+    int node = 0, bit, i;
+
+    for (i = length - 1; i > 0; i--) {
+        bit = (code >> i) & 1;
+        if (huffman_tree[node][bit] == 0) {
+            huffman_tree[node][bit] = (*nodes)++;
+        }
+        node = huffman_tree[node][bit];
+    }
+    huffman_tree[node][code & 1] = -(symbol + 1);
+}
+
+/**
+ * @brief Builds the decoding tree, once per process.
+ */
+void _huffman_build() {
+    int nodes = 1, symbol;
+
+    for (symbol = 0; symbol < 256; symbol++) {
+        _huffman_insert(&nodes, symbol, huffman_codes[symbol], huffman_lengths[symbol]);
+    }
+    _huffman_insert(&nodes, HUFFMAN_EOS, 0x3fffffff, 30);
+}
+
+/**
+ * @brief Decodes a Huffman-coded string.
+ *
+ * @param in The coded string.
+ * @param length Length of the coded string.
+ * @param out Where the string is written, at least length * 8 / 5 bytes.
+ * @return Length of the string, -1 if it is malformed.
+ */
+long _huffman_decode(const uint8_t *in, size_t length, char *out) {
+    int node = 0, bit, depth = 0, ones = 1, i;
+    long written = 0;
+    size_t n;
+
+    for (n = 0; n < length; n++) {
+        for (i = 7; i >= 0; i--) {
+            bit = (in[n] >> i) & 1;
+            node = huffman_tree[node][bit];
+            depth++;
+            ones &= bit;
+            if (node < 0) {
+                if (node == -(HUFFMAN_EOS + 1)) {
+                    return -1;
+                }
+                out[written++] = (char)(-node - 1);
+                node = 0;
+                depth = 0;
+                ones = 1;
+            } else if (node == 0) {
+                return -1;
+            }
+        }
+    }
+    // Padding is the most significant bits of EOS: at most 7 bits, all ones
+    if (depth > 7 || !ones) {
+        return -1;
+    }
+    return written;
+}
+
+/**
+ * @brief Decodes an integer with an N-bit prefix.
+ *
+ * @param block Start of the block.
+ * @param length Length of the block.
+ * @param position Position of the first byte, moved past the integer.
+ * @param prefix Bits of the prefix.
+ * @param value Set to the integer.
+ * @return 0 on success, -1 if it is truncated or too big.
+ */
+int _decode_integer(const uint8_t *block, size_t length, size_t *position, int prefix, size_t *value) {
+    size_t mask = (1 << prefix) - 1;
+    int shift = 0;
+    uint8_t byte;
+
+    if (*position >= length) {
+        return -1;
+    }
+    *value = block[(*position)++] & mask;
+    if (*value < mask) {
+        return 0;
+    }
+    do {
+        if (*position >= length || shift > 21) {
+            return -1;
+        }
+        byte = block[(*position)++];
+        *value += (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return 0;
+}
+
+/**
+ * @brief Decodes a string literal.
+ *
+ * @param block Start of the block.
+ * @param length Length of the block.
+ * @param position Position of the literal, moved past it.
+ * @param scratch Room for Huffman-coded strings, moved past the decoded string.
+ * @param string Set to the string.
+ * @param string_length Set to the length of the string.
+ * @return 0 on success, -1 if the literal is malformed.
+ */
+int _decode_string(const uint8_t *block, size_t length, size_t *position, char **scratch,
+    const char **string, size_t *string_length) {
+    int huffman;
+    size_t coded;
+    long decoded;
+
+    if (*position >= length) {
+        return -1;
+    }
+    huffman = block[*position] & 0x80;
+    if (_decode_integer(block, length, position, 7, &coded) != 0 || coded > length - *position) {
+        return -1;
+    }
+    if (!huffman) {
+        *string = (const char *)block + *position;
+        *string_length = coded;
+    } else {
+        decoded = _huffman_decode(block + *position, coded, *scratch);
+        if (decoded < 0) {
+            return -1;
+        }
+        *string = *scratch;
+        *string_length = decoded;
+        *scratch += decoded;
+    }
+    *position += coded;
+    return 0;
+}
+
+/**
+ * @brief Removes the oldest entry of the dynamic table.
+ *
+ * @param table The table.
+ */
+void _evict(Hpack_table *table) {
+    Hpack_entry *entry = &table->entries[(table->first + table->count - 1) % HPACK_MAX_ENTRIES];
+
+    table->size -= entry->name_length + entry->value_length + HPACK_ENTRY_OVERHEAD;
+    free(entry->name);
+    entry->name = NULL;
+    table->count--;
+}
+
+/**
+ * @brief Adds an entry to the dynamic table, evicting the oldest ones.
+ *
+ * @param table The table.
+ * @param name Name of the header.
+ * @param name_length Length of name.
+ * @param value Value of the header.
+ * @param value_length Length of value.
+ * @return The new entry, NULL if it is bigger than the table or memory allocation fails.
+ */
+Hpack_entry *_insert(Hpack_table *table, const char *name, size_t name_length,
+    const char *value, size_t value_length) {
+    size_t size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+    Hpack_entry *entry;
+    char *copy;
+
+    // The name may point into an entry about to be evicted
+    copy = (char*)malloc(name_length + value_length + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, name, name_length);
+    memcpy(copy + name_length, value, value_length);
+
+    while (table->count > 0 && table->size + size > table->max_size) {
+        _evict(table);
+    }
+    if (size > table->max_size) {
+        free(copy);
+        return NULL;
+    }
+
+    table->first = (table->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    entry = &table->entries[table->first];
+    entry->name = copy;
+    entry->name_length = name_length;
+    entry->value = copy + name_length;
+    entry->value_length = value_length;
+    table->count++;
+    table->size += size;
+    return entry;
+}
+
+/**
+ * @brief Looks up an index of the static or the dynamic table.
+ *
+ * @param table The dynamic table.
+ * @param index The index, starting at 1.
+ * @param name Set to the name.
+ * @param name_length Set to the length of the name.
+ * @param value Set to the value.
+ * @param value_length Set to the length of the value.
+ * @return 0 on success, -1 if the index does not exist.
+ */
+int _lookup(Hpack_table *table, size_t index, const char **name, size_t *name_length,
+    const char **value, size_t *value_length) {
+    Hpack_entry *entry;
+
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        *name = hpack_static_table[index - 1].name;
+        *name_length = strlen(*name);
+        *value = hpack_static_table[index - 1].value;
+        *value_length = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (size_t)table->count) {
+        return -1;
+    }
+    entry = &table->entries[(table->first + index) % HPACK_MAX_ENTRIES];
+    *name = entry->name;
+    *name_length = entry->name_length;
+    *value = entry->value;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+/**
+ * @brief Encodes an integer with an N-bit prefix.
+ *
+ * @param out Where the integer is written.
+ * @param size Room left in out.
+ * @param prefix Bits of the prefix.
+ * @param flags Bits of the first byte above the prefix.
+ * @param value The integer.
+ * @return Bytes written, 0 if they do not fit.
+ */
+size_t _encode_integer(uint8_t *out, size_t size, int prefix, uint8_t flags, size_t value) {
+    size_t mask = (1 << prefix) - 1, n = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (value < mask) {
+        out[n++] = flags | value;
+        return n;
+    }
+    out[n++] = flags | mask;
+    value -= mask;
+    while (value >= 0x80) {
+        if (n == size) {
+            return 0;
+        }
+        out[n++] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    if (n == size) {
+        return 0;
+    }
+    out[n++] = value;
+    return n;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+void hpack_table_init(Hpack_table *table) {
+    memset(table, 0, sizeof(Hpack_table));
+    table->max_size = HPACK_TABLE_SIZE;
+    pthread_once(&huffman_once, _huffman_build);
+}
+
+void hpack_table_free(Hpack_table *table) {
+    while (table->count > 0) {
+        _evict(table);
+    }
+}
+
+int hpack_decode(Hpack_table *table, const uint8_t *block, size_t length, Hpack_emit emit, void *context) {
+    const char *name, *value;
+    size_t position = 0, index, name_length, value_length;
+    char *scratch, *free_scratch;
+    Hpack_entry *entry;
+    uint8_t first;
+    int indexing, status = 0;
+
+    // Huffman codes are at least 5 bits long, no string grows more than 8/5
+    scratch = (char*)malloc(length * 8 / 5 + 1);
+    if (scratch == NULL) {
+        return -1;
+    }
+    free_scratch = scratch;
+
+    while (position < length && status == 0) {
+        first = block[position];
+        if (first & 0x80) {
+            status = _decode_integer(block, length, &position, 7, &index);
+            if (status == 0) {
+                status = _lookup(table, index, &name, &name_length, &value, &value_length);
+            }
+            if (status == 0) {
+                emit(context, name, name_length, value, value_length);
+            }
+            continue;
+        }
+        if ((first & 0xe0) == 0x20) {
+            status = _decode_integer(block, length, &position, 5, &index);
+            if (status == 0 && index > HPACK_TABLE_SIZE) {
+                status = -1;
+            }
+            if (status == 0) {
+                table->max_size = index;
+                while (table->count > 0 && table->size > table->max_size) {
+                    _evict(table);
+                }
+            }
+            continue;
+        }
+
+        indexing = (first & 0xc0) == 0x40;
+        status = _decode_integer(block, length, &position, indexing ? 6 : 4, &index);
+        if (status == 0 && index > 0) {
+            status = _lookup(table, index, &name, &name_length, &value, &value_length);
+        } else if (status == 0) {
+            status = _decode_string(block, length, &position, &scratch, &name, &name_length);
+        }
+        if (status == 0) {
+            status = _decode_string(block, length, &position, &scratch, &value, &value_length);
+        }
+        if (status != 0) {
+            continue;
+        }
+        if (indexing && (entry = _insert(table, name, name_length, value, value_length)) != NULL) {
+            emit(context, entry->name, entry->name_length, entry->value, entry->value_length);
+        } else {
+            emit(context, name, name_length, value, value_length);
+        }
+    }
+
+    free(free_scratch);
+    return status;
+}
+
+size_t hpack_encode(uint8_t *out, size_t size, const char *name, const char *value, size_t value_length) {
+    size_t name_length = strlen(name), n, written;
+    int index = 0, i;
+
+    for (i = 0; i < HPACK_STATIC_ENTRIES; i++) {
+        if (strcmp(hpack_static_table[i].name, name) == 0) {
+            if (strlen(hpack_static_table[i].value) == value_length &&
+                memcmp(hpack_static_table[i].value, value, value_length) == 0) {
+                return _encode_integer(out, size, 7, 0x80, i + 1);
+            }
+            if (index == 0) {
+                index = i + 1;
+            }
+        }
+    }
+
+    n = _encode_integer(out, size, 4, 0x00, index);
+    if (n == 0) {
+        return 0;
+    }
+    if (index == 0) {
+        written = _encode_integer(out + n, size - n, 7, 0x00, name_length);
+        if (written == 0 || n + written + name_length > size) {
+            return 0;
+        }
+        n += written;
+        memcpy(out + n, name, name_length);
+        n += name_length;
+    }
+    written = _encode_integer(out + n, size - n, 7, 0x00, value_length);
+    if (written == 0 || n + written + value_length > size) {
+        return 0;
+    }
+    n += written;
+    memcpy(out + n, value, value_length);
+    return n + value_length;
+}
@@ -0,0 +1,93 @@
+/**
+ * @file hpack.h
+ * @brief Header file for HPACK, the header compression of HTTP/2 (RFC 7541).
+ *
+ * The decoder keeps the dynamic table of a connection and understands every
+ * representation, including Huffman-coded strings. The encoder only emits
+ * literals without indexing, naming static table entries when it can, which
+ * is enough for the few headers of a response and keeps it stateless.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+/**
+ * @struct Hpack_entry
+ * @brief An entry of the dynamic table.
+ */
+typedef struct {
+    char *name;             /**< Name, followed by the value in the same allocation. */
+    char *value;            /**< Value. */
+    size_t name_length;     /**< Length of name. */
+    size_t value_length;    /**< Length of value. */
+} Hpack_entry;
+
+/**
+ * @struct Hpack_table
+ * @brief Dynamic table of a decoder, a ring with the newest entry first.
+ */
+typedef struct {
+    Hpack_entry entries[HPACK_MAX_ENTRIES]; /**< Ring of entries. */
+    int first;              /**< Slot of the newest entry. */
+    int count;              /**< Number of entries. */
+    size_t size;            /**< Size of the entries as defined by HPACK. */
+    size_t max_size;        /**< Current limit, set by the encoder. */
+} Hpack_table;
+
+/**
+ * @brief Receives a decoded header.
+ *
+ * The strings are not NUL-terminated and are only valid during the call.
+ */
+typedef void (*Hpack_emit)(void *context, const char *name, size_t name_length,
+    const char *value, size_t value_length);
+
+/**
+ * @brief Prepares an empty dynamic table.
+ *
+ * @param table The table.
+ */
+void hpack_table_init(Hpack_table *table);
+
+/**
+ * @brief Frees the entries of a dynamic table.
+ *
+ * @param table The table.
+ */
+void hpack_table_free(Hpack_table *table);
+
+/**
+ * @brief Decodes a complete header block.
+ *
+ * @param table Dynamic table of the connection.
+ * @param block The header block.
+ * @param length Length of the block.
+ * @param emit Called for every header, in order.
+ * @param context Passed to emit.
+ * @return 0 on success, -1 if the block is malformed (a connection error).
+ */
+int hpack_decode(Hpack_table *table, const uint8_t *block, size_t length, Hpack_emit emit, void *context);
+
+/**
+ * @brief Encodes a header as a literal without indexing.
+ *
+ * @param out Where the representation is written.
+ * @param size Room left in out.
+ * @param name Name of the header, in lower case.
+ * @param value Value of the header.
+ * @param value_length Length of value.
+ * @return Bytes written, 0 if they do not fit.
+ */
+size_t hpack_encode(uint8_t *out, size_t size, const char *name, const char *value, size_t value_length);
+
+#endif
@@ -10,10 +10,20 @@
  * @date 03-2025
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "http_parser.h"
+#include "log.h"
+#include "trace.h"
+#include "metrics.h"
+#include "io_pool.h"
+#include "miss_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <strings.h>
 
 /* ---------------------- Private Functions ---------------------- */
 /**
@@ -22,48 +32,172 @@
  * Allocates memory for a new Parser structure and its fields, and initializes
  * its members to default values.
  *
+ * @param arena Arena to allocate from, NULL to use malloc.
  * @return Pointer to the newly allocated Parser structure, or NULL if memory
  *         allocation fails.
  */
-Parser *_init_parser() {
+Parser *_init_parser(Arena *arena) {
     Parser *parser;
-    parser = (Parser*) malloc(sizeof(Parser));
+    parser = (Parser*) arena_alloc(arena, sizeof(Parser));
     if (parser == NULL) {
         perror("malloc");
         return NULL;
     }
 
-    parser->filename = (char*)malloc(MAX_PATH);
+    parser->arena = arena;
+    parser->filename = (char*)arena_alloc(arena, MAX_PATH);
     if (parser->filename == NULL) {
         perror("malloc");
-        free(parser);
+        arena_free(arena, parser);
         return NULL;
     }
-    parser->args = (char*)malloc(MAX_ARGS);
+    parser->args = (char*)arena_alloc(arena, MAX_ARGS);
     if (parser->args == NULL) {
         perror("malloc");
-        free(parser);
+        arena_free(arena, parser->filename);
+        arena_free(arena, parser);
         return NULL;
     }
 
-    parser->method = UNKNOWN;
+    parser->args[0] = '\0';
+
+    parser->method = UNKNOWN_METHOD;
     parser->status = HTTP_OK;
+    parser->type = UNKNOWN;
+    parser->version = HTTP1_1;
+    parser->route = -1;
+    parser->asset = NULL;
+    parser->gzip = 0;
+    parser->fd = -1;
 
     return parser;
 }
 
+/**
+ * @brief Finds the proxy route of a path.
+ *
+ * A prefix only matches whole segments: /api takes /api, /api/ and
+ * /api/users but not /apis.
+ *
+ * @param config The compiled server configuration.
+ * @param path Path of the request, without the query string.
+ * @param length Length of path.
+ * @return Index of the first matching route, or -1 if none matches.
+ */
+int _match_route(ServerConfig *config, const char *path, size_t length) {
+    Proxy_route *route;
+    int i;
+
+    for (i = 0; i < config->proxy.route_count; i++) {
+        route = &config->proxy.routes[i];
+        if (length >= route->prefix_length && memcmp(path, route->prefix, route->prefix_length) == 0 &&
+            (route->prefix[route->prefix_length - 1] == '/' || path[route->prefix_length] == '\0' ||
+             path[route->prefix_length] == '/')) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Finds a header of the request.
+ *
+ * @param petition The request, NUL terminated.
+ * @param name Name of the header followed by ':'.
+ * @param length Set to the length of the value.
+ * @return The value without leading spaces, or NULL if the header is missing.
+ */
+const char *_request_header(const char *petition, const char *name, size_t *length) {
+    const char *end, *line, *eol, *value;
+    size_t name_length = strlen(name);
+
+    end = strstr(petition, "\r\n\r\n");
+    if (end == NULL) {
+        end = petition + strlen(petition);
+    }
+
+    line = strstr(petition, "\r\n");
+    while (line != NULL && line < end) {
+        line += 2;
+        eol = strstr(line, "\r\n");
+        if (eol == NULL || eol > end) {
+            eol = end;
+        }
+        if ((size_t)(eol - line) >= name_length && strncasecmp(line, name, name_length) == 0) {
+            for (value = line + name_length; value < eol && *value == ' '; value++);
+            *length = eol - value;
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Looks a request up in the bundle.
+ *
+ * Sets the status, the type and the entry of the parser. A GET whose
+ * If-None-Match has the ETag of the entry gets a 304.
+ *
+ * @param parser The parser, with the method set.
+ * @param config The compiled server configuration.
+ * @param petition The request.
+ * @param path Path of the request, without the query string.
+ * @param length Length of path.
+ */
+void _find_asset(Parser *parser, ServerConfig *config, const char *petition, const char *path, size_t length) {
+    const char *value, *gzip;
+    size_t value_length, rest;
+
+    // "/" is the index file, found in the bundle if it is inside the document root
+    if (strcmp(path, "/") == 0) {
+        path = "";
+        length = 0;
+        if (config->index_file_len > config->base_dir_len &&
+            memcmp(config->index_file, config->base_dir, config->base_dir_len) == 0) {
+            path = config->index_file + config->base_dir_len;
+            length = config->index_file_len - config->base_dir_len;
+        }
+    }
+
+    parser->asset = bundle_find(path, length);
+    metrics_cache(CACHE_BUNDLE, parser->asset != NULL);
+    if (parser->asset == NULL) {
+        parser->status = HTTP_NOT_FOUND;
+        parser->type = UNKNOWN;
+        return;
+    }
+    parser->status = HTTP_OK;
+    parser->type = (File_type)parser->asset->type;
+
+    value = _request_header(petition, "Accept-Encoding:", &value_length);
+    if (value != NULL && (gzip = memmem(value, value_length, "gzip", 4)) != NULL) {
+        // gzip;q=0 refuses it
+        rest = value + value_length - gzip;
+        parser->gzip = rest < 8 || memcmp(gzip + 4, ";q=0", 4) != 0 || (rest > 8 && gzip[8] == '.');
+    }
+
+    value = _request_header(petition, "If-None-Match:", &value_length);
+    if (parser->method == GET && value != NULL &&
+        ((value_length == 1 && *value == '*') ||
+         memmem(value, value_length, parser->asset->etag, strnlen(parser->asset->etag, BUNDLE_ETAG_SIZE)) != NULL)) {
+        parser->status = HTTP_NOT_MODIFIED;
+    }
+}
+
 
 /* ---------------------- Public Functions ---------------------- */
 void free_parser(Parser *parser) {
-    if (parser != NULL) {
+    if (parser != NULL && parser->fd != -1) {
+        close(parser->fd);
+        parser->fd = -1;
+    }
+    if (parser != NULL && parser->arena == NULL) {
         if (parser->filename != NULL) {
             free(parser->filename);
             parser->filename = NULL;
         }
         if (parser->args != NULL) {
-            if (parser->method == POST) {
-                parser->args -= 4;
-            }
             free(parser->args);
             parser->args = NULL;
         }
@@ -73,101 +207,131 @@ void free_parser(Parser *parser) {
     return;
 }
 
-Parser *pars_http(char *petition, Dict *conf) {
+int parser_set_body(Parser *parser, const char *body, size_t length) {
+    char *args;
+
+    // The scripts take their input as a string, a NUL would cut it short
+    if (memchr(body, '\0', length) != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    args = parser->args;
+    if (length >= MAX_ARGS) {
+        args = (char*)arena_alloc(parser->arena, length + 1);
+        if (args == NULL) {
+            return -1;
+        }
+        arena_free(parser->arena, parser->args);
+        parser->args = args;
+    }
+    memcpy(args, body, length);
+    args[length] = '\0';
+    return 0;
+}
+
+Parser *pars_http(char *petition, ServerConfig *config, Arena *arena) {
     Parser *parser;
-    FILE *file = NULL;
-    char method[MAX_METHOD], *temp, *query_string = NULL, *args, *temp2, version[MAX_VERSION];
+    int fd = -1, deferred = 0;
+    char method[MAX_METHOD], *temp, *query_string = NULL, *args, version[MAX_VERSION];
+    char path[MAX_PATH];
+    size_t length;
 
-    parser = _init_parser();
+    parser = _init_parser(arena);
     if (parser == NULL) {
         return NULL;
     }
 
-    printf("PETITION: %s\n", petition);
+    LOG_DEBUG("PETITION: %.160s", petition);
 
-    if (sscanf(petition, "%7s %256s %8s", method, parser->filename, version) < 0) {
+    method[0] = '\0';
+    version[0] = '\0';
+    path[0] = '\0';
+    if (sscanf(petition, "%7s %255s %8s", method, path, version) < 0) {
         free_parser(parser);
         return NULL;
     }
 
-    query_string = strstr(parser->filename, "?");
-
+    query_string = strchr(path, '?');
     if (query_string != NULL) {
         args = query_string + 1;
-        sprintf(parser->args, "%s", args);
-
-        size_t length = query_string - parser->filename;
-        printf("query_string: %p\n", query_string);
-        printf("parser->filename: %p\n", parser->filename);
-        temp2 = (char*)malloc(length + 1);
-        if (temp2 == NULL) {
-            perror("Malloc");
-        }
-        strncpy(temp2, parser->filename, length);
-        temp2[length] = '\0';
-        strcpy(parser->filename, temp2);
-        free(temp2);
+        snprintf(parser->args, MAX_ARGS, "%s", args);
+        *query_string = '\0';
     }
 
-    if (strlen(parser->filename) == 0 || strlen(version) == 0) {
+    length = strlen(path);
+    if (length == 0 || strlen(version) == 0 || config->base_dir_len + length >= MAX_PATH ||
+        config->index_file_len >= MAX_PATH) {
+        parser->filename[0] = '\0';
         parser->status = HTTP_BAD_REQUEST;
         return parser;
     }
 
-    if (strcmp(parser->filename, "/") == 0) {
-        strcpy(parser->filename, get_value(conf, "INDEX_FILE"));
+    if (config->stats_path != NULL && strcmp(path, config->stats_path) == 0) {
+        memcpy(parser->filename, path, length + 1);
+        parser->type = METRICS;
+    } else if ((parser->route = _match_route(config, path, length)) != -1) {
+        memcpy(parser->filename, path, length + 1);
+        parser->type = PROXY;
+    } else if (strcmp(path, "/") == 0) {
+        memcpy(parser->filename, config->index_file, config->index_file_len + 1);
     } else {
-        char *base_dir = get_value(conf, "BASE_DIR");
-        if (base_dir == NULL) {
-            free_parser(parser);
-            return NULL;
-        }
-        temp = (char*)calloc(sizeof(char), strlen(parser->filename) + 1);
-        if (temp == NULL) {
-            free_parser(parser);
-            return NULL;
-        }
-
-        strcpy(temp, parser->filename);
-        strcpy(parser->filename, base_dir);
-        strcat(parser->filename, temp);
-        printf("FILENAME: %s\n", parser->filename);
-        free(temp);
+        memcpy(parser->filename, config->base_dir, config->base_dir_len);
+        memcpy(parser->filename + config->base_dir_len, path, length + 1);
+        LOG_DEBUG("FILENAME: %s", parser->filename);
     }
 
-    printf("METHOD: %s\n", method);
+    LOG_DEBUG("METHOD: %s", method);
     if (strcmp(method, "GET") == 0) {
         parser->method = GET;
-        file = fopen(parser->filename, "rb");
     } else if (strcmp(method, "POST") == 0) {
         parser->method = POST;
-        file = fopen(parser->filename, "rb");
     } else if (strcmp(method, "OPTIONS") == 0) {
         parser->method = OPTIONS;
-        file = fopen(parser->filename, "rb");
     } else {
-        parser->method = UNKNOWN;
+        parser->method = UNKNOWN_METHOD;
     }
 
-    if (file == NULL) {
-        parser->status = HTTP_NOT_FOUND;
-        parser->type = UNKNOWN;
-    } else {
+    if (parser->type == METRICS) {
+        parser->status = parser->method == GET ? HTTP_OK : HTTP_NOT_FOUND;
+    } else if (parser->type == PROXY) {
+        // Any method goes, the backend decides
         parser->status = HTTP_OK;
-        parser->type = get_file_type(parser->filename);
-        fclose(file);
+    } else if (bundle_loaded() && parser->method != UNKNOWN_METHOD &&
+               (parser->type = get_file_type(parser->filename)) != PYTHON && parser->type != PHP) {
+        // Only scripts run from BASE_DIR, the rest is in the bundle or does not exist
+        _find_asset(parser, config, petition, path, length);
+    } else {
+        // A path that was just missing and nothing created since is not looked up again
+        if (parser->method != UNKNOWN_METHOD && !miss_cache_hit(parser->filename)) {
+            trace_phase_begin(PHASE_STAT);
+            fd = io_open(parser->filename, O_RDONLY);
+            trace_phase_end(PHASE_STAT);
+            // Not knowing yet counts as found, the caller that asked not to wait checks it later
+            deferred = fd == -1 && errno == EWOULDBLOCK;
+            if (fd == -1 && (errno == ENOENT || errno == ENOTDIR || errno == EACCES || errno == EXDEV)) {
+                miss_cache_add(parser->filename);
+            }
+        }
+
+        if (fd == -1 && !deferred) {
+            parser->status = HTTP_NOT_FOUND;
+            parser->type = UNKNOWN;
+        } else {
+            parser->status = HTTP_OK;
+            parser->type = get_file_type(parser->filename);
+            // Kept for open_file, the file is not looked up a second time
+            parser->fd = fd;
+        }
     }
 
     temp = strrchr(version, '.');
-    if (strcmp(temp, ".1") == 0) {
+    if (temp != NULL && strcmp(temp, ".1") == 0) {
         parser->version = HTTP1_1;
     } else {
         parser->version = HTTP1_0;
     }
 
-    printf("METHOD: %d\n", parser->method);
-    printf("FILENAME: %s\n", parser->filename);
-    printf("TYPE: %d\n", parser->type);
-    printf("STATUS: %d\n", parser->status);
+    LOG_DEBUG("METHOD: %d FILENAME: %s TYPE: %d STATUS: %d", parser->method, parser->filename,
+        parser->type, parser->status);
     return parser;
 }
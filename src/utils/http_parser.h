@@ -17,8 +17,9 @@
 #define MAX_PATH 256
 #define MAX_ARGS 1024
 
-#include "conf_parser.h"
+#include "server_config.h"
 #include "utils.h"
+#include "bundle.h"
 
 /**
  * @enum HttpStatusCode
@@ -28,8 +29,16 @@
  */
 typedef enum{
     HTTP_OK = 200,          /**< HTTP 200 OK */
+    HTTP_NOT_MODIFIED = 304, /**< HTTP 304 Not Modified */
     HTTP_BAD_REQUEST = 400, /**< HTTP 400 Bad Request */
-    HTTP_NOT_FOUND = 404    /**< HTTP 404 Not Found */
+    HTTP_NOT_FOUND = 404,   /**< HTTP 404 Not Found */
+    HTTP_LENGTH_REQUIRED = 411,     /**< HTTP 411 Length Required */
+    HTTP_PAYLOAD_TOO_LARGE = 413,   /**< HTTP 413 Payload Too Large */
+    HTTP_HEADER_TOO_LARGE = 431,    /**< HTTP 431 Request Header Fields Too Large */
+    HTTP_NOT_IMPLEMENTED = 501,     /**< HTTP 501 Not Implemented */
+    HTTP_BAD_GATEWAY = 502,         /**< HTTP 502 Bad Gateway */
+    HTTP_SERVICE_UNAVAILABLE = 503, /**< HTTP 503 Service Unavailable */
+    HTTP_GATEWAY_TIMEOUT = 504      /**< HTTP 504 Gateway Timeout */
 } HttpStatusCode;
 
 /**
@@ -57,27 +66,49 @@ typedef struct{
     File_type type;         /**< File type of the requested resource */
     HttpStatusCode status;  /**< HTTP status code */
     Version version;        /**< HTTP protocol version */
+    int route;              /**< Proxy route of the request, -1 if it is served locally */
+    const Bundle_entry *asset; /**< Entry of the bundle that answers the request, NULL if none */
+    int gzip;               /**< Whether the client accepts the gzip variant of asset */
+    Arena *arena;           /**< Arena of the request, NULL if allocated with malloc */
+    int fd;                 /**< File opened by the existence check, -1 if none, closed by free_parser */
 } Parser;
 
 /**
  * @brief Parses an HTTP request.
  *
  * This function parses an HTTP request string and populates a Parser structure
- * with the extracted data.
+ * with the extracted data. When a bundle is loaded, files other than scripts
+ * are looked up in it instead of BASE_DIR.
  *
  * @param petition The HTTP request string to parse.
- * @param conf A dictionary containing configuration data.
+ * @param config The compiled server configuration.
+ * @param arena Arena of the connection, NULL to allocate with malloc.
  * @return A pointer to a dynamically allocated Parser structure containing
  *         the parsed data. The caller is responsible for freeing this memory
- *         using free_parser().
+ *         using free_parser() or by resetting the arena.
  */
-Parser *pars_http(char *petition, Dict *conf);
+Parser *pars_http(char *petition, ServerConfig *config, Arena *arena);
+
+/**
+ * @brief Sets the body of a POST as the arguments of the request.
+ *
+ * The arguments grow to the length of the body when it does not fit in
+ * MAX_ARGS, so the script gets the whole body.
+ *
+ * @param parser The parser of the request.
+ * @param body The body, not NUL terminated.
+ * @param length Length of the body.
+ * @return 0 on success, -1 with errno set to EINVAL if the body holds a NUL
+ *         byte, or to ENOMEM if it could not be allocated.
+ */
+int parser_set_body(Parser *parser, const char *body, size_t length);
 
 /**
  * @brief Frees memory allocated for a Parser structure.
  *
- * This function releases the memory allocated for a Parser structure and its
- * associated fields.
+ * This function closes the file left open by pars_http and releases the
+ * memory allocated for a Parser structure and its associated fields. The
+ * memory is left alone if the parser lives in an arena.
  *
  * @param parser A pointer to the Parser structure to free.
  */
@@ -0,0 +1,465 @@
+/**
+ * @file io_pool.c
+ * @brief Bounded pool of threads for the disk I/O that cannot complete from the caches.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include "io_pool.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+
+/**
+ * @struct Open_args
+ * @brief Open run by an I/O thread.
+ */
+typedef struct {
+    int dirfd;          /**< Directory path is relative to. */
+    const char *path;   /**< Path of the file. */
+    int flags;          /**< open() flags. */
+    int fd;             /**< Set to the descriptor, -1 on failure. */
+    int error;          /**< Set to errno on failure. */
+} Open_args;
+
+/**
+ * @struct Read_args
+ * @brief Read run by an I/O thread.
+ */
+typedef struct {
+    int fd;             /**< The file. */
+    char *buf;          /**< Destination of the data. */
+    size_t length;      /**< Bytes to read. */
+    off_t offset;       /**< Position of the first byte. */
+    ssize_t result;     /**< Set to the bytes read, -1 on failure. */
+    int error;          /**< Set to errno on failure. */
+} Read_args;
+
+/**
+ * @struct Io_root
+ * @brief Document root that lookups cannot leave.
+ */
+typedef struct Io_root {
+    int fd;                 /**< The directory, opened with O_PATH. */
+    size_t length;          /**< Length of path. */
+    struct Io_root *next;   /**< Root of an older configuration. */
+    char path[];            /**< BASE_DIR as configured, without trailing slashes. */
+} Io_root;
+
+/* ---------------------- Global objects ---------------------- */
+Io_job *io_queue[IO_QUEUE_SIZE];
+int io_head = 0;
+int io_count = 0;
+
+pthread_t io_threads[IO_MAX_THREADS];
+int io_thread_count = 0;
+pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_work_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t io_done_cond = PTHREAD_COND_INITIALIZER;
+int io_stop = 0;
+
+// Kernels before 5.12 have no RESOLVE_CACHED, every open goes to the threads then
+_Atomic int resolve_cached_missing = 0;
+// Kernels before 5.6 have no openat2, roots are enforced by rejecting ".."
+_Atomic int openat2_missing = 0;
+
+// Newest first, older ones stay open for the requests of older configurations
+_Atomic(Io_root *) io_roots = NULL;
+pthread_mutex_t io_roots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+_Thread_local int io_nowait = 0;
+_Thread_local int io_would_block = 0;
+_Thread_local int io_on_worker = 0;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Runs the queued jobs until io_close.
+ *
+ * @param arg Unused.
+ * @return NULL
+ */
+void *_io_worker(void *arg) {
+    Io_job *job;
+
+    io_on_worker = 1;
+    pthread_mutex_lock(&io_mutex);
+    while (1) {
+        while (io_count == 0 && !io_stop) {
+            pthread_cond_wait(&io_work_cond, &io_mutex);
+        }
+        if (io_count == 0) {
+            break;
+        }
+        job = io_queue[io_head];
+        io_head = (io_head + 1) % IO_QUEUE_SIZE;
+        io_count--;
+        pthread_mutex_unlock(&io_mutex);
+
+        job->run(job->arg);
+
+        pthread_mutex_lock(&io_mutex);
+        // The waiter may free the job as soon as it sees done
+        atomic_store(&job->done, 1);
+        pthread_cond_broadcast(&io_done_cond);
+    }
+    pthread_mutex_unlock(&io_mutex);
+    return NULL;
+}
+
+/**
+ * @brief Finds the root a path is under.
+ *
+ * @param path Path of the file.
+ * @param dirfd Set to the root, or AT_FDCWD if the path is under none.
+ * @return The path relative to dirfd.
+ */
+const char *_io_beneath(const char *path, int *dirfd) {
+    Io_root *root;
+
+    for (root = atomic_load_explicit(&io_roots, memory_order_acquire); root != NULL; root = root->next) {
+        if (strncmp(path, root->path, root->length) == 0 && path[root->length] == '/') {
+            for (path += root->length; *path == '/'; path++);
+            *dirfd = root->fd;
+            return *path != '\0' ? path : ".";
+        }
+    }
+    *dirfd = AT_FDCWD;
+    return path;
+}
+
+/**
+ * @brief Tells whether a relative path has a ".." component.
+ *
+ * @param path The path.
+ * @return 1 if it has one, 0 otherwise.
+ */
+int _io_escapes(const char *path) {
+    const char *p = path;
+
+    while ((p = strstr(p, "..")) != NULL) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            return 1;
+        }
+        p += 2;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens a file with openat2, confined to its root.
+ *
+ * @param dirfd Root of the path, or AT_FDCWD.
+ * @param path Path relative to dirfd.
+ * @param flags open() flags.
+ * @param resolve Extra RESOLVE_* flags.
+ * @return The descriptor, or -1 with errno set (EXDEV if the path leaves
+ *         the root, ENOSYS if there is no openat2).
+ */
+int _io_openat2(int dirfd, const char *path, int flags, unsigned long long resolve) {
+    struct open_how how;
+
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = resolve;
+    if (dirfd != AT_FDCWD) {
+        // Neither "..", absolute symlinks nor /proc links get out of the root
+        how.resolve |= RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    }
+    return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+}
+
+/**
+ * @brief Opens a file on an I/O thread.
+ *
+ * @param arg The Open_args.
+ */
+void _run_open(void *arg) {
+    Open_args *args = (Open_args *)arg;
+
+    if (!atomic_load_explicit(&openat2_missing, memory_order_relaxed)) {
+        args->fd = _io_openat2(args->dirfd, args->path, args->flags, 0);
+        args->error = errno;
+        if (args->fd != -1 || args->error != ENOSYS) {
+            return;
+        }
+        atomic_store(&openat2_missing, 1);
+    }
+
+    if (args->dirfd != AT_FDCWD && _io_escapes(args->path)) {
+        args->fd = -1;
+        args->error = EXDEV;
+        return;
+    }
+    args->fd = openat(args->dirfd, args->path, args->flags | O_CLOEXEC);
+    args->error = errno;
+}
+
+/**
+ * @brief Reads a range of a file on an I/O thread.
+ *
+ * @param arg The Read_args.
+ */
+void _run_read(void *arg) {
+    Read_args *args = (Read_args *)arg;
+    size_t done = 0;
+    ssize_t n;
+
+    // One request for the whole range instead of the default readahead window
+    readahead(args->fd, args->offset, args->length);
+    while (done < args->length) {
+        n = pread(args->fd, args->buf + done, args->length - done, args->offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            args->result = -1;
+            args->error = errno;
+            return;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    args->result = done;
+}
+
+/**
+ * @brief Opens a file only if its whole path is in the dentry cache.
+ *
+ * @param dirfd Root of the path, or AT_FDCWD.
+ * @param path Path relative to dirfd.
+ * @param flags open() flags.
+ * @return The descriptor, or -1 with errno EAGAIN if the lookup would block.
+ */
+int _open_cached(int dirfd, const char *path, int flags) {
+    int fd;
+
+    if (atomic_load_explicit(&resolve_cached_missing, memory_order_relaxed)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    fd = _io_openat2(dirfd, path, flags, RESOLVE_CACHED);
+    if (fd == -1 && (errno == ENOSYS || errno == EINVAL)) {
+        atomic_store(&resolve_cached_missing, 1);
+        errno = EAGAIN;
+    }
+    return fd;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int io_init(int threads) {
+    if (threads > IO_MAX_THREADS) {
+        threads = IO_MAX_THREADS;
+    }
+
+    io_stop = 0;
+    for (io_thread_count = 0; io_thread_count < threads; io_thread_count++) {
+        if (pthread_create(&io_threads[io_thread_count], NULL, _io_worker, NULL) != 0) {
+            perror("io_pool");
+            io_close();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int io_submit(Io_job *job) {
+    pthread_mutex_lock(&io_mutex);
+    if (io_thread_count == 0 || io_stop || io_count == IO_QUEUE_SIZE) {
+        pthread_mutex_unlock(&io_mutex);
+        return -1;
+    }
+    atomic_store(&job->done, 0);
+    io_queue[(io_head + io_count) % IO_QUEUE_SIZE] = job;
+    io_count++;
+    pthread_cond_signal(&io_work_cond);
+    pthread_mutex_unlock(&io_mutex);
+
+    metrics_io_offload();
+    return 0;
+}
+
+void io_wait(Io_job *job) {
+    if (atomic_load(&job->done)) {
+        return;
+    }
+    pthread_mutex_lock(&io_mutex);
+    while (!atomic_load(&job->done)) {
+        pthread_cond_wait(&io_done_cond, &io_mutex);
+    }
+    pthread_mutex_unlock(&io_mutex);
+}
+
+void io_run(Io_job *job) {
+    // A job that does I/O already holds a thread, waiting for another one could take them all
+    if (io_on_worker || io_submit(job) == -1) {
+        job->run(job->arg);
+        atomic_store(&job->done, 1);
+        return;
+    }
+    io_wait(job);
+}
+
+int io_set_root(const char *base_dir) {
+    Io_root *root;
+    size_t length = strlen(base_dir);
+
+    while (length > 1 && base_dir[length - 1] == '/') {
+        length--;
+    }
+
+    pthread_mutex_lock(&io_roots_mutex);
+    for (root = atomic_load(&io_roots); root != NULL; root = root->next) {
+        if (root->length == length && memcmp(root->path, base_dir, length) == 0) {
+            pthread_mutex_unlock(&io_roots_mutex);
+            return 0;
+        }
+    }
+
+    root = (Io_root*)malloc(sizeof(Io_root) + length + 1);
+    if (root == NULL) {
+        pthread_mutex_unlock(&io_roots_mutex);
+        return -1;
+    }
+    root->fd = open(base_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root->fd == -1) {
+        perror(base_dir);
+        free(root);
+        pthread_mutex_unlock(&io_roots_mutex);
+        return -1;
+    }
+    root->length = length;
+    memcpy(root->path, base_dir, length);
+    root->path[length] = '\0';
+    root->next = atomic_load(&io_roots);
+    atomic_store_explicit(&io_roots, root, memory_order_release);
+    pthread_mutex_unlock(&io_roots_mutex);
+    return 0;
+}
+
+int io_open(const char *path, int flags) {
+    Open_args args = {AT_FDCWD, NULL, flags, -1, 0};
+    Io_job job = {_run_open, &args, 0};
+    int fd;
+
+    args.path = _io_beneath(path, &args.dirfd);
+    fd = _open_cached(args.dirfd, args.path, flags);
+    if (fd != -1 || errno != EAGAIN) {
+        // Answered from the dentry cache, a missing file too
+        metrics_cache(CACHE_DENTRY, 1);
+        return fd;
+    }
+    metrics_cache(CACHE_DENTRY, 0);
+    if (io_nowait) {
+        io_would_block = 1;
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    io_run(&job);
+    errno = args.error;
+    return args.fd;
+}
+
+ssize_t io_read(int fd, void *buf, size_t length, off_t offset) {
+    Read_args args;
+    Io_job job = {_run_read, &args, 0};
+    struct iovec iov;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < length) {
+        iov.iov_base = (char *)buf + done;
+        iov.iov_len = length - done;
+        n = preadv2(fd, &iov, 1, offset + done, RWF_NOWAIT);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n == 0) {
+            return done;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        // EOPNOTSUPP: the filesystem cannot tell, the thread reads it
+        if (errno != EAGAIN && errno != EOPNOTSUPP) {
+            return -1;
+        }
+        break;
+    }
+    // Whatever the page cache did not hold must be read by a thread
+    metrics_cache(CACHE_PAGE, done == length);
+    if (done == length) {
+        return done;
+    }
+    if (io_nowait) {
+        io_would_block = 1;
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    args.fd = fd;
+    args.buf = (char *)buf + done;
+    args.length = length - done;
+    args.offset = offset + done;
+    args.result = 0;
+    args.error = 0;
+    io_run(&job);
+    if (args.result == -1) {
+        errno = args.error;
+        return -1;
+    }
+    return done + args.result;
+}
+
+void io_nowait_begin() {
+    io_nowait = 1;
+    io_would_block = 0;
+}
+
+int io_nowait_end() {
+    io_nowait = 0;
+    return io_would_block;
+}
+
+int io_may_wait() {
+    return !io_nowait && !io_on_worker;
+}
+
+void io_close() {
+    Io_root *root, *next;
+    int i;
+
+    pthread_mutex_lock(&io_mutex);
+    io_stop = 1;
+    pthread_cond_broadcast(&io_work_cond);
+    pthread_mutex_unlock(&io_mutex);
+
+    for (i = 0; i < io_thread_count; i++) {
+        pthread_join(io_threads[i], NULL);
+    }
+    io_thread_count = 0;
+
+    root = atomic_exchange(&io_roots, NULL);
+    while (root != NULL) {
+        next = root->next;
+        close(root->fd);
+        free(root);
+        root = next;
+    }
+}
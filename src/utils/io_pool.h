@@ -0,0 +1,145 @@
+/**
+ * @file io_pool.h
+ * @brief Header file for the pool of threads that do the blocking disk I/O.
+ *
+ * Opening a file whose path is not in the dentry cache or reading pages
+ * that are not in the page cache blocks the thread for as long as the disk
+ * takes. Every open and read first tries to complete from the caches
+ * without blocking (openat2 with RESOLVE_CACHED, preadv2 with RWF_NOWAIT);
+ * only when that fails the operation goes to one of a few I/O threads, so
+ * hot files never leave the network thread and cold ones never have more
+ * than io_threads operations competing for the disk.
+ *
+ * Paths under a root set with io_set_root are resolved relative to the
+ * directory with RESOLVE_BENEATH, so "..", symlinks or /proc links that
+ * would leave it fail with EXDEV, and the walk starts at the root instead
+ * of at the current directory.
+ *
+ * A thread that can wait hands the operation over and sleeps until it
+ * completes. An HTTP/2 connection cannot, it serves other streams: inside
+ * io_nowait_begin/io_nowait_end the operations fail with EWOULDBLOCK
+ * instead, and the connection submits the whole response as an Io_job
+ * whose completion is written to its pipe.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define IO_QUEUE_SIZE 1024
+#define IO_MAX_THREADS 64
+
+/**
+ * @struct Io_job
+ * @brief Work run by an I/O thread.
+ */
+typedef struct Io_job {
+    void (*run)(void *arg);   /**< Function run by the thread. */
+    void *arg;                /**< Argument of run. */
+    _Atomic int done;         /**< Set once run has returned. */
+} Io_job;
+
+/**
+ * @brief Starts the I/O threads.
+ *
+ * @param threads Number of threads, 0 runs every operation on the calling
+ *        thread.
+ * @return 0 on success, -1 if a thread cannot be created.
+ */
+int io_init(int threads);
+
+/**
+ * @brief Queues a job.
+ *
+ * @param job The job, must stay valid until it is done.
+ * @return 0 on success, -1 if the queue is full or there are no threads
+ *         (the caller runs it itself then).
+ */
+int io_submit(Io_job *job);
+
+/**
+ * @brief Waits until a submitted job is done.
+ *
+ * @param job The job.
+ */
+void io_wait(Io_job *job);
+
+/**
+ * @brief Runs a job on an I/O thread and waits for it.
+ *
+ * Runs it on the calling thread if it cannot be queued or the calling
+ * thread is an I/O thread itself.
+ *
+ * @param job The job.
+ */
+void io_run(Io_job *job);
+
+/**
+ * @brief Confines the lookups of the paths under a directory to it.
+ *
+ * The roots of older configurations stay valid, their requests may still
+ * be running.
+ *
+ * @param base_dir The directory, as it starts the paths (BASE_DIR).
+ * @return 0 on success, -1 if the directory cannot be opened.
+ */
+int io_set_root(const char *base_dir);
+
+/**
+ * @brief Opens a file, on an I/O thread if its path is not cached.
+ *
+ * @param path Path of the file.
+ * @param flags open() flags, O_CLOEXEC is added.
+ * @return The descriptor, or -1 with errno set (EXDEV if it leaves its
+ *         root, EWOULDBLOCK inside io_nowait_begin if it would block).
+ */
+int io_open(const char *path, int flags);
+
+/**
+ * @brief Reads a range of a file, on an I/O thread the part not in the page cache.
+ *
+ * The I/O thread asks the kernel to read ahead the whole rest of the range
+ * before reading it.
+ *
+ * @param fd The file.
+ * @param buf Destination of the data.
+ * @param length Bytes to read.
+ * @param offset Position of the first byte.
+ * @return Bytes read (fewer only at the end of the file), or -1 with errno
+ *         set (EWOULDBLOCK inside io_nowait_begin if it would block).
+ */
+ssize_t io_read(int fd, void *buf, size_t length, off_t offset);
+
+/**
+ * @brief Makes io_open and io_read of the calling thread fail instead of waiting.
+ */
+void io_nowait_begin();
+
+/**
+ * @brief Ends io_nowait_begin.
+ *
+ * @return 1 if some operation failed with EWOULDBLOCK since io_nowait_begin, 0 otherwise.
+ */
+int io_nowait_end();
+
+/**
+ * @brief Tells whether the calling thread may wait for the I/O of another thread.
+ *
+ * Inside io_nowait_begin it must not block, and an I/O thread waiting for
+ * a job queued behind it would never wake up.
+ *
+ * @return 1 if it may, 0 otherwise.
+ */
+int io_may_wait();
+
+/**
+ * @brief Stops the I/O threads once the queued jobs are done.
+ */
+void io_close();
+
+#endif
@@ -0,0 +1,365 @@
+/**
+ * @file log.c
+ * @brief Asynchronous log with per-thread lock-free ring buffers.
+ *
+ * Each thread claims a ring the first time it logs and gives it back when
+ * it exits. The owner is the only producer and the writer thread the only
+ * consumer, so head and tail are plain atomic counters. Access records are
+ * stored in binary form and only formatted by the writer.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "log.h"
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/* ---------------------- Global objects ---------------------- */
+/**
+ * @enum Entry_kind
+ * @brief Contents of a ring entry.
+ */
+typedef enum {
+    ENTRY_TEXT,   /**< Formatted message. */
+    ENTRY_ACCESS  /**< Access record. */
+} Entry_kind;
+
+/**
+ * @brief One record waiting in a ring.
+ */
+typedef struct {
+    Entry_kind kind;           /**< Contents of the entry. */
+    Log_level level;           /**< Level of the record. */
+    struct timespec time;      /**< Wall-clock time of the record. */
+    union {
+        char text[LOG_LINE];   /**< Message, ENTRY_TEXT. */
+        Access_record access;  /**< Record, ENTRY_ACCESS. */
+    } data;
+} Log_entry;
+
+/**
+ * @enum Ring_state
+ * @brief Ownership of a ring.
+ */
+typedef enum {
+    RING_FREE,     /**< Available to be claimed. */
+    RING_OWNED,    /**< Written by a live thread. */
+    RING_RELEASED  /**< Owner exited, freed once drained. */
+} Ring_state;
+
+/**
+ * @brief Single-producer single-consumer ring of entries.
+ */
+typedef struct {
+    _Atomic size_t head;                /**< Next entry written by the owner. */
+    char pad1[64 - sizeof(size_t)];
+    _Atomic size_t tail;                /**< Next entry read by the writer. */
+    char pad2[64 - sizeof(size_t)];
+    Log_entry entries[LOG_RING_SIZE];   /**< Entries, indexed modulo LOG_RING_SIZE. */
+} Log_ring;
+
+_Atomic int ring_states[LOG_RINGS];
+Log_ring *_Atomic rings[LOG_RINGS];
+_Thread_local Log_ring *own_ring = NULL;
+pthread_key_t ring_key;
+pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+_Atomic int log_level = -1;
+_Atomic unsigned long dropped = 0;
+_Atomic int writer_running = 0;
+pthread_t writer_thread;
+FILE *log_file = NULL;
+
+const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+const char *method_names[] = {"GET", "POST", "OPTIONS", "UNKNOWN"};
+const char *type_names[] = {"jpg", "html", "text", "binary", "gif", "mpeg", "php", "python", "unknown", "mp4", "metrics", "proxy"};
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Gives the ring of an exiting thread back to the writer.
+ *
+ * Registered as the destructor of ring_key.
+ *
+ * @param arg Index of the ring plus one.
+ */
+void _release_ring(void *arg) {
+    int index = (int)((size_t)arg - 1);
+
+    atomic_store(&ring_states[index], RING_RELEASED);
+    own_ring = NULL;
+}
+
+/**
+ * @brief Creates the key whose destructor releases the rings.
+ */
+void _create_ring_key() {
+    pthread_key_create(&ring_key, _release_ring);
+}
+
+/**
+ * @brief Returns the ring of the calling thread, claiming one if needed.
+ *
+ * @return The ring, or NULL if every ring is in use.
+ */
+Log_ring *_get_ring() {
+    Log_ring *ring;
+    int i, expected;
+
+    if (own_ring != NULL) {
+        return own_ring;
+    }
+
+    pthread_once(&ring_key_once, _create_ring_key);
+
+    for (i = 0; i < LOG_RINGS; i++) {
+        expected = RING_FREE;
+        if (!atomic_compare_exchange_strong(&ring_states[i], &expected, RING_OWNED)) {
+            continue;
+        }
+        ring = atomic_load(&rings[i]);
+        if (ring == NULL) {
+            ring = (Log_ring*)calloc(1, sizeof(Log_ring));
+            if (ring == NULL) {
+                atomic_store(&ring_states[i], RING_FREE);
+                return NULL;
+            }
+            atomic_store(&rings[i], ring);
+        }
+        pthread_setspecific(ring_key, (void*)(size_t)(i + 1));
+        own_ring = ring;
+        return ring;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reserves the next entry of the calling thread's ring.
+ *
+ * @return The entry to fill, or NULL if the ring is full.
+ */
+Log_entry *_reserve_entry() {
+    Log_ring *ring = _get_ring();
+    size_t head;
+
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return &ring->entries[head % LOG_RING_SIZE];
+}
+
+/**
+ * @brief Makes the reserved entry visible to the writer.
+ */
+void _commit_entry() {
+    atomic_fetch_add_explicit(&own_ring->head, 1, memory_order_release);
+}
+
+/**
+ * @brief Writes one entry to the log file.
+ *
+ * @param entry The entry to format.
+ */
+void _format_entry(Log_entry *entry) {
+    struct tm tm;
+    char date[32];
+    Access_record *access;
+
+    gmtime_r(&entry->time.tv_sec, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    if (entry->kind == ENTRY_ACCESS) {
+        access = &entry->data.access;
+        fprintf(log_file, "%s.%03ldZ %s %s %d %s %zuB %ldus\n", date, entry->time.tv_nsec / 1000000,
+            method_names[access->method <= UNKNOWN_METHOD ? access->method : UNKNOWN_METHOD],
+            access->path, access->status,
+            type_names[access->type <= PROXY ? access->type : UNKNOWN],
+            access->bytes, access->duration_us);
+    } else {
+        fprintf(log_file, "%s.%03ldZ %s %s\n", date, entry->time.tv_nsec / 1000000,
+            level_names[entry->level], entry->data.text);
+    }
+}
+
+/**
+ * @brief Drains every ring once.
+ *
+ * @return Number of entries written.
+ */
+size_t _drain_rings() {
+    Log_ring *ring;
+    size_t head, tail, written = 0;
+    unsigned long lost;
+    int i, state;
+
+    for (i = 0; i < LOG_RINGS; i++) {
+        state = atomic_load(&ring_states[i]);
+        if (state == RING_FREE) {
+            continue;
+        }
+        ring = atomic_load(&rings[i]);
+        if (ring == NULL) {
+            continue;
+        }
+
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (; tail != head; tail++) {
+            _format_entry(&ring->entries[tail % LOG_RING_SIZE]);
+            written++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        // The owner is gone and nothing is left: the ring can be reused
+        if (state == RING_RELEASED && tail == atomic_load(&ring->head)) {
+            atomic_store(&ring_states[i], RING_FREE);
+        }
+    }
+
+    lost = atomic_exchange(&dropped, 0);
+    if (lost > 0) {
+        fprintf(log_file, "WARN %lu mensajes de log descartados\n", lost);
+        written++;
+    }
+    return written;
+}
+
+/**
+ * @brief Background writer: drains the rings and flushes in batches.
+ *
+ * @param arg Unused.
+ * @return NULL
+ */
+void *_writer(void *arg) {
+    struct timespec pause = {0, LOG_FLUSH_MS * 1000000L};
+
+    while (atomic_load(&writer_running)) {
+        if (_drain_rings() > 0) {
+            fflush(log_file);
+        }
+        nanosleep(&pause, NULL);
+    }
+    _drain_rings();
+    fflush(log_file);
+    return NULL;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+Log_level log_level_from_name(const char *name) {
+    if (name == NULL) {
+        return LOG_LEVEL_INFO;
+    }
+    if (strcmp(name, "error") == 0) {
+        return LOG_LEVEL_ERROR;
+    }
+    if (strcmp(name, "warn") == 0) {
+        return LOG_LEVEL_WARN;
+    }
+    if (strcmp(name, "debug") == 0) {
+        return LOG_LEVEL_DEBUG;
+    }
+    return LOG_LEVEL_INFO;
+}
+
+int log_init(Log_level level, const char *path) {
+    if (path != NULL) {
+        log_file = fopen(path, "a");
+        if (log_file == NULL) {
+            perror("log");
+            return -1;
+        }
+    } else {
+        log_file = stdout;
+    }
+
+    atomic_store(&writer_running, 1);
+    if (pthread_create(&writer_thread, NULL, _writer, NULL) != 0) {
+        perror("pthread_create");
+        atomic_store(&writer_running, 0);
+        if (log_file != stdout) {
+            fclose(log_file);
+        }
+        log_file = NULL;
+        return -1;
+    }
+
+    atomic_store(&log_level, level);
+    return 0;
+}
+
+void log_set_level(Log_level level) {
+    if (atomic_load(&writer_running)) {
+        atomic_store(&log_level, level);
+    }
+}
+
+int log_enabled(Log_level level) {
+    return (int)level <= atomic_load_explicit(&log_level, memory_order_relaxed);
+}
+
+void log_write(Log_level level, const char *fmt, ...) {
+    Log_entry *entry;
+    va_list ap;
+
+    if (!log_enabled(level)) {
+        return;
+    }
+
+    entry = _reserve_entry();
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->kind = ENTRY_TEXT;
+    entry->level = level;
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    va_start(ap, fmt);
+    vsnprintf(entry->data.text, LOG_LINE, fmt, ap);
+    va_end(ap);
+
+    _commit_entry();
+}
+
+void log_access(const Access_record *record) {
+    Log_entry *entry;
+
+    if (!log_enabled(LOG_LEVEL_INFO)) {
+        return;
+    }
+
+    entry = _reserve_entry();
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->kind = ENTRY_ACCESS;
+    entry->level = LOG_LEVEL_INFO;
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    entry->data.access = *record;
+
+    _commit_entry();
+}
+
+void log_close() {
+    if (!atomic_exchange(&writer_running, 0)) {
+        return;
+    }
+    atomic_store(&log_level, -1);
+    pthread_join(writer_thread, NULL);
+    if (log_file != stdout) {
+        fclose(log_file);
+    }
+    log_file = NULL;
+}
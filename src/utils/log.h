@@ -0,0 +1,118 @@
+/**
+ * @file log.h
+ * @brief Header file for the asynchronous access and debug log.
+ *
+ * Every thread writes its records into its own single-producer ring buffer
+ * without taking any lock. A background writer thread drains all the rings
+ * and flushes them in batches, so the request path never waits on the stdio
+ * lock. The verbosity can be changed at runtime and LOG_DEBUG compiles to
+ * nothing when NDEBUG is defined (make RELEASE=1).
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "utils.h"
+
+#define LOG_RINGS 1088
+#define LOG_RING_SIZE 64
+#define LOG_LINE 224
+#define LOG_PATH 128
+#define LOG_FLUSH_MS 20
+
+/**
+ * @enum Log_level
+ * @brief Verbosity levels of the log, from least to most verbose.
+ */
+typedef enum {
+    LOG_LEVEL_ERROR, /**< Errors only. */
+    LOG_LEVEL_WARN,  /**< Errors and warnings. */
+    LOG_LEVEL_INFO,  /**< Access records, errors and warnings. */
+    LOG_LEVEL_DEBUG  /**< Everything, including per-request traces. */
+} Log_level;
+
+/**
+ * @struct Access_record
+ * @brief Compact description of one served request.
+ */
+typedef struct {
+    Method method;         /**< HTTP method of the request. */
+    int status;            /**< HTTP status code of the response. */
+    File_type type;        /**< File type of the resource. */
+    size_t bytes;          /**< Bytes sent, header included. */
+    long duration_us;      /**< Time from request read to response sent. */
+    char path[LOG_PATH];   /**< Path of the resource (truncated). */
+} Access_record;
+
+#ifdef NDEBUG
+#define LOG_DEBUG(...) ((void)0)
+#else
+#define LOG_DEBUG(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+#define LOG_INFO(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/**
+ * @brief Parses a verbosity level name.
+ *
+ * @param name "error", "warn", "info" or "debug".
+ * @return The level, LOG_LEVEL_INFO if the name is unknown or NULL.
+ */
+Log_level log_level_from_name(const char *name);
+
+/**
+ * @brief Starts the background writer.
+ *
+ * Until it is called no level is enabled and every record is dropped.
+ *
+ * @param level Initial verbosity.
+ * @param path File the log is appended to, NULL for the standard output.
+ * @return 0 on success, -1 on failure.
+ */
+int log_init(Log_level level, const char *path);
+
+/**
+ * @brief Changes the verbosity at runtime.
+ *
+ * @param level New verbosity.
+ */
+void log_set_level(Log_level level);
+
+/**
+ * @brief Checks whether records of a level are currently written.
+ *
+ * @param level Level of the record.
+ * @return Non-zero if the level is enabled.
+ */
+int log_enabled(Log_level level);
+
+/**
+ * @brief Queues a formatted message.
+ *
+ * Messages longer than LOG_LINE are truncated. If the ring of the calling
+ * thread is full the message is dropped and counted.
+ *
+ * @param level Level of the message.
+ * @param fmt printf-style format.
+ */
+void log_write(Log_level level, const char *fmt, ...);
+
+/**
+ * @brief Queues an access record at LOG_LEVEL_INFO.
+ *
+ * @param record The record, copied into the ring.
+ */
+void log_access(const Access_record *record);
+
+/**
+ * @brief Drains every ring, stops the writer and closes the log file.
+ */
+void log_close();
+
+#endif
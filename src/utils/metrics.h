@@ -0,0 +1,146 @@
+/**
+ * @file metrics.h
+ * @brief Header file for the server metrics.
+ *
+ * Counters and latency histograms are kept in per-thread blocks aligned to
+ * cache lines. Only the owner thread writes a block, so recording is a
+ * relaxed load and store with no lock and no shared cache line. Blocks are
+ * handed to a new thread when their owner exits and are never cleared, so
+ * the totals are the sum of every block. The endpoint renders them in the
+ * Prometheus text format.
+ *
+ * With WORKERS each process writes its own area of a shared mapping and the
+ * endpoint of any worker renders the totals of all of them.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include "utils.h"
+
+#define METRICS_BLOCKS 1088
+#define METRICS_STATUSES 600
+#define METRICS_BUCKETS 101
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/**
+ * @enum Metric_histogram
+ * @brief Latency histograms recorded per request.
+ */
+typedef enum {
+    HIST_PARSE,    /**< Time spent in pars_http. */
+    HIST_HANDLER,  /**< Time from the parsed request to the response sent. */
+    HIST_TOTAL,    /**< Time from the request read to the response sent. */
+    HIST_COUNT     /**< Number of histograms. */
+} Metric_histogram;
+
+/**
+ * @enum Metric_cache
+ * @brief Caches whose lookups are counted, each with its own hit ratio.
+ */
+typedef enum {
+    CACHE_DENTRY,    /**< Opens answered from the dentry cache without an I/O thread. */
+    CACHE_PAGE,      /**< Reads answered from the page cache without an I/O thread. */
+    CACHE_BUNDLE,    /**< Paths looked up in the bundle. */
+    CACHE_NEGATIVE,  /**< Paths looked up in the cache of recent 404s. */
+    CACHE_COUNT      /**< Number of caches. */
+} Metric_cache;
+
+/**
+ * @brief Counts a served request.
+ *
+ * @param method HTTP method of the request.
+ * @param status HTTP status code of the response.
+ * @param type File type of the resource.
+ * @param bytes Bytes sent, header included.
+ */
+void metrics_request(Method method, int status, File_type type, size_t bytes);
+
+/**
+ * @brief Records a latency in a histogram.
+ *
+ * @param histogram The histogram.
+ * @param ns The latency in nanoseconds.
+ */
+void metrics_observe(Metric_histogram histogram, long ns);
+
+/**
+ * @brief Counts a script execution.
+ */
+void metrics_script();
+
+/**
+ * @brief Counts a lookup in one of the caches.
+ *
+ * A request may look up several caches, each one is counted on its own so
+ * its hit ratio only depends on its own lookups.
+ *
+ * @param cache The cache looked up.
+ * @param hit Non-zero if the lookup was a hit.
+ */
+void metrics_cache(Metric_cache cache, int hit);
+
+/**
+ * @brief Updates the number of open connections.
+ *
+ * @param delta +1 when a connection is accepted, -1 when it is closed.
+ */
+void metrics_connection(int delta);
+
+/**
+ * @brief Counts a connection the accept loop could not take.
+ */
+void metrics_rejected();
+
+/**
+ * @brief Counts a connection or request refused by the per-client limits.
+ */
+void metrics_rate_limited();
+
+/**
+ * @brief Counts a connection closed for missing a transfer deadline.
+ */
+void metrics_slow_client();
+
+/**
+ * @brief Counts a disk operation handed to the I/O threads.
+ */
+void metrics_io_offload();
+
+/**
+ * @brief Counts a request that waited for the result of another one.
+ */
+void metrics_coalesced();
+
+/**
+ * @brief Moves the counters to a mapping shared with the processes forked later.
+ *
+ * @param processes Number of areas, one per process.
+ * @return 0 on success, -1 if the mapping cannot be created.
+ */
+int metrics_share(int processes);
+
+/**
+ * @brief Makes the calling process write its counters in one of the shared areas.
+ *
+ * Must be called right after fork. The counters left by a previous process
+ * of the area are kept.
+ *
+ * @param process Index of the area, smaller than the count given to metrics_share.
+ */
+void metrics_attach(int process);
+
+/**
+ * @brief Renders every metric in the Prometheus text format.
+ *
+ * @param length Where the length of the text is stored.
+ * @return A dynamically allocated string, or NULL on failure. The caller is
+ *         responsible for freeing it.
+ */
+char *metrics_render(size_t *length);
+
+#endif
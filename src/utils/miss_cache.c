@@ -0,0 +1,394 @@
+/**
+ * @file miss_cache.c
+ * @brief Set-associative table of recent 404s, dropped by inotify.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include "miss_cache.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+// Whatever can make a missing path appear
+#define MISS_WATCH_EVENTS (IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+/**
+ * @struct Miss_entry
+ * @brief A path found missing.
+ */
+typedef struct {
+    uint64_t hash;                  /**< Hash of the path, 0 if the entry is empty. */
+    unsigned long expires_ms;       /**< When the entry stops being valid. */
+    unsigned int generation;        /**< Generation of the cache when it was added. */
+    char path[MISS_CACHE_PATH];     /**< The path. */
+} Miss_entry;
+
+/**
+ * @struct Miss_set
+ * @brief Entries a path can be placed in, protected by their own lock.
+ */
+typedef struct {
+    pthread_mutex_t mutex;                  /**< Protects the set. */
+    Miss_entry entries[MISS_CACHE_WAYS];    /**< Entries of the set. */
+} Miss_set;
+
+/**
+ * @struct Miss_watch
+ * @brief A watched directory.
+ */
+typedef struct {
+    int wd;        /**< Watch descriptor. */
+    char *path;    /**< Path of the directory. */
+} Miss_watch;
+
+/* ---------------------- Global objects ---------------------- */
+Miss_set *miss_sets = NULL;
+unsigned int miss_set_count = 0;
+unsigned long miss_ttl_ms = 0;
+
+// Every change in the document root moves it, entries of older generations are stale
+_Atomic unsigned int miss_generation = 0;
+_Thread_local unsigned int miss_seen_generation = 0;
+
+int miss_inotify = -1;
+int miss_wakeup = -1;
+Miss_watch *miss_watches = NULL;
+int miss_watch_count = 0;
+pthread_t miss_thread;
+int miss_watching = 0;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Coarse monotonic time.
+ *
+ * @return Milliseconds since an arbitrary point.
+ */
+unsigned long _miss_now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (unsigned long)ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief FNV-1a hash of a path, never 0.
+ *
+ * @param path The path.
+ * @return The hash.
+ */
+uint64_t _miss_hash(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * @brief Starts watching a directory.
+ *
+ * @param path Path of the directory.
+ */
+void _miss_watch_dir(const char *path) {
+    Miss_watch *grown;
+    int wd;
+
+    if (miss_watch_count == MISS_CACHE_MAX_WATCHES) {
+        return;
+    }
+    wd = inotify_add_watch(miss_inotify, path, MISS_WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1) {
+        perror("inotify_add_watch");
+        return;
+    }
+    grown = (Miss_watch*)realloc(miss_watches, (miss_watch_count + 1) * sizeof(Miss_watch));
+    if (grown == NULL) {
+        return;
+    }
+    miss_watches = grown;
+    miss_watches[miss_watch_count].wd = wd;
+    miss_watches[miss_watch_count].path = strdup(path);
+    if (miss_watches[miss_watch_count].path != NULL) {
+        miss_watch_count++;
+    }
+}
+
+/**
+ * @brief Watches every directory of the walk.
+ */
+int _miss_collect(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    if (flag == FTW_D) {
+        _miss_watch_dir(path);
+    }
+    return 0;
+}
+
+/**
+ * @brief Path of a watched directory.
+ *
+ * @param wd Watch descriptor.
+ * @return The path, or NULL if the descriptor is unknown.
+ */
+const char *_miss_watch_path(int wd) {
+    int i;
+
+    for (i = 0; i < miss_watch_count; i++) {
+        if (miss_watches[i].wd == wd) {
+            return miss_watches[i].path;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Drops the cache on every change of the document root until miss_cache_close.
+ *
+ * @param arg Unused.
+ * @return NULL
+ */
+void *_miss_watcher(void *arg) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[MISS_CACHE_PATH];
+    const struct inotify_event *event;
+    struct pollfd pfd[2];
+    const char *dir;
+    ssize_t n;
+    char *p;
+
+    pfd[0].fd = miss_inotify;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = miss_wakeup;
+    pfd[1].events = POLLIN;
+    while (1) {
+        if (poll(pfd, 2, -1) == -1) {
+            continue;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        n = read(miss_inotify, events, sizeof(events));
+        if (n <= 0) {
+            continue;
+        }
+        atomic_fetch_add(&miss_generation, 1);
+
+        // New directories are watched too, files may appear inside them later
+        for (p = events; p < events + n; p += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *)p;
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && event->len > 0 &&
+                (dir = _miss_watch_path(event->wd)) != NULL &&
+                snprintf(path, sizeof(path), "%s/%s", dir, event->name) < (int)sizeof(path)) {
+                _miss_watch_dir(path);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Stops the watcher and closes its descriptors.
+ */
+void _miss_unwatch() {
+    uint64_t one = 1;
+    int w;
+
+    if (miss_watching) {
+        if (write(miss_wakeup, &one, sizeof(one)) == -1) {
+            perror("miss_cache");
+        }
+        pthread_join(miss_thread, NULL);
+        miss_watching = 0;
+    }
+
+    for (w = 0; w < miss_watch_count; w++) {
+        free(miss_watches[w].path);
+    }
+    free(miss_watches);
+    miss_watches = NULL;
+    miss_watch_count = 0;
+
+    if (miss_inotify != -1) {
+        close(miss_inotify);
+        miss_inotify = -1;
+    }
+    if (miss_wakeup != -1) {
+        close(miss_wakeup);
+        miss_wakeup = -1;
+    }
+}
+
+/**
+ * @brief Starts watching a document root.
+ *
+ * @param base_dir Document root.
+ * @return 0 if the watcher is running, -1 otherwise. Nothing is left open
+ *         on failure.
+ */
+int _miss_watch_root(const char *base_dir) {
+    miss_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    miss_wakeup = eventfd(0, EFD_CLOEXEC);
+    if (miss_inotify == -1 || miss_wakeup == -1) {
+        perror("inotify");
+        _miss_unwatch();
+        return -1;
+    }
+    if (nftw(base_dir, _miss_collect, 16, FTW_PHYS) != 0 || miss_watch_count == 0 ||
+        pthread_create(&miss_thread, NULL, _miss_watcher, NULL) != 0) {
+        _miss_unwatch();
+        return -1;
+    }
+    miss_watching = 1;
+    return 0;
+}
+
+/**
+ * @brief Frees the table.
+ */
+void _miss_free() {
+    unsigned int i;
+
+    for (i = 0; i < miss_set_count; i++) {
+        pthread_mutex_destroy(&miss_sets[i].mutex);
+    }
+    free(miss_sets);
+    miss_sets = NULL;
+    miss_set_count = 0;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int miss_cache_init(const char *base_dir, int size, int ttl_ms) {
+    unsigned int i;
+
+    if (size <= 0 || ttl_ms <= 0) {
+        return 0;
+    }
+
+    miss_set_count = 1;
+    while (miss_set_count * MISS_CACHE_WAYS < (unsigned int)size) {
+        miss_set_count *= 2;
+    }
+    miss_sets = (Miss_set*)calloc(miss_set_count, sizeof(Miss_set));
+    if (miss_sets == NULL) {
+        perror("miss_cache");
+        miss_set_count = 0;
+        return -1;
+    }
+    for (i = 0; i < miss_set_count; i++) {
+        pthread_mutex_init(&miss_sets[i].mutex, NULL);
+    }
+    miss_ttl_ms = ttl_ms;
+
+    if (_miss_watch_root(base_dir) == -1) {
+        fprintf(stderr, "No se puede vigilar %s, los 404 se recuerdan %lu ms\n", base_dir, miss_ttl_ms);
+    }
+    return 0;
+}
+
+void miss_cache_watch(const char *base_dir) {
+    if (miss_sets == NULL) {
+        return;
+    }
+
+    _miss_unwatch();
+    // Whatever happened in the new root while it was not watched is unknown
+    atomic_fetch_add(&miss_generation, 1);
+    if (_miss_watch_root(base_dir) == -1) {
+        fprintf(stderr, "No se puede vigilar %s, los 404 se recuerdan %lu ms\n", base_dir, miss_ttl_ms);
+    }
+}
+
+int miss_cache_hit(const char *path) {
+    uint64_t hash;
+    unsigned int generation;
+    unsigned long now;
+    Miss_set *set;
+    Miss_entry *entry;
+    int i, hit = 0;
+
+    if (miss_sets == NULL) {
+        return 0;
+    }
+
+    hash = _miss_hash(path);
+    generation = atomic_load_explicit(&miss_generation, memory_order_acquire);
+    miss_seen_generation = generation;
+    now = _miss_now_ms();
+    set = &miss_sets[hash & (miss_set_count - 1)];
+
+    pthread_mutex_lock(&set->mutex);
+    for (i = 0; i < MISS_CACHE_WAYS; i++) {
+        entry = &set->entries[i];
+        if (entry->hash == hash && entry->generation == generation && entry->expires_ms > now &&
+            strcmp(entry->path, path) == 0) {
+            hit = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    metrics_cache(CACHE_NEGATIVE, hit);
+    return hit;
+}
+
+void miss_cache_add(const char *path) {
+    uint64_t hash;
+    unsigned int generation;
+    unsigned long now;
+    Miss_set *set;
+    Miss_entry *entry, *victim = NULL, *dead = NULL, *oldest = NULL;
+    int i;
+
+    if (miss_sets == NULL || strlen(path) >= MISS_CACHE_PATH) {
+        return;
+    }
+
+    hash = _miss_hash(path);
+    // A change seen after the lookup began must leave this entry stale
+    generation = miss_seen_generation;
+    now = _miss_now_ms();
+    set = &miss_sets[hash & (miss_set_count - 1)];
+
+    pthread_mutex_lock(&set->mutex);
+    // The same path, else a dead entry, else the one closest to expiring
+    for (i = 0; i < MISS_CACHE_WAYS && victim == NULL; i++) {
+        entry = &set->entries[i];
+        if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+            victim = entry;
+        } else if (entry->hash == 0 || entry->generation != generation || entry->expires_ms <= now) {
+            dead = dead ? dead : entry;
+        } else if (oldest == NULL || entry->expires_ms < oldest->expires_ms) {
+            oldest = entry;
+        }
+    }
+    if (victim == NULL) {
+        victim = dead ? dead : oldest;
+    }
+    victim->hash = hash;
+    victim->generation = generation;
+    victim->expires_ms = now + miss_ttl_ms;
+    strcpy(victim->path, path);
+    pthread_mutex_unlock(&set->mutex);
+}
+
+void miss_cache_close() {
+    _miss_unwatch();
+    _miss_free();
+}
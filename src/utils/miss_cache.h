@@ -0,0 +1,73 @@
+/**
+ * @file miss_cache.h
+ * @brief Header file for the cache of recent 404s.
+ *
+ * Scanners ask for thousands of paths that do not exist, and each one used
+ * to cost an open of the file. Paths that were just found missing are kept
+ * for a short TTL in a bounded set-associative table, and asking for them
+ * again is answered with the pre-rendered 404 without touching the
+ * filesystem.
+ *
+ * An inotify watch on BASE_DIR and every directory below it drops the
+ * whole cache as soon as something is created, moved in or changes its
+ * permissions, so a new file is served right away instead of after the TTL.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef MISS_CACHE_H
+#define MISS_CACHE_H
+
+#define MISS_CACHE_WAYS 4
+#define MISS_CACHE_PATH 256
+#define MISS_CACHE_MAX_WATCHES 4096
+
+/**
+ * @brief Creates the table and starts watching the document root.
+ *
+ * If the directories cannot be watched the cache still works, entries
+ * just live for the whole TTL.
+ *
+ * @param base_dir Document root.
+ * @param size Entries of the table, 0 disables the cache.
+ * @param ttl_ms Milliseconds a miss is remembered.
+ * @return 0 on success, -1 if the table or the thread cannot be created.
+ */
+int miss_cache_init(const char *base_dir, int size, int ttl_ms);
+
+/**
+ * @brief Moves the watch to a new document root.
+ *
+ * Called when a reload changes BASE_DIR. The entries cached so far are
+ * dropped, and if the new root cannot be watched entries just live for
+ * the whole TTL, as in miss_cache_init.
+ *
+ * @param base_dir The new document root.
+ */
+void miss_cache_watch(const char *base_dir);
+
+/**
+ * @brief Tells whether a path was found missing a moment ago.
+ *
+ * @param path Path of the file on disk.
+ * @return 1 if it is still known to be missing, 0 otherwise.
+ */
+int miss_cache_hit(const char *path);
+
+/**
+ * @brief Remembers that a path is missing.
+ *
+ * Must follow the miss_cache_hit of the lookup on the same thread, changes
+ * made since that call leave the entry stale.
+ *
+ * @param path Path of the file on disk.
+ */
+void miss_cache_add(const char *path);
+
+/**
+ * @brief Stops watching the document root and frees the table.
+ */
+void miss_cache_close();
+
+#endif
@@ -0,0 +1,1328 @@
+/**
+ * @file proxy.c
+ * @brief Reverse proxy with pooled keep-alive connections to the backends.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "tls.h"
+#include "log.h"
+#include "metrics.h"
+#include "buffer_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define PROXY_NAME_SIZE 64
+
+/**
+ * @struct Upstream
+ * @brief State of a backend, kept across reloads.
+ */
+typedef struct {
+    char name[PROXY_NAME_SIZE];            /**< host:port as configured. */
+    struct sockaddr_in address;            /**< Resolved address. */
+    pthread_mutex_t mutex;                 /**< Protects the idle connections. */
+    int idle[PROXY_POOL_SLOTS];            /**< Idle connections, the most recent last. */
+    int idle_count;                        /**< Number of idle connections. */
+    _Atomic int active;                    /**< Requests in flight. */
+    _Atomic int fails;                     /**< Failures in a row. */
+    _Atomic unsigned long ejected_until;   /**< End of the passive ejection in ms. */
+    _Atomic int down;                      /**< Whether the last health check failed. */
+} Upstream;
+
+/**
+ * @enum Body_framing
+ * @brief How the end of a response body is found.
+ */
+typedef enum {
+    FRAMING_NONE,      /**< No body (HEAD, 1xx, 204, 304). */
+    FRAMING_LENGTH,    /**< Content-Length bytes. */
+    FRAMING_CHUNKED,   /**< Chunked transfer coding. */
+    FRAMING_CLOSE      /**< Until the backend closes the connection. */
+} Body_framing;
+
+/**
+ * @enum Chunk_state
+ * @brief Position of the chunked decoder.
+ */
+typedef enum {
+    CHUNK_SIZE,          /**< Hex digits of the chunk size. */
+    CHUNK_EXTENSION,     /**< Rest of the size line. */
+    CHUNK_DATA,          /**< Data of the chunk. */
+    CHUNK_DATA_END,      /**< CRLF after the data. */
+    CHUNK_TRAILER,       /**< Start of a trailer line, or the final CRLF. */
+    CHUNK_TRAILER_LINE,  /**< Rest of a trailer line. */
+    CHUNK_DONE           /**< Whole body seen. */
+} Chunk_state;
+
+/**
+ * @struct Chunked
+ * @brief Decoder of a chunked body, fed as the bytes arrive.
+ */
+typedef struct {
+    Chunk_state state;   /**< Current position. */
+    size_t remaining;    /**< Data bytes left in the current chunk. */
+    int digits;          /**< Hex digits read of the size. */
+} Chunked;
+
+/**
+ * @struct Proxy_sink
+ * @brief Destination of a response: the client socket or a buffer.
+ */
+typedef struct Proxy_sink {
+    int (*head)(struct Proxy_sink *sink, const char *data, size_t length);  /**< Takes the head. */
+    int (*body)(struct Proxy_sink *sink, const char *data, size_t length);  /**< Takes body bytes. */
+    int dechunk;        /**< Whether chunked bodies are decoded before body. */
+    int fd;             /**< Client socket. */
+    Deadline deadline;  /**< Deadline of the response to the client. */
+    size_t bytes;       /**< Bytes sent to the client. */
+    char *header;       /**< Collected head. */
+    char *content;      /**< Collected body. */
+    size_t length;      /**< Length of content. */
+    size_t capacity;    /**< Capacity of content. */
+} Proxy_sink;
+
+/**
+ * @struct Exchange
+ * @brief A request being forwarded.
+ */
+typedef struct {
+    const char *head;          /**< Rewritten head and the body already received. */
+    size_t head_length;        /**< Length of head. */
+    size_t body_pending;       /**< Body bytes still to be read from the client. */
+    int client;                /**< Client socket, -1 if the body is complete. */
+    Transfer_limits *limits;   /**< Deadlines of the client transfers. */
+    int no_body;               /**< Whether the response has no body (HEAD). */
+    int idempotent;            /**< Whether the request can be sent again. */
+    int streamed;              /**< Whether body bytes were read from the client. */
+    int complete;              /**< Whether the whole response reached the sink. */
+    int close_client;          /**< Whether the response ended by closing. */
+    int status;                /**< Status of the response. */
+    Proxy_sink *sink;          /**< Destination of the response. */
+} Exchange;
+
+// Outcome of an exchange with a backend (0 means the body was streamed)
+enum {
+    EXCHANGE_REUSABLE = 1,  /**< Response relayed, the connection can be pooled. */
+    EXCHANGE_DONE,          /**< Response relayed, the connection must be closed. */
+    EXCHANGE_CLOSED,        /**< Connection closed before any response byte. */
+    EXCHANGE_RETRY,         /**< Backend failed before the response reached the sink. */
+    EXCHANGE_FAILED         /**< Failed after the sink got part of the response. */
+};
+
+/* ---------------------- Global objects ---------------------- */
+Upstream upstreams[PROXY_UPSTREAM_SLOTS];
+_Atomic int upstream_count = 0;
+pthread_mutex_t upstreams_mutex = PTHREAD_MUTEX_INITIALIZER;
+_Atomic unsigned int route_cursors[PROXY_MAX_ROUTES];
+
+_Atomic int proxy_balance = BALANCE_ROUND_ROBIN;
+_Atomic int proxy_keepalive = 16;
+_Atomic int proxy_timeout = 30;
+_Atomic int proxy_max_fails = 3;
+_Atomic int proxy_eject_time = 10;
+_Atomic int proxy_health_interval = 5;
+
+char health_path[256] = "/";
+pthread_t health_thread;
+pthread_mutex_t health_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t health_cond = PTHREAD_COND_INITIALIZER;
+int health_stop = 0;
+int health_running = 0;
+
+// Transfer-Encoding never reaches a backend, the body is always sent with Content-Length
+const char *request_hop_headers[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "Upgrade:",
+                                     "Expect:", "X-Forwarded-For:", "Transfer-Encoding:", "TE:", NULL};
+const char *response_hop_headers[] = {"Connection:", "Keep-Alive:", NULL};
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Coarse monotonic time for the ejections.
+ *
+ * @return Milliseconds since an arbitrary point.
+ */
+unsigned long _proxy_now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (unsigned long)ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Resolves a host:port to an IPv4 address.
+ *
+ * @param name host:port of the backend.
+ * @param address Set to the address.
+ * @return 0 on success, -1 on failure.
+ */
+int _resolve_upstream(const char *name, struct sockaddr_in *address) {
+    struct addrinfo hints, *result;
+    char host[PROXY_NAME_SIZE];
+    const char *port = strrchr(name, ':');
+
+    if (port == NULL || port == name || (size_t)(port - name) >= sizeof(host) || port[1] == '\0') {
+        return -1;
+    }
+    memcpy(host, name, port - name);
+    host[port - name] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port + 1, &hints, &result) != 0) {
+        return -1;
+    }
+    memcpy(address, result->ai_addr, sizeof(*address));
+    freeaddrinfo(result);
+    return 0;
+}
+
+/**
+ * @brief Finds the slot of a backend, taking a free one if it is new.
+ *
+ * @param name host:port of the backend.
+ * @return Index of the slot, or -1 if it cannot be resolved or there are
+ *         no free slots.
+ */
+int _find_upstream(const char *name) {
+    Upstream *upstream;
+    int i, count, slot = -1;
+
+    if (strlen(name) >= PROXY_NAME_SIZE) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&upstreams_mutex);
+    count = atomic_load(&upstream_count);
+    for (i = 0; i < count; i++) {
+        if (strcmp(upstreams[i].name, name) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == -1 && count < PROXY_UPSTREAM_SLOTS) {
+        upstream = &upstreams[count];
+        if (_resolve_upstream(name, &upstream->address) == 0) {
+            strcpy(upstream->name, name);
+            upstream->idle_count = 0;
+            atomic_store(&upstream->active, 0);
+            atomic_store(&upstream->fails, 0);
+            atomic_store(&upstream->ejected_until, 0);
+            atomic_store(&upstream->down, 0);
+            // Published last, the health thread only looks below the count
+            atomic_store(&upstream_count, count + 1);
+            slot = count;
+        }
+    }
+    pthread_mutex_unlock(&upstreams_mutex);
+    return slot;
+}
+
+/**
+ * @brief Closes the idle connections of a backend.
+ *
+ * @param upstream The backend.
+ */
+void _pool_drain(Upstream *upstream) {
+    pthread_mutex_lock(&upstream->mutex);
+    while (upstream->idle_count > 0) {
+        close(upstream->idle[--upstream->idle_count]);
+    }
+    pthread_mutex_unlock(&upstream->mutex);
+}
+
+/**
+ * @brief Takes an idle connection to a backend.
+ *
+ * A connection with something to read has been closed by the backend (or
+ * carries garbage) and is discarded.
+ *
+ * @param upstream The backend.
+ * @return The connection, or -1 if there is none.
+ */
+int _pool_take(Upstream *upstream) {
+    struct pollfd pfd;
+    int fd;
+
+    pthread_mutex_lock(&upstream->mutex);
+    while (upstream->idle_count > 0) {
+        fd = upstream->idle[--upstream->idle_count];
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) == 0) {
+            pthread_mutex_unlock(&upstream->mutex);
+            return fd;
+        }
+        close(fd);
+    }
+    pthread_mutex_unlock(&upstream->mutex);
+    return -1;
+}
+
+/**
+ * @brief Returns a connection to the pool of its backend.
+ *
+ * @param upstream The backend.
+ * @param fd The connection, closed if the pool is full.
+ */
+void _pool_give(Upstream *upstream, int fd) {
+    int keepalive = atomic_load_explicit(&proxy_keepalive, memory_order_relaxed);
+
+    pthread_mutex_lock(&upstream->mutex);
+    if (upstream->idle_count < keepalive && upstream->idle_count < PROXY_POOL_SLOTS) {
+        upstream->idle[upstream->idle_count++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&upstream->mutex);
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/**
+ * @brief Opens a non-blocking connection to a backend.
+ *
+ * @param upstream The backend.
+ * @param timeout_ms Time allowed for the connection.
+ * @return The connection, or -1 on failure.
+ */
+int _upstream_connect(Upstream *upstream, int timeout_ms) {
+    int fd, error = 0, on = 1;
+    socklen_t length = sizeof(error);
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(fd, (struct sockaddr*)&upstream->address, sizeof(upstream->address)) == 0) {
+        return fd;
+    }
+    if (errno != EINPROGRESS || wait_socket(fd, POLLOUT, timeout_ms) != 1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Chooses the backend of a request among those in rotation.
+ *
+ * @param route Route of the request.
+ * @return The backend, or NULL if all are down or ejected.
+ */
+Upstream *_pick_upstream(Proxy_route *route) {
+    int balance = atomic_load_explicit(&proxy_balance, memory_order_relaxed);
+    unsigned int start = atomic_fetch_add_explicit(&route_cursors[route->index], 1, memory_order_relaxed);
+    unsigned long now = _proxy_now_ms();
+    Upstream *upstream, *best = NULL;
+    int i, active, best_active = INT_MAX;
+
+    for (i = 0; i < route->count; i++) {
+        upstream = &upstreams[route->slots[(start + i) % route->count]];
+        if (atomic_load(&upstream->down) || atomic_load(&upstream->ejected_until) > now) {
+            continue;
+        }
+        if (balance == BALANCE_ROUND_ROBIN) {
+            return upstream;
+        }
+        // Starting at the cursor spreads the ties
+        active = atomic_load(&upstream->active);
+        if (active < best_active) {
+            best = upstream;
+            best_active = active;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Counts a failure of a backend, ejecting it after max_fails.
+ *
+ * @param upstream The backend.
+ */
+void _upstream_failed(Upstream *upstream) {
+    int max_fails = atomic_load(&proxy_max_fails);
+    int eject_time = atomic_load(&proxy_eject_time);
+
+    if (max_fails <= 0 || atomic_fetch_add(&upstream->fails, 1) + 1 < max_fails) {
+        return;
+    }
+    atomic_store(&upstream->fails, 0);
+    atomic_store(&upstream->ejected_until, _proxy_now_ms() + eject_time * 1000UL);
+    _pool_drain(upstream);
+    LOG_WARN("Backend %s fuera de rotación durante %d s", upstream->name, eject_time);
+}
+
+/**
+ * @brief Checks whether a header line has one of the given names.
+ *
+ * @param line Start of the line.
+ * @param names Names with their colon, NULL terminated.
+ * @return 1 if it does, 0 otherwise.
+ */
+int _header_is(const char *line, const char **names) {
+    int i;
+
+    for (i = 0; names[i] != NULL; i++) {
+        if (strncasecmp(line, names[i], strlen(names[i])) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Finds the value of a header in a head.
+ *
+ * @param head The head, from its first line.
+ * @param end End of the head.
+ * @param name Name of the header with its colon.
+ * @param length Set to the length of the value.
+ * @return Start of the value, or NULL if the header is absent.
+ */
+const char *_find_header_value(const char *head, const char *end, const char *name, size_t *length) {
+    const char *line = memchr(head, '\n', end - head), *eol, *value;
+    size_t name_length = strlen(name);
+
+    while (line != NULL && ++line < end) {
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
+        }
+        if ((size_t)(eol - line) > name_length && strncasecmp(line, name, name_length) == 0) {
+            for (value = line + name_length; value < eol && (*value == ' ' || *value == '\t'); value++);
+            *length = eol - value;
+            while (*length > 0 && (value[*length - 1] == '\r' || value[*length - 1] == ' ')) {
+                (*length)--;
+            }
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Checks whether a header value contains a token.
+ *
+ * @param value The value, may be NULL.
+ * @param length Length of value.
+ * @param token The token.
+ * @return 1 if it does, 0 otherwise.
+ */
+int _value_has(const char *value, size_t length, const char *token) {
+    size_t token_length = strlen(token), i;
+
+    for (i = 0; value != NULL && i + token_length <= length; i++) {
+        if (strncasecmp(value + i, token, token_length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Builds the head sent to the backend for an HTTP/1.x request.
+ *
+ * The request line and the end-to-end headers are kept, the hop-by-hop
+ * ones are replaced so the backend connection stays open, and the address
+ * of the client is appended to X-Forwarded-For. The body bytes already
+ * received follow the head so both go in one send.
+ *
+ * @param request The request.
+ * @param head_length Length of its head.
+ * @param body_length Body bytes that follow the head.
+ * @param address IPv4 address of the client, network byte order.
+ * @param length Set to the length of the result.
+ * @return The new request allocated with malloc, or NULL on failure.
+ */
+char *_rewrite_request(const char *request, size_t head_length, size_t body_length, uint32_t address, size_t *length) {
+    const char *line, *eol, *end = request + head_length - 2, *forwarded = NULL;
+    size_t forwarded_length = 0;
+    char ip[INET_ADDRSTRLEN], *out;
+    struct in_addr in;
+    int written;
+
+    in.s_addr = address;
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+
+    out = (char*)malloc(head_length + body_length + 64 + INET_ADDRSTRLEN);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    eol = memchr(request, '\n', head_length);
+    *length = eol + 1 - request;
+    memcpy(out, request, *length);
+    for (line = eol + 1; line < end; line = eol + 1) {
+        eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end - 1;
+        }
+        if (_header_is(line, request_hop_headers)) {
+            if (strncasecmp(line, "X-Forwarded-For:", 16) == 0) {
+                forwarded = _find_header_value(line - 1, eol + 1, "X-Forwarded-For:", &forwarded_length);
+            }
+            continue;
+        }
+        memcpy(out + *length, line, eol + 1 - line);
+        *length += eol + 1 - line;
+    }
+
+    written = sprintf(out + *length, "Connection: keep-alive\r\nX-Forwarded-For: %.*s%s%s\r\n\r\n",
+                      (int)forwarded_length, forwarded != NULL ? forwarded : "",
+                      forwarded_length > 0 ? ", " : "", ip);
+    *length += written;
+    memcpy(out + *length, request + head_length, body_length);
+    *length += body_length;
+    return out;
+}
+
+/**
+ * @brief Parses the head of a response.
+ *
+ * @param head The head.
+ * @param length Length of the head.
+ * @param no_body Whether the request was a HEAD.
+ * @param status Set to the status.
+ * @param framing Set to how the body ends.
+ * @param content_length Set to the Content-Length, if any.
+ * @param reusable Cleared if the backend closes the connection.
+ * @return 0 on success, -1 if it is not an HTTP/1.x head.
+ */
+int _parse_response_head(const char *head, size_t length, int no_body, int *status,
+                         Body_framing *framing, size_t *content_length, int *reusable) {
+    const char *end = head + length, *value;
+    size_t value_length;
+    int major, minor;
+
+    if (sscanf(head, "HTTP/%d.%d %d", &major, &minor, status) != 3 || major != 1) {
+        return -1;
+    }
+
+    value = _find_header_value(head, end, "Connection:", &value_length);
+    if (_value_has(value, value_length, "close") || (minor == 0 && !_value_has(value, value_length, "keep-alive"))) {
+        *reusable = 0;
+    }
+
+    if (no_body || (*status >= 100 && *status < 200) || *status == 204 || *status == 304) {
+        *framing = FRAMING_NONE;
+        return 0;
+    }
+    value = _find_header_value(head, end, "Transfer-Encoding:", &value_length);
+    if (_value_has(value, value_length, "chunked")) {
+        *framing = FRAMING_CHUNKED;
+        return 0;
+    }
+    value = _find_header_value(head, end, "Content-Length:", &value_length);
+    if (value != NULL) {
+        *content_length = strtoul(value, NULL, 10);
+        *framing = FRAMING_LENGTH;
+        return 0;
+    }
+    *framing = FRAMING_CLOSE;
+    *reusable = 0;
+    return 0;
+}
+
+/**
+ * @brief Feeds bytes to a chunked decoder.
+ *
+ * @param chunked The decoder.
+ * @param data Bytes of the body.
+ * @param length Number of bytes.
+ * @param used Set to the bytes that belong to the body.
+ * @param sink Gets the decoded data if it dechunks.
+ * @return 0 on success, -1 if the body is malformed or the sink fails.
+ */
+int _chunked_feed(Chunked *chunked, const char *data, size_t length, size_t *used, Proxy_sink *sink) {
+    size_t i = 0, part;
+    char c;
+    int digit;
+
+    while (i < length && chunked->state != CHUNK_DONE) {
+        c = data[i];
+        switch (chunked->state) {
+            case CHUNK_SIZE:
+                digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+                if (digit >= 0 && chunked->digits < 15) {
+                    chunked->remaining = chunked->remaining * 16 + digit;
+                    chunked->digits++;
+                } else if (chunked->digits == 0 || digit >= 0) {
+                    return -1;
+                } else {
+                    chunked->state = CHUNK_EXTENSION;
+                    continue;
+                }
+                break;
+            case CHUNK_EXTENSION:
+                if (c == '\n') {
+                    chunked->state = chunked->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                    chunked->digits = 0;
+                }
+                break;
+            case CHUNK_DATA:
+                part = length - i < chunked->remaining ? length - i : chunked->remaining;
+                if (sink->dechunk && sink->body(sink, data + i, part) == -1) {
+                    return -1;
+                }
+                chunked->remaining -= part;
+                i += part;
+                if (chunked->remaining == 0) {
+                    chunked->state = CHUNK_DATA_END;
+                }
+                continue;
+            case CHUNK_DATA_END:
+                if (c == '\n') {
+                    chunked->state = CHUNK_SIZE;
+                } else if (c != '\r') {
+                    return -1;
+                }
+                break;
+            case CHUNK_TRAILER:
+                chunked->state = c == '\n' ? CHUNK_DONE : c == '\r' ? CHUNK_TRAILER : CHUNK_TRAILER_LINE;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    chunked->state = CHUNK_TRAILER;
+                }
+                break;
+            default:
+                break;
+        }
+        i++;
+    }
+    *used = i;
+    return 0;
+}
+
+/**
+ * @brief Relays a response body from a backend to the sink.
+ *
+ * @param fd Connection to the backend.
+ * @param buffer Buffer whose first bytes are already part of the body.
+ * @param have Body bytes in the buffer.
+ * @param framing How the body ends.
+ * @param remaining Content-Length of the body.
+ * @param sink Destination of the body.
+ * @param reusable Cleared if bytes follow the body or it ends by closing.
+ * @return 0 on success, -1 on failure.
+ */
+int _relay_body(int fd, Io_buffer *buffer, size_t have, Body_framing framing, size_t remaining,
+                Proxy_sink *sink, int *reusable) {
+    int timeout_ms = atomic_load(&proxy_timeout) * 1000;
+    Chunked chunked = {CHUNK_SIZE, 0, 0};
+    ssize_t received;
+    size_t used = 0;
+
+    while (1) {
+        if (have > 0) {
+            switch (framing) {
+                case FRAMING_NONE:
+                    used = 0;
+                    break;
+                case FRAMING_LENGTH:
+                    used = have < remaining ? have : remaining;
+                    remaining -= used;
+                    if (sink->body(sink, buffer->data, used) == -1) {
+                        return -1;
+                    }
+                    break;
+                case FRAMING_CHUNKED:
+                    if (_chunked_feed(&chunked, buffer->data, have, &used, sink) == -1 ||
+                        (!sink->dechunk && sink->body(sink, buffer->data, used) == -1)) {
+                        return -1;
+                    }
+                    break;
+                case FRAMING_CLOSE:
+                    used = have;
+                    if (sink->body(sink, buffer->data, used) == -1) {
+                        return -1;
+                    }
+                    break;
+            }
+            // A backend must not send anything after the response
+            if (used < have) {
+                *reusable = 0;
+            }
+        }
+        if (framing == FRAMING_NONE || (framing == FRAMING_LENGTH && remaining == 0) ||
+            (framing == FRAMING_CHUNKED && chunked.state == CHUNK_DONE)) {
+            return 0;
+        }
+
+        have = 0;
+        if (wait_socket(fd, POLLIN, timeout_ms) != 1) {
+            return -1;
+        }
+        received = recv(fd, buffer->data, buffer->size, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (received == 0 && framing == FRAMING_CLOSE) {
+            return 0;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        have = received;
+    }
+}
+
+/**
+ * @brief Copies the rest of the request body from the client to the backend.
+ *
+ * @param fd Connection to the backend.
+ * @param buffer Buffer for the copy.
+ * @param exchange The request.
+ * @return 0 on success, or the outcome of the exchange on failure.
+ */
+int _stream_request_body(int fd, Io_buffer *buffer, Exchange *exchange) {
+    int timeout_ms = atomic_load(&proxy_timeout) * 1000, left;
+    Deadline client_deadline, upstream_deadline;
+    ssize_t received;
+    size_t wanted;
+
+    deadline_start(&client_deadline, exchange->limits->body_timeout * 1000L, 0, exchange->limits->min_upload_rate);
+    exchange->streamed = 1;
+    while (exchange->body_pending > 0) {
+        left = deadline_remaining(&client_deadline);
+        if (left == 0 || tls_wait(exchange->client, POLLIN, left) == 0) {
+            LOG_DEBUG("Cliente lento, cuerpo incompleto");
+            metrics_slow_client();
+            return EXCHANGE_FAILED;
+        }
+        wanted = exchange->body_pending < buffer->size ? exchange->body_pending : buffer->size;
+        received = tls_read(exchange->client, buffer->data, wanted);
+        if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (received <= 0) {
+            return EXCHANGE_FAILED;
+        }
+        client_deadline.bytes += received;
+        exchange->body_pending -= received;
+
+        deadline_start(&upstream_deadline, timeout_ms, 0, 0);
+        if (send_all_until(fd, buffer->data, received, &upstream_deadline) == -1) {
+            return EXCHANGE_RETRY;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a request to a backend and relays its response to the sink.
+ *
+ * @param fd Connection to the backend.
+ * @param exchange The request.
+ * @return The outcome of the exchange.
+ */
+int _exchange(int fd, Exchange *exchange) {
+    int timeout_ms = atomic_load(&proxy_timeout) * 1000, reusable = 1, outcome;
+    size_t have = 0, head_length = 0, content_length = 0, out_length;
+    Body_framing framing = FRAMING_CLOSE;
+    const char *line, *eol, *end;
+    Io_buffer *buffer;
+    Deadline deadline;
+    ssize_t received;
+    char *out;
+
+    deadline_start(&deadline, timeout_ms, 0, 0);
+    if (send_all_until(fd, exchange->head, exchange->head_length, &deadline) == -1) {
+        return errno == EPIPE || errno == ECONNRESET ? EXCHANGE_CLOSED : EXCHANGE_RETRY;
+    }
+
+    buffer = buffer_acquire(PROXY_HEAD_SIZE);
+    if (buffer == NULL) {
+        return EXCHANGE_RETRY;
+    }
+    if (exchange->body_pending > 0 && (outcome = _stream_request_body(fd, buffer, exchange)) != 0) {
+        buffer_release(buffer);
+        return outcome;
+    }
+
+    while (1) {
+        buffer->data[have] = '\0';
+        end = strstr(buffer->data, "\r\n\r\n");
+        if (end != NULL) {
+            head_length = end + 4 - buffer->data;
+            if (_parse_response_head(buffer->data, head_length, exchange->no_body, &exchange->status,
+                                     &framing, &content_length, &reusable) == -1 || exchange->status == 101) {
+                buffer_release(buffer);
+                return EXCHANGE_RETRY;
+            }
+            if (exchange->status >= 200) {
+                break;
+            }
+            // Interim responses (100 Continue) are not relayed
+            memmove(buffer->data, buffer->data + head_length, have - head_length);
+            have -= head_length;
+            reusable = 1;
+            continue;
+        }
+        if (have >= buffer->size - 1 || wait_socket(fd, POLLIN, timeout_ms) != 1) {
+            buffer_release(buffer);
+            return EXCHANGE_RETRY;
+        }
+        received = recv(fd, buffer->data + have, buffer->size - 1 - have, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (received <= 0) {
+            buffer_release(buffer);
+            return have == 0 && (received == 0 || errno == ECONNRESET) ? EXCHANGE_CLOSED : EXCHANGE_RETRY;
+        }
+        have += received;
+    }
+
+    // The head goes without the hop-by-hop headers of the backend connection
+    out = (char*)malloc(head_length + 1);
+    if (out == NULL) {
+        buffer_release(buffer);
+        return EXCHANGE_RETRY;
+    }
+    eol = memchr(buffer->data, '\n', head_length);
+    out_length = eol + 1 - buffer->data;
+    memcpy(out, buffer->data, out_length);
+    for (line = eol + 1; line < buffer->data + head_length; line = eol + 1) {
+        eol = memchr(line, '\n', buffer->data + head_length - line);
+        if (!_header_is(line, response_hop_headers)) {
+            memcpy(out + out_length, line, eol + 1 - line);
+            out_length += eol + 1 - line;
+        }
+    }
+    out[out_length] = '\0';
+    if (framing == FRAMING_CLOSE && !exchange->sink->dechunk) {
+        exchange->close_client = 1;
+    }
+    if (exchange->sink->dechunk && framing == FRAMING_CHUNKED) {
+        // The collected body is sent with its length, the coding is gone
+        for (line = out; (line = strcasestr(line, "\nTransfer-Encoding:")) != NULL;) {
+            eol = strchr(line + 1, '\n');
+            memmove((char*)line + 1, eol + 1, strlen(eol + 1) + 1);
+        }
+        out_length = strlen(out);
+    }
+    outcome = exchange->sink->head(exchange->sink, out, out_length);
+    free(out);
+    if (outcome == -1) {
+        buffer_release(buffer);
+        return EXCHANGE_FAILED;
+    }
+
+    memmove(buffer->data, buffer->data + head_length, have - head_length);
+    if (_relay_body(fd, buffer, have - head_length, framing, content_length, exchange->sink, &reusable) == -1) {
+        buffer_release(buffer);
+        return EXCHANGE_FAILED;
+    }
+    buffer_release(buffer);
+    exchange->complete = 1;
+    return reusable ? EXCHANGE_REUSABLE : EXCHANGE_DONE;
+}
+
+/**
+ * @brief Forwards a request to the backends of a route until one answers.
+ *
+ * A stale pooled connection is replaced without counting a failure. Other
+ * failures count against the backend and move to the next one, as long as
+ * the request can still be sent again.
+ *
+ * @param route Route of the request.
+ * @param exchange The request.
+ * @return 0 if the response was relayed, -1 if it failed halfway, 1 if no
+ *         backend answered and the sink got nothing.
+ */
+int _proxy(Proxy_route *route, Exchange *exchange) {
+    int timeout_ms = atomic_load(&proxy_timeout) * 1000, attempt, fd, reused, outcome;
+    Upstream *upstream;
+
+    for (attempt = 0; attempt <= route->count; attempt++) {
+        upstream = _pick_upstream(route);
+        if (upstream == NULL) {
+            break;
+        }
+
+        fd = _pool_take(upstream);
+        reused = fd != -1;
+        if (!reused && (fd = _upstream_connect(upstream, timeout_ms)) == -1) {
+            LOG_DEBUG("No se pudo conectar con el backend %s", upstream->name);
+            _upstream_failed(upstream);
+            continue;
+        }
+
+        atomic_fetch_add(&upstream->active, 1);
+        outcome = _exchange(fd, exchange);
+        atomic_fetch_sub(&upstream->active, 1);
+
+        if (outcome == EXCHANGE_REUSABLE) {
+            atomic_store(&upstream->fails, 0);
+            _pool_give(upstream, fd);
+            return 0;
+        }
+        close(fd);
+        if (outcome == EXCHANGE_DONE) {
+            atomic_store(&upstream->fails, 0);
+            return 0;
+        }
+        if (outcome == EXCHANGE_FAILED) {
+            return -1;
+        }
+        if (outcome == EXCHANGE_CLOSED && reused && !exchange->streamed) {
+            continue;
+        }
+        LOG_DEBUG("El backend %s no respondió", upstream->name);
+        _upstream_failed(upstream);
+        if (exchange->streamed || !exchange->idempotent) {
+            break;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends part of a response to the client.
+ *
+ * @param sink The client sink.
+ * @param data The bytes.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 on failure.
+ */
+int _client_write(Proxy_sink *sink, const char *data, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+    if (tls_send_all(sink->fd, data, length, &sink->deadline) == -1) {
+        if (errno == ETIMEDOUT) {
+            LOG_DEBUG("Cliente lento, respuesta incompleta");
+            metrics_slow_client();
+        }
+        return -1;
+    }
+    sink->bytes += length;
+    return 0;
+}
+
+/**
+ * @brief Keeps the head of a collected response.
+ *
+ * @param sink The buffer sink.
+ * @param data The head.
+ * @param length Length of the head.
+ * @return 0 on success, -1 if memory runs out.
+ */
+int _buffer_head(Proxy_sink *sink, const char *data, size_t length) {
+    sink->header = strndup(data, length);
+    return sink->header == NULL ? -1 : 0;
+}
+
+/**
+ * @brief Appends body bytes to a collected response.
+ *
+ * @param sink The buffer sink.
+ * @param data The bytes.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 if the body exceeds PROXY_FETCH_MAX or memory runs out.
+ */
+int _buffer_body(Proxy_sink *sink, const char *data, size_t length) {
+    size_t capacity = sink->capacity > 0 ? sink->capacity : 16384;
+    char *content;
+
+    if (sink->length + length > PROXY_FETCH_MAX) {
+        return -1;
+    }
+    while (capacity < sink->length + length) {
+        capacity *= 2;
+    }
+    if (capacity != sink->capacity) {
+        content = (char*)realloc(sink->content, capacity);
+        if (content == NULL) {
+            return -1;
+        }
+        sink->content = content;
+        sink->capacity = capacity;
+    }
+    memcpy(sink->content + sink->length, data, length);
+    sink->length += length;
+    return 0;
+}
+
+/**
+ * @brief Asks a backend for the health path.
+ *
+ * @param upstream The backend.
+ * @param path The health path.
+ * @return 1 if it answered with a 2xx or 3xx, 0 otherwise.
+ */
+int _probe_upstream(Upstream *upstream, const char *path) {
+    char request[512], reply[64];
+    int fd, status, healthy = 0;
+    size_t have = 0;
+    ssize_t received;
+    Deadline deadline;
+    int length;
+
+    fd = _upstream_connect(upstream, PROXY_HEALTH_TIMEOUT_MS);
+    if (fd == -1) {
+        return 0;
+    }
+    length = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                      path, upstream->name);
+    deadline_start(&deadline, PROXY_HEALTH_TIMEOUT_MS, 0, 0);
+    if (send_all_until(fd, request, length, &deadline) != -1) {
+        // The status line is enough
+        while (have < 12 && (length = deadline_remaining(&deadline)) > 0 && wait_socket(fd, POLLIN, length) == 1) {
+            received = recv(fd, reply + have, sizeof(reply) - 1 - have, 0);
+            if (received <= 0) {
+                break;
+            }
+            have += received;
+        }
+        reply[have] = '\0';
+        healthy = sscanf(reply, "HTTP/%*d.%*d %d", &status) == 1 && status >= 200 && status < 400;
+    }
+    close(fd);
+    return healthy;
+}
+
+/**
+ * @brief Periodically checks every backend until proxy_close.
+ *
+ * @param arg Unused.
+ * @return NULL
+ */
+void *_health_check(void *arg) {
+    struct timespec deadline;
+    char path[sizeof(health_path)];
+    Upstream *upstream;
+    int i, interval;
+
+    pthread_mutex_lock(&health_mutex);
+    while (!health_stop) {
+        interval = atomic_load(&proxy_health_interval);
+        if (interval > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += interval;
+            pthread_cond_timedwait(&health_cond, &health_mutex, &deadline);
+        } else {
+            pthread_cond_wait(&health_cond, &health_mutex);
+        }
+        if (health_stop || atomic_load(&proxy_health_interval) == 0) {
+            continue;
+        }
+        strcpy(path, health_path);
+        pthread_mutex_unlock(&health_mutex);
+
+        for (i = 0; i < atomic_load(&upstream_count); i++) {
+            upstream = &upstreams[i];
+            if (_probe_upstream(upstream, path)) {
+                if (atomic_exchange(&upstream->down, 0)) {
+                    atomic_store(&upstream->fails, 0);
+                    atomic_store(&upstream->ejected_until, 0);
+                    LOG_WARN("Backend %s de nuevo en rotación", upstream->name);
+                }
+            } else if (!atomic_exchange(&upstream->down, 1)) {
+                _pool_drain(upstream);
+                LOG_WARN("Backend %s no pasa la comprobación de salud", upstream->name);
+            }
+        }
+
+        pthread_mutex_lock(&health_mutex);
+    }
+    pthread_mutex_unlock(&health_mutex);
+    return NULL;
+}
+
+
+/**
+ * @brief Parses a route of the reverse proxy.
+ *
+ * @param value Value of the PROXY_n key.
+ * @param route Route to fill, its strings are allocated with malloc.
+ * @return 0 on success, -1 if the route is invalid or memory runs out.
+ */
+int _parse_route(const char *value, Proxy_route *route) {
+    char *copy, *field, *saveptr = NULL;
+
+    copy = strdup(value);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    field = strtok_r(copy, ",", &saveptr);
+    if (field == NULL || field[0] != '/') {
+        free(copy);
+        return -1;
+    }
+    route->prefix = strdup(field);
+    if (route->prefix == NULL) {
+        free(copy);
+        return -1;
+    }
+    route->prefix_length = strlen(field);
+
+    while ((field = strtok_r(NULL, ",", &saveptr)) != NULL) {
+        if (route->count == PROXY_MAX_UPSTREAMS || strchr(field, ':') == NULL) {
+            free(copy);
+            return -1;
+        }
+        route->upstreams[route->count] = strdup(field);
+        if (route->upstreams[route->count] == NULL) {
+            free(copy);
+            return -1;
+        }
+        route->count++;
+    }
+    free(copy);
+    return route->count > 0 ? 0 : -1;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int proxy_compile(Dict *dict, Proxy_options *options) {
+    Proxy_route *route;
+    char key[16];
+    int i;
+
+    for (i = 0; i < PROXY_MAX_ROUTES; i++) {
+        snprintf(key, sizeof(key), "PROXY_%d", i + 1);
+        if (get_value(dict, key) == NULL) {
+            continue;
+        }
+        route = &options->routes[options->route_count++];
+        if (_parse_route(get_value(dict, key), route) == -1) {
+            printf("Ruta %s invalida\n", key);
+            return -1;
+        }
+    }
+    options->balance = get_value(dict, "PROXY_BALANCE") != NULL &&
+                       strcmp(get_value(dict, "PROXY_BALANCE"), "least_conn") == 0 ? BALANCE_LEAST_CONN : BALANCE_ROUND_ROBIN;
+    if (conf_get_int(dict, "PROXY_KEEPALIVE", 16, &options->keepalive) != 0 ||
+        conf_get_int(dict, "PROXY_TIMEOUT", 30, &options->timeout) != 0 ||
+        conf_get_int(dict, "PROXY_MAX_FAILS", 3, &options->max_fails) != 0 ||
+        conf_get_int(dict, "PROXY_EJECT_TIME", 10, &options->eject_time) != 0 ||
+        conf_get_int(dict, "PROXY_HEALTH_INTERVAL", 5, &options->health_interval) != 0 ||
+        conf_get_string(dict, "PROXY_HEALTH_PATH", "/", &options->health_path) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void proxy_free_options(Proxy_options *options) {
+    int i, j;
+
+    for (i = 0; i < options->route_count; i++) {
+        free(options->routes[i].prefix);
+        for (j = 0; j < options->routes[i].count; j++) {
+            free(options->routes[i].upstreams[j]);
+        }
+    }
+    free(options->health_path);
+    options->route_count = 0;
+    options->health_path = NULL;
+}
+
+int proxy_init(Proxy_options *options) {
+    int i;
+
+    for (i = 0; i < PROXY_UPSTREAM_SLOTS; i++) {
+        pthread_mutex_init(&upstreams[i].mutex, NULL);
+    }
+    if (proxy_configure(options) == -1) {
+        return -1;
+    }
+
+    health_stop = 0;
+    if (pthread_create(&health_thread, NULL, _health_check, NULL) != 0) {
+        perror("proxy");
+        return -1;
+    }
+    health_running = 1;
+    return 0;
+}
+
+int proxy_configure(Proxy_options *options) {
+    Proxy_route *route;
+    int i, j;
+
+    for (i = 0; i < options->route_count; i++) {
+        route = &options->routes[i];
+        route->index = i;
+        for (j = 0; j < route->count; j++) {
+            route->slots[j] = _find_upstream(route->upstreams[j]);
+            if (route->slots[j] == -1) {
+                printf("No se pudo resolver el backend %s\n", route->upstreams[j]);
+                return -1;
+            }
+        }
+    }
+
+    atomic_store(&proxy_balance, options->balance);
+    atomic_store(&proxy_keepalive, options->keepalive > 0 ? options->keepalive : 0);
+    atomic_store(&proxy_timeout, options->timeout > 0 ? options->timeout : 30);
+    atomic_store(&proxy_max_fails, options->max_fails > 0 ? options->max_fails : 0);
+    atomic_store(&proxy_eject_time, options->eject_time > 0 ? options->eject_time : 10);
+
+    pthread_mutex_lock(&health_mutex);
+    snprintf(health_path, sizeof(health_path), "%s", options->health_path != NULL ? options->health_path : "/");
+    // Wakes the checks up so a new interval applies at once
+    atomic_store(&proxy_health_interval, options->health_interval > 0 ? options->health_interval : 0);
+    pthread_cond_signal(&health_cond);
+    pthread_mutex_unlock(&health_mutex);
+    return 0;
+}
+
+int proxy_forward(Proxy_route *route, int client_socket, const char *request, size_t length,
+                  uint32_t address, Transfer_limits *limits, int *status, size_t *bytes) {
+    size_t head_length, announced = 0, received, value_length, out_length;
+    const char *end, *value;
+    Exchange exchange;
+    Proxy_sink sink;
+    Deadline deadline;
+    char *out = NULL;
+    int result = 1;
+
+    *status = 502;
+    *bytes = 0;
+
+    end = strstr(request, "\r\n\r\n");
+    if (end != NULL) {
+        head_length = end + 4 - request;
+        value = _find_header_value(request, end + 2, "Content-Length:", &value_length);
+        if (value != NULL) {
+            announced = strtoul(value, NULL, 10);
+        }
+        received = length - head_length < announced ? length - head_length : announced;
+        out = _rewrite_request(request, head_length, received, address, &out_length);
+    }
+
+    if (out != NULL) {
+        memset(&exchange, 0, sizeof(exchange));
+        exchange.head = out;
+        exchange.head_length = out_length;
+        exchange.body_pending = announced - received;
+        exchange.client = client_socket;
+        exchange.limits = limits;
+        exchange.no_body = strncmp(request, "HEAD ", 5) == 0;
+        exchange.idempotent = strncmp(request, "POST ", 5) != 0 && strncmp(request, "PATCH ", 6) != 0;
+
+        memset(&sink, 0, sizeof(sink));
+        sink.head = _client_write;
+        sink.body = _client_write;
+        sink.fd = client_socket;
+        deadline_start(&sink.deadline, SEND_TIMEOUT_MS, 0, limits->min_download_rate);
+        exchange.sink = &sink;
+
+        result = _proxy(route, &exchange);
+        free(out);
+        *status = exchange.status;
+        *bytes = sink.bytes;
+    }
+
+    if (result == 1) {
+        *status = 502;
+        deadline_start(&deadline, SEND_TIMEOUT_MS, 0, 0);
+        if (tls_send_all(client_socket, PROXY_BAD_GATEWAY_RESPONSE, sizeof(PROXY_BAD_GATEWAY_RESPONSE) - 1, &deadline) != -1) {
+            *bytes = sizeof(PROXY_BAD_GATEWAY_RESPONSE) - 1;
+        }
+        return -1;
+    }
+    return result == 0 && !exchange.close_client ? 0 : -1;
+}
+
+int proxy_fetch(Proxy_route *route, Proxy_fetch *fetch) {
+    char ip[INET_ADDRSTRLEN], *request;
+    Exchange exchange;
+    Proxy_sink sink;
+    struct in_addr in;
+    size_t size;
+    int length;
+
+    in.s_addr = fetch->address;
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+
+    size = strlen(fetch->method) + strlen(fetch->path) + PROXY_NAME_SIZE + INET_ADDRSTRLEN + 160 + fetch->body_length;
+    request = (char*)malloc(size);
+    if (request == NULL) {
+        return -1;
+    }
+    // Every backend of the route is asked with the name of the first one
+    length = snprintf(request, size, "%s %s HTTP/1.1\r\nHost: %s\r\n", fetch->method, fetch->path,
+                      upstreams[route->slots[0]].name);
+    if (fetch->body_length > 0 || strcmp(fetch->method, "POST") == 0 || strcmp(fetch->method, "PUT") == 0) {
+        length += snprintf(request + length, size - length, "Content-Length: %zu\r\n", fetch->body_length);
+    }
+    length += snprintf(request + length, size - length, "Connection: keep-alive\r\nX-Forwarded-For: %s\r\n\r\n", ip);
+    if (fetch->body_length > 0) {
+        memcpy(request + length, fetch->body, fetch->body_length);
+    }
+
+    memset(&exchange, 0, sizeof(exchange));
+    exchange.head = request;
+    exchange.head_length = length + fetch->body_length;
+    exchange.client = -1;
+    exchange.no_body = strcmp(fetch->method, "HEAD") == 0;
+    exchange.idempotent = strcmp(fetch->method, "POST") != 0 && strcmp(fetch->method, "PATCH") != 0;
+
+    memset(&sink, 0, sizeof(sink));
+    sink.head = _buffer_head;
+    sink.body = _buffer_body;
+    sink.dechunk = 1;
+    exchange.sink = &sink;
+
+    _proxy(route, &exchange);
+    free(request);
+
+    if (!exchange.complete) {
+        free(sink.header);
+        free(sink.content);
+        fetch->status = 502;
+        fetch->header = strdup(PROXY_BAD_GATEWAY_RESPONSE);
+        fetch->content = NULL;
+        fetch->content_length = 0;
+        return fetch->header == NULL ? -1 : 0;
+    }
+    fetch->status = exchange.status;
+    fetch->header = sink.header;
+    fetch->content = sink.content;
+    fetch->content_length = sink.length;
+    return 0;
+}
+
+void proxy_close() {
+    int i;
+
+    if (health_running) {
+        pthread_mutex_lock(&health_mutex);
+        health_stop = 1;
+        pthread_cond_signal(&health_cond);
+        pthread_mutex_unlock(&health_mutex);
+        pthread_join(health_thread, NULL);
+        health_running = 0;
+    }
+
+    for (i = 0; i < atomic_load(&upstream_count); i++) {
+        _pool_drain(&upstreams[i]);
+    }
+}
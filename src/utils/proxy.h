@@ -0,0 +1,184 @@
+/**
+ * @file proxy.h
+ * @brief Header file for the reverse proxy to local upstream backends.
+ *
+ * Requests whose path starts with the prefix of a route are forwarded to
+ * one of the backends of the route, chosen round robin or by least
+ * connections. Connections to the backends are kept open after each
+ * response and pooled per backend, so a request usually pays no TCP
+ * handshake.
+ *
+ * On HTTP/1.1 both bodies are streamed: the part of the request body that
+ * did not fit in the receive buffer is copied from the client as it
+ * arrives, and the response is relayed while the backend sends it. Over
+ * HTTP/2 the response is collected first and sent as DATA frames.
+ *
+ * A backend that fails max_fails times in a row is ejected for a while
+ * (passive ejection), and a background thread asks every backend for the
+ * health path, taking out of rotation those that do not answer with a
+ * 2xx or 3xx until they do again.
+ *
+ * Backends keep their state across configuration reloads, routes are
+ * resolved to them by proxy_configure before a configuration is published.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include "socket.h"
+#include "conf_parser.h"
+
+#define PROXY_MAX_ROUTES 8
+#define PROXY_MAX_UPSTREAMS 8
+#define PROXY_UPSTREAM_SLOTS 32
+#define PROXY_POOL_SLOTS 64
+#define PROXY_HEAD_SIZE 16384
+#define PROXY_FETCH_MAX (16 * 1024 * 1024)
+#define PROXY_HEALTH_TIMEOUT_MS 2000
+
+// Pre-rendered, sent when no backend could take the request
+#define PROXY_BAD_GATEWAY_RESPONSE "HTTP/1.1 502 Bad Gateway\r\n" \
+    "Content-Type: text/plain; charset=UTF-8\r\n" \
+    "Content-Length: 12\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "Bad Gateway\n"
+
+/**
+ * @enum Proxy_balance
+ * @brief How the backend of a request is chosen.
+ */
+typedef enum {
+    BALANCE_ROUND_ROBIN,  /**< Each backend in turn. */
+    BALANCE_LEAST_CONN    /**< The backend with fewer requests in flight. */
+} Proxy_balance;
+
+/**
+ * @struct Proxy_route
+ * @brief Prefix of paths forwarded to a group of backends.
+ */
+typedef struct {
+    char *prefix;                          /**< Path prefix of the route. */
+    size_t prefix_length;                  /**< Length of prefix. */
+    char *upstreams[PROXY_MAX_UPSTREAMS];  /**< host:port of each backend. */
+    int slots[PROXY_MAX_UPSTREAMS];        /**< State of each backend, set by proxy_configure. */
+    int count;                             /**< Number of backends. */
+    int index;                             /**< Position of the route, selects its round robin cursor. */
+} Proxy_route;
+
+/**
+ * @struct Proxy_options
+ * @brief Routes and settings of the reverse proxy.
+ */
+typedef struct {
+    Proxy_route routes[PROXY_MAX_ROUTES];  /**< Routes, checked in order. */
+    int route_count;                       /**< Number of routes, 0 disables the proxy. */
+    Proxy_balance balance;                 /**< How backends are chosen. */
+    int keepalive;                         /**< Idle connections kept per backend. */
+    int timeout;                           /**< Seconds to wait for a backend. */
+    int max_fails;                         /**< Failures in a row that eject a backend, 0 never ejects. */
+    int eject_time;                        /**< Seconds an ejected backend is left out. */
+    int health_interval;                   /**< Seconds between health checks, 0 disables them. */
+    char *health_path;                     /**< Path requested by the health checks. */
+} Proxy_options;
+
+/**
+ * @struct Proxy_fetch
+ * @brief Request forwarded by proxy_fetch and the response it collects.
+ */
+typedef struct {
+    const char *method;     /**< Method of the request. */
+    const char *path;       /**< Path of the request, query included. */
+    const char *body;       /**< Body of the request. */
+    size_t body_length;     /**< Length of body. */
+    uint32_t address;       /**< IPv4 address of the client, network byte order. */
+    int status;             /**< Set to the status of the response, 502 if no backend answered. */
+    char *header;           /**< Set to the head of the response, allocated with malloc. */
+    char *content;          /**< Set to the body of the response, allocated with malloc, NULL if empty. */
+    size_t content_length;  /**< Set to the length of content. */
+} Proxy_fetch;
+
+/**
+ * @brief Compiles the PROXY_* keys.
+ *
+ * Each PROXY_n route is the prefix followed by the backends, separated by
+ * commas: /api,127.0.0.1:9001,127.0.0.1:9002
+ *
+ * @param dict Parsed configuration.
+ * @param options Options to fill, free them with proxy_free_options.
+ * @return 0 on success, -1 if a value is invalid or memory runs out.
+ */
+int proxy_compile(Dict *dict, Proxy_options *options);
+
+/**
+ * @brief Frees the strings of options filled by proxy_compile.
+ *
+ * @param options The options.
+ */
+void proxy_free_options(Proxy_options *options);
+
+/**
+ * @brief Resolves the backends and starts the health checks.
+ *
+ * @param options Initial routes and settings.
+ * @return 0 on success, -1 if a backend cannot be resolved or the thread
+ *         cannot be created.
+ */
+int proxy_init(Proxy_options *options);
+
+/**
+ * @brief Applies the settings and resolves the backends of the routes.
+ *
+ * Fills the slots of every route. Backends already known keep their pool
+ * and their health, new ones get a free slot.
+ *
+ * @param options Routes and settings, not yet published.
+ * @return 0 on success, -1 if a backend cannot be resolved or there are no
+ *         free slots (nothing is changed then).
+ */
+int proxy_configure(Proxy_options *options);
+
+/**
+ * @brief Forwards an HTTP/1.x request and relays the response to the client.
+ *
+ * Body bytes announced by Content-Length that are not in the request yet
+ * are read from the client while they are sent to the backend. If no
+ * backend can be used before anything reaches the client, a 502 is sent.
+ *
+ * @param route Route of the request.
+ * @param client_socket Socket of the client.
+ * @param request Head and received body, NUL terminated after length.
+ * @param length Bytes of the request received.
+ * @param address IPv4 address of the client, network byte order.
+ * @param limits Deadlines of the client transfers.
+ * @param status Set to the status of the response.
+ * @param bytes Set to the bytes sent to the client.
+ * @return 0 if the client connection can serve another request, -1 if it
+ *         must be closed.
+ */
+int proxy_forward(Proxy_route *route, int client_socket, const char *request, size_t length,
+                  uint32_t address, Transfer_limits *limits, int *status, size_t *bytes);
+
+/**
+ * @brief Forwards a request and collects the whole response.
+ *
+ * Chunked responses are decoded. Used by HTTP/2, whose frames are sent
+ * from the collected response, so responses bigger than PROXY_FETCH_MAX
+ * become a 502.
+ *
+ * @param route Route of the request.
+ * @param fetch The request, the response is stored in it.
+ * @return 0 on success (the response may be a 502), -1 if memory ran out.
+ */
+int proxy_fetch(Proxy_route *route, Proxy_fetch *fetch);
+
+/**
+ * @brief Stops the health checks and closes the pooled connections.
+ */
+void proxy_close();
+
+#endif
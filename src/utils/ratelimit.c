@@ -0,0 +1,338 @@
+/**
+ * @file ratelimit.c
+ * @brief Sharded table of per-address token buckets.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include "ratelimit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * @struct Rate_bucket
+ * @brief State of one source address.
+ */
+typedef struct {
+    uint32_t address;          /**< Address of the client, 0 if the slot is empty. */
+    int connections;           /**< Open connections of the address. */
+    double tokens;             /**< Requests that can be served right now. */
+    unsigned long updated_ms;  /**< Last refill, also the last use of the bucket. */
+} Rate_bucket;
+
+/**
+ * @struct Rate_shard
+ * @brief Part of the table protected by its own lock.
+ *
+ * Slots use open addressing with linear probing. Nothing is deleted in
+ * place, the sweep rebuilds the shard with the buckets still alive.
+ */
+typedef struct {
+    _Alignas(64) pthread_mutex_t mutex;   /**< Protects the shard. */
+    int used;                             /**< Occupied slots. */
+    Rate_bucket slots[RATE_SHARD_SLOTS];  /**< Buckets of the shard. */
+} Rate_shard;
+
+/* ---------------------- Global objects ---------------------- */
+Rate_shard *rate_shards = NULL;
+
+_Atomic int rate_requests = 0;
+_Atomic int rate_burst = 0;
+_Atomic int rate_connections = 0;
+_Atomic int rate_idle = 60;
+
+pthread_t sweep_thread;
+pthread_mutex_t sweep_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sweep_cond = PTHREAD_COND_INITIALIZER;
+int sweep_stop = 0;
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Coarse monotonic time, enough for refills and costs a few ns.
+ *
+ * @return Milliseconds since an arbitrary point.
+ */
+unsigned long _now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (unsigned long)ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Mixes the bits of an address (murmur3 finalizer).
+ *
+ * The top bits choose the shard and the bottom ones the first slot.
+ *
+ * @param address The address.
+ * @return The hash.
+ */
+uint32_t _hash_address(uint32_t address) {
+    address ^= address >> 16;
+    address *= 0x85ebca6bU;
+    address ^= address >> 13;
+    address *= 0xc2b2ae35U;
+    address ^= address >> 16;
+    return address;
+}
+
+/**
+ * @brief Looks up the bucket of an address, creating it if asked.
+ *
+ * Must be called with the lock of the shard held. A shard is never filled
+ * beyond three quarters so probes stay short.
+ *
+ * @param shard Shard of the address.
+ * @param address The address.
+ * @param hash Hash of the address.
+ * @param create Whether to create a missing bucket.
+ * @param now Current time in milliseconds.
+ * @return The bucket, or NULL if it does not exist and was not created.
+ */
+Rate_bucket *_find_rate_bucket(Rate_shard *shard, uint32_t address, uint32_t hash, int create, unsigned long now) {
+    Rate_bucket *bucket;
+    int i, slot;
+
+    for (i = 0; i < RATE_SHARD_SLOTS; i++) {
+        slot = (hash + i) & (RATE_SHARD_SLOTS - 1);
+        bucket = &shard->slots[slot];
+        if (bucket->address == address) {
+            return bucket;
+        }
+        if (bucket->address == 0) {
+            break;
+        }
+    }
+
+    if (!create || i == RATE_SHARD_SLOTS || shard->used >= RATE_SHARD_SLOTS / 4 * 3) {
+        return NULL;
+    }
+    bucket->address = address;
+    bucket->connections = 0;
+    bucket->tokens = atomic_load_explicit(&rate_burst, memory_order_relaxed);
+    bucket->updated_ms = now;
+    shard->used++;
+    return bucket;
+}
+
+/**
+ * @brief Adds the tokens earned since the last refill.
+ *
+ * @param bucket The bucket.
+ * @param now Current time in milliseconds.
+ */
+void _refill(Rate_bucket *bucket, unsigned long now) {
+    int requests = atomic_load_explicit(&rate_requests, memory_order_relaxed);
+    int burst = atomic_load_explicit(&rate_burst, memory_order_relaxed);
+
+    bucket->tokens += (double)(now - bucket->updated_ms) * requests / 1000.0;
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
+    }
+    bucket->updated_ms = now;
+}
+
+/**
+ * @brief Rebuilds a shard without the buckets that are no longer used.
+ *
+ * @param shard The shard.
+ * @param now Current time in milliseconds.
+ * @param idle_ms Idle time after which a bucket without connections goes.
+ */
+void _sweep_shard(Rate_shard *shard, unsigned long now, unsigned long idle_ms) {
+    Rate_bucket alive[RATE_SHARD_SLOTS];
+    Rate_bucket *bucket;
+    int count = 0, i;
+
+    pthread_mutex_lock(&shard->mutex);
+    for (i = 0; i < RATE_SHARD_SLOTS && shard->used > 0; i++) {
+        bucket = &shard->slots[i];
+        if (bucket->address != 0 && (bucket->connections > 0 || now - bucket->updated_ms < idle_ms)) {
+            alive[count++] = *bucket;
+        }
+    }
+    if (count < shard->used) {
+        memset(shard->slots, 0, sizeof(shard->slots));
+        shard->used = 0;
+        for (i = 0; i < count; i++) {
+            bucket = _find_rate_bucket(shard, alive[i].address, _hash_address(alive[i].address), 1, now);
+            *bucket = alive[i];
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/**
+ * @brief Periodically removes idle buckets until ratelimit_close.
+ *
+ * @param arg Unused.
+ * @return NULL
+ */
+void *_sweep(void *arg) {
+    struct timespec deadline;
+    int i;
+
+    pthread_mutex_lock(&sweep_mutex);
+    while (!sweep_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += RATE_SWEEP_INTERVAL;
+        pthread_cond_timedwait(&sweep_cond, &sweep_mutex, &deadline);
+        if (sweep_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&sweep_mutex);
+
+        for (i = 0; i < RATE_SHARDS; i++) {
+            // Reading used without the lock only decides whether to look
+            if (rate_shards[i].used > 0) {
+                _sweep_shard(&rate_shards[i], _now_ms(), atomic_load(&rate_idle) * 1000UL);
+            }
+        }
+
+        pthread_mutex_lock(&sweep_mutex);
+    }
+    pthread_mutex_unlock(&sweep_mutex);
+    return NULL;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int ratelimit_compile(Dict *dict, Rate_limits *limits) {
+    if (conf_get_int(dict, "RATE_LIMIT", 0, &limits->requests) != 0 ||
+        conf_get_int(dict, "RATE_BURST", 2 * limits->requests, &limits->burst) != 0 ||
+        conf_get_int(dict, "MAX_CONN_PER_IP", 0, &limits->connections) != 0 ||
+        conf_get_int(dict, "RATE_IDLE_TIMEOUT", 60, &limits->idle_timeout) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int ratelimit_init(Rate_limits *limits) {
+    int i;
+
+    ratelimit_configure(limits);
+
+    // calloc only guarantees 16 bytes, the shards must start on their own cache line
+    rate_shards = (Rate_shard*)aligned_alloc(64, RATE_SHARDS * sizeof(Rate_shard));
+    if (rate_shards == NULL) {
+        perror("ratelimit");
+        return -1;
+    }
+    memset(rate_shards, 0, RATE_SHARDS * sizeof(Rate_shard));
+    for (i = 0; i < RATE_SHARDS; i++) {
+        pthread_mutex_init(&rate_shards[i].mutex, NULL);
+    }
+
+    sweep_stop = 0;
+    if (pthread_create(&sweep_thread, NULL, _sweep, NULL) != 0) {
+        perror("ratelimit");
+        free(rate_shards);
+        rate_shards = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void ratelimit_configure(Rate_limits *limits) {
+    atomic_store(&rate_requests, limits->requests > 0 ? limits->requests : 0);
+    atomic_store(&rate_burst, limits->burst > 0 ? limits->burst : (limits->requests > 0 ? limits->requests : 1));
+    atomic_store(&rate_connections, limits->connections > 0 ? limits->connections : 0);
+    atomic_store(&rate_idle, limits->idle_timeout > 0 ? limits->idle_timeout : 60);
+}
+
+int ratelimit_connect(uint32_t address) {
+    int requests = atomic_load_explicit(&rate_requests, memory_order_relaxed);
+    int connections = atomic_load_explicit(&rate_connections, memory_order_relaxed);
+    uint32_t hash = _hash_address(address);
+    Rate_shard *shard;
+    Rate_bucket *bucket;
+    unsigned long now;
+    int status = 0;
+
+    if (rate_shards == NULL || (requests == 0 && connections == 0)) {
+        return 0;
+    }
+
+    now = _now_ms();
+    shard = &rate_shards[hash >> 26];
+    pthread_mutex_lock(&shard->mutex);
+    bucket = _find_rate_bucket(shard, address, hash, 1, now);
+    if (bucket != NULL) {
+        _refill(bucket, now);
+        if ((connections > 0 && bucket->connections >= connections) || (requests > 0 && bucket->tokens < 1)) {
+            status = -1;
+        } else {
+            bucket->connections++;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return status;
+}
+
+void ratelimit_disconnect(uint32_t address) {
+    uint32_t hash = _hash_address(address);
+    Rate_shard *shard;
+    Rate_bucket *bucket;
+
+    if (rate_shards == NULL) {
+        return;
+    }
+
+    shard = &rate_shards[hash >> 26];
+    pthread_mutex_lock(&shard->mutex);
+    bucket = _find_rate_bucket(shard, address, hash, 0, 0);
+    // The limits may have been enabled by a reload after the connection was accepted
+    if (bucket != NULL && bucket->connections > 0) {
+        bucket->connections--;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+int ratelimit_request(uint32_t address) {
+    uint32_t hash = _hash_address(address);
+    Rate_shard *shard;
+    Rate_bucket *bucket;
+    unsigned long now;
+    int status = 0;
+
+    if (rate_shards == NULL || atomic_load_explicit(&rate_requests, memory_order_relaxed) == 0) {
+        return 0;
+    }
+
+    now = _now_ms();
+    shard = &rate_shards[hash >> 26];
+    pthread_mutex_lock(&shard->mutex);
+    bucket = _find_rate_bucket(shard, address, hash, 1, now);
+    if (bucket != NULL) {
+        _refill(bucket, now);
+        if (bucket->tokens < 1) {
+            status = -1;
+        } else {
+            bucket->tokens -= 1;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return status;
+}
+
+void ratelimit_close() {
+    if (rate_shards == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&sweep_mutex);
+    sweep_stop = 1;
+    pthread_cond_signal(&sweep_cond);
+    pthread_mutex_unlock(&sweep_mutex);
+    pthread_join(sweep_thread, NULL);
+
+    free(rate_shards);
+    rate_shards = NULL;
+}
@@ -0,0 +1,106 @@
+/**
+ * @file ratelimit.h
+ * @brief Header file for per-client-IP rate limiting.
+ *
+ * Every source address gets a token bucket for its request rate and a count
+ * of its open connections. The buckets live in a hash table split into
+ * shards, each with its own lock and its own cache lines, so clients only
+ * contend when their addresses fall in the same shard. A check is a hash, a
+ * short probe and a few arithmetic operations under an uncontended lock,
+ * well under a microsecond, so it runs on the accept path.
+ *
+ * Buckets of addresses without connections that have been idle for a while
+ * are removed by a background sweep. When a shard is full new addresses are
+ * let through rather than refused.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include "conf_parser.h"
+
+#define RATE_SHARDS 64
+#define RATE_SHARD_SLOTS 1024
+#define RATE_SWEEP_INTERVAL 5
+
+// Pre-rendered, over-limit clients cost no parsing nor formatting
+#define RATE_LIMIT_RESPONSE "HTTP/1.1 429 Too Many Requests\r\n" \
+    "Content-Type: text/plain; charset=UTF-8\r\n" \
+    "Content-Length: 18\r\n" \
+    "Retry-After: 1\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "Too Many Requests\n"
+
+/**
+ * @struct Rate_limits
+ * @brief Limits applied to every source address.
+ */
+typedef struct {
+    int requests;        /**< Requests per second refilled in the bucket, 0 for no limit. */
+    int burst;           /**< Size of the bucket, requests allowed at once. */
+    int connections;     /**< Simultaneous connections, 0 for no limit. */
+    int idle_timeout;    /**< Seconds after which an unused bucket is removed. */
+} Rate_limits;
+
+/**
+ * @brief Compiles RATE_LIMIT, RATE_BURST, MAX_CONN_PER_IP and RATE_IDLE_TIMEOUT.
+ *
+ * @param dict Parsed configuration.
+ * @param limits Limits to fill.
+ * @return 0 on success, -1 if a value is invalid.
+ */
+int ratelimit_compile(Dict *dict, Rate_limits *limits);
+
+/**
+ * @brief Creates the table and starts the sweep thread.
+ *
+ * @param limits Initial limits.
+ * @return 0 on success, -1 if the table or the thread cannot be created.
+ */
+int ratelimit_init(Rate_limits *limits);
+
+/**
+ * @brief Changes the limits, buckets already in the table keep their state.
+ *
+ * @param limits New limits.
+ */
+void ratelimit_configure(Rate_limits *limits);
+
+/**
+ * @brief Checks a new connection and counts it.
+ *
+ * Besides its connection limit, an address that has run out of request
+ * tokens cannot open new connections until the bucket refills.
+ *
+ * @param address IPv4 address of the client, network byte order.
+ * @return 0 if it is accepted, -1 if the address is over a limit (nothing
+ *         is counted then).
+ */
+int ratelimit_connect(uint32_t address);
+
+/**
+ * @brief Forgets a connection counted by ratelimit_connect.
+ *
+ * @param address IPv4 address of the client, network byte order.
+ */
+void ratelimit_disconnect(uint32_t address);
+
+/**
+ * @brief Takes a request token.
+ *
+ * @param address IPv4 address of the client, network byte order.
+ * @return 0 if the request can be served, -1 if the address is over its rate.
+ */
+int ratelimit_request(uint32_t address);
+
+/**
+ * @brief Stops the sweep thread and frees the table.
+ */
+void ratelimit_close();
+
+#endif
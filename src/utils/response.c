@@ -12,6 +12,10 @@
  
 #include "response.h"
 #include "socket.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include <errno.h>
 
 /* ---------------------- Private Functions ---------------------- */
 /**
@@ -20,18 +24,23 @@
  * This function allocates and initializes a new Response structure.
  * It sets up the necessary fields and prepares the object for use.
  * 
+ * @param arena Arena to allocate from, NULL to use malloc.
  * @return A pointer to the newly created Response object, or NULL if
  *         memory allocation fails.
  */
-Response *_init_response() {
+Response *_init_response(Arena *arena) {
     Response *response;
-    response = (Response*)malloc(sizeof(Response));
+    response = (Response*)arena_alloc(arena, sizeof(Response));
     if (response == NULL) {
         return NULL;
     }
+    response->arena = arena;
     response->content = NULL;
     response->header = NULL;
     response->content_length = 0;
+    response->mapped = 0;
+    response->shared = 0;
+    response->flight = NULL;
     return response;
 }
 
@@ -46,12 +55,13 @@ Response *_init_response() {
  * @param type The file type for which the OPTIONS header is being created.
  *             This parameter is expected to be of type `File_type`.
  *
+ * @param arena Arena to allocate from, NULL to use malloc.
  * @return A dynamically allocated string containing the OPTIONS header.
  *         The caller is responsible for freeing the returned string.
  */
-char *_create_OPTIONS_header(File_type type) {
+char *_create_OPTIONS_header(File_type type, Arena *arena) {
     char *header = NULL;
-    header = (char*)calloc(sizeof(char), 100);
+    header = (char*)arena_calloc(arena, sizeof(char), 100);
     if (header == NULL) {
         return NULL;
     }
@@ -105,12 +115,13 @@ char *_create_OPTIONS_header(File_type type) {
  * @param filename The name of the file being requested.
  * @param file_size The size of the file in bytes.
  * @param type The type of the file (e.g., text, image, etc.).
+ * @param arena Arena to allocate from, NULL to use malloc.
  * @return A dynamically allocated string containing the HTTP GET response header.
  *         The caller is responsible for freeing the allocated memory.
  */
-char *_create_GET_header(char *filename, long file_size, File_type type) {
+char *_create_GET_header(char *filename, long file_size, File_type type, Arena *arena) {
     char *header = NULL;
-    header = (char*)calloc(sizeof(char), 200);
+    header = (char*)arena_calloc(arena, sizeof(char), 200);
     if (header == NULL) {
         return NULL;
     }
@@ -145,6 +156,12 @@ char *_create_GET_header(char *filename, long file_size, File_type type) {
             "Content-Length: %ld\r\n"
             "Content-Disposition: attachment; filename=\"video.mp4\"\r\n"
             "\r\n", file_size);
+    } else if (type == METRICS) {
+        sprintf(header, "HTTP/1.1 200 OK\r\n"
+            "Content-Type: " METRICS_CONTENT_TYPE "\r\n"
+            "Content-Length: %ld\r\n"
+            "Cache-Control: no-store\r\n"
+            "\r\n", file_size);
     }
     return header;
 }
@@ -160,15 +177,16 @@ char *_create_GET_header(char *filename, long file_size, File_type type) {
  *                 This should be a null-terminated string.
  * @param file_size The size of the file in bytes.
  * @param type The type of the file, represented as a `File_type` enum or similar.
+ * @param arena Arena to allocate from, NULL to use malloc.
  * 
  * @return A dynamically allocated string containing the POST request header.
  *         The caller is responsible for freeing the memory allocated for the
  *         returned string.
  */
 
-char *_create_POST_header(char *filename, long file_size, File_type type) {
+char *_create_POST_header(char *filename, long file_size, File_type type, Arena *arena) {
     char *header = NULL;
-    header = (char*)calloc(sizeof(char), 100);
+    header = (char*)arena_calloc(arena, sizeof(char), 100);
     if (header == NULL) {
         return NULL;
     }
@@ -181,74 +199,70 @@ char *_create_POST_header(char *filename, long file_size, File_type type) {
 
 
 /**
- * @brief Creates a 404 HTTP response header.
+ * @brief Creates a complete HTTP error response with an HTML body.
  *
- * This function generates a 404 Not Found response header based on the provided
- * parser object. The generated header can be used to inform the client that the
- * requested resource could not be found on the server.
- *
- * @param parser A pointer to a Parser object containing relevant information
- *               for constructing the response header.
- * @return A dynamically allocated string containing the 404 response header.
+ * @param code HTTP status code of the response.
+ * @param reason Reason phrase of the status code.
+ * @param arena Arena to allocate from, NULL to use malloc.
+ * @return A dynamically allocated string containing the header and body.
  *         The caller is responsible for freeing the allocated memory.
  */
-char *_create_404_header(Parser *parser) {
-    char *header = NULL;
-    char *body = "<!DOCTYPE html>\n"
+char *_create_error_response(int code, const char *reason, Arena *arena) {
+    char *response = NULL;
+    char body[256];
+    int body_length;
+
+    body_length = snprintf(body, sizeof(body), "<!DOCTYPE html>\n"
         "<html>\n"
         "<head>\n"
-        "<title>404 Not Found</title>\n"
+        "<title>%d %s</title>\n"
         "</head>\n"
         "<body>\n"
-        "<h1>Error 404 Not Found</h1>\n"
+        "<h1>Error %d %s</h1>\n"
         "</body>\n"
-        "</html>\n";
-    int body_length = strlen(body);
-    header = (char*)calloc(sizeof(char), 300 + body_length);
-    if (header == NULL) {
+        "</html>\n", code, reason, code, reason);
+    response = (char*)arena_calloc(arena, sizeof(char), body_length + 300);
+    if (response == NULL) {
         return NULL;
     }
-    sprintf(header, "HTTP/1.1 404 Not Found\r\n"
+    sprintf(response, "HTTP/1.1 %d %s\r\n"
         "Content-Type: html; charset=UTF-8\r\n"
         "Content-Length: %d\r\n"
-        "\r\n", body_length);
-    strcat(header, body);
-    return header;
+        "\r\n%s", code, reason, body_length, body);
+    return response;
 }
 
 
 /**
- * @brief Creates a "Bad Request" HTTP response based on the provided parser.
+ * @brief Creates the header of a file of the bundle.
  *
- * This function generates a response string indicating a "400 Bad Request" error.
- * It uses the information from the given parser to construct the response.
+ * Adds the ETag of the entry and, if it has a gzip variant, the headers
+ * that tell caches the content depends on Accept-Encoding.
  *
- * @param parser A pointer to a Parser structure containing the necessary data
- *               to build the "Bad Request" response.
- * @return A dynamically allocated string containing the "Bad Request" response.
+ * @param parser The parsed request, with its entry of the bundle.
+ * @param length Length of the content sent.
+ * @param arena Arena to allocate from, NULL to use malloc.
+ * @return A dynamically allocated string containing the header.
  *         The caller is responsible for freeing the allocated memory.
  */
-char *_create_BadRequest_response(Parser *parser) {
-    char *header = NULL;
-    char *body = "<!DOCTYPE html>\n"
-        "<html>\n"
-        "<head>\n"
-        "<title>400 Bad Request</title>\n"
-        "</head>\n"
-        "<body>\n"
-        "<h1>Error 400 Bad Request</h1>\n"
-        "</body>\n"
-        "</html>\n";
-    int body_length = strlen(body);
-    header = (char*)calloc(sizeof(char), body_length + 300);
-    if (header == NULL) {
+char *_create_asset_header(Parser *parser, size_t length, Arena *arena) {
+    const Bundle_entry *entry = parser->asset;
+    char *base, *header;
+    size_t base_length;
+
+    base = _create_GET_header(parser->filename, length, parser->type, arena);
+    if (base == NULL) {
         return NULL;
     }
-    sprintf(header, "HTTP/1.1 400 Bad Request\r\n"
-        "Content-Type: html; charset=UTF-8\r\n"
-        "Content-Length: %d\r\n"
-        "\r\n", body_length);
-    strcat(header, body);
+    // Without the blank line, the extra headers go before it
+    base_length = strlen(base) - 2;
+    header = (char*)arena_calloc(arena, sizeof(char), base_length + BUNDLE_ETAG_SIZE + 100);
+    if (header != NULL) {
+        sprintf(header, "%.*sETag: %.*s\r\n%s%s\r\n", (int)base_length, base, BUNDLE_ETAG_SIZE, entry->etag,
+            entry->gzip_offset != 0 ? "Vary: Accept-Encoding\r\n" : "",
+            entry->gzip_offset != 0 && parser->gzip ? "Content-Encoding: gzip\r\n" : "");
+    }
+    arena_free(arena, base);
     return header;
 }
 
@@ -267,7 +281,7 @@ void send_file(int socket_fd, Response *response) {
         else
             bytes_to_send = total_size - bytes_sent;
 
-        status = send(socket_fd, content_ptr + bytes_sent, bytes_to_send, 0);
+        status = send_all(socket_fd, content_ptr + bytes_sent, bytes_to_send, SEND_TIMEOUT_MS);
 
         if (status == -1) {
             perror("send");
@@ -279,12 +293,18 @@ void send_file(int socket_fd, Response *response) {
 
 
 void free_response(Response *response) {
-    if (response != NULL) {
-        if (response->content != NULL) {
+    if (response != NULL && response->flight != NULL) {
+        // The content belongs to the flight, the last request to leave frees it
+        flight_leave(response->flight);
+        response->flight = NULL;
+        response->content = NULL;
+    }
+    if (response != NULL && response->arena == NULL) {
+        if (response->content != NULL && !response->mapped) {
             free(response->content);
             response->content = NULL;
         }
-        if (response->header != NULL) {
+        if (response->header != NULL && !response->shared) {
             free(response->header);
             response->header = NULL;
         }
@@ -299,12 +319,20 @@ Response *create_response(Parser *parser) {
     Response *response;
     char *header;
     void *file;
-    response = _init_response();
+    size_t length = 0;
+    Flight *flight = NULL;
+    response = _init_response(parser->arena);
     if (response == NULL) {
         return NULL;
     }
     if (parser->status == HTTP_NOT_FOUND) {
-        header = _create_404_header(parser);
+        // Every 404 is the same, scanners get it without building anything
+        response->header = (char *)NOT_FOUND_RESPONSE;
+        response->shared = 1;
+        return response;
+    }
+    if (parser->status == HTTP_BAD_REQUEST) {
+        header = _create_error_response(HTTP_BAD_REQUEST, "Bad Request", parser->arena);
         if (header == NULL) {
             free_response(response);
             return NULL;
@@ -312,60 +340,109 @@ Response *create_response(Parser *parser) {
         response->header = header;
         return response;
     }
-    if (parser->status == HTTP_BAD_REQUEST) {
-        header = _create_BadRequest_response(parser);
+    if (parser->status == HTTP_NOT_MODIFIED) {
+        header = (char*)arena_calloc(parser->arena, sizeof(char), BUNDLE_ETAG_SIZE + 60);
         if (header == NULL) {
             free_response(response);
             return NULL;
         }
+        sprintf(header, "HTTP/1.1 304 Not Modified\r\n"
+            "ETag: %.*s\r\n"
+            "\r\n", BUNDLE_ETAG_SIZE, parser->asset->etag);
         response->header = header;
         return response;
     }
     if (parser->method == OPTIONS) {
-        header = _create_OPTIONS_header(parser->type);
+        header = _create_OPTIONS_header(parser->type, parser->arena);
         response->content = NULL;
         response->header = header;
         return response;
     }
+    if (parser->type == METRICS) {
+        response->content = arena_adopt(parser->arena, metrics_render(&response->content_length));
+        if (response->content == NULL) {
+            free_response(response);
+            return NULL;
+        }
+        response->header = _create_GET_header(parser->filename, response->content_length, METRICS, parser->arena);
+        if (response->header == NULL) {
+            free_response(response);
+            return NULL;
+        }
+        return response;
+    }
+    if (parser->asset != NULL && (parser->method == GET || parser->method == POST)) {
+        // Served from the mapping, nothing is read or copied
+        response->content = (void *)bundle_content(parser->asset, parser->gzip, &response->content_length);
+        response->mapped = 1;
+        response->header = _create_asset_header(parser, response->content_length, parser->arena);
+        if (response->header == NULL) {
+            free_response(response);
+            return NULL;
+        }
+        return response;
+    }
     file = NULL;
     if (parser->type != PYTHON && parser->type != PHP) {
-        file = open_file(parser->filename, parser->type);
+        trace_phase_begin(PHASE_OPEN_FILE);
+        file = open_file(parser->filename, parser->fd, parser->type, parser->arena, &length, &flight);
+        trace_phase_end(PHASE_OPEN_FILE);
     } else if (parser->method != OPTIONS) {
-        printf("Opening script with %s\n", parser->args);
-        file = open_script(parser->filename, parser->type, parser->method, parser->args);
+        LOG_DEBUG("Opening script with %s", parser->args);
+        trace_phase_begin(PHASE_SCRIPT);
+        file = open_script(parser->filename, parser->type, parser->method, parser->args, &flight);
+        trace_phase_end(PHASE_SCRIPT);
+        if (file != NULL && flight == NULL) {
+            // The output grows with realloc, the arena only takes ownership
+            file = arena_adopt(parser->arena, file);
+        } else if (file == NULL && (errno == ETIMEDOUT || errno == EBUSY)) {
+            if (errno == ETIMEDOUT) {
+                parser->status = HTTP_GATEWAY_TIMEOUT;
+                header = _create_error_response(HTTP_GATEWAY_TIMEOUT, "Gateway Timeout", parser->arena);
+            } else {
+                parser->status = HTTP_SERVICE_UNAVAILABLE;
+                header = _create_error_response(HTTP_SERVICE_UNAVAILABLE, "Service Unavailable", parser->arena);
+            }
+            if (header == NULL) {
+                free_response(response);
+                return NULL;
+            }
+            response->header = header;
+            return response;
+        }
     }
     if (file == NULL) {
-        printf("Error al abrir el archivo\n");
+        if (errno != EWOULDBLOCK) {
+            LOG_WARN("Error al abrir el archivo %s", parser->filename);
+        }
         free_response(response);
         return NULL;
     }
-    printf("Archivo abierto\n");
+    // Freed or left with the response from here on
+    response->content = file;
+    response->flight = flight;
+    LOG_DEBUG("Archivo abierto");
     if (parser->type == TEXT || parser->type == HTML || parser->type == PYTHON || parser->type == PHP) {
         response->content_length = strlen((char*)file);
     } else if (parser->type == BINARY || parser->type == JPG || parser->type == GIF || parser->type == MPEG || parser->type == MP4) {
-        response->content_length = get_file_size(parser->filename);
+        response->content_length = length;
     } else {
-        free(file);
         free_response(response);
         return NULL;
     }
     if (parser->method == GET) {
-        header = _create_GET_header(parser->filename, response->content_length, parser->type);
-        response->content = file;
+        header = _create_GET_header(parser->filename, response->content_length, parser->type, parser->arena);
     } else if (parser->method == POST) {
-        header = _create_POST_header(parser->filename, response->content_length, parser->type);
-        response->content = file;
+        header = _create_POST_header(parser->filename, response->content_length, parser->type, parser->arena);
     } else {
-        free(file);
         free_response(response);
         return NULL;
     }
     if (header == NULL) {
-        free(file);
         free_response(response);
         return NULL;
     }
-    printf("Header creado\n");
+    LOG_DEBUG("Header creado");
     response->header = header;
     return response;
 }
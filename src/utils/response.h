@@ -18,6 +18,57 @@
 #include "http_parser.h"
 #include "utils.h"
 
+// Pre-rendered, shared by every 404
+#define NOT_FOUND_RESPONSE "HTTP/1.1 404 Not Found\r\n" \
+    "Content-Type: html; charset=UTF-8\r\n" \
+    "Content-Length: 119\r\n" \
+    "\r\n" \
+    "<!DOCTYPE html>\n" \
+    "<html>\n" \
+    "<head>\n" \
+    "<title>404 Not Found</title>\n" \
+    "</head>\n" \
+    "<body>\n" \
+    "<h1>Error 404 Not Found</h1>\n" \
+    "</body>\n" \
+    "</html>\n"
+
+// Pre-rendered refusals of requests that cannot be read, the connection is closed after them
+#define BAD_REQUEST_RESPONSE "HTTP/1.1 400 Bad Request\r\n" \
+    "Content-Type: text/plain; charset=UTF-8\r\n" \
+    "Content-Length: 12\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "Bad Request\n"
+
+#define LENGTH_REQUIRED_RESPONSE "HTTP/1.1 411 Length Required\r\n" \
+    "Content-Type: text/plain; charset=UTF-8\r\n" \
+    "Content-Length: 16\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "Length Required\n"
+
+#define PAYLOAD_TOO_LARGE_RESPONSE "HTTP/1.1 413 Payload Too Large\r\n" \
+    "Content-Type: text/plain; charset=UTF-8\r\n" \
+    "Content-Length: 18\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "Payload Too Large\n"
+
+#define HEADER_TOO_LARGE_RESPONSE "HTTP/1.1 431 Request Header Fields Too Large\r\n" \
+    "Content-Type: text/plain; charset=UTF-8\r\n" \
+    "Content-Length: 32\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "Request Header Fields Too Large\n"
+
+#define NOT_IMPLEMENTED_RESPONSE "HTTP/1.1 501 Not Implemented\r\n" \
+    "Content-Type: text/plain; charset=UTF-8\r\n" \
+    "Content-Length: 16\r\n" \
+    "Connection: close\r\n" \
+    "\r\n" \
+    "Not Implemented\n"
+
 /**
  * @struct Response
  * @brief Represents an HTTP response.
@@ -29,12 +80,19 @@ typedef struct {
     void *content;         /**< Pointer to the response content (can be text or binary data). */
     char *header;          /**< HTTP headers of the response (includes metadata such as Content-Type). */
     size_t content_length; /**< Size of the content in bytes. */
+    Arena *arena;          /**< Arena of the request, NULL if allocated with malloc. */
+    int mapped;            /**< Whether content points into the bundle and is never freed. */
+    int shared;            /**< Whether header is a pre-rendered response and is never freed. */
+    Flight *flight;        /**< Flight that owns content when it is shared, NULL if none. */
 } Response;
 
 
 /**
  * @brief Creates a Response object based on the parsed HTTP request.
  *
+ * The response is allocated from the arena of the parser, if it has one.
+ * Files of the bundle are not copied, the content points into the mapping.
+ *
  * @param parser Pointer to the Parser object containing the parsed HTTP request.
  * @return Pointer to the newly created Response object.
  */
@@ -43,6 +101,9 @@ Response *create_response(Parser *parser);
 /**
  * @brief Frees the memory allocated for a Response object.
  *
+ * Leaves the flight that owns the content, if any. The rest is left alone
+ * if the response lives in an arena.
+ *
  * @param response Pointer to the Response object to be freed.
  */
 void free_response(Response *response);
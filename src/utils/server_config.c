@@ -0,0 +1,170 @@
+/**
+ * @file server_config.c
+ * @brief Compilation of the parsed configuration into a ServerConfig.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "server_config.h"
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Compiles the limits of the scripts.
+ *
+ * @return 0 on success, -1 if a value is invalid.
+ */
+int _compile_script_limits(Dict *dict, Script_limits *limits) {
+    if (conf_get_int(dict, "SCRIPT_MAX_RUNNING", 8, &limits->max_running) != 0 ||
+        conf_get_int(dict, "SCRIPT_MAX_PER_SCRIPT", 4, &limits->max_per_script) != 0 ||
+        conf_get_int(dict, "SCRIPT_QUEUE_TIMEOUT", 10, &limits->queue_timeout) != 0 ||
+        conf_get_int(dict, "SCRIPT_TIMEOUT", 10, &limits->timeout) != 0 ||
+        conf_get_long(dict, "SCRIPT_CPU_LIMIT", 0, &limits->cpu_limit) != 0 ||
+        conf_get_long(dict, "SCRIPT_MEM_LIMIT", 0, &limits->mem_limit) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Compiles the options of the listening socket.
+ *
+ * @return 0 on success, -1 if a value is invalid.
+ */
+int _compile_socket_options(Dict *dict, Socket_options *options) {
+    int nonblock;
+
+    if (conf_get_int(dict, "BACKLOG", DEFAULT_BACKLOG, &options->backlog) != 0 ||
+        conf_get_int(dict, "TCP_NODELAY", 1, &options->nodelay) != 0 ||
+        conf_get_int(dict, "TCP_DEFER_ACCEPT", 0, &options->defer_accept) != 0 ||
+        conf_get_int(dict, "TCP_FASTOPEN", 0, &options->fastopen) != 0 ||
+        conf_get_int(dict, "SO_SNDBUF", 0, &options->sndbuf) != 0 ||
+        conf_get_int(dict, "SO_RCVBUF", 0, &options->rcvbuf) != 0 ||
+        conf_get_int(dict, "TCP_NOTSENT_LOWAT", 0, &options->notsent_lowat) != 0 ||
+        conf_get_int(dict, "ACCEPT_NONBLOCK", 0, &nonblock) != 0) {
+        return -1;
+    }
+    options->accept_flags = SOCK_CLOEXEC;
+    if (nonblock) {
+        options->accept_flags |= SOCK_NONBLOCK;
+    }
+    return 0;
+}
+
+/**
+ * @brief Compiles the deadlines of the transfers.
+ *
+ * @return 0 on success, -1 if a value is invalid.
+ */
+int _compile_transfer_limits(Dict *dict, Transfer_limits *limits) {
+    if (conf_get_int(dict, "HEADER_TIMEOUT", 10, &limits->header_timeout) != 0 ||
+        conf_get_int(dict, "HEADER_TIMEOUT_MAX", 30, &limits->header_timeout_max) != 0 ||
+        conf_get_int(dict, "BODY_TIMEOUT", 20, &limits->body_timeout) != 0 ||
+        conf_get_int(dict, "MIN_UPLOAD_RATE", 500, &limits->min_upload_rate) != 0 ||
+        conf_get_int(dict, "MIN_DOWNLOAD_RATE", 500, &limits->min_download_rate) != 0) {
+        return -1;
+    }
+    if (limits->header_timeout <= 0 || limits->body_timeout <= 0) {
+        printf("HEADER_TIMEOUT o BODY_TIMEOUT invalidos\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+ServerConfig *compile_config(Dict *dict) {
+    ServerConfig *config;
+    char *base_dir, *index_file, *stats_path;
+
+    if (dict == NULL) {
+        return NULL;
+    }
+
+    base_dir = get_value(dict, "BASE_DIR");
+    index_file = get_value(dict, "INDEX_FILE");
+    if (base_dir == NULL || index_file == NULL) {
+        printf("Faltan BASE_DIR o INDEX_FILE en la configuración\n");
+        return NULL;
+    }
+
+    config = (ServerConfig*)calloc(1, sizeof(ServerConfig));
+    if (config == NULL) {
+        return NULL;
+    }
+
+    if (conf_get_int(dict, "PORT", 0, &config->port) != 0 ||
+        conf_get_int(dict, "MAX_CLIENTS", 0, &config->max_clients) != 0 ||
+        conf_get_int(dict, "TIMEOUT", 0, &config->timeout) != 0) {
+        free(config);
+        return NULL;
+    }
+    if (config->port <= 0 || config->max_clients <= 0 || config->timeout <= 0) {
+        printf("PORT, MAX_CLIENTS o TIMEOUT invalidos\n");
+        free(config);
+        return NULL;
+    }
+
+    config->base_dir = strdup(base_dir);
+    config->index_file = strdup(index_file);
+    if (config->base_dir == NULL || config->index_file == NULL) {
+        free_config(config);
+        return NULL;
+    }
+    config->base_dir_len = strlen(base_dir);
+    config->index_file_len = strlen(index_file);
+
+    config->log_level = log_level_from_name(get_value(dict, "LOG_LEVEL"));
+
+    // STATS_PATH = off disables the endpoint
+    stats_path = get_value(dict, "STATS_PATH");
+    if (stats_path != NULL && strcmp(stats_path, "off") == 0) {
+        stats_path = NULL;
+    } else if (stats_path == NULL) {
+        stats_path = "/__stats";
+    }
+    if (stats_path != NULL && (config->stats_path = strdup(stats_path)) == NULL) {
+        free_config(config);
+        return NULL;
+    }
+
+    if (_compile_script_limits(dict, &config->script_limits) != 0 ||
+        _compile_socket_options(dict, &config->socket_options) != 0 ||
+        _compile_transfer_limits(dict, &config->transfer_limits) != 0 ||
+        conf_get_string(dict, "ACCESS_LOG", NULL, &config->access_log) != 0 ||
+        conf_get_long(dict, "SLOW_REQUEST_MS", 1000, &config->slow_request_ms) != 0 ||
+        conf_get_int(dict, "TRACE_SAMPLE", 0, &config->trace_sample) != 0 ||
+        conf_get_string(dict, "TRACE_FILE", NULL, &config->trace_file) != 0 ||
+        conf_get_int(dict, "H2C", 1, &config->h2c) != 0 ||
+        conf_get_int(dict, "IO_THREADS", 4, &config->io_threads) != 0 ||
+        conf_get_int(dict, "WORKERS", 0, &config->workers) != 0 ||
+        conf_get_int(dict, "NEGATIVE_CACHE_SIZE", 4096, &config->miss_cache_size) != 0 ||
+        conf_get_int(dict, "NEGATIVE_CACHE_TTL", 2000, &config->miss_cache_ttl) != 0 ||
+        conf_get_string(dict, "BUNDLE", NULL, &config->bundle) != 0 ||
+        conf_get_int(dict, "CAPTURE_BODY", 0, &config->capture_body) != 0 ||
+        conf_get_long(dict, "CAPTURE_MAX_MB", 1024, &config->capture_max_mb) != 0 ||
+        conf_get_string(dict, "CAPTURE_FILE", NULL, &config->capture_file) != 0 ||
+        ratelimit_compile(dict, &config->rate_limits) != 0 ||
+        proxy_compile(dict, &config->proxy) != 0 ||
+        tls_compile(dict, &config->tls) != 0) {
+        free_config(config);
+        return NULL;
+    }
+
+    return config;
+}
+
+void free_config(ServerConfig *config) {
+    if (config != NULL) {
+        proxy_free_options(&config->proxy);
+        tls_free_options(&config->tls);
+        free(config->base_dir);
+        free(config->index_file);
+        free(config->access_log);
+        free(config->stats_path);
+        free(config->trace_file);
+        free(config->capture_file);
+        free(config->bundle);
+        free(config);
+    }
+}
@@ -0,0 +1,80 @@
+/**
+ * @file server_config.h
+ * @brief Header file for the typed server configuration.
+ *
+ * The keys of the core settings are compiled here, the keys of each
+ * subsystem by the compile function of its module (tls_compile,
+ * ratelimit_compile, proxy_compile), so the dictionary library knows
+ * nothing about them. A value that is not valid fails the whole compile,
+ * which stops the startup or keeps the previous configuration on reload.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+#include "conf_parser.h"
+#include "utils.h"
+#include "socket.h"
+#include "log.h"
+#include "tls.h"
+#include "ratelimit.h"
+#include "proxy.h"
+
+/**
+ * @brief Typed server configuration compiled from a Dict.
+ *
+ * All the numeric settings are converted once and the strings used on every
+ * request keep their length so they can be copied without measuring them.
+ */
+typedef struct{
+    int port;                     /**< Listening port. */
+    int max_clients;              /**< Maximum simultaneous clients. */
+    int timeout;                  /**< Keep-alive timeout in seconds. */
+    Transfer_limits transfer_limits; /**< Deadlines of the requests and responses. */
+    char *base_dir;               /**< Document root. */
+    size_t base_dir_len;          /**< Length of base_dir. */
+    char *index_file;             /**< File served for "/". */
+    size_t index_file_len;        /**< Length of index_file. */
+    Script_limits script_limits;  /**< Limits applied to script execution. */
+    Socket_options socket_options; /**< Tuning of the listening socket. */
+    Log_level log_level;          /**< Verbosity of the log. */
+    char *access_log;             /**< File of the log, NULL for the standard output. */
+    char *stats_path;             /**< Path of the metrics endpoint, NULL if disabled. */
+    long slow_request_ms;         /**< Requests slower than this are logged, 0 disables it. */
+    int trace_sample;             /**< One request every trace_sample is exported, 0 disables it. */
+    char *trace_file;             /**< File of the exported traces, NULL if disabled. */
+    char *capture_file;           /**< File where received requests are captured, NULL if disabled. */
+    int capture_body;             /**< Whether the capture stores request bodies. */
+    long capture_max_mb;          /**< Size at which the capture stops, 0 for no limit. */
+    int h2c;                      /**< Whether HTTP/2 over cleartext TCP is accepted. */
+    int io_threads;               /**< Threads of the disk I/O pool, 0 does it on the network threads. */
+    int workers;                  /**< Worker processes under a supervisor, 0 serves from this process. */
+    char *bundle;                 /**< Asset bundle that replaces BASE_DIR, NULL to serve the directory. */
+    int miss_cache_size;          /**< Recent 404s remembered, 0 disables the cache. */
+    int miss_cache_ttl;           /**< Milliseconds a 404 is remembered. */
+    Tls_options tls;              /**< TLS on the listener, disabled without certificate. */
+    Rate_limits rate_limits;      /**< Limits of every client address. */
+    Proxy_options proxy;          /**< Routes forwarded to upstream backends. */
+} ServerConfig;
+
+/**
+ * @brief Compiles the known keys of a Dict into a ServerConfig.
+ *
+ * PORT, MAX_CLIENTS, TIMEOUT, BASE_DIR and INDEX_FILE are required, the
+ * remaining settings take their default value when missing.
+ *
+ * @param dict Pointer to the parsed configuration.
+ * @return Pointer to the new ServerConfig, or NULL if a setting is missing
+ *         or invalid.
+ */
+ServerConfig *compile_config(Dict *dict);
+
+/**
+ * @brief Frees a ServerConfig created by compile_config.
+ *
+ * @param config Pointer to the ServerConfig to be freed.
+ */
+void free_config(ServerConfig *config);
+
+#endif
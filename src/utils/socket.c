@@ -11,7 +11,63 @@
  * @author Miguel Paterson & Mijaíl Sazhín
  * @date 03-2025
 */
+#define _GNU_SOURCE
 #include "socket.h"
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Sets an integer socket option when its value is not 0.
+ *
+ * @param sock The socket.
+ * @param level Protocol level of the option.
+ * @param name Name of the option.
+ * @param value Value of the option, 0 leaves the kernel default.
+ * @param label Name printed if the kernel rejects the option.
+ */
+void _set_option(int sock, int level, int name, int value, const char *label) {
+    if (value == 0) {
+        return;
+    }
+    if (setsockopt(sock, level, name, &value, sizeof(value)) != 0) {
+        perror(label);
+    }
+}
+
+/**
+ * @brief Applies the tuning options to a listening socket.
+ *
+ * Failing options are reported and skipped, they never prevent the server
+ * from starting.
+ *
+ * @param sock The socket.
+ * @param options The tuning applied to the socket.
+ */
+void _apply_options(int sock, Socket_options *options) {
+    _set_option(sock, IPPROTO_TCP, TCP_NODELAY, options->nodelay, "TCP_NODELAY");
+    _set_option(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->defer_accept, "TCP_DEFER_ACCEPT");
+    _set_option(sock, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen, "TCP_FASTOPEN");
+    _set_option(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options->notsent_lowat, "TCP_NOTSENT_LOWAT");
+    _set_option(sock, SOL_SOCKET, SO_SNDBUF, options->sndbuf, "SO_SNDBUF");
+    _set_option(sock, SOL_SOCKET, SO_RCVBUF, options->rcvbuf, "SO_RCVBUF");
+}
+
+/**
+ * @brief Monotonic time in milliseconds.
+ *
+ * @return Milliseconds since an arbitrary point.
+ */
+long _monotonic_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 
 /* ---------------------- Public Functions ---------------------- */
 void free_socket(S_socket *s_socket) {
@@ -21,14 +77,15 @@ void free_socket(S_socket *s_socket) {
     }
 }
 
-S_socket* init_socket(int port) {
+S_socket* init_socket(int port, Socket_options *options) {
     struct sockaddr_in address;
     int sock;
     int status;
     int opt = 1;
     S_socket *s_socket;
 
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    // Only inherited on purpose, by a hot upgrade
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock == -1) {
         perror("socket");
         return NULL;
@@ -36,6 +93,9 @@ S_socket* init_socket(int port) {
 
     status = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
+    // Buffer sizes must be set before listen() to affect the window scale
+    _apply_options(sock, options);
+
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
@@ -46,7 +106,7 @@ S_socket* init_socket(int port) {
         return NULL;
     }
 
-    status = listen(sock, 1);
+    status = listen(sock, options->backlog > 0 ? options->backlog : DEFAULT_BACKLOG);
     if (status < 0) {
         perror("listen");
         return NULL;
@@ -62,3 +122,128 @@ S_socket* init_socket(int port) {
 
     return s_socket;
 }
+
+S_socket* init_socket_from_fd(int fd, Socket_options *options) {
+    S_socket *s_socket;
+    socklen_t len;
+    int listening = 0;
+
+    len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening) {
+        perror("inherited socket");
+        return NULL;
+    }
+
+    s_socket = (S_socket*)malloc(sizeof(S_socket));
+    if (s_socket == NULL) {
+        return NULL;
+    }
+
+    len = sizeof(s_socket->address);
+    if (getsockname(fd, (struct sockaddr *) &s_socket->address, &len) != 0) {
+        perror("getsockname");
+        free(s_socket);
+        return NULL;
+    }
+
+    _apply_options(fd, options);
+    listen(fd, options->backlog > 0 ? options->backlog : DEFAULT_BACKLOG);
+
+    s_socket->socket = fd;
+
+    return s_socket;
+}
+
+int accept_client(S_socket *s_socket, Socket_options *options) {
+    socklen_t clilen = sizeof(s_socket->address);
+
+    return accept4(s_socket->socket, (struct sockaddr*) &s_socket->address, &clilen, options->accept_flags);
+}
+
+int wait_socket(int fd, short events, int timeout_ms) {
+    struct pollfd pfd;
+    int status;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        status = poll(&pfd, 1, timeout_ms);
+    } while (status == -1 && errno == EINTR);
+
+    if (status == 1 && (pfd.revents & (POLLERR | POLLNVAL))) {
+        return -1;
+    }
+    return status;
+}
+
+ssize_t send_all(int fd, const void *buf, size_t len, int timeout_ms) {
+    size_t sent = 0;
+    ssize_t status;
+
+    while (sent < len) {
+        status = send(fd, (const char *)buf + sent, len - sent, MSG_NOSIGNAL);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_socket(fd, POLLOUT, timeout_ms) == 1) {
+                continue;
+            }
+            return -1;
+        }
+        sent += status;
+    }
+    return sent;
+}
+
+void deadline_start(Deadline *deadline, long initial_ms, long max_ms, long min_rate) {
+    deadline->start_ms = _monotonic_ms();
+    deadline->initial_ms = initial_ms;
+    deadline->max_ms = max_ms;
+    deadline->min_rate = min_rate;
+    deadline->bytes = 0;
+}
+
+int deadline_remaining(Deadline *deadline) {
+    long allowed = deadline->initial_ms, left;
+
+    if (deadline->min_rate > 0) {
+        allowed += (long)(deadline->bytes / deadline->min_rate) * 1000L;
+    }
+    if (deadline->max_ms > 0 && allowed > deadline->max_ms) {
+        allowed = deadline->max_ms;
+    }
+    left = deadline->start_ms + allowed - _monotonic_ms();
+    if (left <= 0) {
+        return 0;
+    }
+    return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+ssize_t send_all_until(int fd, const void *buf, size_t len, Deadline *deadline) {
+    size_t sent = 0;
+    ssize_t status;
+    int left;
+
+    while (sent < len) {
+        status = send(fd, (const char *)buf + sent, len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                left = deadline_remaining(deadline);
+                if (left > 0 && (left = wait_socket(fd, POLLOUT, left)) == 1) {
+                    continue;
+                }
+                if (left == 0) {
+                    errno = ETIMEDOUT;
+                }
+            }
+            return -1;
+        }
+        sent += status;
+        deadline->bytes += status;
+    }
+    return sent;
+}
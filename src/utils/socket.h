@@ -20,6 +20,59 @@
 #include <unistd.h>
 #include <string.h>
 #define SERV_PORT 8080
+#define LISTEN_FD_ENV "RE_SERVER_LISTEN_FD"
+#define READY_FD_ENV "RE_SERVER_READY_FD"
+#define DEFAULT_BACKLOG 511
+#define SEND_TIMEOUT_MS 30000
+
+/**
+ * @struct Socket_options
+ * @brief Tuning applied to the listening socket.
+ *
+ * A value of 0 leaves the kernel default for the corresponding option. On
+ * Linux TCP_NODELAY, the buffer sizes and TCP_NOTSENT_LOWAT are copied from
+ * the listening socket into every accepted socket, so they only need to be
+ * set once.
+ */
+typedef struct {
+    int backlog;        /**< Length of the accept queue passed to listen(). */
+    int nodelay;        /**< Disable Nagle's algorithm (TCP_NODELAY). */
+    int defer_accept;   /**< Seconds to wait for data before accepting (TCP_DEFER_ACCEPT). */
+    int fastopen;       /**< Queue length of pending TFO requests (TCP_FASTOPEN). */
+    int sndbuf;         /**< Send buffer size in bytes (SO_SNDBUF). */
+    int rcvbuf;         /**< Receive buffer size in bytes (SO_RCVBUF). */
+    int notsent_lowat;  /**< Unsent bytes limit before reporting writable (TCP_NOTSENT_LOWAT). */
+    int accept_flags;   /**< Flags passed to accept4() (SOCK_NONBLOCK, SOCK_CLOEXEC). */
+} Socket_options;
+
+/**
+ * @struct Transfer_limits
+ * @brief Deadlines of the transfers of a request.
+ *
+ * Each deadline starts with some seconds of allowance and grows by one second
+ * for every min_rate bytes transferred, so a client that keeps sending or
+ * reading at least that fast is never cut, while one that trickles a few bytes
+ * at a time runs out of time however often it sends something.
+ */
+typedef struct {
+    int header_timeout;     /**< Seconds to receive the head of a request. */
+    int header_timeout_max; /**< Seconds the head may take however fast it arrives, 0 for no cap. */
+    int body_timeout;       /**< Seconds to receive the body after the head. */
+    int min_upload_rate;    /**< Bytes per second of the request that extend its deadlines, 0 for none. */
+    int min_download_rate;  /**< Bytes per second of the response that extend its deadline, 0 for none. */
+} Transfer_limits;
+
+/**
+ * @struct Deadline
+ * @brief Deadline of a transfer that grows with the bytes transferred.
+ */
+typedef struct {
+    long start_ms;      /**< Start of the transfer, monotonic clock. */
+    long initial_ms;    /**< Time allowed before any byte is transferred. */
+    long max_ms;        /**< Longest the transfer may take, 0 for no cap. */
+    long min_rate;      /**< Bytes per second that extend the deadline one second, 0 for none. */
+    size_t bytes;       /**< Bytes transferred so far. */
+} Deadline;
 
 /**
  * @struct S_socket
@@ -36,13 +89,91 @@ typedef struct {
 /**
  * @brief Initializes a socket and binds it to the specified port.
  *
- * This function creates a socket, binds it to the given port, and prepares it
- * for use in communication.
+ * This function creates a socket, applies the tuning options, binds it to the
+ * given port, and prepares it for use in communication.
  *
  * @param port The port number to bind the socket to.
+ * @param options The tuning applied to the socket.
  * @return A pointer to an S_socket structure representing the initialized socket.
  */
-S_socket* init_socket(int port);
+S_socket* init_socket(int port, Socket_options *options);
+
+/**
+ * @brief Wraps a listening socket inherited from another process.
+ *
+ * Used after a hot upgrade: the previous server passes its already bound
+ * and listening socket, so no connection is refused while it is replaced.
+ * The tuning options are applied again, so a new backlog takes effect.
+ *
+ * @param fd File descriptor of the inherited listening socket.
+ * @param options The tuning applied to the socket.
+ * @return A pointer to an S_socket structure, or NULL if fd is not a socket.
+ */
+S_socket* init_socket_from_fd(int fd, Socket_options *options);
+
+/**
+ * @brief Accepts a connection with the flags of the socket options.
+ *
+ * @param s_socket Pointer to the listening socket.
+ * @param options The tuning of the socket, accept_flags is passed to accept4().
+ * @return The accepted socket, or -1 on failure (errno is set).
+ */
+int accept_client(S_socket *s_socket, Socket_options *options);
+
+/**
+ * @brief Waits until a socket is ready for the requested events.
+ *
+ * @param fd The socket.
+ * @param events poll() events to wait for (POLLIN, POLLOUT).
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @return 1 if ready, 0 on timeout, -1 on error.
+ */
+int wait_socket(int fd, short events, int timeout_ms);
+
+/**
+ * @brief Sends a whole buffer, waiting when a non-blocking socket is full.
+ *
+ * @param fd The socket.
+ * @param buf The data to send.
+ * @param len Number of bytes to send.
+ * @param timeout_ms Maximum time to wait each time the socket is full.
+ * @return Number of bytes sent, or -1 on error or timeout.
+ */
+ssize_t send_all(int fd, const void *buf, size_t len, int timeout_ms);
+
+/**
+ * @brief Starts the deadline of a transfer.
+ *
+ * @param deadline The deadline.
+ * @param initial_ms Time allowed before any byte is transferred.
+ * @param max_ms Longest the transfer may take, 0 for no cap.
+ * @param min_rate Bytes per second that extend the deadline one second, 0 for none.
+ */
+void deadline_start(Deadline *deadline, long initial_ms, long max_ms, long min_rate);
+
+/**
+ * @brief Time left until a deadline.
+ *
+ * @param deadline The deadline, its bytes must be kept up to date.
+ * @return Milliseconds left, 0 once the deadline has passed.
+ */
+int deadline_remaining(Deadline *deadline);
+
+/**
+ * @brief Sends a whole buffer before a deadline.
+ *
+ * The socket is never blocked on, even if it is a blocking one, so a client
+ * that stops reading cannot hold the sender past the deadline. The bytes
+ * sent are added to the deadline.
+ *
+ * @param fd The socket.
+ * @param buf The data to send.
+ * @param len Number of bytes to send.
+ * @param deadline Deadline of the whole transfer.
+ * @return Number of bytes sent, or -1 on error or when the deadline passes
+ *         (errno is ETIMEDOUT then).
+ */
+ssize_t send_all_until(int fd, const void *buf, size_t len, Deadline *deadline);
 
 /**
  * @brief Frees the resources associated with a socket.
@@ -0,0 +1,420 @@
+/**
+ * @file tls.c
+ * @brief TLS termination with OpenSSL and kernel TLS offload.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#define _GNU_SOURCE
+#include "tls.h"
+#include "socket.h"
+#include "log.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#define TICKET_NAME_LENGTH 16
+#define TICKET_KEY_LENGTH 32
+#define SESSION_ID_CONTEXT "re_server"
+
+/**
+ * @struct Ticket_key
+ * @brief Key protecting session tickets.
+ */
+typedef struct {
+    unsigned char name[TICKET_NAME_LENGTH];   /**< Identifies the key inside the ticket. */
+    unsigned char aes[TICKET_KEY_LENGTH];     /**< AES-256-CBC key of the ticket. */
+    unsigned char hmac[TICKET_KEY_LENGTH];    /**< HMAC-SHA256 key of the ticket. */
+    time_t created;                           /**< Generation time, 0 if the slot is empty. */
+} Ticket_key;
+
+/* ---------------------- Global objects ---------------------- */
+SSL_CTX *tls_context = NULL;
+int tls_h2 = 0;
+
+// ticket_keys[0] seals new tickets, ticket_keys[1] is the previous one
+Ticket_key ticket_keys[2];
+int ticket_rotation = 0;
+pthread_mutex_t ticket_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+_Thread_local SSL *own_session = NULL;
+
+/* ---------------------- Private Functions ---------------------- */
+
+/**
+ * @brief Logs and clears the OpenSSL error queue.
+ *
+ * @param what Operation that failed.
+ */
+void _log_ssl_errors(const char *what) {
+    unsigned long error;
+    char text[256];
+
+    while ((error = ERR_get_error()) != 0) {
+        ERR_error_string_n(error, text, sizeof(text));
+        LOG_DEBUG("%s: %s", what, text);
+    }
+}
+
+/**
+ * @brief Fills a ticket key with random bytes.
+ *
+ * @param key The key.
+ * @param now Generation time.
+ * @return 0 on success, -1 if there is no entropy.
+ */
+int _generate_ticket_key(Ticket_key *key, time_t now) {
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aes, sizeof(key->aes)) != 1 ||
+        RAND_bytes(key->hmac, sizeof(key->hmac)) != 1) {
+        return -1;
+    }
+    key->created = now;
+    return 0;
+}
+
+/**
+ * @brief Rotates the ticket keys when the interval has passed.
+ *
+ * Must be called with ticket_mutex held. After two intervals without
+ * rotating the previous key is too old to be accepted and is dropped.
+ */
+void _rotate_ticket_keys() {
+    time_t now = time(NULL);
+
+    if (now - ticket_keys[0].created < ticket_rotation) {
+        return;
+    }
+
+    if (now - ticket_keys[0].created < 2 * (time_t)ticket_rotation) {
+        ticket_keys[1] = ticket_keys[0];
+    } else {
+        memset(&ticket_keys[1], 0, sizeof(ticket_keys[1]));
+    }
+    if (_generate_ticket_key(&ticket_keys[0], now) != 0) {
+        LOG_WARN("No se pudo generar una clave de tickets TLS");
+        return;
+    }
+    LOG_INFO("Clave de tickets TLS rotada");
+}
+
+/**
+ * @brief Seals and opens session tickets with the rotating keys.
+ *
+ * @param ssl The session.
+ * @param name Name of the key, written when sealing and read when opening.
+ * @param iv Initialization vector of the ticket.
+ * @param cipher Cipher context to initialize.
+ * @param hmac MAC context to initialize.
+ * @param enc 1 to seal a new ticket, 0 to open a received one.
+ * @return 1 if the key is the current one, 2 if the ticket must be renewed,
+ *         0 if the key is unknown (full handshake), -1 on error.
+ */
+int _ticket_key_callback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                         EVP_MAC_CTX *hmac, int enc) {
+    Ticket_key key;
+    OSSL_PARAM params[3];
+    int found = -1, i;
+
+    pthread_mutex_lock(&ticket_mutex);
+    _rotate_ticket_keys();
+    if (enc) {
+        key = ticket_keys[0];
+        found = 0;
+    } else {
+        for (i = 0; i < 2; i++) {
+            if (ticket_keys[i].created != 0 && memcmp(name, ticket_keys[i].name, TICKET_NAME_LENGTH) == 0) {
+                key = ticket_keys[i];
+                found = i;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ticket_mutex);
+
+    if (found == -1) {
+        return 0;
+    }
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params(hmac, params) != 1) {
+        return -1;
+    }
+
+    if (enc) {
+        memcpy(name, key.name, TICKET_NAME_LENGTH);
+        if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1 ||
+            EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) {
+            return -1;
+        }
+        return 1;
+    }
+
+    if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key.aes, iv) != 1) {
+        return -1;
+    }
+    return found == 0 ? 1 : 2;
+}
+
+/**
+ * @brief Chooses the application protocol offered through ALPN.
+ *
+ * @param ssl The session.
+ * @param out Set to the chosen protocol.
+ * @param outlen Set to its length.
+ * @param in Protocols offered by the client.
+ * @param inlen Length of the offer.
+ * @param arg Unused.
+ * @return SSL_TLSEXT_ERR_OK, or SSL_TLSEXT_ERR_NOACK if none is supported.
+ */
+int _alpn_callback(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                   const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char with_h2[] = "\x02h2\x08http/1.1";
+    static const unsigned char http11[] = "\x08http/1.1";
+    const unsigned char *server = tls_h2 ? with_h2 : http11;
+    unsigned int length = tls_h2 ? sizeof(with_h2) - 1 : sizeof(http11) - 1;
+
+    if (SSL_select_next_proto((unsigned char **)out, outlen, server, length, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * @brief Waits for the socket as requested by the last OpenSSL error.
+ *
+ * @param ssl The session.
+ * @param status Return value of the failed OpenSSL call.
+ * @param fd The socket.
+ * @param timeout_ms Maximum time to wait.
+ * @return 1 if the call can be retried, 0 on timeout, -1 on error.
+ */
+int _wait_ssl(SSL *ssl, int status, int fd, int timeout_ms) {
+    switch (SSL_get_error(ssl, status)) {
+        case SSL_ERROR_WANT_READ:
+            return wait_socket(fd, POLLIN, timeout_ms);
+        case SSL_ERROR_WANT_WRITE:
+            return wait_socket(fd, POLLOUT, timeout_ms);
+        default:
+            return -1;
+    }
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int tls_compile(Dict *dict, Tls_options *options) {
+    if (conf_get_int(dict, "TLS_KTLS", 1, &options->ktls) != 0 ||
+        conf_get_int(dict, "TLS_SESSION_CACHE", 20480, &options->session_cache) != 0 ||
+        conf_get_int(dict, "TLS_TICKET_ROTATION", 3600, &options->ticket_rotation) != 0) {
+        return -1;
+    }
+    if (get_value(dict, "TLS_CERT") == NULL) {
+        return 0;
+    }
+    // Without TLS_KEY the certificate file holds the key too
+    if (conf_get_string(dict, "TLS_CERT", NULL, &options->cert) != 0 ||
+        conf_get_string(dict, "TLS_KEY", options->cert, &options->key) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void tls_free_options(Tls_options *options) {
+    free(options->cert);
+    free(options->key);
+    options->cert = NULL;
+    options->key = NULL;
+}
+
+int tls_init(Tls_options *options, int h2) {
+    if (options->cert == NULL) {
+        return 0;
+    }
+
+    tls_context = SSL_CTX_new(TLS_server_method());
+    if (tls_context == NULL) {
+        _log_ssl_errors("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+
+    if (SSL_CTX_use_certificate_chain_file(tls_context, options->cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_context, options->key ? options->key : options->cert, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_context) != 1) {
+        printf("No se pudo cargar el certificado %s o su clave\n", options->cert);
+        ERR_print_errors_fp(stdout);
+        tls_close();
+        return -1;
+    }
+
+    // Partial writes let tls_send_all resume after a full non-blocking socket
+    SSL_CTX_set_mode(tls_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (options->ktls) {
+        SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS);
+    }
+
+    SSL_CTX_set_session_id_context(tls_context, (const unsigned char *)SESSION_ID_CONTEXT,
+                                   sizeof(SESSION_ID_CONTEXT) - 1);
+    if (options->session_cache > 0) {
+        SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(tls_context, options->session_cache);
+    } else {
+        SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_OFF);
+    }
+
+    ticket_rotation = options->ticket_rotation;
+    if (ticket_rotation > 0) {
+        if (_generate_ticket_key(&ticket_keys[0], time(NULL)) != 0) {
+            tls_close();
+            return -1;
+        }
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(tls_context, _ticket_key_callback);
+    } else {
+        SSL_CTX_set_options(tls_context, SSL_OP_NO_TICKET);
+    }
+
+    tls_h2 = h2;
+    SSL_CTX_set_alpn_select_cb(tls_context, _alpn_callback, NULL);
+
+    printf("TLS activado con %s%s\n", options->cert, options->ktls ? " (kTLS si el kernel lo permite)" : "");
+    return 0;
+}
+
+int tls_enabled() {
+    return tls_context != NULL;
+}
+
+int tls_accept(int fd, Deadline *deadline) {
+    SSL *ssl;
+    int flags, status, left, ready;
+
+    ssl = SSL_new(tls_context);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return -1;
+    }
+
+    // Blocking calls would ignore the deadlines, slow clients must not hold the thread
+    flags = fcntl(fd, F_GETFL);
+    if (!(flags & O_NONBLOCK)) {
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+    while ((status = SSL_accept(ssl)) != 1) {
+        // The bytes of the handshake extend the deadline like those of a request
+        deadline->bytes = BIO_number_read(SSL_get_rbio(ssl));
+        left = deadline_remaining(deadline);
+        ready = left > 0 ? _wait_ssl(ssl, status, fd, left) : 0;
+        if (ready != 1) {
+            _log_ssl_errors("SSL_accept");
+            SSL_free(ssl);
+            ERR_clear_error();
+            errno = ready == 0 ? ETIMEDOUT : EPROTO;
+            return -1;
+        }
+    }
+
+    LOG_DEBUG("TLS %s %s, reanudada %d, kTLS tx %d rx %d", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+              SSL_session_reused(ssl), (int)BIO_get_ktls_send(SSL_get_wbio(ssl)),
+              (int)BIO_get_ktls_recv(SSL_get_rbio(ssl)));
+    own_session = ssl;
+    return 0;
+}
+
+void tls_end() {
+    if (own_session == NULL) {
+        return;
+    }
+    SSL_shutdown(own_session);
+    SSL_free(own_session);
+    ERR_clear_error();
+    own_session = NULL;
+}
+
+ssize_t tls_read(int fd, void *buf, size_t len) {
+    int status;
+
+    if (own_session == NULL) {
+        return read(fd, buf, len);
+    }
+
+    status = SSL_read(own_session, buf, len > INT_MAX ? INT_MAX : (int)len);
+    if (status > 0) {
+        return status;
+    }
+    switch (SSL_get_error(own_session, status)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            ERR_clear_error();
+            return errno == 0 ? 0 : -1;
+        default:
+            _log_ssl_errors("SSL_read");
+            errno = EIO;
+            return -1;
+    }
+}
+
+ssize_t tls_send_all(int fd, const void *buf, size_t len, Deadline *deadline) {
+    size_t sent = 0, chunk;
+    int status, left;
+
+    if (own_session == NULL) {
+        return send_all_until(fd, buf, len, deadline);
+    }
+
+    // With kTLS on the send side SSL_write is a plain write(), the kernel seals the records
+    while (sent < len) {
+        chunk = len - sent > INT_MAX ? INT_MAX : len - sent;
+        status = SSL_write(own_session, (const char *)buf + sent, (int)chunk);
+        if (status > 0) {
+            sent += status;
+            deadline->bytes += status;
+            continue;
+        }
+        left = deadline_remaining(deadline);
+        if (left > 0 && (left = _wait_ssl(own_session, status, fd, left)) == 1) {
+            continue;
+        }
+        if (left == 0) {
+            errno = ETIMEDOUT;
+        } else {
+            _log_ssl_errors("SSL_write");
+        }
+        return -1;
+    }
+    return sent;
+}
+
+int tls_wait(int fd, short events, int timeout_ms) {
+    if ((events & POLLIN) && tls_pending()) {
+        return 1;
+    }
+    return wait_socket(fd, events, timeout_ms);
+}
+
+int tls_pending() {
+    return own_session != NULL && SSL_has_pending(own_session);
+}
+
+void tls_close() {
+    if (tls_context != NULL) {
+        SSL_CTX_free(tls_context);
+        tls_context = NULL;
+    }
+    OPENSSL_cleanse(ticket_keys, sizeof(ticket_keys));
+}
@@ -0,0 +1,147 @@
+/**
+ * @file tls.h
+ * @brief Header file for TLS termination on the listener.
+ *
+ * When a certificate is configured every accepted connection starts with a
+ * TLS handshake done by OpenSSL. Right after it the symmetric keys are
+ * handed to the kernel (kTLS) when the kernel and the negotiated cipher
+ * allow it: from then on records are encrypted and decrypted by the kernel
+ * and the responses leave through the same send path as in cleartext, with
+ * no copy or crypto in userspace. Without kTLS OpenSSL does the crypto.
+ *
+ * Sessions can be resumed from a server-side cache (session IDs) or from
+ * stateless tickets. Ticket keys are generated at startup and rotated every
+ * interval; the previous key is still accepted for one more interval, and
+ * tickets sealed with it are renewed.
+ *
+ * The session of a connection is kept in a thread-local pointer, like the
+ * request trace, so the I/O functions below take the same arguments as the
+ * cleartext ones and fall back to them when the connection has no TLS.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "socket.h"
+#include "conf_parser.h"
+
+/**
+ * @struct Tls_options
+ * @brief TLS settings of the listener.
+ */
+typedef struct {
+    char *cert;             /**< PEM certificate chain, NULL disables TLS. */
+    char *key;              /**< PEM private key. */
+    int ktls;               /**< Whether the keys are handed to the kernel after the handshake. */
+    int session_cache;      /**< Sessions kept for resumption by ID, 0 disables the cache. */
+    int ticket_rotation;    /**< Seconds between ticket key rotations, 0 disables tickets. */
+} Tls_options;
+
+/**
+ * @brief Compiles the TLS_* keys.
+ *
+ * @param dict Parsed configuration.
+ * @param options Options to fill, free them with tls_free_options.
+ * @return 0 on success, -1 if a value is invalid or memory runs out.
+ */
+int tls_compile(Dict *dict, Tls_options *options);
+
+/**
+ * @brief Frees the strings of options filled by tls_compile.
+ *
+ * @param options The options.
+ */
+void tls_free_options(Tls_options *options);
+
+/**
+ * @brief Creates the TLS context of the listener.
+ *
+ * @param options TLS settings, TLS stays disabled if no certificate is given.
+ * @param h2 Whether HTTP/2 is offered through ALPN.
+ * @return 0 on success, -1 if the certificate or the key cannot be loaded.
+ */
+int tls_init(Tls_options *options, int h2);
+
+/**
+ * @brief Whether the listener terminates TLS.
+ *
+ * @return 1 if connections must be accepted with tls_accept, 0 otherwise.
+ */
+int tls_enabled();
+
+/**
+ * @brief Runs the server side of the handshake on an accepted socket.
+ *
+ * On success the session becomes the one of the calling thread and kTLS is
+ * enabled when possible. The socket is left non-blocking, so reads and
+ * writes through the session never wait past the deadlines of the caller.
+ *
+ * @param fd The accepted socket, blocking or not.
+ * @param deadline Deadline of the whole handshake, extended by the bytes
+ *        received like the head of a request.
+ * @return 0 on success, -1 if the handshake failed (errno EPROTO) or missed
+ *         the deadline (errno ETIMEDOUT).
+ */
+int tls_accept(int fd, Deadline *deadline);
+
+/**
+ * @brief Sends close_notify and frees the session of the calling thread.
+ *
+ * Does nothing if the thread has no session.
+ */
+void tls_end();
+
+/**
+ * @brief Reads from a socket, through the session of the calling thread if any.
+ *
+ * @param fd The socket.
+ * @param buf Buffer for the data.
+ * @param len Size of the buffer.
+ * @return Bytes read, 0 when the connection is closed, -1 on error with errno
+ *         set (EAGAIN when a non-blocking socket has nothing to read).
+ */
+ssize_t tls_read(int fd, void *buf, size_t len);
+
+/**
+ * @brief Sends a whole buffer, through the session of the calling thread if any.
+ *
+ * @param fd The socket.
+ * @param buf The data to send.
+ * @param len Number of bytes to send.
+ * @param deadline Deadline of the whole transfer, the bytes sent are added to it.
+ * @return Number of bytes sent, or -1 on error or when the deadline passes
+ *         (errno is ETIMEDOUT then).
+ */
+ssize_t tls_send_all(int fd, const void *buf, size_t len, Deadline *deadline);
+
+/**
+ * @brief Waits until a socket is ready, counting data already decrypted.
+ *
+ * OpenSSL may hold decrypted bytes that poll() cannot see, so waiting for
+ * POLLIN returns at once when the session has pending data.
+ *
+ * @param fd The socket.
+ * @param events poll() events to wait for (POLLIN, POLLOUT).
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @return 1 if ready, 0 on timeout, -1 on error.
+ */
+int tls_wait(int fd, short events, int timeout_ms);
+
+/**
+ * @brief Whether the session of the calling thread has decrypted data pending.
+ *
+ * @return 1 if tls_read would return data without reading the socket.
+ */
+int tls_pending();
+
+/**
+ * @brief Frees the TLS context and the ticket keys.
+ */
+void tls_close();
+
+#endif
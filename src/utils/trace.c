@@ -0,0 +1,218 @@
+/**
+ * @file trace.c
+ * @brief Low-overhead phase timestamps, slow-request log and trace export.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#include "trace.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_TSC 1
+#endif
+
+/* ---------------------- Global objects ---------------------- */
+double ns_per_tick = 1.0;
+unsigned long trace_epoch = 0;
+_Atomic long slow_ticks = 0;
+_Atomic int sample_rate = 0;
+_Atomic unsigned long sample_counter = 0;
+_Thread_local Request_trace *current_trace = NULL;
+
+FILE *trace_file = NULL;
+int trace_events = 0;
+pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const char *phase_names[] = {"read", "parse", "stat", "open_file", "script", "proxy", "send"};
+const char *trace_methods[] = {"GET", "POST", "OPTIONS", "UNKNOWN"};
+
+
+/* ---------------------- Private Functions ---------------------- */
+/**
+ * @brief Reads CLOCK_MONOTONIC in nanoseconds.
+ *
+ * @return The time in nanoseconds.
+ */
+unsigned long _monotonic_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * @brief Measures the length of a tick against CLOCK_MONOTONIC.
+ */
+void _calibrate() {
+#ifdef TRACE_TSC
+    struct timespec pause = {0, 20000000L};
+    unsigned long ns0, ns1, t0, t1;
+
+    ns0 = _monotonic_ns();
+    t0 = __rdtsc();
+    nanosleep(&pause, NULL);
+    ns1 = _monotonic_ns();
+    t1 = __rdtsc();
+    if (t1 > t0) {
+        ns_per_tick = (double)(ns1 - ns0) / (double)(t1 - t0);
+    }
+#endif
+}
+
+/**
+ * @brief Appends one complete event to the trace-event file.
+ *
+ * Must be called with trace_mutex held.
+ *
+ * @param name Name of the event.
+ * @param begin Start timestamp in ticks.
+ * @param ticks Duration in ticks.
+ * @param tid Thread identifier.
+ * @param args Extra JSON members, may be empty.
+ */
+void _write_event(const char *name, unsigned long begin, unsigned long ticks, long tid, const char *args) {
+    fprintf(trace_file, "%s{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+        "\"pid\":%d,\"tid\":%ld%s}", trace_events++ ? ",\n" : "", name,
+        trace_ns(begin - trace_epoch) / 1000.0, trace_ns(ticks) / 1000.0, (int)getpid(), tid, args);
+}
+
+/**
+ * @brief Exports a request and its phases as trace events.
+ *
+ * @param trace The trace of the request.
+ * @param end Timestamp of the end of the request.
+ * @param method HTTP method of the request.
+ * @param path Path of the resource.
+ * @param status HTTP status code of the response.
+ */
+void _export(Request_trace *trace, unsigned long end, Method method, const char *path, int status) {
+    char args[LOG_PATH + 64];
+    char clean[LOG_PATH];
+    long tid = syscall(SYS_gettid);
+    int i;
+
+    for (i = 0; i < LOG_PATH - 1 && path[i] != '\0'; i++) {
+        clean[i] = (path[i] == '"' || path[i] == '\\' || (unsigned char)path[i] < 0x20) ? '_' : path[i];
+    }
+    clean[i] = '\0';
+    snprintf(args, sizeof(args), ",\"args\":{\"path\":\"%s\",\"status\":%d}", clean, status);
+
+    pthread_mutex_lock(&trace_mutex);
+    _write_event(trace_methods[method <= UNKNOWN_METHOD ? method : UNKNOWN_METHOD], trace->start,
+        end - trace->start, tid, args);
+    for (i = 0; i < PHASE_COUNT; i++) {
+        if (trace->first[i] != 0) {
+            _write_event(phase_names[i], trace->first[i], trace->ticks[i], tid, "");
+        }
+    }
+    fflush(trace_file);
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+int trace_init(const char *path) {
+    _calibrate();
+    trace_epoch = trace_now();
+
+    if (path == NULL) {
+        return 0;
+    }
+
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        perror("trace");
+        return -1;
+    }
+    fprintf(trace_file, "[\n");
+    return 0;
+}
+
+void trace_configure(long slow_ms, int sample) {
+    atomic_store(&slow_ticks, slow_ms > 0 ? (long)(slow_ms * 1000000.0 / ns_per_tick) : 0);
+    atomic_store(&sample_rate, trace_file != NULL ? sample : 0);
+}
+
+unsigned long trace_now() {
+#ifdef TRACE_TSC
+    return __rdtsc();
+#else
+    return _monotonic_ns();
+#endif
+}
+
+long trace_ns(unsigned long ticks) {
+    return (long)(ticks * ns_per_tick);
+}
+
+void trace_request_begin(Request_trace *trace) {
+    memset(trace, 0, sizeof(Request_trace));
+    trace->start = trace_now();
+    current_trace = trace;
+}
+
+void trace_request_switch(Request_trace *trace) {
+    current_trace = trace;
+}
+
+void trace_phase_begin(Trace_phase phase) {
+    Request_trace *trace = current_trace;
+
+    if (trace == NULL) {
+        return;
+    }
+    trace->begin[phase] = trace_now();
+    if (trace->first[phase] == 0) {
+        trace->first[phase] = trace->begin[phase];
+    }
+}
+
+void trace_phase_end(Trace_phase phase) {
+    Request_trace *trace = current_trace;
+
+    if (trace == NULL || trace->begin[phase] == 0) {
+        return;
+    }
+    trace->ticks[phase] += trace_now() - trace->begin[phase];
+}
+
+void trace_request_end(Request_trace *trace, unsigned long end, Method method, const char *path, int status) {
+    long slow = atomic_load_explicit(&slow_ticks, memory_order_relaxed);
+    int sample = atomic_load_explicit(&sample_rate, memory_order_relaxed);
+
+    current_trace = NULL;
+
+    if (slow > 0 && end - trace->start > (unsigned long)slow) {
+        LOG_WARN("SLOW %s %s %d total=%ldus read=%ldus parse=%ldus stat=%ldus open_file=%ldus script=%ldus proxy=%ldus send=%ldus",
+            trace_methods[method <= UNKNOWN_METHOD ? method : UNKNOWN_METHOD], path, status,
+            trace_ns(end - trace->start) / 1000,
+            trace_ns(trace->ticks[PHASE_READ]) / 1000, trace_ns(trace->ticks[PHASE_PARSE]) / 1000,
+            trace_ns(trace->ticks[PHASE_STAT]) / 1000, trace_ns(trace->ticks[PHASE_OPEN_FILE]) / 1000,
+            trace_ns(trace->ticks[PHASE_SCRIPT]) / 1000, trace_ns(trace->ticks[PHASE_PROXY]) / 1000,
+            trace_ns(trace->ticks[PHASE_SEND]) / 1000);
+    }
+
+    if (sample > 0 && atomic_fetch_add_explicit(&sample_counter, 1, memory_order_relaxed) % sample == 0) {
+        _export(trace, end, method, path, status);
+    }
+}
+
+void trace_close() {
+    pthread_mutex_lock(&trace_mutex);
+    if (trace_file != NULL) {
+        fprintf(trace_file, "\n]\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    atomic_store(&sample_rate, 0);
+    pthread_mutex_unlock(&trace_mutex);
+}
@@ -0,0 +1,134 @@
+/**
+ * @file trace.h
+ * @brief Header file for per-request phase tracing.
+ *
+ * Every request records when each phase starts and how long it takes using
+ * the TSC (calibrated against CLOCK_MONOTONIC at startup) or, on other
+ * architectures, CLOCK_MONOTONIC. The trace of the request being served is
+ * kept in a thread-local pointer so the parser and the file and script
+ * helpers can mark their phases without extra parameters.
+ *
+ * Requests slower than a threshold are written to the log with their phase
+ * breakdown, and one request every N can be exported as Chrome trace-event
+ * JSON (chrome://tracing, Perfetto) for offline analysis.
+ *
+ * @author Miguel Paterson & Mijaíl Sazhín
+ * @date 03-2025
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+
+/**
+ * @enum Trace_phase
+ * @brief Phases of a request.
+ */
+typedef enum {
+    PHASE_READ,       /**< read() of the request. */
+    PHASE_PARSE,      /**< pars_http. */
+    PHASE_STAT,       /**< Existence check of the file inside pars_http. */
+    PHASE_OPEN_FILE,  /**< open_file. */
+    PHASE_SCRIPT,     /**< open_script. */
+    PHASE_PROXY,      /**< Exchange with an upstream backend. */
+    PHASE_SEND,       /**< Sending the header and the content. */
+    PHASE_COUNT       /**< Number of phases. */
+} Trace_phase;
+
+/**
+ * @struct Request_trace
+ * @brief Timestamps of one request, in ticks of trace_now().
+ */
+typedef struct {
+    unsigned long start;                /**< Start of the request. */
+    unsigned long begin[PHASE_COUNT];   /**< Start of the last run of each phase. */
+    unsigned long first[PHASE_COUNT];   /**< Start of the first run of each phase, 0 if it did not run. */
+    unsigned long ticks[PHASE_COUNT];   /**< Accumulated duration of each phase. */
+} Request_trace;
+
+/**
+ * @brief Calibrates the clock and opens the trace-event file.
+ *
+ * @param path File where sampled requests are written as Chrome trace-event
+ *             JSON, NULL to disable sampling.
+ * @return 0 on success, -1 if the file cannot be opened.
+ */
+int trace_init(const char *path);
+
+/**
+ * @brief Sets the slow-request threshold and the sampling rate.
+ *
+ * @param slow_ms Requests slower than this are logged, 0 disables it.
+ * @param sample One request every sample is exported, 0 disables it.
+ */
+void trace_configure(long slow_ms, int sample);
+
+/**
+ * @brief Current timestamp in ticks.
+ *
+ * @return The timestamp.
+ */
+unsigned long trace_now();
+
+/**
+ * @brief Converts ticks to nanoseconds.
+ *
+ * @param ticks A duration in ticks.
+ * @return The duration in nanoseconds.
+ */
+long trace_ns(unsigned long ticks);
+
+/**
+ * @brief Starts tracing a request on the calling thread.
+ *
+ * @param trace The trace, owned by the caller until trace_request_end.
+ */
+void trace_request_begin(Request_trace *trace);
+
+/**
+ * @brief Changes the request traced on the calling thread.
+ *
+ * Lets a thread that serves several requests at once, like an HTTP/2
+ * connection, charge each phase to the right one.
+ *
+ * @param trace A trace already started with trace_request_begin, NULL for none.
+ */
+void trace_request_switch(Request_trace *trace);
+
+/**
+ * @brief Marks the start of a phase of the current request.
+ *
+ * Does nothing if the thread is not tracing a request.
+ *
+ * @param phase The phase.
+ */
+void trace_phase_begin(Trace_phase phase);
+
+/**
+ * @brief Marks the end of a phase of the current request.
+ *
+ * @param phase The phase.
+ */
+void trace_phase_end(Trace_phase phase);
+
+/**
+ * @brief Finishes the current request.
+ *
+ * Logs the phase breakdown if the request was slow and exports it if it is
+ * sampled.
+ *
+ * @param trace The trace passed to trace_request_begin.
+ * @param end Timestamp of the end of the request.
+ * @param method HTTP method of the request.
+ * @param path Path of the resource.
+ * @param status HTTP status code of the response.
+ */
+void trace_request_end(Request_trace *trace, unsigned long end, Method method, const char *path, int status);
+
+/**
+ * @brief Closes the trace-event file.
+ */
+void trace_close();
+
+#endif
@@ -10,11 +10,37 @@
  */
 
 #include "utils.h"
+#include "log.h"
+#include "metrics.h"
+#include "io_pool.h"
+#include "flight.h"
 #include <sys/socket.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* ---------------------- Global objects ---------------------- */
+/**
+ * @brief Number of instances of one script currently running.
+ */
+typedef struct {
+    char filename[256]; /**< Path of the script, empty if the slot is free. */
+    int running;        /**< Instances running or starting. */
+} Script_slot;
+
+Script_limits script_limits = {8, 4, 10, 10, 0, 0};
+Script_slot script_slots[SCRIPT_SLOTS];
+int scripts_running = 0;
+pthread_mutex_t scripts_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t scripts_cond = PTHREAD_COND_INITIALIZER;
 
 /* ---------------------- Private Functions ---------------------- */
 /**
@@ -37,231 +63,522 @@ void _replace_ampersand(char *str) {
 }
 
 
-/* ---------------------- Public Functions ---------------------- */
-void *open_file(char *filename, File_type type){
-    FILE *file;
-    void *content;
-    int tam;
-    size_t file_size;
-
-    // Checks the type of the file to open
-    if (type == BINARY || type == JPG || type == GIF || type == MPEG || type == MP4){
-        file = fopen(filename, "rb");
-    }
-    else if (type == TEXT || type == HTML){
-        file = fopen(filename, "r");
+/**
+ * @brief Finds the slot tracking a script.
+ *
+ * Must be called with scripts_mutex held.
+ *
+ * @param filename Path of the script.
+ * @param create If non-zero a free slot is claimed when none matches.
+ * @return Pointer to the slot, or NULL if not found.
+ */
+Script_slot *_find_script_slot(char *filename, int create) {
+    Script_slot *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < SCRIPT_SLOTS; i++) {
+        if (script_slots[i].running == 0) {
+            if (free_slot == NULL) {
+                free_slot = &script_slots[i];
+            }
+            continue;
+        }
+        if (strcmp(script_slots[i].filename, filename) == 0) {
+            return &script_slots[i];
+        }
     }
-    else{
-        return NULL;
+
+    if (create && free_slot != NULL) {
+        snprintf(free_slot->filename, sizeof(free_slot->filename), "%s", filename);
+        return free_slot;
     }
-    if (file == NULL){
-        perror("fopen");
-        return NULL;
+    return NULL;
+}
+
+/**
+ * @brief Waits until a script may start running.
+ *
+ * Blocks while the global or per-script limit is reached. Requests are
+ * queued on a condition variable for at most the queue timeout.
+ *
+ * @param filename Path of the script to run.
+ * @return 0 when a slot has been reserved, -1 if the queue timeout expired.
+ */
+int _acquire_script_slot(char *filename) {
+    struct timespec deadline;
+    Script_slot *slot;
+    int status = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += script_limits.queue_timeout;
+
+    pthread_mutex_lock(&scripts_mutex);
+    while (1) {
+        slot = _find_script_slot(filename, 0);
+        if (scripts_running < script_limits.max_running &&
+            (slot == NULL || slot->running < script_limits.max_per_script)) {
+            break;
+        }
+        status = pthread_cond_timedwait(&scripts_cond, &scripts_mutex, &deadline);
+        if (status == ETIMEDOUT) {
+            pthread_mutex_unlock(&scripts_mutex);
+            return -1;
+        }
     }
 
+    slot = _find_script_slot(filename, 1);
+    slot->running++;
+    scripts_running++;
+    pthread_mutex_unlock(&scripts_mutex);
 
-    // Gets the size of the file
-    file_size = get_file_size(filename);
-    if (file_size == 0){
-        fclose(file);
-        return NULL;
+    return 0;
+}
+
+/**
+ * @brief Releases the slot reserved by _acquire_script_slot.
+ *
+ * @param filename Path of the script that finished.
+ */
+void _release_script_slot(char *filename) {
+    Script_slot *slot;
+
+    pthread_mutex_lock(&scripts_mutex);
+    slot = _find_script_slot(filename, 0);
+    if (slot != NULL) {
+        slot->running--;
     }
+    scripts_running--;
+    pthread_cond_broadcast(&scripts_cond);
+    pthread_mutex_unlock(&scripts_mutex);
+}
 
-    // Reads the file and stores it on a string or binary
-    if (type == TEXT || type == HTML){
-        content = (char*)calloc(sizeof(char), file_size);
-        if (content == NULL){
-            fclose(file);
-            return NULL;
-        }
+/**
+ * @brief Milliseconds left until a deadline on the monotonic clock.
+ *
+ * @param deadline Absolute deadline.
+ * @return Milliseconds left, or 0 if the deadline has passed.
+ */
+int _ms_until(struct timespec *deadline) {
+    struct timespec now;
+    long ms;
 
-        tam = fread(content, sizeof(char), file_size - 1, file);
-        if (tam < 0){
-            fclose(file);
-            free(content);
-            perror("fread");
-            return NULL;
-        }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? (int)ms : 0;
+}
+
+/**
+ * @brief Executes the interpreter in the child process.
+ *
+ * Puts the child in its own process group, applies the resource limits and
+ * replaces the process with the interpreter. Never returns.
+ *
+ * @param filename Path of the script.
+ * @param type Type of the script (PYTHON or PHP).
+ * @param method HTTP method, GET arguments are passed through argv.
+ * @param input Arguments of the script separated by spaces.
+ */
+void _exec_script(char *filename, File_type type, Method method, char *input) {
+    char *argv[SCRIPT_MAX_ARGV];
+    char *token, *saveptr;
+    struct rlimit rl;
+    sigset_t mask;
+    int argc = 0;
+
+    setpgid(0, 0);
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+
+    if (script_limits.cpu_limit > 0) {
+        rl.rlim_cur = script_limits.cpu_limit;
+        rl.rlim_max = script_limits.cpu_limit + 1;
+        setrlimit(RLIMIT_CPU, &rl);
+    }
+    if (script_limits.mem_limit > 0) {
+        rl.rlim_cur = rl.rlim_max = (rlim_t)script_limits.mem_limit * 1024 * 1024;
+        setrlimit(RLIMIT_AS, &rl);
     }
-    else if (type == BINARY || type == JPG || type == GIF || type == MPEG || type == MP4){
-        content = malloc(file_size);
-        if (content == NULL){
-            fclose(file);
-            return NULL;
-        }
 
-        tam = fread(content, 1, file_size, file);
-        if (tam < 0){
-            fclose(file);
-            free(content);
-            perror("fread");
-            return NULL;
+    argv[argc++] = (type == PYTHON) ? "python3" : "php";
+    argv[argc++] = filename;
+    if (method == GET) {
+        token = strtok_r(input, " ", &saveptr);
+        while (token != NULL && argc < SCRIPT_MAX_ARGV - 1) {
+            argv[argc++] = token;
+            token = strtok_r(NULL, " ", &saveptr);
         }
     }
+    argv[argc] = NULL;
 
-    fclose(file);
-
-    return content;
+    execvp(argv[0], argv);
+    perror("execvp");
+    _exit(EXIT_FAILURE);
 }
 
-
-char *open_script(char *filename, File_type type, Method method, char *input) {
-    FILE *file_out;
-    char command[256];
+/**
+ * @brief Runs a script and collects its standard output.
+ *
+ * POST arguments are written to the standard input of the script while
+ * its output is read, both until EOF or until the wall-clock deadline
+ * expires, in which case the whole process group of the script is killed.
+ *
+ * @param filename Path of the script.
+ * @param type Type of the script (PYTHON or PHP).
+ * @param method HTTP method (GET or POST).
+ * @param input Arguments of the script separated by spaces.
+ * @return The output of the script, or NULL on failure (errno is set to
+ *         ETIMEDOUT when the deadline expired).
+ */
+char *_run_script(char *filename, File_type type, Method method, char *input) {
     char buffer[1024];
-    char *output = NULL;
-    size_t output_size = 0;
+    char *output = NULL, *new_output;
+    size_t output_size = 0, input_length, written = 0;
     int fdfather[2], fdson[2];
+    struct timespec deadline;
+    struct pollfd pfd[2];
+    ssize_t n;
     pid_t pid;
+    int timed_out = 0;
 
-    _replace_ampersand(input);
-    printf("ARGS: %s\n", input);
+    if (pipe(fdfather) == -1) {
+        perror("pipe");
+        return NULL;
+    }
+    if (pipe(fdson) == -1) {
+        perror("pipe");
+        close(fdfather[0]);
+        close(fdfather[1]);
+        return NULL;
+    }
 
-    if (input == NULL) {
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fdfather[0]);
+        close(fdfather[1]);
+        close(fdson[0]);
+        close(fdson[1]);
         return NULL;
     }
 
-    if (method == GET) {
-        // Construir el comando para GET
-        if (type == PYTHON) {
-            snprintf(command, sizeof(command), "python3 %s %s", filename, input);
-        } else if (type == PHP) {
-            snprintf(command, sizeof(command), "php %s %s", filename, input);
-        } else {
-            return NULL;
-        }
+    if (pid == 0) {
+        close(fdson[1]);
+        close(fdfather[0]);
 
-        file_out = popen(command, "r");  // Ejecutar el script y leer su salida
-        if (!file_out) {
-            perror("popen");
-            return NULL;
+        dup2(fdson[0], STDIN_FILENO);
+        close(fdson[0]);
+
+        dup2(fdfather[1], STDOUT_FILENO);
+        close(fdfather[1]);
+
+        _exec_script(filename, type, method, input);
+    }
+
+    // Both sides call setpgid so the group exists before any kill
+    setpgid(pid, pid);
+    close(fdson[0]);
+    close(fdfather[1]);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += script_limits.timeout;
+
+    // The input is written from the same loop, a script that never reads it cannot hold us past the deadline
+    input_length = method == POST ? strlen(input) : 0;
+    if (input_length == 0 || fcntl(fdson[1], F_SETFL, O_NONBLOCK) == -1) {
+        close(fdson[1]);
+        fdson[1] = -1;
+        input_length = 0;
+    }
+
+    // Leer la salida del hijo hasta EOF o hasta el deadline
+    pfd[0].fd = fdfather[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = fdson[1];
+    pfd[1].events = POLLOUT;
+    while (1) {
+        n = poll(pfd, 2, _ms_until(&deadline));
+        if (n == 0) {
+            timed_out = 1;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
         }
 
-        while (fgets(buffer, sizeof(buffer), file_out)) {
-            size_t len = strlen(buffer);
-            char *new_output = realloc(output, output_size + len + 1);
-            if (!new_output) {
-                free(output);
-                pclose(file_out);
-                return NULL;
+        if (pfd[1].fd != -1 && pfd[1].revents) {
+            n = write(pfd[1].fd, input + written, input_length - written);
+            if (n > 0) {
+                written += n;
+            }
+            // Done, or the script closed its standard input
+            if (written == input_length || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(pfd[1].fd);
+                pfd[1].fd = -1;
             }
-            output = new_output;
-            memcpy(output + output_size, buffer, len);
-            output_size += len;
         }
-        
-        if (output) {
-            output[output_size] = '\0'; // Asegurar terminación en null
+        if (!pfd[0].revents) {
+            continue;
         }
 
-        pclose(file_out);
-        return output;
-    } 
-    else if (method == POST) {
-        if (pipe(fdfather) == -1 || pipe(fdson) == -1) {
-            perror("pipe");
-            return NULL;
+        n = read(fdfather[0], buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
         }
 
-        pid = fork();
-        if (pid == -1) {
-            perror("fork");
-            return NULL;
+        new_output = realloc(output, output_size + n + 1);
+        if (!new_output) {
+            break;
         }
+        output = new_output;
+        memcpy(output + output_size, buffer, n);
+        output_size += n;
+    }
+    if (pfd[1].fd != -1) {
+        close(pfd[1].fd);
+    }
+    close(fdfather[0]);
 
-        if (pid == 0) { 
-            close(fdson[1]);  
-            close(fdfather[0]); 
+    // Kill whatever is left of the group, including grandchildren
+    kill(-pid, SIGKILL);
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
 
-            dup2(fdson[0], STDIN_FILENO); 
-            close(fdson[0]);
+    if (timed_out) {
+        LOG_WARN("Timeout del script %s, grupo %d eliminado", filename, pid);
+        free(output);
+        errno = ETIMEDOUT;
+        return NULL;
+    }
 
-            dup2(fdfather[1], STDOUT_FILENO); 
-            close(fdfather[1]);
+    if (output) {
+        output[output_size] = '\0';
+    }
+    return output;
+}
 
-            // Ejecutar el script
-            if (type == PYTHON) {
-                execlp("python3", "python3", filename, NULL);
-            } else if (type == PHP) {
-                execlp("php", "php", filename, NULL);
-            }
-            
-            perror("execlp");
-            exit(EXIT_FAILURE);
-        } 
-        else { 
-            close(fdson[0]);
-            close(fdfather[1]);
-
-            // Enviar input al hijo
-            write(fdson[1], input, strlen(input));
-            close(fdson[1]); // Indicar fin de datos
-
-            // Leer la salida del hijo
-            ssize_t n;
-            while ((n = read(fdfather[0], buffer, sizeof(buffer) - 1)) > 0) {
-                buffer[n] = '\0'; 
-                size_t len = n;
-                char *new_output = realloc(output, output_size + len + 1);
-                if (!new_output) {
-                    free(output);
-                    close(fdfather[0]);
-                    return NULL;
-                }
-                output = new_output;
-                memcpy(output + output_size, buffer, len);
-                output_size += len;
-            }
 
-            if (output) {
-                output[output_size] = '\0'; 
+/**
+ * @brief Reads a file into the arena of the request.
+ *
+ * @param filename Path of the file.
+ * @param fd Descriptor already open on the file, -1 to open it here. It is
+ *        read with offsets and left open.
+ * @param type Type of the file, text is read without its last byte.
+ * @param arena Arena of the request.
+ * @param length Set to the size of the buffer returned.
+ * @return The content, or NULL with errno set.
+ */
+void *_read_file(char *filename, int fd, File_type type, Arena *arena, size_t *length){
+    struct stat st;
+    void *content = NULL;
+    ssize_t tam = -1;
+    size_t file_size;
+    int own = fd == -1, err;
+
+    if (own){
+        fd = io_open(filename, O_RDONLY);
+        if (fd == -1){
+            if (errno != EWOULDBLOCK){
+                perror("open");
             }
+            return NULL;
+        }
+    }
 
-            close(fdfather[0]);
-            wait(NULL); // Esperar a que el hijo termine
-            return output;
+    // Gets the size of the file
+    file_size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    if (file_size == 0){
+        if (own){
+            close(fd);
         }
+        return NULL;
     }
-    
-    return NULL;
+
+    // Reads the file and stores it on a string or binary
+    if (type == TEXT || type == HTML){
+        content = (char*)arena_calloc(arena, sizeof(char), file_size);
+        if (content != NULL){
+            tam = io_read(fd, content, file_size - 1, 0);
+        }
+    }
+    else{
+        content = arena_alloc(arena, file_size);
+        if (content != NULL){
+            tam = io_read(fd, content, file_size, 0);
+        }
+    }
+    err = errno;
+    if (own){
+        close(fd);
+    }
+    if (content == NULL){
+        errno = err;
+        return NULL;
+    }
+    if (tam < 0){
+        arena_free(arena, content);
+        if (err != EWOULDBLOCK){
+            perror("read");
+        }
+        errno = err;
+        return NULL;
+    }
+
+    *length = file_size;
+    return content;
 }
 
+/**
+ * @brief Runs a script in one of the slots.
+ *
+ * @return The output, allocated with malloc, or NULL with errno set.
+ */
+char *_run_limited(char *filename, File_type type, Method method, char *input) {
+    char *output;
+    int err;
 
-File_type get_file_type(char *filename){
-    char *ext;
+    if (_acquire_script_slot(filename) != 0) {
+        LOG_WARN("Sin hueco para ejecutar %s", filename);
+        errno = EBUSY;
+        return NULL;
+    }
 
-    ext = strrchr(filename, '.');
-    if (strcmp(ext, ".html") == 0){
-        return HTML;
+    metrics_script();
+    output = _run_script(filename, type, method, input);
+    err = errno;
+    _release_script_slot(filename);
+    errno = err;
+
+    return output;
+}
+
+
+/* ---------------------- Public Functions ---------------------- */
+void set_script_limits(Script_limits *limits) {
+    pthread_mutex_lock(&scripts_mutex);
+    script_limits = *limits;
+    if (script_limits.max_running <= 0 || script_limits.max_running > SCRIPT_SLOTS) {
+        script_limits.max_running = SCRIPT_SLOTS;
+    }
+    if (script_limits.max_per_script <= 0) {
+        script_limits.max_per_script = script_limits.max_running;
+    }
+    pthread_cond_broadcast(&scripts_cond);
+    pthread_mutex_unlock(&scripts_mutex);
+}
+
+
+void *open_file(char *filename, int fd, File_type type, Arena *arena, size_t *length, Flight **shared){
+    Flight *flight;
+    const void *result;
+    void *content;
+    int leader, err;
+
+    *shared = NULL;
+
+    // Checks the type of the file to open
+    if (type != BINARY && type != JPG && type != GIF && type != MPEG && type != MP4 &&
+        type != TEXT && type != HTML){
+        return NULL;
+    }
+
+    flight = io_may_wait() ? flight_join(filename, &leader) : NULL;
+    if (flight == NULL){
+        return _read_file(filename, fd, type, arena, length);
+    }
+
+    // Requests for the same file send the buffer of the first one instead of reading it again
+    if (!leader){
+        result = flight_wait(flight, length, &err);
+        if (result == NULL){
+            flight_leave(flight);
+            errno = err;
+            return NULL;
+        }
+        *shared = flight;
+        return (void *)result;
+    }
+
+    // Outside the arena, the buffer lives as long as the flight
+    content = _read_file(filename, fd, type, NULL, length);
+    err = errno;
+    flight_land(flight, content, *length, content != NULL ? 0 : err);
+    if (content == NULL){
+        flight_leave(flight);
+        errno = err;
+        return NULL;
     }
-    else if (strcmp(ext, ".txt") == 0){
-        return TEXT;
+    *shared = flight;
+    return content;
+}
+
+
+char *open_script(char *filename, File_type type, Method method, char *input, Flight **shared) {
+    Flight *flight;
+    const void *result;
+    char *output, *key;
+    size_t length = 0;
+    int leader, err;
+
+    *shared = NULL;
+
+    if (input == NULL) {
+        return NULL;
     }
-    else if (strcmp(ext, ".gif") == 0){
-        return GIF;
+
+    if (type != PYTHON && type != PHP) {
+        return NULL;
     }
-    else if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0 || strcmp(ext, ".ico") == 0){
-        return JPG;
+
+    if (method != GET && method != POST) {
+        return NULL;
     }
-    else if (strcmp(ext, ".mpeg") == 0){
-        return MPEG;
+
+    _replace_ampersand(input);
+    LOG_DEBUG("ARGS: %s", input);
+
+    // Only GETs are shared, a POST may change something on each run
+    flight = NULL;
+    if (method == GET && io_may_wait()) {
+        key = (char*)malloc(strlen(filename) + strlen(input) + 2);
+        if (key != NULL) {
+            sprintf(key, "%s?%s", filename, input);
+            flight = flight_join(key, &leader);
+            free(key);
+        }
     }
-    else if (strcmp(ext, ".py") == 0){
-        return PYTHON;
+    if (flight == NULL) {
+        return _run_limited(filename, type, method, input);
     }
-    else if (strcmp(ext, ".php") == 0){
-        return PHP;
+
+    if (!leader) {
+        result = flight_wait(flight, &length, &err);
+        if (result == NULL) {
+            flight_leave(flight);
+            errno = err;
+            return NULL;
+        }
+        *shared = flight;
+        return (char *)result;
     }
-    else if (strcmp(ext, ".mp4") == 0){
-        return MP4;
+
+    output = _run_limited(filename, type, method, input);
+    err = errno;
+    flight_land(flight, output, output != NULL ? strlen(output) + 1 : 0, output != NULL ? 0 : err);
+    if (output == NULL) {
+        flight_leave(flight);
+        errno = err;
+        return NULL;
     }
-    return UNKNOWN;
+    *shared = flight;
+    return output;
 }
 
 
-size_t get_file_size(const char *filename) {
-    struct stat st;
-    if (stat(filename, &st) == 0)
-        return st.st_size;
-    return 0; 
-}
@@ -16,28 +16,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include "arena.h"
+#include "flight.h"
+#include "file_type.h"
 
 #define BUFFER_SIZE 4096
-
-/**
- * @enum File_type
- * @brief Enumeration of supported file types.
- *
- * This enum defines various file types that can be used to identify
- * the type of a file based on its extension or content.
- */
-typedef enum {
-    JPG,        /**< JPEG image file */
-    HTML,       /**< HTML file */
-    TEXT,       /**< Plain text file */
-    BINARY,     /**< Binary file */
-    GIF,        /**< GIF image file */
-    MPEG,       /**< MPEG video file */
-    PHP,        /**< PHP script file */
-    PYTHON,     /**< Python script file */
-    UNKNOWN,    /**< Unknown file type */
-    MP4         /**< MP4 video file */
-} File_type;
+#define SCRIPT_SLOTS 256
+#define SCRIPT_MAX_ARGV 64
 
 /**
  * @enum Method
@@ -53,29 +38,52 @@ typedef enum {
 } Method;
 
 /**
- * @brief Opens a file and returns its content.
+ * @struct Script_limits
+ * @brief Limits applied to every script execution.
  *
- * @param filename The name of the file to open.
- * @param type The type of the file (from the File_type enum).
- * @return A pointer to the file content, or NULL on failure.
+ * Bounds how many interpreters can run at once, how long a request may wait
+ * for a free slot and how much time and memory each interpreter may use.
+ * A value of 0 disables the corresponding resource limit.
  */
-void *open_file(char *filename, File_type type);
+typedef struct {
+    int max_running;      /**< Maximum scripts running at once in the whole server. */
+    int max_per_script;   /**< Maximum instances of the same script running at once. */
+    int queue_timeout;    /**< Seconds a request may wait for a free slot. */
+    int timeout;          /**< Wall-clock deadline in seconds for each execution. */
+    long cpu_limit;       /**< RLIMIT_CPU of the interpreter in seconds. */
+    long mem_limit;       /**< RLIMIT_AS of the interpreter in megabytes. */
+} Script_limits;
 
 /**
- * @brief Determines the type of a file based on its name or content.
+ * @brief Sets the limits used by open_script.
+ *
+ * Must be called before any script is executed. max_running is clamped to
+ * SCRIPT_SLOTS.
  *
- * @param filename The name of the file to analyze.
- * @return The file type (from the File_type enum).
+ * @param limits Pointer to the limits to copy.
  */
-File_type get_file_type(char *filename);
+void set_script_limits(Script_limits *limits);
 
 /**
- * @brief Gets the size of a file in bytes.
+ * @brief Opens a file and returns its content.
+ *
+ * The open and the read go through io_open and io_read, so whatever is not
+ * cached is done by the I/O threads.
  *
- * @param filename The name of the file.
- * @return The size of the file in bytes, or 0 on failure.
+ * @param filename The name of the file to open.
+ * @param fd Descriptor the request already holds on the file, -1 to open
+ *        it by name. It is not closed.
+ * @param type The type of the file (from the File_type enum).
+ * @param arena Arena that owns the content, NULL to use malloc.
+ * @param length Set to the size of the file, taken from the descriptor
+ *        that was read.
+ * @param shared Set to the flight that owns the content when concurrent
+ *        requests for the file share one buffer, NULL if the content is in
+ *        arena. The caller leaves the flight once the content is sent.
+ * @return A pointer to the file content, or NULL on failure (errno is
+ *         EWOULDBLOCK inside io_nowait_begin if the disk had to be read).
  */
-size_t get_file_size(const char *filename);
+void *open_file(char *filename, int fd, File_type type, Arena *arena, size_t *length, Flight **shared);
 
 /**
  * @brief Opens a script file and processes it based on the HTTP method and input.
@@ -83,9 +91,18 @@ size_t get_file_size(const char *filename);
  * @param filename The name of the script file to open.
  * @param type The type of the file (from the File_type enum).
  * @param method The HTTP method to use (from the Method enum).
+ * The script runs in its own process group under the limits set with
+ * set_script_limits. If no slot becomes free within the queue timeout NULL is
+ * returned with errno set to EBUSY; if the script exceeds its deadline the
+ * whole process group is killed and NULL is returned with errno set to
+ * ETIMEDOUT.
+ *
  * @param input The input data to pass to the script.
+ * @param shared Set to the flight that owns the output when concurrent GETs
+ *        share one run, NULL if the output was allocated with malloc for
+ *        the caller. The caller leaves the flight once the output is sent.
  * @return A pointer to the processed script output, or NULL on failure.
  */
-char *open_script(char *filename, File_type type, Method method, char *input);
+char *open_script(char *filename, File_type type, Method method, char *input, Flight **shared);
 
 #endif
\ No newline at end of file